@@ -1,6 +1,5 @@
 #include "CurlHandle.h"
 
-#include <curl/curl.h>
 #include <stdexcept>
 
 CurlHandle::CurlHandle() {
@@ -8,11 +7,49 @@ CurlHandle::CurlHandle() {
    if (eCode != CURLE_OK) {
       throw std::runtime_error{"Error initializing libCURL"};
    }
+
+   m_pShare = curl_share_init();
+   if (m_pShare == nullptr) {
+      return; // sessions still work, each with its own caches
+   }
+
+   curl_share_setopt(m_pShare, CURLSHOPT_LOCKFUNC, &CurlHandle::lock);
+   curl_share_setopt(m_pShare, CURLSHOPT_UNLOCKFUNC, &CurlHandle::unlock);
+   curl_share_setopt(m_pShare, CURLSHOPT_USERDATA, this);
+
+   curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+   curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 // 7.57.0
+   curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
 }
 
-CurlHandle::~CurlHandle() { curl_global_cleanup(); }
+CurlHandle::~CurlHandle() {
+   if (m_pShare != nullptr) {
+      curl_share_cleanup(m_pShare);
+   }
+   curl_global_cleanup();
+}
 
 CurlHandle &CurlHandle::instance() {
    static CurlHandle inst{};
    return inst;
 }
+
+void CurlHandle::attach(CURL *pCurl) const {
+   if (pCurl != nullptr && m_pShare != nullptr) {
+      curl_easy_setopt(pCurl, CURLOPT_SHARE, m_pShare);
+   }
+}
+
+void CurlHandle::lock(CURL *, curl_lock_data eData, curl_lock_access, void *pUser) {
+   if (eData >= 0 && eData < CURL_LOCK_DATA_LAST) {
+      static_cast<CurlHandle *>(pUser)->m_locks[eData].lock();
+   }
+}
+
+void CurlHandle::unlock(CURL *, curl_lock_data eData, void *pUser) {
+   if (eData >= 0 && eData < CURL_LOCK_DATA_LAST) {
+      static_cast<CurlHandle *>(pUser)->m_locks[eData].unlock();
+   }
+}
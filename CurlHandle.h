@@ -1,6 +1,12 @@
 #ifndef INCLUDE_CURLHANDLE_H_
 #define INCLUDE_CURLHANDLE_H_
 
+#include <curl/curl.h>
+#include <mutex>
+
+/* Process-wide libcurl state: curl_global_init/cleanup and one CURLSH that every
+ * mail session is attached to, so clients talking to the same server share the
+ * DNS cache, TLS session IDs (abbreviated handshakes) and open connections. */
 class CurlHandle {
   public:
    static CurlHandle &instance();
@@ -13,8 +19,18 @@ class CurlHandle {
 
    ~CurlHandle();
 
+   /* sets CURLOPT_SHARE on pCurl; must be repeated after curl_easy_reset */
+   void attach(CURL *pCurl) const;
+
   private:
    CurlHandle();
+
+   static void lock(CURL *pCurl, curl_lock_data eData, curl_lock_access eAccess, void *pUser);
+   static void unlock(CURL *pCurl, curl_lock_data eData, void *pUser);
+
+   CURLSH *m_pShare = nullptr;
+   /* one lock per shared data kind, so DNS lookups do not wait on TLS session updates */
+   std::mutex m_locks[CURL_LOCK_DATA_LAST];
 };
 
 #endif
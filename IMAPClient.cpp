@@ -10,8 +10,10 @@
 
 #include "IMAPClient.h"
 
-CIMAPClient::CIMAPClient(LogFnCallback oLogger) :
-   CMailClient(oLogger),
+#include "IMAPCompressRelay.h"
+
+CIMAPClient::CIMAPClient() :
+   CMailClient(),
    m_pstrText(nullptr),
    m_eOperationType(IMAP_NOOP),
    m_eMailProperty(MailProperty::Flagged),
@@ -43,34 +45,90 @@ bool CIMAPClient::ListSubFolders(std::string& strList)
    return Perform();
 }
 
-bool CIMAPClient::SendString(const std::string& strMail)
+bool CIMAPClient::SendString(const std::string& strMail, const std::string& strFolder)
 {
    m_strMail = strMail;
+   m_strMailbox = strFolder;
    m_eOperationType = IMAP_SEND_STRING;
 
    return Perform();
 }
 
-bool CIMAPClient::SendFile(const std::string& strPath)
+bool CIMAPClient::SendFile(const std::string& strPath, const std::string& strFolder)
 {
    m_strLocalFile = strPath;
+   m_strMailbox = strFolder;
    m_eOperationType = IMAP_SEND_FILE;
 
    return Perform();
 }
 
-bool CIMAPClient::GetString(const std::string& strMsgNumber, std::string& strOutput)
+size_t CIMAPClient::MultiAppendCost(const std::string& strMail)
+{
+   /* " {<size>+}\r\n" around the normalized message */
+   CMailClient::UploadSource oSource;
+   oSource.Reset(strMail.data(), strMail.size());
+   const size_t uSize = static_cast<size_t>(oSource.NormalizedSize());
+   return uSize + std::to_string(uSize).size() + 6;
+}
+
+bool CIMAPClient::MultiAppend(const std::vector<std::string>& vecMails, const std::string& strFolder)
+{
+   if (vecMails.empty())
+      return false;
+
+   std::string strCmd = "APPEND " + QuoteString(strFolder);
+   for (const auto& strMail : vecMails)
+   {
+      /* a custom request is a C string: messages with NUL must go through SendString */
+      if (strMail.find('\0') != std::string::npos)
+         return false;
+
+      const std::string strLiteral = UploadSource::NormalizeCRLF(strMail.data(), strMail.size());
+      strCmd += " {" + std::to_string(strLiteral.size()) + "+}\r\n";
+      strCmd += strLiteral;
+   }
+
+   if (strCmd.size() > MULTIAPPEND_MAX_COMMAND)
+   {
+      if (m_eSettingsFlags & ENABLE_LOG)
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::MULTIAPPEND_TOO_LARGE,
+                      static_cast<int64_t>(strCmd.size()), static_cast<int64_t>(MULTIAPPEND_MAX_COMMAND));
+
+      return false;
+   }
+
+   m_strMail = strCmd;
+   m_eOperationType = IMAP_MULTIAPPEND;
+
+   return Perform();
+}
+
+bool CIMAPClient::GetString(const std::string& strMsgNumber, std::string& strOutput, const std::string& strFolder)
 {
    m_strMsgNumber = strMsgNumber;
+   m_strMailbox = strFolder;
    m_pstrText = &strOutput;
    m_eOperationType = IMAP_RETR_STRING;
 
    return Perform();
 }
 
-bool CIMAPClient::GetFile(const std::string& strMsgNumber, const std::string& strFilePath)
+bool CIMAPClient::GetStringByUID(const std::string& strUID, std::string& strOutput, const std::string& strFolder)
+{
+   m_strMsgNumber = strUID;
+   m_strMailbox = strFolder;
+   m_pstrText = &strOutput;
+   m_eOperationType = IMAP_RETR_STRING_UID;
+
+   return Perform();
+}
+
+bool CIMAPClient::GetFile(const std::string& strMsgNumber, const std::string& strFilePath,
+                          const std::string& strFolder)
 {
    m_strMsgNumber = strMsgNumber;
+   m_strMailbox = strFolder;
    m_strLocalFile = strFilePath;
    m_eOperationType = IMAP_RETR_FILE;
 
@@ -92,15 +150,30 @@ bool CIMAPClient::Noop()
    return Perform();
 }
 
-bool CIMAPClient::CopyMail(const std::string& strMsgNumber, const std::string& strFolderName)
+bool CIMAPClient::CopyMail(const std::string& strMsgNumber, const std::string& strFolderName,
+                           const std::string& strSourceFolder, bool bUID)
 {
    m_strMsgNumber = strMsgNumber;
    m_strFolderName = strFolderName;
+   m_strMailbox = strSourceFolder;
+   m_bUID = bUID;
    m_eOperationType = IMAP_COPY;
 
    return Perform();
 }
 
+bool CIMAPClient::MoveMail(const std::string& strSet, const std::string& strFolderName,
+                           const std::string& strSourceFolder, bool bUID)
+{
+   m_strMsgNumber = strSet;
+   m_strFolderName = strFolderName;
+   m_strMailbox = strSourceFolder;
+   m_bUID = bUID;
+   m_eOperationType = IMAP_MOVE;
+
+   return Perform();
+}
+
 bool CIMAPClient::CreateFolder(const std::string& strFolderName)
 {
    m_strFolderName = strFolderName;
@@ -109,24 +182,74 @@ bool CIMAPClient::CreateFolder(const std::string& strFolderName)
    return Perform();
 }
 
-bool CIMAPClient::SetMailProperty(const std::string& strMsgNumber, MailProperty eNewProperty)
+bool CIMAPClient::SetMailProperty(const std::string& strMsgNumber, MailProperty eNewProperty,
+                                  const std::string& strFolder)
 {
    m_strMsgNumber = strMsgNumber;
+   m_strMailbox = strFolder;
    m_eMailProperty = eNewProperty;
    m_eOperationType = IMAP_STORE;
 
    return Perform();
 }
 
-bool CIMAPClient::Search(std::string& strRes, SearchOption eSearchOption)
+bool CIMAPClient::StoreProperty(const std::string& strSet, MailProperty eProperty, bool bAdd,
+                                const std::string& strFolder, bool bUID)
+{
+   m_strMsgNumber = strSet;
+   m_eMailProperty = eProperty;
+   m_bAddProperty = bAdd;
+   m_strMailbox = strFolder;
+   m_bUID = bUID;
+   m_eOperationType = IMAP_STORE_SET;
+
+   return Perform();
+}
+
+bool CIMAPClient::Expunge(const std::string& strUIDSet, const std::string& strFolder)
+{
+   m_strMsgNumber = strUIDSet;
+   m_strMailbox = strFolder;
+   m_eOperationType = IMAP_EXPUNGE;
+
+   return Perform();
+}
+
+bool CIMAPClient::Search(std::string& strRes, SearchOption eSearchOption, const std::string& strFolder)
 {
    m_pstrText = &strRes;
+   m_strMailbox = strFolder;
    m_eSearchOption = eSearchOption;
+   m_strSearchCriteria.clear();
+   m_bSearchByUID = false;
    m_eOperationType = IMAP_SEARCH;
 
    return Perform();
 }
 
+bool CIMAPClient::Search(std::string& strRes, const std::string& strCriteria, bool bUID,
+                         const std::string& strFolder)
+{
+   if (strCriteria.empty())
+      return false;
+
+   m_pstrText = &strRes;
+   m_strMailbox = strFolder;
+   m_strSearchCriteria = strCriteria;
+   m_bSearchByUID = bUID;
+   m_eOperationType = IMAP_SEARCH;
+
+   return Perform();
+}
+
+bool CIMAPClient::Capability(std::string& strRes)
+{
+   m_pstrText = &strRes;
+   m_eOperationType = IMAP_CAPABILITY;
+
+   return Perform();
+}
+
 bool CIMAPClient::InfoFolder(std::string& strFolderName, std::string& strInfo)
 {
    m_strFolderName = strFolderName;
@@ -136,6 +259,86 @@ bool CIMAPClient::InfoFolder(std::string& strFolderName, std::string& strInfo)
    return Perform();
 }
 
+bool CIMAPClient::FetchSummaries(std::string& strOutput, const std::string& strSequenceSet,
+                                 const std::string& strFolder)
+{
+   m_strMsgNumber = strSequenceSet;
+   m_strMailbox = strFolder;
+   m_pstrText = &strOutput;
+   m_eOperationType = IMAP_FETCH_SUMMARY;
+
+   return Perform();
+}
+
+bool CIMAPClient::Status(const std::string& strFolder, std::string& strRes)
+{
+   m_strFolderName = strFolder;
+   m_pstrText = &strRes;
+   m_eOperationType = IMAP_STATUS;
+
+   return Perform();
+}
+
+bool CIMAPClient::ListStatus(std::string& strRes)
+{
+   m_pstrText = &strRes;
+   m_eOperationType = IMAP_LIST_STATUS;
+
+   return Perform();
+}
+
+std::string CIMAPClient::MailboxPath() const
+{
+   /* RFC 5092: the mailbox is a path segment, so everything that would end
+   * or split it (space, '%', ';', '?', '#') is percent-encoded */
+   static const char s_szHex[] = "0123456789ABCDEF";
+   std::string strPath;
+   strPath.reserve(m_strMailbox.size());
+   for (const char c : m_strMailbox)
+   {
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+          (c != '\0' && std::strchr("-._~/&+,=:@!$'*", c) != nullptr))
+      {
+         strPath += c;
+      }
+      else
+      {
+         strPath += '%';
+         strPath += s_szHex[static_cast<unsigned char>(c) >> 4];
+         strPath += s_szHex[static_cast<unsigned char>(c) & 0x0F];
+      }
+   }
+   return strPath;
+}
+
+const char* CIMAPClient::PropertyName(MailProperty eProperty)
+{
+   switch (eProperty)
+   {
+      case MailProperty::Deleted:  return "Deleted";
+      case MailProperty::Seen:     return "Seen";
+      case MailProperty::Answered: return "Answered";
+      case MailProperty::Flagged:  return "Flagged";
+      case MailProperty::Draft:    return "Draft";
+      case MailProperty::Recent:   return "Recent";
+   }
+   return nullptr;
+}
+
+std::string CIMAPClient::QuoteString(const std::string& strText)
+{
+   std::string strQuoted("\"");
+   strQuoted.reserve(strText.size() + 2);
+   for (const char c : strText)
+   {
+      if (c == '"' || c == '\\')
+         strQuoted += '\\';
+      strQuoted += c;
+   }
+   strQuoted += '"';
+   return strQuoted;
+}
+
 void CIMAPClient::ParseURL(std::string& strURL)
 {
    std::string strTmp = strURL;
@@ -160,6 +363,26 @@ void CIMAPClient::ParseURL(std::string& strURL)
 
 }
 
+/**
+* @brief adds the IMAP specific session options to the common ones
+*
+*/
+void CIMAPClient::ApplySessionOptions()
+{
+   CMailClient::ApplySessionOptions();
+
+   /* The relay only sees plaintext and cannot sit behind an HTTP proxy tunnel */
+   if (m_bCompress && m_eSslTlsFlags == NO_SSLTLS && m_strProxy.empty())
+   {
+      curl_easy_setopt(m_pCurlSession, CURLOPT_OPENSOCKETFUNCTION, &CIMAPCompressRelay::OpenSocketCallback);
+      /* Pooled connections of other clients bypass the relay, and ours must not
+      * reach clients without it: keep a connection cache of our own */
+      curl_easy_setopt(m_pCurlSession, CURLOPT_SHARE, nullptr);
+   }
+   else if (m_bCompress && (m_eSettingsFlags & ENABLE_LOG))
+      m_oLog.Write(CMailLog::LEVEL_WARNING, CMailLog::COMPRESS_UNAVAILABLE);
+}
+
 /**
 * @brief configures the curl session according to requested
 * IMAp operation.
@@ -184,17 +407,14 @@ bool CIMAPClient::PrePerform()
          /* This will create a new message 100. Note that you should perform an
          * EXAMINE command to obtain the UID of the next message to create and a
          * SELECT to ensure you are creating the message in the OUTBOX. */
-         strRequestURL += m_strMsgNumber;
-         m_ssString.str(m_strMail);
-         
-         /* LF will be replaced by CRLF when sending the mail.
-         * This must be taken in consideration in the total size of the payload */
-         /*uCountLF = std::count_if(m_strMail.cbegin(), m_strMail.cend(),
-                                       [](const char c) { return c == '\n'; });*/
-
-         //curl_easy_setopt(m_pCurlSession, CURLOPT_INFILESIZE, uCountLF + m_strMail.length());
-         curl_easy_setopt(m_pCurlSession, CURLOPT_READFUNCTION, ReadLineFromStringStreamCallback);
-         curl_easy_setopt(m_pCurlSession, CURLOPT_READDATA, &m_ssString);
+         strRequestURL += MailboxPath();
+         m_oUpload.Reset(m_strMail.data(), m_strMail.size());
+
+         /* LF will be replaced by CRLF when sending the mail. APPEND sends the
+         * size up front, so it is the size after normalization */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_INFILESIZE_LARGE, m_oUpload.NormalizedSize());
+         curl_easy_setopt(m_pCurlSession, CURLOPT_READFUNCTION, ReadBlockCallback);
+         curl_easy_setopt(m_pCurlSession, CURLOPT_READDATA, &m_oUpload);
          curl_easy_setopt(m_pCurlSession, CURLOPT_UPLOAD, 1L);
          break;
 
@@ -214,7 +434,7 @@ bool CIMAPClient::PrePerform()
             }
             fsize = (curl_off_t)file_info.st_size;*/
 
-            m_fLocalFile.open(m_strLocalFile, std::fstream::in);
+            m_fLocalFile.open(m_strLocalFile, std::fstream::in | std::fstream::binary);
             
             // LF will be replaced by CRLF when sending the mail
             /*uCountLF = std::count_if((std::istreambuf_iterator<char>(m_fLocalFile)),
@@ -225,17 +445,20 @@ bool CIMAPClient::PrePerform()
             if (m_fLocalFile)
             {
                m_fLocalFile.seekg(0);
-
-               curl_easy_setopt(m_pCurlSession, CURLOPT_READFUNCTION, CMailClient::ReadLineFromFileStreamCallback);
-               curl_easy_setopt(m_pCurlSession, CURLOPT_READDATA, &m_fLocalFile);
+               strRequestURL += MailboxPath();
+               m_oUpload.Reset(&m_fLocalFile);
+
+               /* One counting pass over the file for the APPEND size, then the
+               * upload streams it in 64 KiB chunks */
+               curl_easy_setopt(m_pCurlSession, CURLOPT_INFILESIZE_LARGE, m_oUpload.NormalizedSize());
+               curl_easy_setopt(m_pCurlSession, CURLOPT_READFUNCTION, CMailClient::ReadBlockCallback);
+               curl_easy_setopt(m_pCurlSession, CURLOPT_READDATA, &m_oUpload);
                curl_easy_setopt(m_pCurlSession, CURLOPT_UPLOAD, 1L);
-               //curl_easy_setopt(m_pCurlSession, CURLOPT_INFILESIZE_LARGE, uFileSize + uCountLF);
             }
             else
             {
                if (m_eSettingsFlags & ENABLE_LOG)
-                  m_oLog(StringFormat("[IMAPClient][Error] Unable to open local file %s in CIMAPClient::PrePerform()"
-                                      "in case IMAP_SEND_FILE.", m_strLocalFile.c_str()));
+                  m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::LOCAL_FILE_OPEN, 0, 0, m_strLocalFile.c_str());
 
                return false;
             }
@@ -259,8 +482,7 @@ bool CIMAPClient::PrePerform()
             if (!m_strFolderName.empty())
                strRequestURL += m_strFolderName;
 
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteInStringCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pstrText);
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
          }
          else
             return false;
@@ -272,7 +494,7 @@ bool CIMAPClient::PrePerform()
          if (!m_strFolderName.empty())
          {
             /* Set the DELE command */
-            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("DELETE " + m_strFolderName).c_str());
+            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("DELETE " + QuoteString(m_strFolderName)).c_str());
          }
          else
             return false;
@@ -280,16 +502,16 @@ bool CIMAPClient::PrePerform()
          break;
 
       case IMAP_RETR_STRING:
+      case IMAP_RETR_STRING_UID:
          if (!m_strMsgNumber.empty())
-            strRequestURL += "INBOX;MAILINDEX=" + m_strMsgNumber;
+            strRequestURL += MailboxPath() + (m_eOperationType == IMAP_RETR_STRING ? ";MAILINDEX=" : ";UID=") + m_strMsgNumber;
          else
             return false;
 
          /* This will retrieve message 'm_strMsgNumber' from the user's mailbox */
          if (m_pstrText != nullptr)
          {
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteInStringCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pstrText);
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
          }
          else
             return false;
@@ -297,21 +519,19 @@ bool CIMAPClient::PrePerform()
 
       case IMAP_RETR_FILE:
          if (!m_strMsgNumber.empty())
-            strRequestURL += "INBOX/;MAILINDEX=" + m_strMsgNumber;
+            strRequestURL += MailboxPath() + "/;MAILINDEX=" + m_strMsgNumber;
          else
             return false;
 
          m_fLocalFile.open(m_strLocalFile, std::fstream::out | std::fstream::binary | std::fstream::trunc);
          if (m_fLocalFile)
          {
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteToFileCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, &m_fLocalFile);
+            SetWriteTarget(&CMailClient::WriteToFileCallback, &m_fLocalFile);
          }
          else
          {
             if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog(StringFormat("[IMAPClient][Error] Unable to open local file %s in CIMAPClient::PrePerform()"
-                  " in case IMAP_RETR_FILE.", m_strLocalFile.c_str()));
+               m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::LOCAL_FILE_OPEN, 1, 0, m_strLocalFile.c_str());
 
             return false;
          }
@@ -320,22 +540,20 @@ bool CIMAPClient::PrePerform()
       case IMAP_INFO_FOLDER:
          if (m_pstrText != nullptr)
          {
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteInStringCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pstrText);
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
          }
          else
             return false;
 
          /* Set the EXAMINE command specifing the mailbox folder */
-         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("EXAMINE " + m_strFolderName).c_str());
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("EXAMINE " + QuoteString(m_strFolderName)).c_str());
 
          break;
 
       case IMAP_LSUB:
          if (m_pstrText != nullptr)
          {
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteInStringCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pstrText);
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
          }
          else
             return false;
@@ -349,10 +567,10 @@ bool CIMAPClient::PrePerform()
       case IMAP_COPY:
          if (!m_strMsgNumber.empty() && !m_strFolderName.empty())
          {
-            strRequestURL += "INBOX";
+            strRequestURL += MailboxPath();
             /* Set the COPY command specifing the message ID and destination folder */
             curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
-               ("COPY "+ m_strMsgNumber + " " + m_strFolderName).c_str());
+               ((m_bUID ? "UID COPY " : "COPY ") + m_strMsgNumber + " " + QuoteString(m_strFolderName)).c_str());
 
             /* Note that to perform a move operation you will need to perform the copy,
             * then mark the original mail as Deleted and EXPUNGE or CLOSE. Please see
@@ -367,7 +585,7 @@ bool CIMAPClient::PrePerform()
          if (!m_strFolderName.empty())
          {
             /* Set the CREATE command specifing the new folder name */
-            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("CREATE " + m_strFolderName).c_str());
+            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("CREATE " + QuoteString(m_strFolderName)).c_str());
          }
          else
             return false;
@@ -377,15 +595,16 @@ bool CIMAPClient::PrePerform()
       case IMAP_SEARCH:
          if (m_pstrText != nullptr)
          {
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, &CMailClient::WriteInStringCallback);
-            curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pstrText);
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
          }
          else
             return false;
 
-         strRequestURL += "INBOX";
+         strRequestURL += MailboxPath();
 
-         if (m_eSearchOption == SearchOption::ANSWERED)
+         if (!m_strSearchCriteria.empty())
+            strCmd = m_strSearchCriteria;
+         else if (m_eSearchOption == SearchOption::ANSWERED)
             strCmd = "ANSWERED";
          else if (m_eSearchOption == SearchOption::DELETED)
             strCmd = "DELETED";
@@ -411,7 +630,8 @@ bool CIMAPClient::PrePerform()
          * keywords including flags such as ANSWERED, DELETED, DRAFT, FLAGGED, NEW,
          * RECENT and SEEN. For more information about the search criteria please
          * see RFC-3501 section 6.4.4.   */
-         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, ("SEARCH " + strCmd).c_str());
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+            ((m_bSearchByUID ? "UID SEARCH " : "SEARCH ") + strCmd).c_str());
 
          break;
 
@@ -435,7 +655,7 @@ bool CIMAPClient::PrePerform()
                return false;
             }
 
-            strRequestURL += "INBOX";
+            strRequestURL += MailboxPath();
 
             /* Set the STORE command with the Deleted flag for message m_strMsgNumber */
             curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
@@ -446,9 +666,128 @@ bool CIMAPClient::PrePerform()
 
          break;
 
+      case IMAP_FETCH_SUMMARY:
+         if (m_pstrText != nullptr && !m_strMsgNumber.empty())
+         {
+            /* curl writes a custom FETCH's untagged lines as body but stops
+            * each at a "{n}": the literal ENVELOPE strings that follow reach
+            * only the header callback, which sees every response line
+            * verbatim. The whole response is collected from there; the
+            * setup responses it also carries are no FETCH lines. */
+            SetWriteTarget(&CMailClient::DiscardCallback, nullptr);
+            SetHeaderTarget(&CMailClient::WriteInStringCallback, m_pstrText);
+         }
+         else
+            return false;
+
+         strRequestURL += MailboxPath();
+
+         /* One round trip for the whole mailbox */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+            ("FETCH " + m_strMsgNumber + " (UID FLAGS RFC822.SIZE INTERNALDATE ENVELOPE)").c_str());
+
+         break;
+
+      case IMAP_CAPABILITY:
+         if (m_pstrText != nullptr)
+         {
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
+         }
+         else
+            return false;
+
+         /* No mailbox in the URL: CAPABILITY is valid in any state */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, "CAPABILITY");
+
+         break;
+
+      case IMAP_STATUS:
+         if (m_pstrText != nullptr && !m_strFolderName.empty())
+         {
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
+         }
+         else
+            return false;
+
+         /* STATUS does not select the folder, so it is cheap even on huge ones */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+            ("STATUS " + QuoteString(m_strFolderName) + " (MESSAGES UNSEEN UIDNEXT UIDVALIDITY)").c_str());
+
+         break;
+
+      case IMAP_LIST_STATUS:
+         if (m_pstrText != nullptr)
+         {
+            /* curl hands a custom LIST only the "* LIST" lines as body; the
+            * "* STATUS" lines reach the header callback, like every response
+            * line. The LIST lines arrive twice, the parser keeps one. */
+            SetWriteTarget(&CMailClient::WriteInStringCallback, m_pstrText);
+            SetHeaderTarget(&CMailClient::WriteInStringCallback, m_pstrText);
+         }
+         else
+            return false;
+
+         /* Untagged LIST and STATUS responses for every folder (RFC 5819) */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+            "LIST \"\" \"*\" RETURN (STATUS (MESSAGES UNSEEN UIDNEXT UIDVALIDITY))");
+
+         break;
+
+      case IMAP_STORE_SET:
+         if (!m_strMsgNumber.empty() && PropertyName(m_eMailProperty) != nullptr)
+         {
+            strRequestURL += MailboxPath();
+
+            /* .SILENT: the server does not echo a FETCH response for every message */
+            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+               ((m_bUID ? "UID STORE " : "STORE ") + m_strMsgNumber + (m_bAddProperty ? " +" : " -") +
+                "FLAGS.SILENT (\\" + PropertyName(m_eMailProperty) + ")").c_str());
+            curl_easy_setopt(m_pCurlSession, CURLOPT_NOBODY, 1L);
+         }
+         else
+            return false;
+
+         break;
+
+      case IMAP_MOVE:
+         if (!m_strMsgNumber.empty() && !m_strFolderName.empty())
+         {
+            strRequestURL += MailboxPath();
+
+            /* Copy, flag and expunge in one command; the caller checks the MOVE capability */
+            curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+               ((m_bUID ? "UID MOVE " : "MOVE ") + m_strMsgNumber + " " + QuoteString(m_strFolderName)).c_str());
+            curl_easy_setopt(m_pCurlSession, CURLOPT_NOBODY, 1L);
+            /* curl still hands over the untagged EXPUNGE responses */
+            SetWriteTarget(&CMailClient::DiscardCallback, nullptr);
+         }
+         else
+            return false;
+
+         break;
+
+      case IMAP_MULTIAPPEND:
+         /* LITERAL+ literals need no continuation, so the messages travel inside
+         * the command line itself. No mailbox in the URL: APPEND needs no SELECT */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, m_strMail.c_str());
+         curl_easy_setopt(m_pCurlSession, CURLOPT_NOBODY, 1L);
+
+         break;
+
+      case IMAP_EXPUNGE:
+         strRequestURL += MailboxPath();
+
+         /* UID EXPUNGE (UIDPLUS) leaves other \Deleted messages alone */
+         curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST,
+            (m_strMsgNumber.empty() ? std::string("EXPUNGE") : "UID EXPUNGE " + m_strMsgNumber).c_str());
+         curl_easy_setopt(m_pCurlSession, CURLOPT_NOBODY, 1L);
+         SetWriteTarget(&CMailClient::DiscardCallback, nullptr);
+
+         break;
+
       default:
          if (m_eSettingsFlags & ENABLE_LOG)
-            m_oLog("[IMAPClient][Error] Unknown operation.");
+            m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::UNKNOWN_OPERATION, m_eOperationType);
 
          break;
    }
@@ -458,6 +797,111 @@ bool CIMAPClient::PrePerform()
    return true;
 }
 
+/* the key a replay transport matches this operation with, see CMailTransport */
+std::string CIMAPClient::DescribeOperation() const
+{
+   /* only the members the operation reads: the others keep values of earlier
+   * operations and would make equal requests differ */
+   std::string strKey = std::to_string(static_cast<int>(m_eOperationType));
+   const auto Add = [&strKey](const std::string& strField) { strKey += '\t'; strKey += strField; };
+
+   switch (m_eOperationType)
+   {
+      case IMAP_LIST:
+      case IMAP_DELETE_FOLDER:
+      case IMAP_INFO_FOLDER:
+      case IMAP_CREATE:
+      case IMAP_STATUS:
+         Add(m_strFolderName);
+         break;
+
+      case IMAP_SEND_STRING:
+         Add(m_strMailbox);
+         Add(std::to_string(m_strMail.size()));
+         break;
+
+      case IMAP_SEND_FILE:
+         Add(m_strMailbox);
+         Add(m_strLocalFile);
+         break;
+
+      case IMAP_MULTIAPPEND:
+         Add(std::to_string(m_strMail.size()));
+         break;
+
+      case IMAP_RETR_STRING:
+      case IMAP_RETR_STRING_UID:
+      case IMAP_RETR_FILE:
+      case IMAP_FETCH_SUMMARY:
+      case IMAP_EXPUNGE:
+         Add(m_strMailbox);
+         Add(m_strMsgNumber);
+         break;
+
+      case IMAP_COPY:
+      case IMAP_MOVE:
+         Add(m_strMailbox);
+         Add(m_strMsgNumber);
+         Add(m_strFolderName);
+         Add(m_bUID ? "UID" : "");
+         break;
+
+      case IMAP_SEARCH:
+         Add(m_strMailbox);
+         Add(m_strSearchCriteria.empty() ? std::to_string(static_cast<int>(m_eSearchOption)) : m_strSearchCriteria);
+         Add(m_bSearchByUID ? "UID" : "");
+         break;
+
+      case IMAP_STORE:
+         Add(m_strMailbox);
+         Add(m_strMsgNumber);
+         Add(std::to_string(static_cast<int>(m_eMailProperty)));
+         break;
+
+      case IMAP_STORE_SET:
+         Add(m_strMailbox);
+         Add(m_strMsgNumber);
+         Add((m_bAddProperty ? "+" : "-") + std::to_string(static_cast<int>(m_eMailProperty)));
+         Add(m_bUID ? "UID" : "");
+         break;
+
+      default: // NOOP, LSUB, CAPABILITY, LIST-STATUS: no arguments
+         break;
+   }
+
+   return strKey;
+}
+
+const char* CIMAPClient::OperationName() const
+{
+   switch (m_eOperationType)
+   {
+      case IMAP_NOOP:            return "noop";
+      case IMAP_LIST:            return "list";
+      case IMAP_SEND_STRING:     return "append";
+      case IMAP_SEND_FILE:       return "append_file";
+      case IMAP_RETR_FILE:       return "fetch_file";
+      case IMAP_RETR_STRING:     return "fetch";
+      case IMAP_RETR_STRING_UID: return "fetch_uid";
+      case IMAP_DELETE_FOLDER:   return "delete_folder";
+      case IMAP_INFO_FOLDER:     return "examine";
+      case IMAP_LSUB:            return "lsub";
+      case IMAP_COPY:            return "copy";
+      case IMAP_CREATE:          return "create_folder";
+      case IMAP_SEARCH:          return "search";
+      case IMAP_STORE:           return "store";
+      case IMAP_FETCH_SUMMARY:   return "fetch_summary";
+      case IMAP_CAPABILITY:      return "capability";
+      case IMAP_STATUS:          return "status";
+      case IMAP_LIST_STATUS:     return "list_status";
+      case IMAP_STORE_SET:       return "store_set";
+      case IMAP_MOVE:            return "move";
+      case IMAP_EXPUNGE:         return "expunge";
+      case IMAP_MULTIAPPEND:     return "multiappend";
+   }
+   return "unknown";
+}
+
 /**
 * @brief performs operations that need to be done after performing
 * an IMAP request.
@@ -482,12 +926,12 @@ bool CIMAPClient::PostPerform(CURLcode ePerformCode)
          curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, "EXPUNGE");
 
          /* Perform the second custom request */
-         ePerformCode = curl_easy_perform(m_pCurlSession);
+         ePerformCode = PerformTransfer();
 
          /* Check for errors */
          if (ePerformCode != CURLE_OK)
             if (m_eSettingsFlags & ENABLE_LOG)
-               m_oLog(StringFormat(LOG_ERROR_CURL_PEFORM_FAILURE_FORMAT, ePerformCode, curl_easy_strerror(ePerformCode)));
+               m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::PERFORM_FAILED, ePerformCode);
       }
    }
 
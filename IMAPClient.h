@@ -13,6 +13,8 @@
 
 #include "MAILClient.h"
 
+#include <vector>
+
 class CIMAPClient : public CMailClient
 {
 public:
@@ -38,7 +40,7 @@ public:
    };
 
 
-   explicit CIMAPClient(LogFnCallback oLogger);
+   CIMAPClient();
 
    // copy constructor and assignment operator are disabled
    CIMAPClient(const CIMAPClient& Copy) = delete;
@@ -46,23 +48,45 @@ public:
 
    bool CleanupSession() override;
 
+   /* negotiate COMPRESS=DEFLATE (RFC 4978) on new connections, see IMAPCompressRelay.h.
+   * Plaintext (NO_SSLTLS) sessions without a proxy only: otherwise the setting is
+   * ignored and COMPRESS_UNAVAILABLE is logged. Compressed sessions keep their
+   * connections to themselves. Takes effect on the next connection. */
+   inline void SetCompression(const bool& bCompress) { m_bCompress = bCompress; m_bSessionConfigured = false; }
+   inline bool GetCompression() const { return m_bCompress; }
+
    /* list the folders within a mailbox and save it in strList */
    bool List(std::string& strList, const std::string& strFolderName = "");
 
    /* list the subscribed folders and save it in strList */
    bool ListSubFolders(std::string& strList);
 
+   /* Every operation on messages takes the folder it works in (strFolder),
+   * INBOX by default. Names are passed to the server as they are, so they must
+   * be in the server's form (modified UTF-7, as returned by LIST). */
+
    /* send a string as an e-mail */
-   bool SendString(const std::string& strMail);
+   bool SendString(const std::string& strMail, const std::string& strFolder = "INBOX");
 
    /* send a text file as an e-mail */
-   bool SendFile(const std::string& strPath);
+   bool SendFile(const std::string& strPath, const std::string& strFolder = "INBOX");
+
+   /* append several e-mails with one MULTIAPPEND command made of LITERAL+ literals
+   * (RFC 3502, RFC 7888); the caller checks both capabilities. The whole command
+   * must fit in MULTIAPPEND_MAX_COMMAND bytes, curl's limit for a command line. */
+   static const size_t MULTIAPPEND_MAX_COMMAND = 60000;
+   static size_t MultiAppendCost(const std::string& strMail);
+   bool MultiAppend(const std::vector<std::string>& vecMails, const std::string& strFolder = "INBOX");
 
    /* retrieve e-mail and save its content in strOutput */
-   bool GetString(const std::string& strMsgNumber, std::string& strOutput);
+   bool GetString(const std::string& strMsgNumber, std::string& strOutput, const std::string& strFolder = "INBOX");
+
+   /* retrieve e-mail by its UID and save its content in strOutput */
+   bool GetStringByUID(const std::string& strUID, std::string& strOutput, const std::string& strFolder = "INBOX");
 
    /* retrieve e-mail and save its content in a file */
-   bool GetFile(const std::string& strMsgNumber, const std::string& strFilePath);
+   bool GetFile(const std::string& strMsgNumber, const std::string& strFilePath,
+                const std::string& strFolder = "INBOX");
 
    /* delete an existing folder */
    bool DeleteFolder(const std::string& strMsgNumber);
@@ -70,21 +94,54 @@ public:
    /* perform a noop */
    bool Noop();
 
-   /* copy an e-mail from one folder to another */
-   bool CopyMail(const std::string& strMsgNumber, const std::string& strFolder);
+   /* copy an e-mail from one folder (strSourceFolder) to another */
+   bool CopyMail(const std::string& strMsgNumber, const std::string& strFolder,
+                 const std::string& strSourceFolder = "INBOX", bool bUID = false);
+
+   /* move the e-mails in strSet to strFolder in one command (RFC 6851 MOVE) */
+   bool MoveMail(const std::string& strSet, const std::string& strFolder,
+                 const std::string& strSourceFolder = "INBOX", bool bUID = true);
 
    /* create a new folder */
    bool CreateFolder(const std::string& strFolderName);
 
    /* modify the properties of an e-mail according to MailProperty */
-   bool SetMailProperty(const std::string& strMsgNumber, MailProperty eNewProperty);
+   bool SetMailProperty(const std::string& strMsgNumber, MailProperty eNewProperty,
+                        const std::string& strFolder = "INBOX");
+
+   /* add (bAdd) or remove a property on every e-mail of strSet with one STORE .SILENT */
+   bool StoreProperty(const std::string& strSet, MailProperty eProperty, bool bAdd = true,
+                      const std::string& strFolder = "INBOX", bool bUID = true);
+
+   /* permanently remove \Deleted e-mails; only those of strUIDSet when given (RFC 4315 UID EXPUNGE) */
+   bool Expunge(const std::string& strUIDSet = "", const std::string& strFolder = "INBOX");
    
    /* search for e-mails according to SearchOption */
-   bool Search(std::string& strRes, SearchOption eSearchOption = SearchOption::NEW);
+   bool Search(std::string& strRes, SearchOption eSearchOption = SearchOption::NEW,
+               const std::string& strFolder = "INBOX");
+
+   /* search for e-mails with raw criteria, e.g. "RETURN (COUNT) SINCE 1-Feb-2023 UNSEEN",
+   * results are UIDs when bUID is true */
+   bool Search(std::string& strRes, const std::string& strCriteria, bool bUID = false,
+               const std::string& strFolder = "INBOX");
+
+   /* list the server capabilities and save the untagged response in strRes */
+   bool Capability(std::string& strRes);
       
    /* obtain information about a folder */
    bool InfoFolder(std::string& strFolderName, std::string& strInfo);
 
+   /* fetch UID, FLAGS, RFC822.SIZE, INTERNALDATE and ENVELOPE of the messages in strSequenceSet;
+   * strOutput gets the whole response with its literals, setup responses included */
+   bool FetchSummaries(std::string& strOutput, const std::string& strSequenceSet = "1:*",
+                       const std::string& strFolder = "INBOX");
+
+   /* MESSAGES, UNSEEN, UIDNEXT and UIDVALIDITY of one folder */
+   bool Status(const std::string& strFolder, std::string& strRes);
+
+   /* every folder with its STATUS in one round trip (RFC 5819 LIST-STATUS) */
+   bool ListStatus(std::string& strRes);
+
 protected:
    enum MailOperation
    {
@@ -94,19 +151,38 @@ protected:
       IMAP_SEND_FILE,
       IMAP_RETR_FILE,
       IMAP_RETR_STRING,
+      IMAP_RETR_STRING_UID,
       IMAP_DELETE_FOLDER,
       IMAP_INFO_FOLDER,
       IMAP_LSUB,
       IMAP_COPY,
       IMAP_CREATE,
       IMAP_SEARCH,
-      IMAP_STORE
+      IMAP_STORE,
+      IMAP_FETCH_SUMMARY,
+      IMAP_CAPABILITY,
+      IMAP_STATUS,
+      IMAP_LIST_STATUS,
+      IMAP_STORE_SET,
+      IMAP_MOVE,
+      IMAP_EXPUNGE,
+      IMAP_MULTIAPPEND
    };
 
+   void ApplySessionOptions() override;
    bool PrePerform() override;
    bool PostPerform(CURLcode ePerformCode) override;
+   std::string DescribeOperation() const override;
+   const char* OperationName() const override;
    inline void ParseURL(std::string& strURL) override final;
 
+   /* m_strMailbox as a URL path segment */
+   std::string MailboxPath() const;
+   /* quoted IMAP string for use inside a command */
+   static std::string QuoteString(const std::string& strText);
+   /* system flag name of a MailProperty, without the backslash */
+   static const char* PropertyName(MailProperty eProperty);
+
    MailOperation        m_eOperationType;
    MailProperty         m_eMailProperty;
    SearchOption         m_eSearchOption;
@@ -117,6 +193,12 @@ protected:
    std::string          m_strMail;
    std::string          m_strMsgNumber;
    std::string          m_strFolderName;
+   std::string          m_strMailbox;
+   std::string          m_strSearchCriteria;
+   bool                 m_bSearchByUID = false;
+   bool                 m_bUID = false;
+   bool                 m_bAddProperty = true;
+   bool                 m_bCompress = false;
    std::string*         m_pstrText;
 
 };
@@ -0,0 +1,446 @@
+/*
+* @file IMAPCompressRelay.cpp
+* @brief IMAP COMPRESS=DEFLATE (RFC 4978) underneath libcurl
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "IMAPCompressRelay.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const size_t RELAY_BUFFER_SIZE = 64 * 1024;
+const int CONNECT_TIMEOUT_MS = 30000;
+const char COMPRESS_TAG[] = "QTEFZ";
+
+/* "tag VERB ..." -> VERB in upper case */
+std::string CommandVerb(const std::string& strLine, std::string* pTag)
+{
+   const size_t uTagEnd = strLine.find(' ');
+   if (uTagEnd == std::string::npos)
+      return std::string();
+
+   size_t uVerbEnd = strLine.find_first_of(" \r", uTagEnd + 1);
+   if (uVerbEnd == std::string::npos)
+      uVerbEnd = strLine.size();
+
+   if (pTag != nullptr)
+      *pTag = strLine.substr(0, uTagEnd);
+
+   std::string strVerb = strLine.substr(uTagEnd + 1, uVerbEnd - uTagEnd - 1);
+   for (auto& c : strVerb)
+      c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+   return strVerb;
+}
+
+#ifndef WINDOWS
+/* Waits for curl to connect iClient to the listener. Any other local process
+* connecting first is turned away, it would otherwise see the session. */
+int AcceptClient(int iListener, int iClient)
+{
+   pollfd oPoll { iListener, POLLIN, 0 };
+   while (poll(&oPoll, 1, CONNECT_TIMEOUT_MS) == 1)
+   {
+      sockaddr_storage oPeer, oExpected;
+      socklen_t uPeerLength = sizeof(oPeer), uExpectedLength = sizeof(oExpected);
+      const int iAccepted = accept(iListener, reinterpret_cast<sockaddr*>(&oPeer), &uPeerLength);
+      if (iAccepted < 0)
+      {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         return -1;
+      }
+
+      if (getsockname(iClient, reinterpret_cast<sockaddr*>(&oExpected), &uExpectedLength) == 0 &&
+          uPeerLength == uExpectedLength && std::memcmp(&oPeer, &oExpected, uPeerLength) == 0)
+         return iAccepted;
+
+      close(iAccepted);
+   }
+   return -1;
+}
+#endif
+
+} // namespace
+
+CIMAPCompressRelay::Stats& CIMAPCompressRelay::GetStats()
+{
+   static Stats s_oStats;
+   return s_oStats;
+}
+
+#ifdef WINDOWS
+
+curl_socket_t CIMAPCompressRelay::OpenSocketCallback(void*, curlsocktype, struct curl_sockaddr* pAddress)
+{
+   /* no relay on Windows: a plain socket, uncompressed */
+   return socket(pAddress->family, pAddress->socktype, pAddress->protocol);
+}
+
+#else
+
+curl_socket_t CIMAPCompressRelay::OpenSocketCallback(void*, curlsocktype ePurpose, struct curl_sockaddr* pAddress)
+{
+   if (ePurpose != CURLSOCKTYPE_IPCXN || (pAddress->family != AF_INET && pAddress->family != AF_INET6))
+      return CURL_SOCKET_BAD;
+
+   /* Connect to the server ourselves; on failure curl tries its next address */
+   const int iServer = socket(pAddress->family, pAddress->socktype, pAddress->protocol);
+   if (iServer < 0)
+      return CURL_SOCKET_BAD;
+
+   const int iFlags = fcntl(iServer, F_GETFL, 0);
+   fcntl(iServer, F_SETFL, iFlags | O_NONBLOCK);
+   int iResult = connect(iServer, &pAddress->addr, pAddress->addrlen);
+   if (iResult != 0 && errno == EINPROGRESS)
+   {
+      pollfd oPoll { iServer, POLLOUT, 0 };
+      int iError = 0;
+      socklen_t uLength = sizeof(iError);
+      if (poll(&oPoll, 1, CONNECT_TIMEOUT_MS) == 1 &&
+          getsockopt(iServer, SOL_SOCKET, SO_ERROR, &iError, &uLength) == 0 && iError == 0)
+         iResult = 0;
+   }
+   fcntl(iServer, F_SETFL, iFlags);
+
+   /* curl gets a fresh socket of the same family and connects it to a one-shot
+   * loopback listener in place of the server. Handing curl a socket pair with
+   * CURL_SOCKOPT_ALREADY_CONNECTED does not work on every libcurl release. */
+   sockaddr_storage oListen;
+   std::memset(&oListen, 0, sizeof(oListen));
+   socklen_t uListenLength;
+   if (pAddress->family == AF_INET)
+   {
+      sockaddr_in* pIn = reinterpret_cast<sockaddr_in*>(&oListen);
+      pIn->sin_family = AF_INET;
+      pIn->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      uListenLength = sizeof(sockaddr_in);
+   }
+   else
+   {
+      sockaddr_in6* pIn6 = reinterpret_cast<sockaddr_in6*>(&oListen);
+      pIn6->sin6_family = AF_INET6;
+      pIn6->sin6_addr = in6addr_loopback;
+      uListenLength = sizeof(sockaddr_in6);
+   }
+
+   const int iListener = (iResult == 0) ? socket(pAddress->family, SOCK_STREAM, 0) : -1;
+   if (iListener < 0 ||
+       bind(iListener, reinterpret_cast<sockaddr*>(&oListen), uListenLength) != 0 ||
+       listen(iListener, 1) != 0 ||
+       getsockname(iListener, reinterpret_cast<sockaddr*>(&oListen), &uListenLength) != 0 ||
+       uListenLength > pAddress->addrlen)
+   {
+      if (iListener >= 0)
+         close(iListener);
+      close(iServer);
+      return CURL_SOCKET_BAD;
+   }
+
+   const int iClient = socket(pAddress->family, pAddress->socktype, pAddress->protocol);
+   if (iClient < 0)
+   {
+      close(iListener);
+      close(iServer);
+      return CURL_SOCKET_BAD;
+   }
+
+   std::memcpy(&pAddress->addr, &oListen, uListenLength);
+   pAddress->addrlen = uListenLength;
+
+   /* The relay owns the listener and the server socket and ends when curl closes iClient */
+   std::thread([iListener, iClient, iServer]()
+   {
+      const int iAccepted = AcceptClient(iListener, iClient);
+      close(iListener);
+      if (iAccepted < 0)
+      {
+         close(iServer);
+         return;
+      }
+
+      CIMAPCompressRelay oRelay(iAccepted, iServer);
+      oRelay.Run();
+   }).detach();
+
+   return iClient;
+}
+
+#endif
+
+CIMAPCompressRelay::CIMAPCompressRelay(int iClient, int iServer) :
+   m_iClient(iClient),
+   m_iServer(iServer)
+{
+   std::memset(&m_oDeflate, 0, sizeof(m_oDeflate));
+   std::memset(&m_oInflate, 0, sizeof(m_oInflate));
+}
+
+CIMAPCompressRelay::~CIMAPCompressRelay()
+{
+   if (m_bZlibReady)
+   {
+      deflateEnd(&m_oDeflate);
+      inflateEnd(&m_oInflate);
+   }
+#ifndef WINDOWS
+   close(m_iClient);
+   close(m_iServer);
+#endif
+}
+
+void CIMAPCompressRelay::Run()
+{
+#ifndef WINDOWS
+   std::string strBuffer(RELAY_BUFFER_SIZE, '\0');
+
+   for (;;)
+   {
+      pollfd aoPoll[2] = { { m_iClient, POLLIN, 0 }, { m_iServer, POLLIN, 0 } };
+      if (poll(aoPoll, 2, -1) < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return;
+      }
+
+      for (int i = 0; i < 2; ++i)
+      {
+         if (aoPoll[i].revents == 0)
+            continue;
+
+         const ssize_t iRead = recv(aoPoll[i].fd, &strBuffer[0], strBuffer.size(), 0);
+         if (iRead <= 0)
+            return; // either side closed: close the other one too
+
+         const bool bOk = (i == 0) ? FromClient(strBuffer.data(), static_cast<size_t>(iRead))
+                                   : FromServer(strBuffer.data(), static_cast<size_t>(iRead));
+         if (!bOk)
+            return;
+      }
+   }
+#endif
+}
+
+bool CIMAPCompressRelay::FromClient(const char* pData, size_t uSize)
+{
+   GetStats().uPlainSent += uSize;
+
+   if (m_eState == State::AUTHENTICATED && !Negotiate())
+      return false;
+
+   if (m_eState == State::PREAUTH)
+      WatchClientLines(pData, uSize);
+
+   if (m_eState != State::COMPRESSED)
+      return SendToServer(pData, uSize);
+
+   /* Z_SYNC_FLUSH after every chunk: the server must be able to act on the
+   * command without waiting for more input (RFC 4978 section 4) */
+   std::string strOut(RELAY_BUFFER_SIZE, '\0');
+   m_oDeflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pData));
+   m_oDeflate.avail_in = static_cast<uInt>(uSize);
+   do
+   {
+      m_oDeflate.next_out = reinterpret_cast<Bytef*>(&strOut[0]);
+      m_oDeflate.avail_out = static_cast<uInt>(strOut.size());
+      if (deflate(&m_oDeflate, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+         return false;
+      if (!SendToServer(strOut.data(), strOut.size() - m_oDeflate.avail_out))
+         return false;
+   } while (m_oDeflate.avail_out == 0);
+
+   return true;
+}
+
+bool CIMAPCompressRelay::FromServer(const char* pData, size_t uSize)
+{
+   GetStats().uWireReceived += uSize;
+
+   if (m_eState == State::PREAUTH)
+      WatchServerLines(pData, uSize);
+
+   if (m_eState != State::COMPRESSED)
+      return SendToClient(pData, uSize);
+
+   std::string strOut(RELAY_BUFFER_SIZE, '\0');
+   m_oInflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pData));
+   m_oInflate.avail_in = static_cast<uInt>(uSize);
+   do
+   {
+      m_oInflate.next_out = reinterpret_cast<Bytef*>(&strOut[0]);
+      m_oInflate.avail_out = static_cast<uInt>(strOut.size());
+      const int iResult = inflate(&m_oInflate, Z_SYNC_FLUSH);
+      if (iResult != Z_OK && iResult != Z_BUF_ERROR)
+         return false;
+      if (!SendToClient(strOut.data(), strOut.size() - m_oInflate.avail_out))
+         return false;
+   } while (m_oInflate.avail_out == 0 || m_oInflate.avail_in > 0);
+
+   return true;
+}
+
+bool CIMAPCompressRelay::Negotiate()
+{
+#ifndef WINDOWS
+   /* curl waits for the answer to the command we are holding, so untagged data
+   * arriving meanwhile is simply passed on */
+   const std::string strCommand = std::string(COMPRESS_TAG) + " COMPRESS DEFLATE\r\n";
+   if (!SendToServer(strCommand.data(), strCommand.size()))
+      return false;
+
+   std::string strPending;
+   std::string strBuffer(RELAY_BUFFER_SIZE, '\0');
+   for (;;)
+   {
+      const size_t uLineEnd = strPending.find("\r\n");
+      if (uLineEnd == std::string::npos)
+      {
+         pollfd oPoll { m_iServer, POLLIN, 0 };
+         if (poll(&oPoll, 1, CONNECT_TIMEOUT_MS) != 1)
+            return false;
+
+         const ssize_t iRead = recv(m_iServer, &strBuffer[0], strBuffer.size(), 0);
+         if (iRead <= 0)
+            return false;
+
+         GetStats().uWireReceived += static_cast<size_t>(iRead);
+         strPending.append(strBuffer.data(), static_cast<size_t>(iRead));
+         continue;
+      }
+
+      const std::string strLine = strPending.substr(0, uLineEnd + 2);
+      strPending.erase(0, uLineEnd + 2);
+
+      std::string strTag;
+      const std::string strStatus = CommandVerb(strLine, &strTag);
+      if (strTag != COMPRESS_TAG)
+      {
+         if (!SendToClient(strLine.data(), strLine.size()))
+            return false;
+         continue;
+      }
+
+      if (strStatus != "OK")
+      {
+         m_eState = State::PASSTHROUGH;
+         return strPending.empty() || SendToClient(strPending.data(), strPending.size());
+      }
+
+      /* raw deflate streams (no zlib header), one per direction */
+      if (deflateInit2(&m_oDeflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+         return false;
+      if (inflateInit2(&m_oInflate, -15) != Z_OK)
+      {
+         deflateEnd(&m_oDeflate);
+         return false;
+      }
+      m_bZlibReady = true;
+      m_eState = State::COMPRESSED;
+      ++GetStats().uCompressedSessions;
+
+      /* anything after the OK is already compressed */
+      GetStats().uWireReceived -= strPending.size();
+      return strPending.empty() || FromServer(strPending.data(), strPending.size());
+   }
+#else
+   m_eState = State::PASSTHROUGH;
+   return true;
+#endif
+}
+
+void CIMAPCompressRelay::WatchClientLines(const char* pData, size_t uSize)
+{
+   m_strClientLine.append(pData, uSize);
+
+   size_t uLineEnd;
+   while ((uLineEnd = m_strClientLine.find("\r\n")) != std::string::npos)
+   {
+      std::string strTag;
+      const std::string strVerb = CommandVerb(m_strClientLine.substr(0, uLineEnd), &strTag);
+      m_strClientLine.erase(0, uLineEnd + 2);
+
+      if (strVerb == "LOGIN" || strVerb == "AUTHENTICATE")
+         m_strLoginTag = strTag;
+      else if (strVerb == "STARTTLS")
+         m_eState = State::PASSTHROUGH; // TLS bytes from now on
+   }
+}
+
+void CIMAPCompressRelay::WatchServerLines(const char* pData, size_t uSize)
+{
+   m_strServerLine.append(pData, uSize);
+
+   size_t uLineEnd;
+   while ((uLineEnd = m_strServerLine.find("\r\n")) != std::string::npos)
+   {
+      std::string strTag;
+      const std::string strStatus = CommandVerb(m_strServerLine.substr(0, uLineEnd), &strTag);
+      m_strServerLine.erase(0, uLineEnd + 2);
+
+      if (!m_strLoginTag.empty() && strTag == m_strLoginTag)
+      {
+         if (strStatus == "OK")
+         {
+            m_eState = State::AUTHENTICATED;
+            m_strClientLine.clear();
+            m_strServerLine.clear();
+            return;
+         }
+         m_strLoginTag.clear();
+      }
+   }
+}
+
+bool CIMAPCompressRelay::SendToServer(const char* pData, size_t uSize)
+{
+#ifndef WINDOWS
+   GetStats().uWireSent += uSize;
+   while (uSize > 0)
+   {
+      const ssize_t iSent = send(m_iServer, pData, uSize, MSG_NOSIGNAL);
+      if (iSent <= 0)
+      {
+         if (iSent < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      pData += iSent;
+      uSize -= static_cast<size_t>(iSent);
+   }
+#endif
+   return true;
+}
+
+bool CIMAPCompressRelay::SendToClient(const char* pData, size_t uSize)
+{
+#ifndef WINDOWS
+   GetStats().uPlainReceived += uSize;
+   while (uSize > 0)
+   {
+      const ssize_t iSent = send(m_iClient, pData, uSize, MSG_NOSIGNAL);
+      if (iSent <= 0)
+      {
+         if (iSent < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      pData += iSent;
+      uSize -= static_cast<size_t>(iSent);
+   }
+#endif
+   return true;
+}
@@ -0,0 +1,77 @@
+/*
+* @file IMAPCompressRelay.h
+* @brief IMAP COMPRESS=DEFLATE (RFC 4978) underneath libcurl
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_IMAPCOMPRESSRELAY_H_
+#define INCLUDE_IMAPCOMPRESSRELAY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <curl/curl.h>
+#include <string>
+#include <zlib.h>
+
+/* libcurl has no COMPRESS support and owns the socket, so the compression
+* happens in a relay thread: the relay holds the real server connection and
+* curl is pointed at a loopback listener of the relay instead. The relay watches the plaintext
+* conversation until the login succeeds, sends COMPRESS DEFLATE before the
+* next command and, if the server agrees, deflates everything curl sends and
+* inflates everything the server answers. If the server refuses, or the
+* session switches to TLS (STARTTLS), the relay just copies bytes.
+*
+* The relay only sees plaintext, so it cannot compress SSL or STARTTLS
+* sessions: CIMAPClient installs it for NO_SSLTLS sessions without a proxy
+* only, and logs COMPRESS_UNAVAILABLE for the others. */
+class CIMAPCompressRelay
+{
+public:
+   struct Stats
+   {
+      std::atomic<uint64_t> uPlainSent{0};      // bytes curl sent
+      std::atomic<uint64_t> uWireSent{0};       // bytes written to the server
+      std::atomic<uint64_t> uPlainReceived{0};  // bytes handed to curl
+      std::atomic<uint64_t> uWireReceived{0};   // bytes read from the server
+      std::atomic<uint64_t> uCompressedSessions{0};
+   };
+
+   /* totals over every relayed connection of the process */
+   static Stats& GetStats();
+
+   /* CURLOPT_OPENSOCKETFUNCTION: connects to the server, starts the relay and
+   * rewrites the address curl connects to */
+   static curl_socket_t OpenSocketCallback(void* pClient, curlsocktype ePurpose, struct curl_sockaddr* pAddress);
+
+   CIMAPCompressRelay(const CIMAPCompressRelay&) = delete;
+   CIMAPCompressRelay& operator=(const CIMAPCompressRelay&) = delete;
+
+private:
+   enum class State { PREAUTH, AUTHENTICATED, COMPRESSED, PASSTHROUGH };
+
+   CIMAPCompressRelay(int iClient, int iServer);
+   ~CIMAPCompressRelay();
+
+   void Run();
+   bool FromClient(const char* pData, size_t uSize);
+   bool FromServer(const char* pData, size_t uSize);
+   bool Negotiate();
+   void WatchClientLines(const char* pData, size_t uSize);
+   void WatchServerLines(const char* pData, size_t uSize);
+
+   bool SendToServer(const char* pData, size_t uSize);
+   bool SendToClient(const char* pData, size_t uSize);
+
+   int            m_iClient;
+   int            m_iServer;
+   State          m_eState = State::PREAUTH;
+   std::string    m_strClientLine;
+   std::string    m_strServerLine;
+   std::string    m_strLoginTag;
+   z_stream       m_oDeflate;
+   z_stream       m_oInflate;
+   bool           m_bZlibReady = false;
+};
+
+#endif
@@ -0,0 +1,1212 @@
+/*
+* @file IMAPStandInServer.cpp
+* @brief a small IMAP server on loopback serving a synthetic mailbox
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "IMAPStandInServer.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <zlib.h>
+
+#ifndef WINDOWS
+#include <netinet/in.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+const char CAPABILITIES[] = "IMAP4rev1 LITERAL+ ESEARCH UIDPLUS LIST-STATUS MOVE COMPRESS=DEFLATE";
+const char* const MONTHS[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+const char* const WEEKDAYS[7] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" }; // 1970-01-01 was a Thursday
+const char* const WORDS[16] = { "invoice", "meeting", "report", "quarter", "schedule", "delivery",
+                                "budget", "review", "project", "update", "contract", "summary",
+                                "customer", "release", "payment", "server" };
+const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const int FIRST_DAY = 19358; // 2023-01-01
+const unsigned MESSAGES_PER_DAY = 10;
+
+typedef std::function<bool(const void*, size_t)> Predicate;
+typedef std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+
+/* days since 1970-01-01 <-> civil date, proleptic Gregorian (H. Hinnant) */
+int DaysFromCivil(int iYear, unsigned uMonth, unsigned uDay)
+{
+   iYear -= uMonth <= 2;
+   const int iEra = (iYear >= 0 ? iYear : iYear - 399) / 400;
+   const unsigned uYearOfEra = static_cast<unsigned>(iYear - iEra * 400);
+   const unsigned uDayOfYear = (153 * (uMonth > 2 ? uMonth - 3 : uMonth + 9) + 2) / 5 + uDay - 1;
+   const unsigned uDayOfEra = uYearOfEra * 365 + uYearOfEra / 4 - uYearOfEra / 100 + uDayOfYear;
+   return iEra * 146097 + static_cast<int>(uDayOfEra) - 719468;
+}
+
+void CivilFromDays(int iDays, int& iYear, unsigned& uMonth, unsigned& uDay)
+{
+   iDays += 719468;
+   const int iEra = (iDays >= 0 ? iDays : iDays - 146096) / 146097;
+   const unsigned uDayOfEra = static_cast<unsigned>(iDays - iEra * 146097);
+   const unsigned uYearOfEra = (uDayOfEra - uDayOfEra / 1460 + uDayOfEra / 36524 - uDayOfEra / 146096) / 365;
+   const unsigned uDayOfYear = uDayOfEra - (365 * uYearOfEra + uYearOfEra / 4 - uYearOfEra / 100);
+   const unsigned uMonthPrime = (5 * uDayOfYear + 2) / 153;
+   uDay = uDayOfYear - (153 * uMonthPrime + 2) / 5 + 1;
+   uMonth = uMonthPrime < 10 ? uMonthPrime + 3 : uMonthPrime - 9;
+   iYear = static_cast<int>(uYearOfEra) + iEra * 400 + (uMonth <= 2);
+}
+
+/* "d-Mon-yyyy" -> days since 1970-01-01 */
+bool ParseImapDate(const std::string& strDate, int& iDays)
+{
+   const size_t uFirst = strDate.find('-');
+   const size_t uSecond = strDate.find('-', uFirst + 1);
+   if (uFirst == std::string::npos || uSecond != uFirst + 4)
+      return false;
+
+   for (unsigned uMonth = 0; uMonth < 12; ++uMonth)
+   {
+      if (strncasecmp(strDate.c_str() + uFirst + 1, MONTHS[uMonth], 3) == 0)
+      {
+         iDays = DaysFromCivil(std::atoi(strDate.c_str() + uSecond + 1), uMonth + 1,
+                               static_cast<unsigned>(std::atoi(strDate.c_str())));
+         return true;
+      }
+   }
+   return false;
+}
+
+std::string Upper(std::string str)
+{
+   for (auto& c : str)
+      c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+   return str;
+}
+
+bool ContainsNoCase(const std::string& strHaystack, const std::string& strNeedle)
+{
+   return std::search(strHaystack.begin(), strHaystack.end(), strNeedle.begin(), strNeedle.end(),
+      [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == std::tolower(static_cast<unsigned char>(b)); })
+      != strHaystack.end();
+}
+
+/* Splits a command line at the spaces outside quotes, parentheses and
+* brackets. Quoted strings lose their quotes, lists keep their parentheses. */
+std::vector<std::string> Tokenize(const std::string& strLine)
+{
+   std::vector<std::string> vecTokens;
+   std::string strToken;
+   bool bToken = false;
+   int iDepth = 0;
+
+   for (size_t i = 0; i < strLine.size(); ++i)
+   {
+      const char c = strLine[i];
+      if (c == '"' && iDepth == 0)
+      {
+         for (++i; i < strLine.size() && strLine[i] != '"'; ++i)
+         {
+            if (strLine[i] == '\\' && i + 1 < strLine.size())
+               ++i;
+            strToken += strLine[i];
+         }
+         bToken = true;
+      }
+      else if (c == ' ' && iDepth == 0)
+      {
+         if (bToken)
+            vecTokens.push_back(strToken);
+         strToken.clear();
+         bToken = false;
+      }
+      else
+      {
+         if (c == '(' || c == '[')
+            ++iDepth;
+         else if ((c == ')' || c == ']') && iDepth > 0)
+            --iDepth;
+         strToken += c;
+         bToken = true;
+      }
+   }
+   if (bToken)
+      vecTokens.push_back(strToken);
+   return vecTokens;
+}
+
+/* "(a b c)" -> a, b, c */
+std::vector<std::string> ListItems(const std::string& strList)
+{
+   if (strList.size() >= 2 && strList.front() == '(' && strList.back() == ')')
+      return Tokenize(strList.substr(1, strList.size() - 2));
+   return Tokenize(strList);
+}
+
+/* "1:5,7,9:*" with * = uMax; false on anything else */
+bool ParseSet(const std::string& strSet, uint32_t uMax, Ranges& vecRanges)
+{
+   size_t uPos = 0;
+   while (uPos < strSet.size())
+   {
+      uint32_t auValues[2];
+      int iCount = 0;
+      while (iCount < 2)
+      {
+         if (strSet[uPos] == '*')
+         {
+            auValues[iCount++] = uMax;
+            ++uPos;
+         }
+         else
+         {
+            char* pEnd = nullptr;
+            const unsigned long ulValue = std::strtoul(strSet.c_str() + uPos, &pEnd, 10);
+            if (pEnd == strSet.c_str() + uPos || ulValue > 0xFFFFFFFFul)
+               return false;
+            auValues[iCount++] = static_cast<uint32_t>(ulValue);
+            uPos = static_cast<size_t>(pEnd - strSet.c_str());
+         }
+         if (iCount == 1 && uPos < strSet.size() && strSet[uPos] == ':')
+            ++uPos;
+         else
+            break;
+      }
+
+      const uint32_t uLast = iCount == 2 ? auValues[1] : auValues[0];
+      vecRanges.emplace_back(std::min(auValues[0], uLast), std::max(auValues[0], uLast));
+
+      if (uPos < strSet.size() && strSet[uPos] != ',')
+         return false;
+      ++uPos;
+   }
+
+   /* sorted and merged, for InRanges() */
+   std::sort(vecRanges.begin(), vecRanges.end());
+   size_t uMerged = 0;
+   for (size_t i = 1; i < vecRanges.size(); ++i)
+   {
+      if (vecRanges[i].first <= static_cast<uint64_t>(vecRanges[uMerged].second) + 1)
+         vecRanges[uMerged].second = std::max(vecRanges[uMerged].second, vecRanges[i].second);
+      else
+         vecRanges[++uMerged] = vecRanges[i];
+   }
+   vecRanges.resize(vecRanges.empty() ? 0 : uMerged + 1);
+   return !vecRanges.empty();
+}
+
+bool InRanges(const Ranges& vecRanges, uint32_t uValue)
+{
+   auto itRange = std::upper_bound(vecRanges.begin(), vecRanges.end(), uValue,
+      [](uint32_t u, const std::pair<uint32_t, uint32_t>& oRange) { return u < oRange.first; });
+   return itRange != vecRanges.begin() && uValue <= (itRange - 1)->second;
+}
+
+/* ascending values -> "1:3,7" */
+std::string RenderSet(const std::vector<uint32_t>& vecValues)
+{
+   std::string strSet;
+   for (size_t i = 0; i < vecValues.size(); )
+   {
+      size_t j = i;
+      while (j + 1 < vecValues.size() && vecValues[j + 1] == vecValues[j] + 1)
+         ++j;
+      if (!strSet.empty())
+         strSet += ',';
+      strSet += std::to_string(vecValues[i]);
+      if (j != i)
+         strSet += ':' + std::to_string(vecValues[j]);
+      i = j + 1;
+   }
+   return strSet;
+}
+
+std::string Quote(const std::string& str)
+{
+   if (str.empty())
+      return "NIL";
+
+   std::string strQuoted = "\"";
+   for (char c : str)
+   {
+      if (c == '"' || c == '\\')
+         strQuoted += '\\';
+      strQuoted += c;
+   }
+   return strQuoted + '"';
+}
+
+/* what servers send for 8-bit, quoted or long values */
+std::string Literal(const std::string& str)
+{
+   return "{" + std::to_string(str.size()) + "}\r\n" + str;
+}
+
+std::string Base64(const std::string& strData)
+{
+   std::string strOut;
+   strOut.reserve((strData.size() + 2) / 3 * 4);
+   for (size_t i = 0; i < strData.size(); i += 3)
+   {
+      const uint32_t uChunk = (static_cast<unsigned char>(strData[i]) << 16) |
+         (i + 1 < strData.size() ? static_cast<unsigned char>(strData[i + 1]) << 8 : 0) |
+         (i + 2 < strData.size() ? static_cast<unsigned char>(strData[i + 2]) : 0);
+      strOut += BASE64[(uChunk >> 18) & 63];
+      strOut += BASE64[(uChunk >> 12) & 63];
+      strOut += i + 1 < strData.size() ? BASE64[(uChunk >> 6) & 63] : '=';
+      strOut += i + 2 < strData.size() ? BASE64[uChunk & 63] : '=';
+   }
+   return strOut;
+}
+
+/* about uBytes of words in lines of at most 76 characters */
+std::string Text(std::mt19937& oRandom, size_t uBytes)
+{
+   std::string strText;
+   size_t uLine = 0;
+   while (strText.size() < uBytes)
+   {
+      const char* pWord = WORDS[oRandom() % 16];
+      const size_t uLength = std::strlen(pWord);
+      if (uLine + uLength + 1 > 76)
+      {
+         strText += "\r\n";
+         uLine = 0;
+      }
+      else if (uLine != 0)
+      {
+         strText += ' ';
+         ++uLine;
+      }
+      strText += pWord;
+      uLine += uLength;
+   }
+   return strText + "\r\n";
+}
+
+std::string HeaderValue(const std::string& strMessage, const char* pName)
+{
+   const std::string strName = std::string("\n") + pName + ": ";
+   const size_t uHeaderEnd = strMessage.find("\r\n\r\n");
+   size_t uPos = ("\n" + strMessage.substr(0, uHeaderEnd)).find(strName);
+   if (uPos == std::string::npos)
+      return std::string();
+
+   uPos += strName.size() - 1; // the "\n" prepended above
+   return strMessage.substr(uPos, strMessage.find("\r\n", uPos) - uPos);
+}
+
+std::string AddressOf(const std::string& strValue)
+{
+   const size_t uOpen = strValue.find('<');
+   if (uOpen == std::string::npos)
+      return strValue;
+   return strValue.substr(uOpen + 1, strValue.find('>', uOpen) - uOpen - 1);
+}
+
+#ifndef WINDOWS
+bool SendAll(int iSocket, const std::string& strData)
+{
+   const char* pData = strData.data();
+   size_t uSize = strData.size();
+   while (uSize > 0)
+   {
+      const ssize_t iSent = send(iSocket, pData, uSize, MSG_NOSIGNAL);
+      if (iSent <= 0)
+      {
+         if (iSent < 0 && errno == EINTR)
+            continue;
+         return false;
+      }
+      pData += iSent;
+      uSize -= static_cast<size_t>(iSent);
+   }
+   return true;
+}
+#endif
+
+} // namespace
+
+CIMAPStandInServer::CIMAPStandInServer(const MailboxSpec& oSpec) :
+   m_bLiteralEnvelopes(oSpec.bLiteralEnvelopes)
+{
+   std::mt19937 oRandom(oSpec.uSeed);
+   m_vecMessages.reserve(oSpec.uMessages);
+   for (unsigned i = 0; i < oSpec.uMessages; ++i)
+   {
+      Message oMessage;
+      oMessage.uUid = m_uUidNext++;
+      oMessage.iDay = FIRST_DAY + static_cast<int>(i / MESSAGES_PER_DAY);
+      oMessage.bSeen = oRandom() % 100 < oSpec.uSeenPercent;
+      oMessage.bFlagged = oRandom() % 20 == 0;
+      oMessage.bAnswered = oMessage.bSeen && oRandom() % 4 == 0;
+      oMessage.bDeleted = false;
+      oMessage.strData = MakeMessage(oSpec, i);
+      oMessage.strFrom = AddressOf(HeaderValue(oMessage.strData, "From"));
+      oMessage.strTo = AddressOf(HeaderValue(oMessage.strData, "To"));
+      oMessage.strSubject = HeaderValue(oMessage.strData, "Subject");
+      m_uMailboxBytes += oMessage.strData.size();
+      m_vecMessages.push_back(std::move(oMessage));
+   }
+}
+
+CIMAPStandInServer::~CIMAPStandInServer()
+{
+   Stop();
+}
+
+std::string CIMAPStandInServer::MakeMessage(const MailboxSpec& oSpec, unsigned uIndex)
+{
+   std::mt19937 oRandom(oSpec.uSeed * 1000003u + uIndex);
+
+   const int iDay = FIRST_DAY + static_cast<int>(uIndex / MESSAGES_PER_DAY);
+   int iYear;
+   unsigned uMonth, uDay;
+   CivilFromDays(iDay, iYear, uMonth, uDay);
+   const unsigned uSecond = (uIndex % MESSAGES_PER_DAY) * 8640 + oRandom() % 8640;
+   char szDate[64];
+   std::snprintf(szDate, sizeof(szDate), "%s, %02u %s %d %02u:%02u:%02u +0000", WEEKDAYS[((iDay % 7) + 7) % 7],
+                 uDay, MONTHS[uMonth - 1], iYear, uSecond / 3600, uSecond / 60 % 60, uSecond % 60);
+
+   const unsigned uSender = oRandom() % 50;
+   const std::string strTopic = std::string(WORDS[oRandom() % 16]) + ' ' + WORDS[oRandom() % 16];
+   std::string strFrom = "Sender " + std::to_string(uSender);
+   std::string strSubject = "Message " + std::to_string(uIndex + 1) + ": " + strTopic;
+   if (oSpec.bEncodedHeaders)
+   {
+      strFrom = "=?UTF-8?B?" + Base64("Отправитель " + std::to_string(uSender)) + "?=";
+      strSubject = "=?UTF-8?B?" + Base64("Письмо " + std::to_string(uIndex + 1) + ": " + strTopic) + "?=";
+   }
+
+   std::string strMessage;
+   strMessage.reserve(oSpec.uBodyBytes * (oSpec.bHtmlAlternative ? 2 : 1) + oSpec.uAttachments * oSpec.uAttachmentBytes * 4 / 3 + 1024);
+   strMessage += "From: " + strFrom + " <sender" + std::to_string(uSender) + "@example.org>\r\n";
+   strMessage += "To: user@example.com\r\n";
+   strMessage += "Subject: " + strSubject + "\r\n";
+   strMessage += std::string("Date: ") + szDate + "\r\n";
+   strMessage += "Message-ID: <" + std::to_string(uIndex + 1) + '.' + std::to_string(oSpec.uSeed) + "@standin.example>\r\n";
+   strMessage += "MIME-Version: 1.0\r\n";
+
+   const std::string strText = Text(oRandom, oSpec.uBodyBytes);
+   if (oSpec.uAttachments == 0 && !oSpec.bHtmlAlternative)
+   {
+      strMessage += "Content-Type: text/plain; charset=utf-8\r\n\r\n";
+      return strMessage + strText;
+   }
+
+   const std::string strBoundary = "=_standin_" + std::to_string(uIndex + 1);
+   const std::string strAlternative = strBoundary + "_alt";
+   strMessage += "Content-Type: multipart/mixed; boundary=\"" + strBoundary + "\"\r\n\r\n";
+   strMessage += "--" + strBoundary + "\r\n";
+   if (oSpec.bHtmlAlternative)
+   {
+      strMessage += "Content-Type: multipart/alternative; boundary=\"" + strAlternative + "\"\r\n\r\n";
+      strMessage += "--" + strAlternative + "\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n" + strText;
+      strMessage += "--" + strAlternative + "\r\nContent-Type: text/html; charset=utf-8\r\n\r\n";
+      strMessage += "<html><body><p>" + strText + "</p></body></html>\r\n";
+      strMessage += "--" + strAlternative + "--\r\n";
+   }
+   else
+      strMessage += "Content-Type: text/plain; charset=utf-8\r\n\r\n" + strText;
+
+   for (unsigned uAttachment = 0; uAttachment < oSpec.uAttachments; ++uAttachment)
+   {
+      std::string strBinary(oSpec.uAttachmentBytes, '\0');
+      for (auto& c : strBinary)
+         c = static_cast<char>(oRandom());
+
+      const std::string strEncoded = Base64(strBinary);
+      strMessage += "--" + strBoundary + "\r\n";
+      strMessage += "Content-Type: application/octet-stream; name=\"attachment-" + std::to_string(uAttachment + 1) + ".bin\"\r\n";
+      strMessage += "Content-Disposition: attachment; filename=\"attachment-" + std::to_string(uAttachment + 1) + ".bin\"\r\n";
+      strMessage += "Content-Transfer-Encoding: base64\r\n\r\n";
+      for (size_t uPos = 0; uPos < strEncoded.size(); uPos += 76)
+         strMessage += strEncoded.substr(uPos, 76) + "\r\n";
+   }
+   return strMessage + "--" + strBoundary + "--\r\n";
+}
+
+#ifdef WINDOWS
+
+bool CIMAPStandInServer::Start(uint16_t)
+{
+   return false;
+}
+
+void CIMAPStandInServer::Stop()
+{
+}
+
+void CIMAPStandInServer::AcceptLoop()
+{
+}
+
+void CIMAPStandInServer::Serve(int)
+{
+}
+
+#else
+
+bool CIMAPStandInServer::Start(uint16_t uPort)
+{
+   if (m_bRunning)
+      return false;
+
+   m_iListener = socket(AF_INET, SOCK_STREAM, 0);
+   if (m_iListener < 0)
+      return false;
+
+   const int iReuse = 1;
+   setsockopt(m_iListener, SOL_SOCKET, SO_REUSEADDR, &iReuse, sizeof(iReuse));
+
+   sockaddr_in oAddress;
+   std::memset(&oAddress, 0, sizeof(oAddress));
+   oAddress.sin_family = AF_INET;
+   oAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   oAddress.sin_port = htons(uPort);
+   socklen_t uLength = sizeof(oAddress);
+   if (bind(m_iListener, reinterpret_cast<sockaddr*>(&oAddress), sizeof(oAddress)) != 0 ||
+       listen(m_iListener, 64) != 0 ||
+       getsockname(m_iListener, reinterpret_cast<sockaddr*>(&oAddress), &uLength) != 0)
+   {
+      close(m_iListener);
+      m_iListener = -1;
+      return false;
+   }
+
+   m_uPort = ntohs(oAddress.sin_port);
+   m_uCommands = 0;
+   m_uWireBytes = 0;
+   m_bRunning = true;
+   m_oAcceptThread = std::thread(&CIMAPStandInServer::AcceptLoop, this);
+   return true;
+}
+
+void CIMAPStandInServer::Stop()
+{
+   if (!m_bRunning)
+      return;
+
+   m_bRunning = false;
+   m_oAcceptThread.join();
+   close(m_iListener);
+   m_iListener = -1;
+
+   std::vector<std::thread> vecSessions;
+   {
+      std::lock_guard<std::mutex> oLock(m_oSessionLock);
+      for (int iSocket : m_vecSockets)
+         shutdown(iSocket, SHUT_RDWR);
+      vecSessions.swap(m_vecSessions);
+   }
+   for (auto& oThread : vecSessions)
+      oThread.join();
+}
+
+void CIMAPStandInServer::AcceptLoop()
+{
+   while (m_bRunning)
+   {
+      pollfd oPoll { m_iListener, POLLIN, 0 };
+      if (poll(&oPoll, 1, 100) != 1)
+         continue;
+
+      const int iSocket = accept(m_iListener, nullptr, nullptr);
+      if (iSocket < 0)
+         continue;
+
+      std::lock_guard<std::mutex> oLock(m_oSessionLock);
+      m_vecSockets.push_back(iSocket);
+      m_vecSessions.emplace_back(&CIMAPStandInServer::Serve, this, iSocket);
+   }
+}
+
+void CIMAPStandInServer::Serve(int iSocket)
+{
+   Session oSession;
+   std::string strInput;
+   std::string strBuffer(64 * 1024, '\0');
+   std::string strChunk(16 * 1024, '\0');
+
+   /* once COMPRESS is active both directions are raw deflate streams (RFC 4978),
+   * flushed after every response */
+   z_stream oDeflate {};
+   z_stream oInflate {};
+   bool bCompressed = false;
+
+   const auto Send = [&](const std::string& strData)
+   {
+      if (!bCompressed)
+      {
+         m_uWireBytes += strData.size();
+         return SendAll(iSocket, strData);
+      }
+
+      std::string strWire;
+      oDeflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(strData.data()));
+      oDeflate.avail_in = static_cast<uInt>(strData.size());
+      do
+      {
+         oDeflate.next_out = reinterpret_cast<Bytef*>(&strChunk[0]);
+         oDeflate.avail_out = static_cast<uInt>(strChunk.size());
+         if (deflate(&oDeflate, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+            return false;
+         strWire.append(strChunk.data(), strChunk.size() - oDeflate.avail_out);
+      } while (oDeflate.avail_out == 0);
+
+      m_uWireBytes += strWire.size();
+      return SendAll(iSocket, strWire);
+   };
+
+   bool bOpen = Send(std::string("* OK [CAPABILITY ") + CAPABILITIES + "] stand-in server ready\r\n");
+
+   while (bOpen)
+   {
+      const ssize_t iRead = recv(iSocket, &strBuffer[0], strBuffer.size(), 0);
+      if (iRead <= 0)
+         break;
+      m_uWireBytes += static_cast<size_t>(iRead);
+
+      if (!bCompressed)
+         strInput.append(strBuffer.data(), static_cast<size_t>(iRead));
+      else
+      {
+         oInflate.next_in = reinterpret_cast<Bytef*>(&strBuffer[0]);
+         oInflate.avail_in = static_cast<uInt>(iRead);
+         do
+         {
+            oInflate.next_out = reinterpret_cast<Bytef*>(&strChunk[0]);
+            oInflate.avail_out = static_cast<uInt>(strChunk.size());
+            const int iStatus = inflate(&oInflate, Z_SYNC_FLUSH);
+            if (iStatus != Z_OK && iStatus != Z_BUF_ERROR)
+            {
+               bOpen = false;
+               break;
+            }
+            strInput.append(strChunk.data(), strChunk.size() - oInflate.avail_out);
+         } while (oInflate.avail_out == 0);
+      }
+
+      size_t uLineEnd;
+      while (bOpen && (uLineEnd = strInput.find("\r\n")) != std::string::npos)
+      {
+         const std::string strLine = strInput.substr(0, uLineEnd);
+         strInput.erase(0, uLineEnd + 2);
+
+         std::string strOut;
+         bOpen = Handle(oSession, strLine, strOut);
+         bOpen = Send(strOut) && bOpen;
+
+         /* the client waits for the OK before it compresses, so nothing is buffered yet */
+         if (bOpen && oSession.bCompress && !bCompressed)
+         {
+            bOpen = deflateInit2(&oDeflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            if (bOpen && inflateInit2(&oInflate, -15) != Z_OK)
+            {
+               deflateEnd(&oDeflate);
+               bOpen = false;
+            }
+            bCompressed = bOpen;
+         }
+      }
+   }
+
+   if (bCompressed)
+   {
+      deflateEnd(&oDeflate);
+      inflateEnd(&oInflate);
+   }
+
+   std::lock_guard<std::mutex> oLock(m_oSessionLock);
+   m_vecSockets.erase(std::find(m_vecSockets.begin(), m_vecSockets.end(), iSocket));
+   close(iSocket);
+}
+
+#endif
+
+bool CIMAPStandInServer::Handle(Session& oSession, const std::string& strLine, std::string& strOut)
+{
+   ++m_uCommands;
+
+   std::vector<std::string> vecArgs = Tokenize(strLine);
+   if (vecArgs.size() < 2)
+   {
+      strOut = "* BAD empty command\r\n";
+      return true;
+   }
+
+   const std::string strTag = vecArgs[0];
+   std::string strVerb = Upper(vecArgs[1]);
+   vecArgs.erase(vecArgs.begin(), vecArgs.begin() + 2);
+
+   const bool bUID = strVerb == "UID" && !vecArgs.empty();
+   if (bUID)
+   {
+      strVerb = Upper(vecArgs[0]);
+      vecArgs.erase(vecArgs.begin());
+   }
+
+   if (!strLine.empty() && strLine.back() == '}')
+   {
+      strOut = strTag + " BAD literals are not supported\r\n";
+      return true;
+   }
+
+   if (strVerb == "CAPABILITY" && !bUID)
+   {
+      strOut = std::string("* CAPABILITY ") + CAPABILITIES + "\r\n" + strTag + " OK CAPABILITY completed\r\n";
+      return true;
+   }
+   if (strVerb == "NOOP" && !bUID)
+   {
+      strOut = strTag + " OK NOOP completed\r\n";
+      return true;
+   }
+   if (strVerb == "LOGOUT" && !bUID)
+   {
+      strOut = "* BYE logging out\r\n" + strTag + " OK LOGOUT completed\r\n";
+      return false;
+   }
+   if (strVerb == "LOGIN" && !bUID)
+   {
+      oSession.bAuthenticated = vecArgs.size() == 2;
+      strOut = strTag + (oSession.bAuthenticated ? " OK LOGIN completed\r\n" : " BAD LOGIN needs user and password\r\n");
+      return true;
+   }
+   if (!oSession.bAuthenticated)
+   {
+      strOut = strTag + " NO not authenticated\r\n";
+      return true;
+   }
+
+   if (strVerb == "COMPRESS" && !bUID)
+   {
+      if (vecArgs.size() != 1 || Upper(vecArgs[0]) != "DEFLATE")
+         strOut = strTag + " BAD only COMPRESS DEFLATE is supported\r\n";
+      else if (oSession.bCompress)
+         strOut = strTag + " NO [COMPRESSIONACTIVE] DEFLATE already active\r\n";
+      else
+      {
+         oSession.bCompress = true;
+         strOut = strTag + " OK DEFLATE active\r\n";
+      }
+      return true;
+   }
+
+   std::lock_guard<std::mutex> oLock(m_oMailboxLock);
+
+   uint32_t uUnseen = 0;
+   for (const auto& oMessage : m_vecMessages)
+      uUnseen += oMessage.bSeen ? 0 : 1;
+   const std::string strStatus = "* STATUS INBOX (MESSAGES " + std::to_string(m_vecMessages.size()) +
+      " UNSEEN " + std::to_string(uUnseen) + " UIDNEXT " + std::to_string(m_uUidNext) + " UIDVALIDITY 1)\r\n";
+
+   if ((strVerb == "LIST" || strVerb == "LSUB") && !bUID && vecArgs.size() >= 2)
+   {
+      const std::string strPattern = Upper(vecArgs[1]);
+      if (strPattern.empty())
+         strOut = "* " + strVerb + " (\\Noselect) \"/\" \"\"\r\n";
+      else if (strPattern == "*" || strPattern == "%" || strPattern == "INBOX")
+      {
+         strOut = "* " + strVerb + " (\\HasNoChildren) \"/\" INBOX\r\n";
+         if (vecArgs.size() >= 4 && Upper(vecArgs[2]) == "RETURN")
+            strOut += strStatus;
+      }
+      strOut += strTag + " OK " + strVerb + " completed\r\n";
+      return true;
+   }
+
+   if (strVerb == "STATUS" && !bUID && !vecArgs.empty())
+   {
+      strOut = (Upper(vecArgs[0]) == "INBOX" ? strStatus : std::string()) + strTag +
+         (Upper(vecArgs[0]) == "INBOX" ? " OK STATUS completed\r\n" : " NO no such mailbox\r\n");
+      return true;
+   }
+
+   if ((strVerb == "SELECT" || strVerb == "EXAMINE") && !bUID && !vecArgs.empty())
+   {
+      oSession.bSelected = Upper(vecArgs[0]) == "INBOX";
+      oSession.bReadOnly = strVerb == "EXAMINE";
+      if (!oSession.bSelected)
+      {
+         strOut = strTag + " NO no such mailbox\r\n";
+         return true;
+      }
+      strOut = "* " + std::to_string(m_vecMessages.size()) + " EXISTS\r\n* 0 RECENT\r\n"
+         "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n"
+         "* OK [UIDVALIDITY 1] UIDs valid\r\n"
+         "* OK [UIDNEXT " + std::to_string(m_uUidNext) + "] predicted next UID\r\n" +
+         strTag + (oSession.bReadOnly ? " OK [READ-ONLY] " : " OK [READ-WRITE] ") + strVerb + " completed\r\n";
+      return true;
+   }
+
+   if (!oSession.bSelected)
+   {
+      strOut = strTag + " BAD no mailbox selected\r\n";
+      return true;
+   }
+
+   if (strVerb == "FETCH" && vecArgs.size() >= 2)
+   {
+      strOut = Fetch(vecArgs, bUID, strOut) ? strOut + strTag + " OK FETCH completed\r\n"
+                                            : strTag + " BAD unsupported FETCH item\r\n";
+      return true;
+   }
+   if (strVerb == "SEARCH")
+   {
+      vecArgs.insert(vecArgs.begin(), strTag);
+      strOut = Search(vecArgs, bUID, strOut) ? strOut + strTag + " OK SEARCH completed\r\n"
+                                             : strTag + " BAD unsupported search criteria\r\n";
+      return true;
+   }
+   if (strVerb == "STORE" && vecArgs.size() >= 3)
+   {
+      if (oSession.bReadOnly)
+         strOut = strTag + " NO mailbox is read-only\r\n";
+      else
+         strOut = Store(vecArgs, bUID, strOut) ? strOut + strTag + " OK STORE completed\r\n"
+                                               : strTag + " BAD unsupported STORE\r\n";
+      return true;
+   }
+   if ((strVerb == "COPY" || strVerb == "MOVE") && vecArgs.size() == 2)
+   {
+      if (Upper(vecArgs[1]) == "INBOX")
+         strOut = strTag + " NO cannot copy into the same mailbox\r\n";
+      else if (strVerb == "MOVE" && oSession.bReadOnly)
+         strOut = strTag + " NO mailbox is read-only\r\n";
+      else
+      {
+         if (strVerb == "MOVE")
+         {
+            const std::vector<size_t> vecIndexes = Resolve(vecArgs[0], bUID);
+            for (auto it = vecIndexes.rbegin(); it != vecIndexes.rend(); ++it)
+            {
+               m_uMailboxBytes -= m_vecMessages[*it].strData.size();
+               m_vecMessages.erase(m_vecMessages.begin() + static_cast<std::ptrdiff_t>(*it));
+               strOut += "* " + std::to_string(*it + 1) + " EXPUNGE\r\n";
+            }
+         }
+         strOut += strTag + " OK " + strVerb + " completed\r\n";
+      }
+      return true;
+   }
+   if ((strVerb == "EXPUNGE" || (strVerb == "CLOSE" && !bUID)) && (!bUID || !vecArgs.empty()))
+   {
+      std::string strExpunged;
+      if (!oSession.bReadOnly)
+         Expunge(bUID ? &vecArgs : nullptr, strExpunged);
+      if (strVerb == "CLOSE")
+         oSession.bSelected = false;
+      else
+         strOut = strExpunged;
+      strOut += strTag + " OK " + strVerb + " completed\r\n";
+      return true;
+   }
+
+   strOut = strTag + " BAD unknown command\r\n";
+   return true;
+}
+
+bool CIMAPStandInServer::Fetch(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut)
+{
+   std::vector<std::string> vecItems;
+   for (size_t i = 1; i < vecArgs.size(); ++i)
+   {
+      for (const auto& strItem : ListItems(vecArgs[i]))
+         vecItems.push_back(Upper(strItem));
+   }
+
+   /* macros, then UID first and the literals last: curl reads the size of
+   * the body from the first "{" of the line */
+   std::vector<std::string> vecPlain, vecLiterals;
+   if (bUID)
+      vecPlain.push_back("UID");
+   for (const auto& strItem : vecItems)
+   {
+      if (strItem == "ALL" || strItem == "FAST" || strItem == "FULL")
+      {
+         for (const char* pItem : { "FLAGS", "INTERNALDATE", "RFC822.SIZE", "ENVELOPE" })
+         {
+            if (strItem != "FAST" || std::strcmp(pItem, "ENVELOPE") != 0)
+               vecPlain.push_back(pItem);
+         }
+      }
+      else if (strItem == "UID" || strItem == "FLAGS" || strItem == "RFC822.SIZE" ||
+               strItem == "INTERNALDATE" || strItem == "ENVELOPE")
+      {
+         if (std::find(vecPlain.begin(), vecPlain.end(), strItem) == vecPlain.end())
+            vecPlain.push_back(strItem);
+      }
+      else if (strItem == "BODY[]" || strItem == "BODY.PEEK[]" || strItem == "RFC822" ||
+               strItem == "BODY[HEADER]" || strItem == "BODY.PEEK[HEADER]" || strItem == "RFC822.HEADER" ||
+               strItem == "BODY[TEXT]" || strItem == "BODY.PEEK[TEXT]" || strItem == "RFC822.TEXT")
+         vecLiterals.push_back(strItem);
+      else
+         return false;
+   }
+
+   for (size_t uIndex : Resolve(vecArgs[0], bUID))
+   {
+      Message& oMessage = m_vecMessages[uIndex];
+      std::string strItems;
+      for (const auto& strItem : vecLiterals)
+      {
+         if (strItem.compare(0, 9, "BODY.PEEK") != 0 && strItem != "RFC822.HEADER")
+            oMessage.bSeen = true;
+      }
+
+      for (const auto& strItem : vecPlain)
+      {
+         strItems += strItems.empty() ? "" : " ";
+         if (strItem == "UID")
+            strItems += "UID " + std::to_string(oMessage.uUid);
+         else if (strItem == "FLAGS")
+            strItems += "FLAGS " + Flags(oMessage);
+         else if (strItem == "RFC822.SIZE")
+            strItems += "RFC822.SIZE " + std::to_string(oMessage.strData.size());
+         else if (strItem == "ENVELOPE")
+            strItems += "ENVELOPE " + Envelope(oMessage);
+         else
+         {
+            int iYear;
+            unsigned uMonth, uDay;
+            CivilFromDays(oMessage.iDay, iYear, uMonth, uDay);
+            strItems += "INTERNALDATE \"" + std::to_string(uDay) + '-' + MONTHS[uMonth - 1] + '-' +
+               std::to_string(iYear) + " 12:00:00 +0000\"";
+         }
+      }
+
+      strOut += "* " + std::to_string(uIndex + 1) + " FETCH (" + strItems;
+      for (const auto& strItem : vecLiterals)
+      {
+         const size_t uHeaderEnd = oMessage.strData.find("\r\n\r\n");
+         const size_t uBodyStart = uHeaderEnd == std::string::npos ? oMessage.strData.size() : uHeaderEnd + 4;
+         std::string strName = "BODY[]";
+         size_t uFrom = 0, uTo = oMessage.strData.size();
+         if (strItem.find("HEADER") != std::string::npos)
+         {
+            strName = strItem == "RFC822.HEADER" ? strItem : "BODY[HEADER]";
+            uTo = uBodyStart;
+         }
+         else if (strItem.find("TEXT") != std::string::npos)
+         {
+            strName = strItem == "RFC822.TEXT" ? strItem : "BODY[TEXT]";
+            uFrom = uBodyStart;
+         }
+         else if (strItem == "RFC822")
+            strName = strItem;
+
+         strOut += (strOut.back() == '(' ? "" : " ") + strName + " {" + std::to_string(uTo - uFrom) + "}\r\n";
+         strOut.append(oMessage.strData, uFrom, uTo - uFrom);
+      }
+      strOut += ")\r\n";
+   }
+   return true;
+}
+
+bool CIMAPStandInServer::Search(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut)
+{
+   const std::string& strTag = vecArgs[0];
+   size_t uPos = 1;
+
+   bool bExtended = false;
+   std::vector<std::string> vecReturn;
+   if (uPos + 1 < vecArgs.size() && Upper(vecArgs[uPos]) == "RETURN")
+   {
+      bExtended = true;
+      for (const auto& strOption : ListItems(vecArgs[uPos + 1]))
+         vecReturn.push_back(Upper(strOption));
+      if (vecReturn.empty())
+         vecReturn.push_back("ALL");
+      uPos += 2;
+   }
+   if (uPos + 1 < vecArgs.size() && Upper(vecArgs[uPos]) == "CHARSET")
+      uPos += 2; // the strings are matched byte for byte
+
+   const uint32_t uMaxUid = m_vecMessages.empty() ? 0 : m_vecMessages.back().uUid;
+   const uint32_t uMaxSeq = static_cast<uint32_t>(m_vecMessages.size());
+
+   /* criteria -> predicate over (Message*, 0-based index), AND of all keys */
+   std::function<bool(const std::vector<std::string>&, size_t&, Predicate&)> Compile;
+   std::function<bool(const std::vector<std::string>&, size_t, Predicate&)> CompileAll =
+      [&Compile](const std::vector<std::string>& vecKeys, size_t uFrom, Predicate& oResult) {
+         std::vector<Predicate> vecAll;
+         for (size_t u = uFrom; u < vecKeys.size(); )
+         {
+            Predicate oKey;
+            if (!Compile(vecKeys, u, oKey))
+               return false;
+            vecAll.push_back(oKey);
+         }
+         oResult = [vecAll](const void* p, size_t i) {
+            for (const auto& oKey : vecAll)
+               if (!oKey(p, i))
+                  return false;
+            return true;
+         };
+         return true;
+      };
+
+   Compile = [&](const std::vector<std::string>& vecKeys, size_t& u, Predicate& oResult) {
+      const std::string strKey = Upper(vecKeys[u++]);
+      const auto Msg = [](const void* p) { return static_cast<const Message*>(p); };
+      const bool bHasArg = u < vecKeys.size();
+      const std::string strArg = bHasArg ? vecKeys[u] : std::string();
+
+      if (strKey.size() >= 2 && strKey.front() == '(' && strKey.back() == ')')
+         return CompileAll(ListItems(vecKeys[u - 1]), 0, oResult);
+
+      if (strKey == "ALL" || strKey == "OLD" || strKey == "UNDRAFT")
+         oResult = [](const void*, size_t) { return true; };
+      else if (strKey == "NEW" || strKey == "RECENT" || strKey == "DRAFT")
+         oResult = [](const void*, size_t) { return false; };
+      else if (strKey == "SEEN" || strKey == "UNSEEN")
+         oResult = [Msg, strKey](const void* p, size_t) { return Msg(p)->bSeen == (strKey == "SEEN"); };
+      else if (strKey == "FLAGGED" || strKey == "UNFLAGGED")
+         oResult = [Msg, strKey](const void* p, size_t) { return Msg(p)->bFlagged == (strKey == "FLAGGED"); };
+      else if (strKey == "ANSWERED" || strKey == "UNANSWERED")
+         oResult = [Msg, strKey](const void* p, size_t) { return Msg(p)->bAnswered == (strKey == "ANSWERED"); };
+      else if (strKey == "DELETED" || strKey == "UNDELETED")
+         oResult = [Msg, strKey](const void* p, size_t) { return Msg(p)->bDeleted == (strKey == "DELETED"); };
+      else if ((strKey == "LARGER" || strKey == "SMALLER") && bHasArg)
+      {
+         ++u;
+         const size_t uSize = std::strtoull(strArg.c_str(), nullptr, 10);
+         const bool bLarger = strKey == "LARGER";
+         oResult = [Msg, uSize, bLarger](const void* p, size_t) {
+            return bLarger ? Msg(p)->strData.size() > uSize : Msg(p)->strData.size() < uSize;
+         };
+      }
+      else if ((strKey == "FROM" || strKey == "TO" || strKey == "SUBJECT" || strKey == "BODY" || strKey == "TEXT") && bHasArg)
+      {
+         ++u;
+         oResult = [Msg, strKey, strArg](const void* p, size_t) {
+            const Message* pMessage = Msg(p);
+            const std::string& strField = strKey == "FROM" ? pMessage->strFrom : strKey == "TO" ? pMessage->strTo
+               : strKey == "SUBJECT" ? pMessage->strSubject : pMessage->strData;
+            return ContainsNoCase(strField, strArg);
+         };
+      }
+      else if (strKey == "HEADER" && u + 1 < vecKeys.size())
+      {
+         const std::string strName = vecKeys[u];
+         const std::string strValue = vecKeys[u + 1];
+         u += 2;
+         oResult = [Msg, strName, strValue](const void* p, size_t) {
+            const std::string strHeader = HeaderValue(Msg(p)->strData, strName.c_str());
+            return !strHeader.empty() && ContainsNoCase(strHeader, strValue);
+         };
+      }
+      else if ((strKey == "SINCE" || strKey == "BEFORE" || strKey == "ON" || strKey == "SENTSINCE" ||
+                strKey == "SENTBEFORE" || strKey == "SENTON") && bHasArg)
+      {
+         ++u;
+         int iDay;
+         if (!ParseImapDate(strArg, iDay))
+            return false;
+         const int iCompare = strKey.find("SINCE") != std::string::npos ? 1 : strKey.find("BEFORE") != std::string::npos ? -1 : 0;
+         oResult = [Msg, iDay, iCompare](const void* p, size_t) {
+            const int iMessageDay = Msg(p)->iDay;
+            return iCompare > 0 ? iMessageDay >= iDay : iCompare < 0 ? iMessageDay < iDay : iMessageDay == iDay;
+         };
+      }
+      else if (strKey == "UID" && bHasArg)
+      {
+         ++u;
+         Ranges vecRanges;
+         if (!ParseSet(strArg, uMaxUid, vecRanges))
+            return false;
+         oResult = [Msg, vecRanges](const void* p, size_t) { return InRanges(vecRanges, Msg(p)->uUid); };
+      }
+      else if (strKey == "NOT" && bHasArg)
+      {
+         Predicate oOperand;
+         if (!Compile(vecKeys, u, oOperand))
+            return false;
+         oResult = [oOperand](const void* p, size_t i) { return !oOperand(p, i); };
+      }
+      else if (strKey == "OR" && u + 1 < vecKeys.size())
+      {
+         Predicate oLeft, oRight;
+         if (!Compile(vecKeys, u, oLeft) || u >= vecKeys.size() || !Compile(vecKeys, u, oRight))
+            return false;
+         oResult = [oLeft, oRight](const void* p, size_t i) { return oLeft(p, i) || oRight(p, i); };
+      }
+      else if (!strKey.empty() && (std::isdigit(static_cast<unsigned char>(strKey[0])) || strKey[0] == '*'))
+      {
+         Ranges vecRanges;
+         if (!ParseSet(strKey, uMaxSeq, vecRanges))
+            return false;
+         oResult = [vecRanges](const void*, size_t i) { return InRanges(vecRanges, static_cast<uint32_t>(i + 1)); };
+      }
+      else
+         return false;
+      return true;
+   };
+
+   Predicate oCriteria;
+   if (uPos >= vecArgs.size() || !CompileAll(vecArgs, uPos, oCriteria))
+      return false;
+
+   std::vector<uint32_t> vecFound;
+   for (size_t i = 0; i < m_vecMessages.size(); ++i)
+   {
+      if (oCriteria(&m_vecMessages[i], i))
+         vecFound.push_back(bUID ? m_vecMessages[i].uUid : static_cast<uint32_t>(i + 1));
+   }
+
+   if (!bExtended)
+   {
+      strOut = "* SEARCH";
+      for (uint32_t uValue : vecFound)
+         strOut += ' ' + std::to_string(uValue);
+      strOut += "\r\n";
+      return true;
+   }
+
+   strOut = "* ESEARCH (TAG " + Quote(strTag) + ")" + (bUID ? " UID" : "");
+   for (const auto& strOption : vecReturn)
+   {
+      if (strOption == "COUNT")
+         strOut += " COUNT " + std::to_string(vecFound.size());
+      else if (vecFound.empty())
+         continue;
+      else if (strOption == "MIN")
+         strOut += " MIN " + std::to_string(vecFound.front());
+      else if (strOption == "MAX")
+         strOut += " MAX " + std::to_string(vecFound.back());
+      else if (strOption == "ALL")
+         strOut += " ALL " + RenderSet(vecFound);
+   }
+   strOut += "\r\n";
+   return true;
+}
+
+bool CIMAPStandInServer::Store(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut)
+{
+   std::string strItem = Upper(vecArgs[1]);
+   const bool bSilent = strItem.size() > 7 && strItem.compare(strItem.size() - 7, 7, ".SILENT") == 0;
+   if (bSilent)
+      strItem.erase(strItem.size() - 7);
+
+   const int iMode = strItem == "+FLAGS" ? 1 : strItem == "-FLAGS" ? -1 : strItem == "FLAGS" ? 0 : 2;
+   if (iMode == 2)
+      return false;
+
+   /* "(\Seen \Deleted)" or, as the old STORE of CIMAPClient sends it, "\Seen" */
+   std::vector<std::string> vecFlags;
+   for (size_t i = 2; i < vecArgs.size(); ++i)
+   {
+      for (const auto& strFlag : ListItems(vecArgs[i]))
+         vecFlags.push_back(Upper(strFlag));
+   }
+
+   for (size_t uIndex : Resolve(vecArgs[0], bUID))
+   {
+      Message& oMessage = m_vecMessages[uIndex];
+      if (iMode == 0)
+         oMessage.bSeen = oMessage.bFlagged = oMessage.bAnswered = oMessage.bDeleted = false;
+      for (const auto& strFlag : vecFlags)
+      {
+         bool* pFlag = strFlag == "\\SEEN" ? &oMessage.bSeen : strFlag == "\\FLAGGED" ? &oMessage.bFlagged
+            : strFlag == "\\ANSWERED" ? &oMessage.bAnswered : strFlag == "\\DELETED" ? &oMessage.bDeleted : nullptr;
+         if (pFlag != nullptr)
+            *pFlag = iMode >= 0;
+      }
+
+      if (!bSilent)
+      {
+         strOut += "* " + std::to_string(uIndex + 1) + " FETCH (FLAGS " + Flags(oMessage) +
+            (bUID ? " UID " + std::to_string(oMessage.uUid) : std::string()) + ")\r\n";
+      }
+   }
+   return true;
+}
+
+void CIMAPStandInServer::Expunge(const std::vector<std::string>* pUidSet, std::string& strOut)
+{
+   std::vector<size_t> vecOnly;
+   if (pUidSet != nullptr)
+      vecOnly = Resolve((*pUidSet)[0], true);
+
+   /* from the end, so every EXPUNGE number is still valid when the client reads it */
+   for (size_t i = m_vecMessages.size(); i-- > 0; )
+   {
+      if (!m_vecMessages[i].bDeleted ||
+          (pUidSet != nullptr && !std::binary_search(vecOnly.begin(), vecOnly.end(), i)))
+         continue;
+
+      m_uMailboxBytes -= m_vecMessages[i].strData.size();
+      m_vecMessages.erase(m_vecMessages.begin() + static_cast<std::ptrdiff_t>(i));
+      strOut += "* " + std::to_string(i + 1) + " EXPUNGE\r\n";
+   }
+}
+
+std::vector<size_t> CIMAPStandInServer::Resolve(const std::string& strSet, bool bUID) const
+{
+   std::vector<size_t> vecIndexes;
+   if (m_vecMessages.empty())
+      return vecIndexes;
+
+   Ranges vecRanges;
+   if (!ParseSet(strSet, bUID ? m_vecMessages.back().uUid : static_cast<uint32_t>(m_vecMessages.size()), vecRanges))
+      return vecIndexes;
+
+   for (const auto& oRange : vecRanges)
+   {
+      if (!bUID)
+      {
+         for (uint64_t u = std::max<uint32_t>(oRange.first, 1); u <= std::min<uint64_t>(oRange.second, m_vecMessages.size()); ++u)
+            vecIndexes.push_back(static_cast<size_t>(u - 1));
+         continue;
+      }
+
+      /* messages are in UID order */
+      auto itMessage = std::lower_bound(m_vecMessages.begin(), m_vecMessages.end(), oRange.first,
+         [](const Message& oMessage, uint32_t uUid) { return oMessage.uUid < uUid; });
+      for (; itMessage != m_vecMessages.end() && itMessage->uUid <= oRange.second; ++itMessage)
+         vecIndexes.push_back(static_cast<size_t>(itMessage - m_vecMessages.begin()));
+   }
+
+   std::sort(vecIndexes.begin(), vecIndexes.end());
+   vecIndexes.erase(std::unique(vecIndexes.begin(), vecIndexes.end()), vecIndexes.end());
+   return vecIndexes;
+}
+
+std::string CIMAPStandInServer::Flags(const Message& oMessage) const
+{
+   std::string strFlags;
+   if (oMessage.bSeen)
+      strFlags += " \\Seen";
+   if (oMessage.bFlagged)
+      strFlags += " \\Flagged";
+   if (oMessage.bAnswered)
+      strFlags += " \\Answered";
+   if (oMessage.bDeleted)
+      strFlags += " \\Deleted";
+   return "(" + (strFlags.empty() ? strFlags : strFlags.substr(1)) + ")";
+}
+
+std::string CIMAPStandInServer::Envelope(const Message& oMessage) const
+{
+   const auto Address = [](const std::string& strAddress) {
+      const size_t uAt = strAddress.find('@');
+      return "((NIL NIL " + Quote(strAddress.substr(0, uAt)) + ' ' +
+         Quote(uAt == std::string::npos ? std::string() : strAddress.substr(uAt + 1)) + "))";
+   };
+
+   /* date and subject as literals on request: the client must reassemble them */
+   const auto Text = [this](const std::string& str) { return m_bLiteralEnvelopes ? Literal(str) : Quote(str); };
+
+   const std::string strFrom = Address(oMessage.strFrom);
+   return "(" + Text(HeaderValue(oMessage.strData, "Date")) + ' ' + Text(oMessage.strSubject) + ' ' +
+      strFrom + ' ' + strFrom + ' ' + strFrom + ' ' + Address(oMessage.strTo) + " NIL NIL NIL " +
+      Quote(HeaderValue(oMessage.strData, "Message-ID")) + ")";
+}
@@ -0,0 +1,119 @@
+/*
+* @file IMAPStandInServer.h
+* @brief a small IMAP server on loopback serving a synthetic mailbox
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_IMAPSTANDINSERVER_H_
+#define INCLUDE_IMAPSTANDINSERVER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Stand-in for a real mail server when measuring the client: one INBOX of
+* generated messages, every connection served by its own thread. It speaks
+* the subset of IMAP4rev1 the client sends - CAPABILITY, LOGIN (any
+* credentials), LIST, SELECT/EXAMINE, STATUS, [UID] FETCH, [UID] SEARCH with
+* ESEARCH RETURN, [UID] STORE, [UID] EXPUNGE, [UID] COPY and [UID] MOVE to
+* any other folder (which keeps nothing: moved messages just leave INBOX),
+* COMPRESS DEFLATE, NOOP and LOGOUT - no TLS. Connections share the flags and see each other's expunges without
+* being told, which is enough for measuring one client at a time. */
+class CIMAPStandInServer
+{
+public:
+   struct MailboxSpec
+   {
+      unsigned uMessages = 1000;
+      size_t   uBodyBytes = 4096;        // text part
+      unsigned uAttachments = 0;         // 0: a single text/plain part
+      size_t   uAttachmentBytes = 16384; // decoded size of every attachment
+      bool     bHtmlAlternative = false; // text/plain + text/html alternative
+      bool     bEncodedHeaders = false;  // RFC 2047 Subject and From names
+      bool     bLiteralEnvelopes = false; // ENVELOPE date and subject as {n} literals
+      unsigned uSeenPercent = 50;
+      unsigned uSeed = 1;
+   };
+
+   explicit CIMAPStandInServer(const MailboxSpec& oSpec);
+   ~CIMAPStandInServer();
+
+   CIMAPStandInServer(const CIMAPStandInServer&) = delete;
+   CIMAPStandInServer& operator=(const CIMAPStandInServer&) = delete;
+
+   /* listens on 127.0.0.1; port 0 picks a free one, see GetPort() */
+   bool Start(uint16_t uPort = 0);
+   void Stop();
+   inline uint16_t GetPort() const { return m_uPort; }
+
+   inline unsigned GetMessageCount() const { return static_cast<unsigned>(m_vecMessages.size()); }
+   inline const std::string& GetMessage(unsigned uIndex) const { return m_vecMessages[uIndex].strData; }
+   /* sum of the message sizes */
+   inline uint64_t GetMailboxBytes() const { return m_uMailboxBytes; }
+   /* commands answered since Start() */
+   inline uint64_t GetCommandCount() const { return m_uCommands; }
+   /* bytes read and written on the sockets since Start(), compressed when COMPRESS is active */
+   inline uint64_t GetWireBytes() const { return m_uWireBytes; }
+
+   /* the message generator on its own, for parser tests and corpora */
+   static std::string MakeMessage(const MailboxSpec& oSpec, unsigned uIndex);
+
+private:
+   struct Message
+   {
+      uint32_t    uUid;
+      int         iDay;    // days since 1970-01-01, INTERNALDATE and SINCE/BEFORE
+      bool        bSeen;
+      bool        bFlagged;
+      bool        bAnswered;
+      bool        bDeleted;
+      std::string strFrom; // mailbox@host
+      std::string strTo;
+      std::string strSubject;
+      std::string strData;
+   };
+
+   struct Session
+   {
+      bool bAuthenticated = false;
+      bool bSelected = false;
+      bool bReadOnly = false;
+      bool bCompress = false; // COMPRESS DEFLATE accepted, takes effect after the answer
+   };
+
+   void AcceptLoop();
+   void Serve(int iSocket);
+   bool Handle(Session& oSession, const std::string& strLine, std::string& strOut);
+
+   bool Fetch(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut);
+   bool Search(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut);
+   bool Store(const std::vector<std::string>& vecArgs, bool bUID, std::string& strOut);
+   void Expunge(const std::vector<std::string>* pUidSet, std::string& strOut);
+
+   /* message indexes (0-based) a sequence set or UID set names */
+   std::vector<size_t> Resolve(const std::string& strSet, bool bUID) const;
+   std::string Flags(const Message& oMessage) const;
+   std::string Envelope(const Message& oMessage) const;
+
+   bool                     m_bLiteralEnvelopes;
+   std::vector<Message>     m_vecMessages;
+   uint64_t                 m_uMailboxBytes = 0;
+   uint32_t                 m_uUidNext = 1;
+   mutable std::mutex       m_oMailboxLock;
+
+   int                      m_iListener = -1;
+   uint16_t                 m_uPort = 0;
+   std::atomic<bool>        m_bRunning{false};
+   std::atomic<uint64_t>    m_uCommands{0};
+   std::atomic<uint64_t>    m_uWireBytes{0};
+   std::thread              m_oAcceptThread;
+   std::mutex               m_oSessionLock;
+   std::vector<int>         m_vecSockets;
+   std::vector<std::thread> m_vecSessions;
+};
+
+#endif
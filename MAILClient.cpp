@@ -12,6 +12,7 @@
 
 // Static members initialization
 std::string    CMailClient::s_strCertificationAuthorityFile;
+std::atomic<unsigned> CMailClient::s_uCertificateGeneration(0);
 
 #ifdef DEBUG_CURL
 std::string CMailClient::s_strCurlTraceLogDirectory;
@@ -20,11 +21,8 @@ std::string CMailClient::s_strCurlTraceLogDirectory;
 /**
 * @brief constructor for the mail client object
 *
-* @param Logger - a callabck to a logger function void(const std::string&)
-*
 */
-CMailClient::CMailClient(LogFnCallback Logger) :
-   m_oLog(Logger),
+CMailClient::CMailClient() :
    m_iCurlTimeout(5),
    m_eSettingsFlags(ALL_FLAGS),
    m_eSslTlsFlags(SslTlsFlag::NO_SSLTLS),
@@ -45,7 +43,7 @@ CMailClient::~CMailClient()
    if (m_pCurlSession != nullptr)
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_WARNING_OBJECT_NOT_CLEANED);
+         m_oLog.Write(CMailLog::LEVEL_WARNING, CMailLog::OBJECT_NOT_CLEANED);
 
       CleanupSession();
    }
@@ -79,7 +77,7 @@ bool CMailClient::InitSession(const std::string& strHost, const std::string& str
    if (strHost.empty())
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_EMPTY_HOST_MSG);
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::EMPTY_HOST);
 
       return false;
    }
@@ -87,11 +85,12 @@ bool CMailClient::InitSession(const std::string& strHost, const std::string& str
    if (m_pCurlSession)
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_CURL_ALREADY_INIT_MSG);
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::CURL_ALREADY_INIT);
 
       return false;
    }
    m_pCurlSession = curl_easy_init();
+   m_bSessionConfigured = false;
 //   curl_easy_setopt(m_pCurlSession, CURLOPT_USE_SSL, CURLUSESSL_ALL);
 
    m_eSettingsFlags = eSettingsFlags;
@@ -122,7 +121,7 @@ bool CMailClient::CleanupSession()
    if (!m_pCurlSession)
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_CURL_NOT_INIT_MSG);
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::CURL_NOT_INIT);
 
       return false;
    }
@@ -136,6 +135,7 @@ bool CMailClient::CleanupSession()
 
    curl_easy_cleanup(m_pCurlSession);
    m_pCurlSession = nullptr;
+   m_bSessionConfigured = false;
 
    /* Free the list of recipients */
    if (m_pRecipientslist)
@@ -169,6 +169,7 @@ void CMailClient::SetProgressFnCallback(void* pOwner, const ProgressFnCallback&
    m_ProgressStruct.pCurl = m_pCurlSession;
    m_ProgressStruct.dLastRunTime = 0;
    m_bProgressCallbackSet = true;
+   m_bSessionConfigured = false;
 }
 
 /**
@@ -189,6 +190,8 @@ void CMailClient::SetProxy(const std::string& strProxy)
       m_strProxy = "http://" + strProxy;
    else
       m_strProxy = strProxy;
+
+   m_bSessionConfigured = false;
 };
 
 /**
@@ -206,20 +209,66 @@ bool CMailClient::Perform()
    if (!m_pCurlSession)
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_CURL_NOT_INIT_MSG);
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::CURL_NOT_INIT);
 
       return false;
    }
-   // Reset is mandatory to avoid bad surprises
-   curl_easy_reset(m_pCurlSession);
+   if (!m_bSessionConfigured || m_uAppliedCertificateGeneration != s_uCertificateGeneration)
+      ApplySessionOptions();
+
+   // Operation options of the previous request must not leak into this one
+   ResetOperationOptions();
 
    if (!PrePerform())
    {
       if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_PREPERFORM_FAILED_MSG);
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::PREPERFORM_FAILED);
+
+      return false;
+   }
+
+#ifdef DEBUG_CURL
+   StartCurlDebug();
+#endif
+
+   // Perform the requested operation
+   res = PerformTransfer();
+
+#ifdef DEBUG_CURL
+   EndCurlDebug();
+#endif
+
+   if (!PostPerform(res))
+   {
+      if (m_eSettingsFlags & ENABLE_LOG)
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::POSTPERFORM_FAILED);
+
+      return false;
+   }
+
+   if (res != CURLE_OK)
+   {
+      if (m_eSettingsFlags & ENABLE_LOG)
+         m_oLog.Write(CMailLog::LEVEL_ERROR, CMailLog::PERFORM_FAILED, res);
 
       return false;
    }
+   return true;
+}
+
+/**
+* @brief sets the options that do not change between operations of a session
+*
+* Called by Perform() for a fresh handle and after a setter changed one of them.
+*
+*/
+void CMailClient::ApplySessionOptions()
+{
+   /* Start from a clean handle: the connection cache survives a reset */
+   curl_easy_reset(m_pCurlSession);
+
+   /* DNS cache, TLS sessions and connections shared with the other clients */
+   m_curlHandle.attach(m_pCurlSession);
 
    /* Set username and password */
    curl_easy_setopt(m_pCurlSession, CURLOPT_USERNAME, m_strUserName.c_str());
@@ -311,71 +360,121 @@ bool CMailClient::Perform()
    curl_easy_setopt(m_pCurlSession, CURLOPT_SSL_VERIFYPEER, 0L);
    curl_easy_setopt(m_pCurlSession, CURLOPT_SSL_VERIFYHOST, 0L);
 
-#ifdef DEBUG_CURL
-   StartCurlDebug();
-#endif
-
-   // Perform the requested operation
-   res = curl_easy_perform(m_pCurlSession);
-
-#ifdef DEBUG_CURL
-   EndCurlDebug();
-#endif
-
-   if (!PostPerform(res))
-   {
-      if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(LOG_ERROR_POSTPERFORM_FAILED_MSG);
-
-      return false;
-   }
-
-   if (res != CURLE_OK)
-   {
-      if (m_eSettingsFlags & ENABLE_LOG)
-         m_oLog(StringFormat(LOG_ERROR_CURL_PEFORM_FAILURE_FORMAT, res, curl_easy_strerror(res)));
-
-      return false;
-   }
-   return true;
+   m_bSessionConfigured = true;
+   m_uAppliedCertificateGeneration = s_uCertificateGeneration;
 }
 
 /**
-* @brief returns a formatted string
+* @brief puts back to their defaults the options a PrePerform() may set
 *
-* @param [in] strFormat string with one or many format specifiers
-* @param [in] parameters to be placed in the format specifiers of strFormat
+* Derived classes that set other per-operation options must reset them here too.
 *
-* @retval string formatted string
 */
-std::string CMailClient::StringFormat(const std::string strFormat, ...)
+void CMailClient::ResetOperationOptions()
 {
-   int n = (static_cast<int>(strFormat.size())) * 2; // Reserve two times as much as the length of the strFormat
+   curl_easy_setopt(m_pCurlSession, CURLOPT_URL, nullptr);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_CUSTOMREQUEST, nullptr);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_NOBODY, 0L);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_UPLOAD, 0L);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_INFILESIZE_LARGE, static_cast<curl_off_t>(-1));
+   SetWriteTarget(nullptr, stdout);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_READFUNCTION, nullptr);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_READDATA, stdin);
+   SetHeaderTarget(nullptr, nullptr);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_MAIL_FROM, nullptr);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_MAIL_RCPT, nullptr);
+}
 
-   std::unique_ptr<char[]> pFormatted;
+/**
+* @brief sets CURLOPT_WRITEFUNCTION and CURLOPT_WRITEDATA and remembers them
+*
+* @param [in] fnWrite callback, nullptr for curl's fwrite
+* @param [in] pData its data, a FILE* without callback
+*
+*/
+void CMailClient::SetWriteTarget(CMailTransport::WriteFn fnWrite, void* pData)
+{
+   m_fnWrite = fnWrite;
+   m_pWriteData = pData;
+   curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, fnWrite);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, pData);
+}
 
-   va_list ap;
+/**
+* @brief sets CURLOPT_HEADERFUNCTION and CURLOPT_HEADERDATA and remembers them
+*
+* @param [in] fnHeader callback, nullptr for none
+* @param [in] pData its data
+*
+*/
+void CMailClient::SetHeaderTarget(CMailTransport::WriteFn fnHeader, void* pData)
+{
+   m_fnHeader = fnHeader;
+   m_pHeaderData = pData;
+   curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERFUNCTION, fnHeader);
+   curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERDATA, pData);
+}
 
-   while(true)
+/**
+* @brief runs the prepared operation: curl_easy_perform, or the transport if one is set
+*
+* The transfer is reported to the metrics, if any, when curl performed it.
+*
+* @retval CURLcode result of the transfer
+*
+*/
+CURLcode CMailClient::PerformTransfer()
+{
+   /* with metrics, the response goes through a probe on its way to the targets */
+   const bool bMeasure = m_pMetrics != nullptr && (m_pTransport == nullptr || m_pTransport->UsesCurl());
+   CMailMetrics::Probe oProbe;
+   CMailTransport::WriteFn fnWrite = m_fnWrite;
+   void* pWriteData = m_pWriteData;
+   CMailTransport::WriteFn fnHeader = m_fnHeader;
+   void* pHeaderData = m_pHeaderData;
+   if (bMeasure)
    {
-      pFormatted.reset(new char[n]); // Wrap the plain char array into the unique_ptr
-      strcpy(&pFormatted[0], strFormat.c_str());
+      oProbe.fnTarget = m_fnWrite;
+      oProbe.pTargetData = m_pWriteData;
+      oProbe.fnHeaderTarget = m_fnHeader;
+      oProbe.pHeaderTargetData = m_pHeaderData;
+      fnWrite = &CMailMetrics::Probe::Callback;
+      pWriteData = &oProbe;
+      fnHeader = &CMailMetrics::Probe::HeaderCallback;
+      pHeaderData = &oProbe;
+      curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, fnWrite);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, pWriteData);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERFUNCTION, fnHeader);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERDATA, pHeaderData);
+      oProbe.tStart = std::chrono::steady_clock::now();
+   }
 
-      va_start(ap, strFormat);
-      int iFinaln = vsnprintf(&pFormatted[0], n, strFormat.c_str(), ap);
-      va_end(ap);
+   CURLcode eCode = CURLE_OK;
+   if (m_pTransport == nullptr)
+      eCode = curl_easy_perform(m_pCurlSession);
+   else
+   {
+      CMailTransport::Transfer oTransfer;
+      oTransfer.pCurl = m_pCurlSession;
+      oTransfer.strOperation = DescribeOperation();
+      oTransfer.fnWrite = fnWrite;
+      oTransfer.pWriteData = pWriteData;
+      oTransfer.fnHeader = fnHeader;
+      oTransfer.pHeaderData = pHeaderData;
+      eCode = m_pTransport->Perform(oTransfer);
+   }
 
-      if (iFinaln < 0 || iFinaln >= n)
-      {
-         n += abs(iFinaln - n + 1);
-      }
-      else
-      {
-         break;
-      }
+   if (bMeasure)
+   {
+      /* the probe lives on this stack */
+      curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEFUNCTION, m_fnWrite);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_WRITEDATA, m_pWriteData);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERFUNCTION, m_fnHeader);
+      curl_easy_setopt(m_pCurlSession, CURLOPT_HEADERDATA, m_pHeaderData);
+      m_pMetrics->Record(OperationName(), CMailMetrics::Collect(m_pCurlSession, eCode, oProbe));
    }
 
-   return std::string(pFormatted.get());
+   return eCode;
 }
 
 /**
@@ -399,6 +498,16 @@ size_t CMailClient::WriteInStringCallback(void* ptr, size_t size, size_t nmemb,
    return 0;
 }
 
+/**
+* @brief drops the data, for streams an operation reads from the other callback
+*
+* @return (size * nmemb)
+*/
+size_t CMailClient::DiscardCallback(void* /*ptr*/, size_t size, size_t nmemb, void* /*data*/)
+{
+   return size * nmemb;
+}
+
 /**
 * @brief stores the server response in an already opened file stream
 *
@@ -505,6 +614,144 @@ size_t CMailClient::ReadFromFileCallback(void* ptr, size_t size, size_t nmemb, v
    return 0;
 }
 
+/**
+* @brief sends the next block of an UploadSource
+*
+* @param ptr pointer of max size (size*nmemb) to write data to it
+* @param size size parameter
+* @param nmemb memblock parameter
+* @param userp pointer to user data (UploadSource)
+*
+* @return number of bytes written, 0 at the end of the upload
+*/
+size_t CMailClient::ReadBlockCallback(void* ptr, size_t size, size_t nmemb, void* userp)
+{
+   if ((size == 0) || (nmemb == 0) || (userp == nullptr))
+      return 0;
+
+   return reinterpret_cast<UploadSource*>(userp)->Read(reinterpret_cast<char*>(ptr), size * nmemb);
+}
+
+void CMailClient::UploadSource::Reset(const char* pData, size_t uSize)
+{
+   m_pData = pData;
+   m_uSize = uSize;
+   m_uPos = 0;
+   m_pStream = nullptr;
+   m_cLast = '\0';
+   m_bPendingLF = false;
+}
+
+void CMailClient::UploadSource::Reset(std::istream* pStream)
+{
+   Reset(nullptr, 0);
+   m_pStream = pStream;
+}
+
+curl_off_t CMailClient::UploadSource::NormalizedSize()
+{
+   curl_off_t iSize = 0;
+   char cLast = '\0';
+   auto count = [&iSize, &cLast](const char* pData, size_t uSize)
+   {
+      iSize += static_cast<curl_off_t>(uSize);
+      for (const char* p = pData; (p = static_cast<const char*>(std::memchr(p, '\n', pData + uSize - p))) != nullptr; ++p)
+      {
+         if ((p == pData ? cLast : p[-1]) != '\r')
+            ++iSize;
+      }
+      if (uSize > 0)
+         cLast = pData[uSize - 1];
+   };
+
+   if (m_pStream == nullptr)
+   {
+      count(m_pData, m_uSize);
+      return iSize;
+   }
+
+   const std::istream::pos_type oStart = m_pStream->tellg();
+   std::string strBuffer(64 * 1024, '\0');
+   while (m_pStream->read(&strBuffer[0], static_cast<std::streamsize>(strBuffer.size())) || m_pStream->gcount() > 0)
+      count(strBuffer.data(), static_cast<size_t>(m_pStream->gcount()));
+
+   m_pStream->clear();
+   m_pStream->seekg(oStart);
+   return iSize;
+}
+
+size_t CMailClient::UploadSource::Read(char* pOut, size_t uCapacity)
+{
+   char* const pBegin = pOut;
+   char* const pEnd = pOut + uCapacity;
+
+   while (pOut < pEnd)
+   {
+      if (m_bPendingLF)
+      {
+         *pOut++ = '\n';
+         m_cLast = '\n';
+         m_bPendingLF = false;
+         continue;
+      }
+      if (m_uPos == m_uSize && !Refill())
+         break;
+
+      /* copy everything up to the next LF in one go */
+      const char* pSrc = m_pData + m_uPos;
+      const size_t uAvailable = std::min(m_uSize - m_uPos, static_cast<size_t>(pEnd - pOut));
+      const char* pLF = static_cast<const char*>(std::memchr(pSrc, '\n', uAvailable));
+      const size_t uRun = (pLF != nullptr) ? static_cast<size_t>(pLF - pSrc) : uAvailable;
+
+      std::memcpy(pOut, pSrc, uRun);
+      pOut += uRun;
+      m_uPos += uRun;
+      if (uRun > 0)
+         m_cLast = pSrc[uRun - 1];
+
+      if (pLF != nullptr)
+      {
+         ++m_uPos;
+         if (m_cLast != '\r')
+         {
+            *pOut++ = '\r';
+            m_cLast = '\r';
+            if (pOut == pEnd)
+            {
+               m_bPendingLF = true;
+               break;
+            }
+         }
+         *pOut++ = '\n';
+         m_cLast = '\n';
+      }
+   }
+   return static_cast<size_t>(pOut - pBegin);
+}
+
+bool CMailClient::UploadSource::Refill()
+{
+   if (m_pStream == nullptr)
+      return false;
+
+   m_strChunk.resize(64 * 1024);
+   m_pStream->read(&m_strChunk[0], static_cast<std::streamsize>(m_strChunk.size()));
+   m_pData = m_strChunk.data();
+   m_uSize = static_cast<size_t>(m_pStream->gcount());
+   m_uPos = 0;
+   return m_uSize > 0;
+}
+
+std::string CMailClient::UploadSource::NormalizeCRLF(const char* pData, size_t uSize)
+{
+   UploadSource oSource;
+   oSource.Reset(pData, uSize);
+
+   std::string strResult(static_cast<size_t>(oSource.NormalizedSize()), '\0');
+   oSource.Read(&strResult[0], strResult.size());
+   return strResult;
+}
+
 #ifdef DEBUG_CURL
 void CMailClient::SetCurlTraceLogDirectory(const std::string& strPath)
 {
@@ -14,6 +14,7 @@
 #define CLIENT_USERAGENT "mailclientcpp-agent/1.0"
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>         // std::size_t
 #include <cstdio>          // snprintf
 #include <cstdlib>
@@ -32,13 +33,15 @@
 #include <memory>          // std::unique_ptr
 
 #include "CurlHandle.h"
+#include "MAILLog.h"
+#include "MAILMetrics.h"
+#include "MAILTransport.h"
 
 class CMailClient
 {
 public:
    // Public definitions
    typedef std::function<int(void*, double, double, double, double)> ProgressFnCallback;
-   typedef std::function<void(const std::string&)>                   LogFnCallback;
 
    // Progress Function Data Object - parameter void* of ProgressFnCallback references it
    struct ProgressFnStruct
@@ -69,9 +72,9 @@ public:
       ENABLE_SSL = 0x02
    };
 
-   /* Please provide your logger thread-safe routine, otherwise, you can turn off 
-    * error log messages printing by not using the flag ALL_FLAGS or ENABLE_LOG */
-   explicit CMailClient(LogFnCallback oLogger);
+   /* Errors are written to the client's log, see GetLog(), unless the
+    * session is started without the flag ALL_FLAGS or ENABLE_LOG */
+   CMailClient();
    virtual ~CMailClient();
 
    // copy constructor and assignment operator are disabled
@@ -81,8 +84,8 @@ public:
    // Setters - Getters (for unit tests)
    void SetProgressFnCallback(void* pOwner, const ProgressFnCallback& fnCallback);
    void SetProxy(const std::string& strProxy);
-   inline void SetTimeout(const int& iTimeout) { m_iCurlTimeout = iTimeout; }
-   inline void SetNoSignal(const bool& bNoSignal) { m_bNoSignal = bNoSignal; }
+   inline void SetTimeout(const int& iTimeout) { m_iCurlTimeout = iTimeout; m_bSessionConfigured = false; }
+   inline void SetNoSignal(const bool& bNoSignal) { m_bNoSignal = bNoSignal; m_bSessionConfigured = false; }
    inline auto GetProgressFnCallback() const
    {
       return m_fnProgressCallback.target<int(*)(void*,double,double,double,double)>();
@@ -107,19 +110,38 @@ public:
    const CURL* GetCurlPointer() const { return m_pCurlSession; }
 
    static const std::string& GetCertificateFile() { return s_strCertificationAuthorityFile; }
-   static void SetCertificateFile(const std::string& strPath) { s_strCertificationAuthorityFile = strPath; }
+   static void SetCertificateFile(const std::string& strPath)
+   {
+      s_strCertificationAuthorityFile = strPath;
+      ++s_uCertificateGeneration;
+   }
  
-   void SetSSLCertFile(const std::string& strPath) { m_strSSLCertFile = strPath; }
+   void SetSSLCertFile(const std::string& strPath) { m_strSSLCertFile = strPath; m_bSessionConfigured = false; }
    const std::string& GetSSLCertFile() const { return m_strSSLCertFile; }
    
-   void SetSSLKeyFile(const std::string& strPath) { m_strSSLKeyFile = strPath; }
+   void SetSSLKeyFile(const std::string& strPath) { m_strSSLKeyFile = strPath; m_bSessionConfigured = false; }
    const std::string& GetSSLKeyFile() const { return m_strSSLKeyFile; }
 
-   void SetSSLKeyPassword(const std::string& strPwd) { m_strSSLKeyPwd = strPwd; }
+   void SetSSLKeyPassword(const std::string& strPwd) { m_strSSLKeyPwd = strPwd; m_bSessionConfigured = false; }
    const std::string& GetSSLKeyPwd() const { return m_strSSLKeyPwd; }
 
    inline unsigned char GetSettingsFlags() const { return m_eSettingsFlags; }
 
+   /* run operations through pTransport instead of curl_easy_perform, e.g. to
+   * record or replay a session (see MAILTransport.h); nullptr goes back to
+   * curl. Not owned, it must outlive the client's operations. */
+   inline void SetTransport(CMailTransport* pTransport) { m_pTransport = pTransport; }
+   inline CMailTransport* GetTransport() const { return m_pTransport; }
+
+   /* report the timings, bytes and result of every operation performed with
+   * curl to pMetrics (see MAILMetrics.h); not owned, may be shared */
+   inline void SetMetrics(CMailMetrics* pMetrics) { m_pMetrics = pMetrics; }
+   inline CMailMetrics* GetMetrics() const { return m_pMetrics; }
+
+   /* the last events of this client, read them with GetLog().Read() */
+   inline CMailLog& GetLog() { return m_oLog; }
+   inline const CMailLog& GetLog() const { return m_oLog; }
+
 #ifdef DEBUG_CURL
    static void SetCurlTraceLogDirectory(const std::string& strPath);
 #endif
@@ -131,15 +153,60 @@ protected:
    virtual bool PostPerform(CURLcode) { return true; }
    virtual inline void ParseURL(std::string&) { }
 
+   /* Options that stay the same for the whole session (credentials, TLS, proxy,
+    * timeouts) are set once per handle; before each operation only the options
+    * a PrePerform may set are put back to their defaults. */
+   virtual void ApplySessionOptions();
+   virtual void ResetOperationOptions();
+
+   /* A PrePerform sets the write and header callbacks through these, so that a
+   * transport knows where the response goes */
+   void SetWriteTarget(CMailTransport::WriteFn fnWrite, void* pData);
+   void SetHeaderTarget(CMailTransport::WriteFn fnHeader, void* pData);
+   /* curl_easy_perform, or the transport when one is set */
+   CURLcode PerformTransfer();
+   /* the request of the current operation without host and credentials, the
+   * key a replay transport matches records with */
+   virtual std::string DescribeOperation() const { return std::string(); }
+   /* the operation type, the label its metrics are aggregated under */
+   virtual const char* OperationName() const { return "perform"; }
+
    // Curl callbacks
    static size_t WriteInStringCallback(void* ptr, size_t size, size_t nmemb, void* data);
    static size_t WriteToFileCallback(void* ptr, size_t size, size_t nmemb, void* data);
+   static size_t DiscardCallback(void* ptr, size_t size, size_t nmemb, void* data);
    static size_t ReadLineFromFileStreamCallback(void* ptr, size_t size, size_t nmemb, void* stream);
    static size_t ReadLineFromStringStreamCallback(void* ptr, size_t size, size_t nmemb, void* userp);
    static size_t ReadFromFileCallback(void* ptr, size_t size, size_t nmemb, void* stream);
+   static size_t ReadBlockCallback(void* ptr, size_t size, size_t nmemb, void* userp);
+
+   /* Upload source for ReadBlockCallback: fills every curl buffer completely and
+    * turns bare LF into CRLF on the way, so the cost is per buffer, not per line.
+    * Reads from memory directly or from a stream through a 64 KiB chunk. */
+   class UploadSource
+   {
+   public:
+      void Reset(const char* pData, size_t uSize);
+      void Reset(std::istream* pStream);
+
+      /* size after CRLF normalization; a stream is read once and rewound */
+      curl_off_t NormalizedSize();
+      size_t Read(char* pOut, size_t uCapacity);
+
+      /* bare LF -> CRLF, existing CRLF kept */
+      static std::string NormalizeCRLF(const char* pData, size_t uSize);
+
+   private:
+      bool Refill();
 
-   // Helper for error log printing
-   static std::string StringFormat(const std::string strFormat, ...);
+      const char*       m_pData = nullptr;
+      size_t            m_uSize = 0;
+      size_t            m_uPos = 0;
+      std::istream*     m_pStream = nullptr;
+      std::string       m_strChunk;
+      char              m_cLast = '\0';
+      bool              m_bPendingLF = false;
+   };
 
 #ifdef DEBUG_CURL
    static int DebugCallback(CURL* curl, curl_infotype curl_info_type, char* strace, size_t nSize, void* pFile);
@@ -159,9 +226,11 @@ protected:
    std::string          m_strLocalFile;
    std::fstream         m_fLocalFile;
    std::istringstream   m_ssString;
+   UploadSource         m_oUpload;
 
    // SSL
    static std::string   s_strCertificationAuthorityFile;
+   static std::atomic<unsigned> s_uCertificateGeneration;
    std::string          m_strSSLCertFile;
    std::string          m_strSSLKeyFile;
    std::string          m_strSSLKeyPwd;
@@ -177,8 +246,20 @@ protected:
    ProgressFnStruct       m_ProgressStruct;
    bool                   m_bProgressCallbackSet;
 
-   // Log printer callback
-   LogFnCallback          m_oLog;
+   // Session options applied to m_pCurlSession, see ApplySessionOptions()
+   bool                   m_bSessionConfigured = false;
+   unsigned               m_uAppliedCertificateGeneration = 0;
+
+   // Response targets, see SetWriteTarget(), and the transport
+   CMailTransport::WriteFn m_fnWrite = nullptr;
+   void*                   m_pWriteData = nullptr;
+   CMailTransport::WriteFn m_fnHeader = nullptr;
+   void*                   m_pHeaderData = nullptr;
+   CMailTransport*         m_pTransport = nullptr;
+   CMailMetrics*           m_pMetrics = nullptr;
+
+   // Log events
+   CMailLog               m_oLog;
 
 #ifdef DEBUG_CURL
    static std::string s_strCurlTraceLogDirectory;
@@ -192,15 +273,4 @@ inline CMailClient::SettingsFlag operator|(CMailClient::SettingsFlag a, CMailCli
     return static_cast<CMailClient::SettingsFlag>(static_cast<int>(a) | static_cast<int>(b));
 }
 
-// Logs messages
-#define LOG_ERROR_CURL_ALREADY_INIT_MSG       "[MAILClient][Error] Curl session is already initialized ! " \
-                                              "Use CleanupSession() to clean the present one."
-#define LOG_ERROR_EMPTY_HOST_MSG              "[MAILClient][Error] Empty hostname."
-#define LOG_ERROR_CURL_NOT_INIT_MSG           "[MAILClient][Error] Curl session is not initialized ! Use InitSession() before."
-#define LOG_WARNING_OBJECT_NOT_CLEANED        "[MAILClient][Warning] Object was freed before calling CMailClient::CleanupSession()." \
-                                              " The API session was cleaned though."
-#define LOG_ERROR_PREPERFORM_FAILED_MSG       "[MAILClient][Error] PrePerform failed !"
-#define LOG_ERROR_POSTPERFORM_FAILED_MSG      "[MAILClient][Error] PostPerform failed !"
-#define LOG_ERROR_CURL_PEFORM_FAILURE_FORMAT  "[MAILClient][Error] Unable to perform a request (Error=%d | %s) !"
-
 #endif
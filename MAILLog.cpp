@@ -0,0 +1,110 @@
+/*
+* @file MAILLog.cpp
+* @brief bounded ring of structured log events of the mail clients
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "MAILLog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <curl/curl.h>
+
+CMailLog::CMailLog(size_t uCapacity) :
+   m_vecEvents(std::max<size_t>(uCapacity, 1))
+{
+}
+
+void CMailLog::Write(Level eLevel, Code eCode, int64_t iArg0, int64_t iArg1, const char* szText)
+{
+   const int64_t iTime = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   Event& oEvent = m_vecEvents[m_uWritten % m_vecEvents.size()];
+   oEvent.uSequence = m_uWritten++;
+   oEvent.iTime = iTime;
+   oEvent.eLevel = eLevel;
+   oEvent.eCode = eCode;
+   oEvent.aiArgs[0] = iArg0;
+   oEvent.aiArgs[1] = iArg1;
+   oEvent.szText[0] = '\0';
+   if (szText != nullptr)
+   {
+      const size_t uLength = strlen(szText);
+      const size_t uKept = std::min(uLength, TEXT_SIZE - 1);
+      memcpy(oEvent.szText, szText + (uLength - uKept), uKept);
+      oEvent.szText[uKept] = '\0';
+   }
+}
+
+std::vector<CMailLog::Event> CMailLog::Read(uint64_t uSince) const
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   const uint64_t uOldest = m_uWritten > m_vecEvents.size() ? m_uWritten - m_vecEvents.size() : 0;
+   uint64_t uFrom = std::max(uSince, std::max(uOldest, m_uCleared));
+
+   std::vector<Event> vecEvents;
+   for (; uFrom < m_uWritten; ++uFrom)
+      vecEvents.push_back(m_vecEvents[uFrom % m_vecEvents.size()]);
+   return vecEvents;
+}
+
+uint64_t CMailLog::GetWritten() const
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   return m_uWritten;
+}
+
+void CMailLog::Clear()
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   m_uCleared = m_uWritten;
+}
+
+std::string CMailLog::Format(const Event& oEvent)
+{
+   char szMessage[256];
+   switch (oEvent.eCode)
+   {
+      case OBJECT_NOT_CLEANED:
+         return "[MAILClient][Warning] Object was freed before calling CMailClient::CleanupSession()."
+                " The API session was cleaned though.";
+      case EMPTY_HOST:
+         return "[MAILClient][Error] Empty hostname.";
+      case CURL_ALREADY_INIT:
+         return "[MAILClient][Error] Curl session is already initialized ! "
+                "Use CleanupSession() to clean the present one.";
+      case CURL_NOT_INIT:
+         return "[MAILClient][Error] Curl session is not initialized ! Use InitSession() before.";
+      case PREPERFORM_FAILED:
+         return "[MAILClient][Error] PrePerform failed !";
+      case POSTPERFORM_FAILED:
+         return "[MAILClient][Error] PostPerform failed !";
+      case PERFORM_FAILED:
+         snprintf(szMessage, sizeof(szMessage), "[MAILClient][Error] Unable to perform a request (Error=%d | %s) !",
+                  static_cast<int>(oEvent.aiArgs[0]), curl_easy_strerror(static_cast<CURLcode>(oEvent.aiArgs[0])));
+         return szMessage;
+      case MULTIAPPEND_TOO_LARGE:
+         snprintf(szMessage, sizeof(szMessage), "[IMAPClient][Error] MULTIAPPEND command of %lld bytes is over the %lld bytes limit.",
+                  static_cast<long long>(oEvent.aiArgs[0]), static_cast<long long>(oEvent.aiArgs[1]));
+         return szMessage;
+      case COMPRESS_UNAVAILABLE:
+         return "[IMAPClient][Warning] COMPRESS=DEFLATE is only available on plaintext sessions without proxy.";
+      case LOCAL_FILE_OPEN:
+         snprintf(szMessage, sizeof(szMessage), "[IMAPClient][Error] Unable to open local file %s in CIMAPClient::PrePerform()"
+                  " in case %s.", oEvent.szText, oEvent.aiArgs[0] == 0 ? "IMAP_SEND_FILE" : "IMAP_RETR_FILE");
+         return szMessage;
+      case UNKNOWN_OPERATION:
+         snprintf(szMessage, sizeof(szMessage), "[IMAPClient][Error] Unknown operation %lld.",
+                  static_cast<long long>(oEvent.aiArgs[0]));
+         return szMessage;
+   }
+
+   snprintf(szMessage, sizeof(szMessage), "[MAILClient] Event %d (%lld, %lld) %s", static_cast<int>(oEvent.eCode),
+            static_cast<long long>(oEvent.aiArgs[0]), static_cast<long long>(oEvent.aiArgs[1]), oEvent.szText);
+   return szMessage;
+}
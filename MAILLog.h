@@ -0,0 +1,89 @@
+/*
+* @file MAILLog.h
+* @brief bounded ring of structured log events of the mail clients
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_MAILLOG_H_
+#define INCLUDE_MAILLOG_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* The clients log an event code with up to two numbers and a short text
+* instead of a formatted message: writing one copies a few dozen bytes into a
+* preallocated slot, without allocating, formatting or calling out. The ring
+* keeps the last uCapacity events, older ones are overwritten, so a client
+* that lives for months or hits an error storm uses the same memory.
+*
+* Readers (sinks) take the events newer than the last sequence number they
+* saw and format them with Format() when they need text. Every method may
+* be called from any thread. */
+class CMailLog
+{
+public:
+   enum Level : uint8_t
+   {
+      LEVEL_WARNING,
+      LEVEL_ERROR
+   };
+
+   /* the arguments of each code are listed next to it */
+   enum Code : uint16_t
+   {
+      OBJECT_NOT_CLEANED,    //
+      EMPTY_HOST,            //
+      CURL_ALREADY_INIT,     //
+      CURL_NOT_INIT,         //
+      PREPERFORM_FAILED,     //
+      POSTPERFORM_FAILED,    //
+      PERFORM_FAILED,        // CURLcode
+      MULTIAPPEND_TOO_LARGE, // command size, limit
+      COMPRESS_UNAVAILABLE,  //
+      LOCAL_FILE_OPEN,       // 0 for an upload, 1 for a download; text: the path
+      UNKNOWN_OPERATION      // operation number
+   };
+
+   /* text arguments longer than this keep their end: for paths, the file name */
+   static const size_t TEXT_SIZE = 64;
+
+   struct Event
+   {
+      uint64_t uSequence = 0;
+      int64_t  iTime = 0;          // microseconds since the Unix epoch
+      Level    eLevel = LEVEL_ERROR;
+      Code     eCode = UNKNOWN_OPERATION;
+      int64_t  aiArgs[2] = { 0, 0 };
+      char     szText[TEXT_SIZE] = { 0 };
+   };
+
+   explicit CMailLog(size_t uCapacity = 128);
+
+   CMailLog(const CMailLog&) = delete;
+   CMailLog& operator=(const CMailLog&) = delete;
+
+   void Write(Level eLevel, Code eCode, int64_t iArg0 = 0, int64_t iArg1 = 0, const char* szText = nullptr);
+
+   /* the events still in the ring with a sequence number of at least uSince,
+   * oldest first; pass the last one's uSequence + 1 to get only newer ones */
+   std::vector<Event> Read(uint64_t uSince = 0) const;
+   /* the sequence number the next event will get: events written so far */
+   uint64_t GetWritten() const;
+   inline size_t GetCapacity() const { return m_vecEvents.size(); }
+   void Clear();
+
+   /* "[MAILClient][Error] Unable to perform a request (Error=7 | Couldn't connect to server) !" */
+   static std::string Format(const Event& oEvent);
+
+private:
+   mutable std::mutex  m_oLock;
+   std::vector<Event>  m_vecEvents;
+   uint64_t            m_uWritten = 0;
+   uint64_t            m_uCleared = 0;
+};
+
+#endif
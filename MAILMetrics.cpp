@@ -0,0 +1,279 @@
+/*
+* @file MAILMetrics.cpp
+* @brief per-operation curl timings aggregated into log-linear latency histograms
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "MAILMetrics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+
+/* ----------------------------------------------------------------------------
+*  Histogram
+* ------------------------------------------------------------------------- */
+
+size_t CMailMetrics::CHistogram::BucketIndex(uint64_t uValue)
+{
+   /* values below 2^(SUB_BUCKET_BITS + 1) have a bucket each; above, every
+   * power of two is split in 2^SUB_BUCKET_BITS equal buckets */
+   unsigned uMagnitude = 0;
+   while ((uValue >> uMagnitude) >= (2u << SUB_BUCKET_BITS))
+      ++uMagnitude;
+   return (static_cast<size_t>(uMagnitude) << SUB_BUCKET_BITS) + static_cast<size_t>(uValue >> uMagnitude);
+}
+
+uint64_t CMailMetrics::CHistogram::HighestEquivalent(size_t uIndex)
+{
+   if (uIndex < (2u << SUB_BUCKET_BITS))
+      return uIndex;
+
+   const unsigned uMagnitude = static_cast<unsigned>(uIndex >> SUB_BUCKET_BITS) - 1;
+   const uint64_t uSubBucket = uIndex - (static_cast<size_t>(uMagnitude) << SUB_BUCKET_BITS);
+   return ((uSubBucket + 1) << uMagnitude) - 1;
+}
+
+void CMailMetrics::CHistogram::Record(uint64_t uValue)
+{
+   const size_t uIndex = BucketIndex(uValue);
+   if (uIndex >= m_vecCounts.size())
+      m_vecCounts.resize(uIndex + 1, 0);
+
+   ++m_vecCounts[uIndex];
+   ++m_uCount;
+   m_uSum += uValue;
+   m_uMin = std::min(m_uMin, uValue);
+   m_uMax = std::max(m_uMax, uValue);
+}
+
+void CMailMetrics::CHistogram::Merge(const CHistogram& oOther)
+{
+   if (oOther.m_vecCounts.size() > m_vecCounts.size())
+      m_vecCounts.resize(oOther.m_vecCounts.size(), 0);
+   for (size_t i = 0; i < oOther.m_vecCounts.size(); ++i)
+      m_vecCounts[i] += oOther.m_vecCounts[i];
+
+   m_uCount += oOther.m_uCount;
+   m_uSum += oOther.m_uSum;
+   m_uMin = std::min(m_uMin, oOther.m_uMin);
+   m_uMax = std::max(m_uMax, oOther.m_uMax);
+}
+
+uint64_t CMailMetrics::CHistogram::ValueAtPercentile(double dPercentile) const
+{
+   if (m_uCount == 0)
+      return 0;
+
+   /* nearest rank, never past the largest value seen */
+   const double dClamped = std::min(100.0, std::max(0.0, dPercentile));
+   const uint64_t uRank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(dClamped / 100.0 * m_uCount)));
+   uint64_t uSeen = 0;
+   for (size_t i = 0; i < m_vecCounts.size(); ++i)
+   {
+      uSeen += m_vecCounts[i];
+      if (uSeen >= uRank)
+         return std::min(HighestEquivalent(i), m_uMax);
+   }
+   return m_uMax;
+}
+
+uint64_t CMailMetrics::CHistogram::CountAtOrBelow(uint64_t uValue) const
+{
+   uint64_t uCount = 0;
+   for (size_t i = 0; i < m_vecCounts.size() && HighestEquivalent(i) <= uValue; ++i)
+      uCount += m_vecCounts[i];
+   return uCount;
+}
+
+/* ----------------------------------------------------------------------------
+*  Metrics
+* ------------------------------------------------------------------------- */
+
+const char* CMailMetrics::PhaseName(Phase ePhase)
+{
+   switch (ePhase)
+   {
+      case PHASE_DNS:      return "dns";
+      case PHASE_CONNECT:  return "connect";
+      case PHASE_TLS:      return "tls";
+      case PHASE_SETUP:    return "setup";
+      case PHASE_WAIT:     return "wait";
+      case PHASE_TRANSFER: return "transfer";
+      case PHASE_TOTAL:    return "total";
+      default:             break;
+   }
+   return "";
+}
+
+size_t CMailMetrics::Probe::Callback(void* ptr, size_t size, size_t nmemb, void* data)
+{
+   Probe* pProbe = static_cast<Probe*>(data);
+   const size_t uWritten = CMailTransport::Forward(pProbe->fnTarget, pProbe->pTargetData,
+                                                   static_cast<const char*>(ptr), size * nmemb);
+   pProbe->uBytes += uWritten;
+   return uWritten;
+}
+
+size_t CMailMetrics::Probe::HeaderCallback(void* ptr, size_t size, size_t nmemb, void* data)
+{
+   Probe* pProbe = static_cast<Probe*>(data);
+   const char* pLine = static_cast<const char*>(ptr);
+   const size_t uSize = size * nmemb;
+   const TimePoint tNow = std::chrono::steady_clock::now();
+
+   if (!pProbe->bInCommand)
+   {
+      pProbe->atFirstLine[0] = pProbe->atFirstLine[1];
+      pProbe->atTaggedLine[0] = pProbe->atTaggedLine[1];
+      pProbe->atFirstLine[1] = tNow;
+      pProbe->bInCommand = true;
+      ++pProbe->uCommands;
+   }
+
+   /* curl tags its commands with a letter and three digits; matching the
+   * whole tag keeps lines of literals from passing for tagged ones */
+   if (uSize > 4 && pLine[0] >= 'A' && pLine[0] <= 'Z' && isdigit(static_cast<unsigned char>(pLine[1])) &&
+       isdigit(static_cast<unsigned char>(pLine[2])) && isdigit(static_cast<unsigned char>(pLine[3])) && pLine[4] == ' ')
+   {
+      pProbe->atTaggedLine[1] = tNow;
+      pProbe->bInCommand = false;
+   }
+
+   return CMailTransport::Forward(pProbe->fnHeaderTarget, pProbe->pHeaderTargetData, pLine, uSize);
+}
+
+CMailMetrics::Sample CMailMetrics::Collect(CURL* pCurl, CURLcode eCode, const Probe& oProbe)
+{
+   Sample oSample;
+   oSample.eCode = eCode;
+
+   long lConnects = 0;
+   curl_easy_getinfo(pCurl, CURLINFO_NUM_CONNECTS, &lConnects);
+   oSample.bNewConnection = lConnects > 0;
+
+   curl_easy_getinfo(pCurl, CURLINFO_NAMELOOKUP_TIME_T, &oSample.iNameLookup);
+   curl_easy_getinfo(pCurl, CURLINFO_CONNECT_TIME_T, &oSample.iConnect);
+   curl_easy_getinfo(pCurl, CURLINFO_APPCONNECT_TIME_T, &oSample.iAppConnect);
+   curl_easy_getinfo(pCurl, CURLINFO_PRETRANSFER_TIME_T, &oSample.iPreTransfer);
+   curl_easy_getinfo(pCurl, CURLINFO_TOTAL_TIME_T, &oSample.iTotal);
+   curl_easy_getinfo(pCurl, CURLINFO_SIZE_UPLOAD_T, &oSample.iBytesUp);
+   oSample.iBytesDown = static_cast<curl_off_t>(oProbe.uBytes);
+
+   const auto Since = [&oProbe](const Probe::TimePoint& tPoint)
+   {
+      return static_cast<curl_off_t>(std::chrono::duration_cast<std::chrono::microseconds>(tPoint - oProbe.tStart).count());
+   };
+   if (oProbe.uCommands >= 2)
+      oSample.iRequestSent = Since(oProbe.atTaggedLine[0]);
+   else if (oSample.bNewConnection)
+      oSample.iRequestSent = std::max(oSample.iConnect, oSample.iAppConnect);
+   if (oProbe.uCommands >= 1)
+      oSample.iFirstResponse = Since(oProbe.atFirstLine[1]);
+   return oSample;
+}
+
+void CMailMetrics::Record(const std::string& strOperation, const Sample& oSample)
+{
+   /* the timestamps only grow, but a failed transfer leaves the later ones at 0 */
+   const auto Span = [](curl_off_t iFrom, curl_off_t iTo) -> uint64_t
+   {
+      return iTo > iFrom ? static_cast<uint64_t>(iTo - iFrom) : 0;
+   };
+
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   OperationStats& oStats = m_mapOperations[strOperation];
+   ++oStats.uCount;
+   ++oStats.mapResults[static_cast<int>(oSample.eCode)];
+   oStats.uBytesUp += static_cast<uint64_t>(std::max<curl_off_t>(0, oSample.iBytesUp));
+   oStats.uBytesDown += static_cast<uint64_t>(std::max<curl_off_t>(0, oSample.iBytesDown));
+
+   if (oSample.bNewConnection)
+   {
+      oStats.aoPhases[PHASE_DNS].Record(Span(0, oSample.iNameLookup));
+      oStats.aoPhases[PHASE_CONNECT].Record(Span(oSample.iNameLookup, oSample.iConnect));
+      if (oSample.iAppConnect > 0)
+         oStats.aoPhases[PHASE_TLS].Record(Span(oSample.iConnect, oSample.iAppConnect));
+   }
+   if (oSample.iFirstResponse > 0)
+   {
+      if (oSample.iRequestSent > 0)
+         oStats.aoPhases[PHASE_SETUP].Record(Span(std::max(oSample.iConnect, oSample.iAppConnect), oSample.iRequestSent));
+      oStats.aoPhases[PHASE_WAIT].Record(Span(oSample.iRequestSent, oSample.iFirstResponse));
+      oStats.aoPhases[PHASE_TRANSFER].Record(Span(oSample.iFirstResponse, oSample.iTotal));
+   }
+   oStats.aoPhases[PHASE_TOTAL].Record(static_cast<uint64_t>(std::max<curl_off_t>(0, oSample.iTotal)));
+}
+
+std::map<std::string, CMailMetrics::OperationStats> CMailMetrics::Snapshot() const
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   return m_mapOperations;
+}
+
+void CMailMetrics::Reset()
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   m_mapOperations.clear();
+}
+
+std::string CMailMetrics::ToPrometheus(const std::string& strPrefix) const
+{
+   const std::map<std::string, OperationStats> mapOperations = Snapshot();
+   const double adQuantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+   std::string strOut;
+   char szLine[512];
+   const auto Seconds = [](uint64_t uMicros) { return static_cast<double>(uMicros) / 1e6; };
+
+   strOut += "# HELP " + strPrefix + "_operations_total Operations performed, by curl result code.\n";
+   strOut += "# TYPE " + strPrefix + "_operations_total counter\n";
+   for (const auto& oOperation : mapOperations)
+      for (const auto& oResult : oOperation.second.mapResults)
+      {
+         snprintf(szLine, sizeof(szLine), "%s_operations_total{operation=\"%s\",result=\"%d\"} %llu\n",
+                  strPrefix.c_str(), oOperation.first.c_str(), oResult.first,
+                  static_cast<unsigned long long>(oResult.second));
+         strOut += szLine;
+      }
+
+   strOut += "# HELP " + strPrefix + "_bytes_total Bytes sent and received by operations.\n";
+   strOut += "# TYPE " + strPrefix + "_bytes_total counter\n";
+   for (const auto& oOperation : mapOperations)
+   {
+      snprintf(szLine, sizeof(szLine), "%s_bytes_total{operation=\"%s\",direction=\"up\"} %llu\n"
+               "%s_bytes_total{operation=\"%s\",direction=\"down\"} %llu\n",
+               strPrefix.c_str(), oOperation.first.c_str(), static_cast<unsigned long long>(oOperation.second.uBytesUp),
+               strPrefix.c_str(), oOperation.first.c_str(), static_cast<unsigned long long>(oOperation.second.uBytesDown));
+      strOut += szLine;
+   }
+
+   strOut += "# HELP " + strPrefix + "_phase_seconds Time spent in each phase of an operation.\n";
+   strOut += "# TYPE " + strPrefix + "_phase_seconds summary\n";
+   for (const auto& oOperation : mapOperations)
+      for (int iPhase = 0; iPhase < PHASE_COUNT; ++iPhase)
+      {
+         const CHistogram& oHistogram = oOperation.second.aoPhases[iPhase];
+         if (oHistogram.GetCount() == 0)
+            continue;
+
+         const char* szPhase = PhaseName(static_cast<Phase>(iPhase));
+         for (double dQuantile : adQuantiles)
+         {
+            snprintf(szLine, sizeof(szLine), "%s_phase_seconds{operation=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+                     strPrefix.c_str(), oOperation.first.c_str(), szPhase, dQuantile,
+                     Seconds(oHistogram.ValueAtPercentile(dQuantile * 100)));
+            strOut += szLine;
+         }
+         snprintf(szLine, sizeof(szLine), "%s_phase_seconds_sum{operation=\"%s\",phase=\"%s\"} %.6f\n"
+                  "%s_phase_seconds_count{operation=\"%s\",phase=\"%s\"} %llu\n",
+                  strPrefix.c_str(), oOperation.first.c_str(), szPhase, Seconds(oHistogram.GetSum()),
+                  strPrefix.c_str(), oOperation.first.c_str(), szPhase,
+                  static_cast<unsigned long long>(oHistogram.GetCount()));
+         strOut += szLine;
+      }
+
+   return strOut;
+}
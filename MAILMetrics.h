@@ -0,0 +1,157 @@
+/*
+* @file MAILMetrics.h
+* @brief per-operation curl timings aggregated into log-linear latency histograms
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_MAILMETRICS_H_
+#define INCLUDE_MAILMETRICS_H_
+
+#include "MAILTransport.h"
+
+#include <chrono>
+#include <cstdint>
+#include <curl/curl.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* A client given a CMailMetrics with SetMetrics() reports every operation it
+* performs with curl: the result code, the bytes sent and received, and the
+* time spent in each phase:
+*
+*  - dns, connect, tls: resolving, the TCP and the TLS handshakes, only for
+*    operations that opened a connection,
+*  - setup: the commands curl sends before the request (CAPABILITY and LOGIN
+*    on a new connection, SELECT when the folder changes),
+*  - wait: from sending the request to its first response line, the server's
+*    think time plus one round trip,
+*  - transfer: from the first response line to the end,
+*  - total.
+*
+* The handshakes come from CURLINFO_*_TIME_T. For IMAP curl's later
+* timestamps cover the request and the setup together, so a Probe between
+* curl and the client's callbacks stamps the response lines instead: every
+* command ends with a tagged line, the last one answers the request, the one
+* before ends the setup.
+*
+* Phases are aggregated per operation type ("fetch_uid", "search", ...) in
+* histograms with a relative error under 1/32, so high percentiles stay exact
+* enough over millions of samples in a few kilobytes. One instance may be
+* shared by many clients. */
+class CMailMetrics
+{
+public:
+   enum Phase
+   {
+      PHASE_DNS,
+      PHASE_CONNECT,
+      PHASE_TLS,
+      PHASE_SETUP,
+      PHASE_WAIT,
+      PHASE_TRANSFER,
+      PHASE_TOTAL,
+      PHASE_COUNT
+   };
+
+   /* values in microseconds, counted in buckets narrower than 1/32 of their values */
+   class CHistogram
+   {
+   public:
+      void Record(uint64_t uValue);
+      void Merge(const CHistogram& oOther);
+
+      inline uint64_t GetCount() const { return m_uCount; }
+      inline uint64_t GetSum() const { return m_uSum; }
+      inline uint64_t GetMin() const { return m_uCount != 0 ? m_uMin : 0; }
+      inline uint64_t GetMax() const { return m_uMax; }
+      /* highest value equivalent to the one at dPercentile (0..100) */
+      uint64_t ValueAtPercentile(double dPercentile) const;
+      /* recorded values not above uValue, within the bucket precision */
+      uint64_t CountAtOrBelow(uint64_t uValue) const;
+
+   private:
+      /* 32 linear sub-buckets per power of two above 32 */
+      static const unsigned SUB_BUCKET_BITS = 5;
+      static size_t BucketIndex(uint64_t uValue);
+      static uint64_t HighestEquivalent(size_t uIndex);
+
+      std::vector<uint64_t> m_vecCounts;
+      uint64_t              m_uCount = 0;
+      uint64_t              m_uSum = 0;
+      uint64_t              m_uMin = UINT64_MAX;
+      uint64_t              m_uMax = 0;
+   };
+
+   /* what one Perform() reports, times in microseconds from the start */
+   struct Sample
+   {
+      CURLcode   eCode = CURLE_OK;
+      bool       bNewConnection = false;
+      curl_off_t iNameLookup = 0;    // CURLINFO_*_TIME_T
+      curl_off_t iConnect = 0;
+      curl_off_t iAppConnect = 0;
+      curl_off_t iPreTransfer = 0;
+      curl_off_t iTotal = 0;
+      curl_off_t iRequestSent = 0;   // from the Probe, 0 when unknown
+      curl_off_t iFirstResponse = 0;
+      curl_off_t iBytesUp = 0;
+      curl_off_t iBytesDown = 0;
+   };
+
+   /* sits between curl and the client's write and header targets, counting
+   * the response bytes and stamping the response lines */
+   struct Probe
+   {
+      typedef std::chrono::steady_clock::time_point TimePoint;
+
+      CMailTransport::WriteFn fnTarget = nullptr;
+      void*                   pTargetData = nullptr;
+      CMailTransport::WriteFn fnHeaderTarget = nullptr;
+      void*                   pHeaderTargetData = nullptr;
+      TimePoint               tStart;
+      uint64_t                uBytes = 0;
+      /* first and tagged line of the last two commands, [1] the latest */
+      TimePoint               atFirstLine[2];
+      TimePoint               atTaggedLine[2];
+      unsigned                uCommands = 0;
+      bool                    bInCommand = false;
+
+      static size_t Callback(void* ptr, size_t size, size_t nmemb, void* data);
+      static size_t HeaderCallback(void* ptr, size_t size, size_t nmemb, void* data);
+   };
+
+   struct OperationStats
+   {
+      uint64_t                uCount = 0;
+      std::map<int, uint64_t> mapResults; // CURLcode -> operations
+      uint64_t                uBytesUp = 0;
+      uint64_t                uBytesDown = 0;
+      CHistogram              aoPhases[PHASE_COUNT];
+   };
+
+   CMailMetrics() = default;
+   CMailMetrics(const CMailMetrics&) = delete;
+   CMailMetrics& operator=(const CMailMetrics&) = delete;
+
+   /* the sample of the transfer just performed on pCurl through oProbe */
+   static Sample Collect(CURL* pCurl, CURLcode eCode, const Probe& oProbe);
+   void Record(const std::string& strOperation, const Sample& oSample);
+
+   std::map<std::string, OperationStats> Snapshot() const;
+   void Reset();
+
+   /* Prometheus text format: operations and bytes counters and, per operation
+   * and phase, a summary with the 0.5, 0.9, 0.99 and 0.999 quantiles */
+   std::string ToPrometheus(const std::string& strPrefix = "qtemailfetcher_mail") const;
+
+   static const char* PhaseName(Phase ePhase);
+
+private:
+   mutable std::mutex                    m_oLock;
+   std::map<std::string, OperationStats> m_mapOperations;
+};
+
+#endif
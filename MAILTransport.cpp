@@ -0,0 +1,269 @@
+/*
+* @file MAILTransport.cpp
+* @brief pluggable transfer behind CMailClient::Perform: record and replay of sessions
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "MAILTransport.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+namespace {
+
+/* Capture file: the magic, then per operation
+*    u32 key size, key, i32 CURLcode, u32 chunk count,
+*    per chunk: u8 1 for header bytes 0 for body bytes, u32 size, bytes
+* with integers little-endian. */
+const char   CAPTURE_MAGIC[] = "QTEFCAP1";
+const size_t CAPTURE_MAGIC_SIZE = sizeof(CAPTURE_MAGIC) - 1;
+
+void PutU32(std::string& strOut, uint32_t uValue)
+{
+   for (int i = 0; i < 4; ++i)
+      strOut += static_cast<char>((uValue >> (8 * i)) & 0xFF);
+}
+
+bool GetU32(const std::string& strIn, size_t& uPos, uint32_t& uValue)
+{
+   if (strIn.size() - uPos < 4)
+      return false;
+
+   uValue = 0;
+   for (int i = 0; i < 4; ++i)
+      uValue |= static_cast<uint32_t>(static_cast<unsigned char>(strIn[uPos + i])) << (8 * i);
+   uPos += 4;
+   return true;
+}
+
+bool GetBytes(const std::string& strIn, size_t& uPos, std::string& strOut)
+{
+   uint32_t uSize = 0;
+   if (!GetU32(strIn, uPos, uSize) || strIn.size() - uPos < uSize)
+      return false;
+
+   strOut.assign(strIn, uPos, uSize);
+   uPos += uSize;
+   return true;
+}
+
+} // namespace
+
+size_t CMailTransport::Forward(WriteFn fnWrite, void* pData, const char* pBytes, size_t uSize)
+{
+   if (fnWrite != nullptr)
+      return fnWrite(const_cast<char*>(pBytes), 1, uSize, pData);
+   if (pData != nullptr)
+      return fwrite(pBytes, 1, uSize, static_cast<FILE*>(pData));
+   return uSize;
+}
+
+/* ----------------------------------------------------------------------------
+*  Recording
+* ------------------------------------------------------------------------- */
+
+struct CRecordingTransport::Tee
+{
+   WriteFn fnTarget;
+   void*   pTargetData;
+   bool    bHeader;
+   Record* pRecord;
+};
+
+bool CRecordingTransport::Open(const std::string& strPath)
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   if (m_fCapture.is_open())
+      m_fCapture.close();
+
+   m_fCapture.open(strPath, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+   if (!m_fCapture)
+      return false;
+
+   m_fCapture.write(CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+   m_uRecords = 0;
+   return static_cast<bool>(m_fCapture);
+}
+
+void CRecordingTransport::Close()
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   if (m_fCapture.is_open())
+      m_fCapture.close();
+}
+
+size_t CRecordingTransport::TeeCallback(void* ptr, size_t size, size_t nmemb, void* data)
+{
+   Tee* pTee = static_cast<Tee*>(data);
+   const size_t uAccepted = Forward(pTee->fnTarget, pTee->pTargetData, static_cast<const char*>(ptr), size * nmemb);
+
+   /* only what the client took: a refused write fails the transfer the same way on replay */
+   const size_t uKept = std::min(uAccepted, size * nmemb);
+   std::vector<Chunk>& vecChunks = pTee->pRecord->vecChunks;
+   if (vecChunks.empty() || vecChunks.back().bHeader != pTee->bHeader)
+      vecChunks.push_back(Chunk { pTee->bHeader, std::string() });
+   vecChunks.back().strData.append(static_cast<const char*>(ptr), uKept);
+
+   return uAccepted;
+}
+
+CURLcode CRecordingTransport::Perform(const Transfer& oTransfer)
+{
+   Record oRecord;
+   Tee oWriteTee { oTransfer.fnWrite, oTransfer.pWriteData, false, &oRecord };
+   Tee oHeaderTee { oTransfer.fnHeader, oTransfer.pHeaderData, true, &oRecord };
+
+   /* headers are only delivered, and so only recorded, when the client asked for them */
+   const bool bHeaders = oTransfer.fnHeader != nullptr || oTransfer.pHeaderData != nullptr;
+
+   curl_easy_setopt(oTransfer.pCurl, CURLOPT_WRITEFUNCTION, &CRecordingTransport::TeeCallback);
+   curl_easy_setopt(oTransfer.pCurl, CURLOPT_WRITEDATA, &oWriteTee);
+   if (bHeaders)
+   {
+      curl_easy_setopt(oTransfer.pCurl, CURLOPT_HEADERFUNCTION, &CRecordingTransport::TeeCallback);
+      curl_easy_setopt(oTransfer.pCurl, CURLOPT_HEADERDATA, &oHeaderTee);
+   }
+
+   oRecord.eCode = curl_easy_perform(oTransfer.pCurl);
+
+   /* the tees live on this stack: a later perform must not find them */
+   curl_easy_setopt(oTransfer.pCurl, CURLOPT_WRITEFUNCTION, oTransfer.fnWrite);
+   curl_easy_setopt(oTransfer.pCurl, CURLOPT_WRITEDATA, oTransfer.pWriteData);
+   if (bHeaders)
+   {
+      curl_easy_setopt(oTransfer.pCurl, CURLOPT_HEADERFUNCTION, oTransfer.fnHeader);
+      curl_easy_setopt(oTransfer.pCurl, CURLOPT_HEADERDATA, oTransfer.pHeaderData);
+   }
+
+   std::string strOut;
+   PutU32(strOut, static_cast<uint32_t>(oTransfer.strOperation.size()));
+   strOut += oTransfer.strOperation;
+   PutU32(strOut, static_cast<uint32_t>(oRecord.eCode));
+   PutU32(strOut, static_cast<uint32_t>(oRecord.vecChunks.size()));
+   for (const Chunk& oChunk : oRecord.vecChunks)
+   {
+      strOut += static_cast<char>(oChunk.bHeader ? 1 : 0);
+      PutU32(strOut, static_cast<uint32_t>(oChunk.strData.size()));
+      strOut += oChunk.strData;
+   }
+
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   if (m_fCapture.is_open())
+   {
+      m_fCapture.write(strOut.data(), static_cast<std::streamsize>(strOut.size()));
+      m_fCapture.flush();
+      ++m_uRecords;
+   }
+
+   return oRecord.eCode;
+}
+
+/* ----------------------------------------------------------------------------
+*  Replay
+* ------------------------------------------------------------------------- */
+
+bool CReplayTransport::Load(const std::string& strPath)
+{
+   std::ifstream fCapture(strPath, std::ifstream::in | std::ifstream::binary);
+   if (!fCapture)
+      return false;
+
+   const std::string strData((std::istreambuf_iterator<char>(fCapture)), std::istreambuf_iterator<char>());
+   if (strData.compare(0, CAPTURE_MAGIC_SIZE, CAPTURE_MAGIC) != 0)
+      return false;
+
+   std::map<std::string, Queue> mapQueues;
+   size_t uRecords = 0;
+   size_t uPos = CAPTURE_MAGIC_SIZE;
+   while (uPos < strData.size())
+   {
+      std::string strKey;
+      uint32_t uCode = 0;
+      uint32_t uChunks = 0;
+      if (!GetBytes(strData, uPos, strKey) || !GetU32(strData, uPos, uCode) || !GetU32(strData, uPos, uChunks))
+         return false;
+
+      Record oRecord;
+      oRecord.eCode = static_cast<CURLcode>(uCode);
+      for (uint32_t i = 0; i < uChunks; ++i)
+      {
+         if (uPos >= strData.size())
+            return false;
+
+         Chunk oChunk;
+         oChunk.bHeader = strData[uPos++] != 0;
+         if (!GetBytes(strData, uPos, oChunk.strData))
+            return false;
+         oRecord.vecChunks.push_back(std::move(oChunk));
+      }
+
+      mapQueues[strKey].vecRecords.push_back(std::move(oRecord));
+      ++uRecords;
+   }
+
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   m_mapQueues.swap(mapQueues);
+   m_uRecords = uRecords;
+   return true;
+}
+
+void CReplayTransport::Rewind()
+{
+   std::lock_guard<std::mutex> oLock(m_oLock);
+   for (auto& oQueue : m_mapQueues)
+      oQueue.second.uNext = 0;
+}
+
+CURLcode CReplayTransport::Perform(const Transfer& oTransfer)
+{
+   const Record* pRecord = nullptr;
+   {
+      std::lock_guard<std::mutex> oLock(m_oLock);
+      auto itQueue = m_mapQueues.find(oTransfer.strOperation);
+      if (itQueue != m_mapQueues.end())
+      {
+         Queue& oQueue = itQueue->second;
+         if (m_bLoop && oQueue.uNext == oQueue.vecRecords.size())
+            oQueue.uNext = 0;
+         if (oQueue.uNext < oQueue.vecRecords.size())
+            pRecord = &oQueue.vecRecords[oQueue.uNext++];
+      }
+   }
+   if (pRecord == nullptr)
+   {
+      ++m_oStats.uMissing;
+      return CURLE_COULDNT_CONNECT;
+   }
+
+   /* records are not modified after Load(), delivery needs no lock. Body bytes
+   * go in pieces of at most CURL_MAX_WRITE_SIZE and header bytes one line at
+   * a time, as curl passes them. */
+   for (const Chunk& oChunk : pRecord->vecChunks)
+   {
+      const std::string& strData = oChunk.strData;
+      size_t uPos = 0;
+      while (uPos < strData.size())
+      {
+         size_t uSize = std::min(strData.size() - uPos, static_cast<size_t>(CURL_MAX_WRITE_SIZE));
+         if (oChunk.bHeader)
+         {
+            const size_t uEnd = strData.find('\n', uPos);
+            uSize = (uEnd == std::string::npos ? strData.size() : uEnd + 1) - uPos;
+         }
+
+         const size_t uWritten = oChunk.bHeader ?
+            Forward(oTransfer.fnHeader, oTransfer.pHeaderData, strData.data() + uPos, uSize) :
+            Forward(oTransfer.fnWrite, oTransfer.pWriteData, strData.data() + uPos, uSize);
+         if (uWritten != uSize)
+            return CURLE_WRITE_ERROR;
+
+         uPos += uSize;
+         m_oStats.uBytes += uSize;
+      }
+   }
+
+   ++m_oStats.uServed;
+   return pRecord->eCode;
+}
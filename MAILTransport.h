@@ -0,0 +1,144 @@
+/*
+* @file MAILTransport.h
+* @brief pluggable transfer behind CMailClient::Perform: record and replay of sessions
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_MAILTRANSPORT_H_
+#define INCLUDE_MAILTRANSPORT_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <curl/curl.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* By default a client hands every operation to curl_easy_perform. A transport
+* set with CMailClient::SetTransport() runs it instead and gets what the
+* operation needs: the handle, a key naming the request and the write and
+* header targets the client set up.
+*
+* CRecordingTransport performs for real and saves, per operation, the bytes
+* curl passed to those targets and the result code. CReplayTransport serves a
+* saved file back from memory: no socket, no TLS, no server, so the whole
+* client path above curl (response parsing, MIME decoding, caches) can be
+* profiled on captured traffic at full speed and with identical input on
+* every run. */
+class CMailTransport
+{
+public:
+   /* the signature of the CMailClient write callbacks */
+   typedef size_t (*WriteFn)(void* ptr, size_t size, size_t nmemb, void* data);
+
+   struct Transfer
+   {
+      CURL*       pCurl = nullptr;
+      std::string strOperation; // CMailClient::DescribeOperation()
+      WriteFn     fnWrite = nullptr;
+      void*       pWriteData = nullptr;
+      WriteFn     fnHeader = nullptr;
+      void*       pHeaderData = nullptr;
+   };
+
+   virtual ~CMailTransport() = default;
+   virtual CURLcode Perform(const Transfer& oTransfer) = 0;
+   /* false when Perform() does not run curl: the handle's timings are not the operation's */
+   virtual bool UsesCurl() const { return true; }
+
+   /* what curl does with a target: the callback, else fwrite into a FILE*, else nothing */
+   static size_t Forward(WriteFn fnWrite, void* pData, const char* pBytes, size_t uSize);
+
+protected:
+   /* one operation of a capture: the result and the bytes in the order curl wrote them */
+   struct Chunk
+   {
+      bool        bHeader = false;
+      std::string strData;
+   };
+   struct Record
+   {
+      CURLcode           eCode = CURLE_OK;
+      std::vector<Chunk> vecChunks;
+   };
+
+};
+
+/* Performs with curl and appends every operation to a capture file. One
+* instance may be shared by several clients, the file is written under a lock.
+* The capture holds what the server sent, message contents included. */
+class CRecordingTransport : public CMailTransport
+{
+public:
+   CRecordingTransport() = default;
+   CRecordingTransport(const CRecordingTransport&) = delete;
+   CRecordingTransport& operator=(const CRecordingTransport&) = delete;
+
+   /* truncates strPath */
+   bool Open(const std::string& strPath);
+   void Close();
+   inline uint64_t GetRecordCount() const { return m_uRecords; }
+
+   CURLcode Perform(const Transfer& oTransfer) override;
+
+private:
+   struct Tee;
+   static size_t TeeCallback(void* ptr, size_t size, size_t nmemb, void* data);
+
+   std::mutex            m_oLock;
+   std::ofstream         m_fCapture;
+   std::atomic<uint64_t> m_uRecords{0};
+};
+
+/* Serves a capture file without touching the network. Records are matched by
+* operation key, in the order they were recorded for that key, so a client
+* replays correctly as long as it repeats the same requests; clients sharing an
+* instance take turns on the records of a key. An operation with no record left
+* fails with CURLE_COULDNT_CONNECT, unless looping is on. */
+class CReplayTransport : public CMailTransport
+{
+public:
+   struct Stats
+   {
+      std::atomic<uint64_t> uServed{0};
+      std::atomic<uint64_t> uMissing{0};
+      std::atomic<uint64_t> uBytes{0};
+   };
+
+   CReplayTransport() = default;
+   CReplayTransport(const CReplayTransport&) = delete;
+   CReplayTransport& operator=(const CReplayTransport&) = delete;
+
+   /* reads the whole capture into memory, before any client uses the instance;
+   * false if the file is missing or damaged */
+   bool Load(const std::string& strPath);
+   /* start over at the first record of a key once its records are used up,
+   * for benchmarks running more iterations than were captured */
+   inline void SetLoop(const bool& bLoop) { m_bLoop = bLoop; }
+   /* every key back to its first record */
+   void Rewind();
+   inline size_t GetRecordCount() const { return m_uRecords; }
+   inline const Stats& GetStats() const { return m_oStats; }
+
+   CURLcode Perform(const Transfer& oTransfer) override;
+   bool UsesCurl() const override { return false; }
+
+private:
+   struct Queue
+   {
+      std::vector<Record> vecRecords;
+      size_t              uNext = 0;
+   };
+
+   std::mutex                   m_oLock;
+   std::map<std::string, Queue> m_mapQueues;
+   size_t                       m_uRecords = 0;
+   bool                         m_bLoop = false;
+   Stats                        m_oStats;
+};
+
+#endif
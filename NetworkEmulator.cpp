@@ -0,0 +1,325 @@
+/*
+* @file NetworkEmulator.cpp
+* @brief TCP relay on loopback adding latency, jitter, bandwidth caps and stalls
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#include "NetworkEmulator.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <random>
+
+#ifndef WINDOWS
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+/* small chunks keep the bandwidth shaping smooth */
+const size_t CHUNK_SIZE = 4096;
+
+} // namespace
+
+struct CNetworkEmulator::Link
+{
+   struct Chunk
+   {
+      Clock::time_point tRelease;
+      std::string       strData;
+   };
+
+   /* 0: client to server, 1: server to client */
+   struct Direction
+   {
+      std::mutex              oLock;
+      std::condition_variable oReady;
+      std::deque<Chunk>       queChunks;
+      bool                    bEnd = false;
+      std::mt19937            oRandom;
+      Clock::time_point       tSerialized;
+      Clock::time_point       tLastRelease;
+   };
+
+   int       aiSocket[2] = { -1, -1 }; // client, server
+   Direction aoDirection[2];
+
+   ~Link()
+   {
+#ifndef WINDOWS
+      for (int iSocket : aiSocket)
+         if (iSocket >= 0)
+            close(iSocket);
+#endif
+   }
+};
+
+CNetworkEmulator::CNetworkEmulator(const Profile& oProfile) :
+   m_oProfile(oProfile)
+{
+}
+
+CNetworkEmulator::~CNetworkEmulator()
+{
+   Stop();
+}
+
+#ifdef WINDOWS
+
+bool CNetworkEmulator::Start(const std::string&, uint16_t)
+{
+   return false;
+}
+
+void CNetworkEmulator::Stop()
+{
+}
+
+void CNetworkEmulator::AcceptLoop()
+{
+}
+
+void CNetworkEmulator::Pump(std::shared_ptr<Link>, int)
+{
+}
+
+void CNetworkEmulator::Deliver(std::shared_ptr<Link>, int)
+{
+}
+
+#else
+
+bool CNetworkEmulator::Start(const std::string& strHost, uint16_t uPort)
+{
+   if (m_bRunning)
+      return false;
+
+   m_iListener = socket(AF_INET, SOCK_STREAM, 0);
+   if (m_iListener < 0)
+      return false;
+
+   sockaddr_in oAddress;
+   std::memset(&oAddress, 0, sizeof(oAddress));
+   oAddress.sin_family = AF_INET;
+   oAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   socklen_t uLength = sizeof(oAddress);
+   if (bind(m_iListener, reinterpret_cast<sockaddr*>(&oAddress), sizeof(oAddress)) != 0 ||
+       listen(m_iListener, 64) != 0 ||
+       getsockname(m_iListener, reinterpret_cast<sockaddr*>(&oAddress), &uLength) != 0)
+   {
+      close(m_iListener);
+      m_iListener = -1;
+      return false;
+   }
+
+   m_strHost = strHost;
+   m_uTargetPort = uPort;
+   m_uPort = ntohs(oAddress.sin_port);
+   m_bRunning = true;
+   m_oAcceptThread = std::thread(&CNetworkEmulator::AcceptLoop, this);
+   return true;
+}
+
+void CNetworkEmulator::Stop()
+{
+   if (!m_bRunning)
+      return;
+
+   m_bRunning = false;
+   m_oAcceptThread.join();
+   close(m_iListener);
+   m_iListener = -1;
+
+   std::vector<std::thread> vecThreads;
+   {
+      std::lock_guard<std::mutex> oLock(m_oLinkLock);
+      for (const auto& pWeak : m_vecLinks)
+      {
+         const std::shared_ptr<Link> pLink = pWeak.lock();
+         if (!pLink)
+            continue;
+
+         for (int iSocket : pLink->aiSocket)
+            shutdown(iSocket, SHUT_RDWR);
+         for (auto& oDirection : pLink->aoDirection)
+         {
+            std::lock_guard<std::mutex> oDirectionLock(oDirection.oLock);
+            oDirection.oReady.notify_all();
+         }
+      }
+      m_vecLinks.clear();
+      vecThreads.swap(m_vecThreads);
+   }
+   for (auto& oThread : vecThreads)
+      oThread.join();
+}
+
+void CNetworkEmulator::AcceptLoop()
+{
+   while (m_bRunning)
+   {
+      pollfd oPoll { m_iListener, POLLIN, 0 };
+      if (poll(&oPoll, 1, 100) != 1)
+         continue;
+
+      const int iClient = accept(m_iListener, nullptr, nullptr);
+      if (iClient < 0)
+         continue;
+
+      /* the target is local: a blocking connect is quick */
+      addrinfo oHints;
+      std::memset(&oHints, 0, sizeof(oHints));
+      oHints.ai_family = AF_UNSPEC;
+      oHints.ai_socktype = SOCK_STREAM;
+      addrinfo* pResult = nullptr;
+      int iServer = -1;
+      if (getaddrinfo(m_strHost.c_str(), std::to_string(m_uTargetPort).c_str(), &oHints, &pResult) == 0)
+      {
+         for (addrinfo* pInfo = pResult; pInfo != nullptr && iServer < 0; pInfo = pInfo->ai_next)
+         {
+            iServer = socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+            if (iServer >= 0 && connect(iServer, pInfo->ai_addr, pInfo->ai_addrlen) != 0)
+            {
+               close(iServer);
+               iServer = -1;
+            }
+         }
+         freeaddrinfo(pResult);
+      }
+      if (iServer < 0)
+      {
+         close(iClient);
+         continue;
+      }
+
+      /* the delays are ours, Nagle would add its own */
+      const int iNoDelay = 1;
+      setsockopt(iClient, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+      setsockopt(iServer, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+
+      const uint64_t uConnection = m_oStats.uConnections++;
+      std::shared_ptr<Link> pLink = std::make_shared<Link>();
+      pLink->aiSocket[0] = iClient;
+      pLink->aiSocket[1] = iServer;
+      for (int iDirection = 0; iDirection < 2; ++iDirection)
+      {
+         std::seed_seq oSeed { m_oProfile.uSeed, static_cast<unsigned>(uConnection), static_cast<unsigned>(iDirection) };
+         pLink->aoDirection[iDirection].oRandom.seed(oSeed);
+      }
+
+      std::lock_guard<std::mutex> oLock(m_oLinkLock);
+      m_vecLinks.push_back(pLink);
+      for (int iDirection = 0; iDirection < 2; ++iDirection)
+      {
+         m_vecThreads.emplace_back(&CNetworkEmulator::Pump, this, pLink, iDirection);
+         m_vecThreads.emplace_back(&CNetworkEmulator::Deliver, this, pLink, iDirection);
+      }
+   }
+}
+
+void CNetworkEmulator::Pump(std::shared_ptr<Link> pLink, int iDirection)
+{
+   Link::Direction& oDirection = pLink->aoDirection[iDirection];
+   const int iFrom = pLink->aiSocket[iDirection];
+   std::string strBuffer(CHUNK_SIZE, '\0');
+
+   for (;;)
+   {
+      const ssize_t iRead = recv(iFrom, &strBuffer[0], strBuffer.size(), 0);
+      if (iRead < 0 && errno == EINTR)
+         continue;
+
+      std::lock_guard<std::mutex> oLock(oDirection.oLock);
+      if (iRead <= 0)
+      {
+         oDirection.bEnd = true;
+         oDirection.oReady.notify_all();
+         return;
+      }
+
+      /* serialization on the sender's link, then propagation; mt19937 output
+      * is fully specified, unlike the standard distributions */
+      const Clock::time_point tNow = Clock::now();
+      std::chrono::microseconds oDelay(m_oProfile.uRttMs * 500);
+      if (m_oProfile.uJitterMs != 0)
+      {
+         const int64_t iJitter = static_cast<int64_t>(oDirection.oRandom() % (2 * m_oProfile.uJitterMs * 1000 + 1)) -
+                                 static_cast<int64_t>(m_oProfile.uJitterMs) * 1000;
+         oDelay = std::max(std::chrono::microseconds(0), oDelay + std::chrono::microseconds(iJitter));
+      }
+      if (m_oProfile.uStallPerMille != 0 && oDirection.oRandom() % 1000 < m_oProfile.uStallPerMille)
+      {
+         oDelay += std::chrono::milliseconds(m_oProfile.uStallMs);
+         ++m_oStats.uStalls;
+      }
+
+      oDirection.tSerialized = std::max(oDirection.tSerialized, tNow);
+      if (m_oProfile.uBandwidth != 0)
+         oDirection.tSerialized += std::chrono::microseconds(static_cast<uint64_t>(iRead) * 1000000 / m_oProfile.uBandwidth);
+
+      /* TCP keeps the order: a chunk never overtakes the one before it */
+      oDirection.tLastRelease = std::max(oDirection.tLastRelease, oDirection.tSerialized + oDelay);
+      oDirection.queChunks.push_back(Link::Chunk { oDirection.tLastRelease, strBuffer.substr(0, static_cast<size_t>(iRead)) });
+      oDirection.oReady.notify_all();
+   }
+}
+
+void CNetworkEmulator::Deliver(std::shared_ptr<Link> pLink, int iDirection)
+{
+   Link::Direction& oDirection = pLink->aoDirection[iDirection];
+   const int iTo = pLink->aiSocket[1 - iDirection];
+
+   std::unique_lock<std::mutex> oLock(oDirection.oLock);
+   for (;;)
+   {
+      oDirection.oReady.wait(oLock, [&]() { return !oDirection.queChunks.empty() || oDirection.bEnd || !m_bRunning; });
+      if (!m_bRunning)
+         return;
+      if (oDirection.queChunks.empty())
+      {
+         shutdown(iTo, SHUT_WR); // pass the end of stream on
+         return;
+      }
+
+      const Clock::time_point tRelease = oDirection.queChunks.front().tRelease;
+      if (oDirection.oReady.wait_until(oLock, tRelease, [this]() { return !m_bRunning; }))
+         return;
+
+      const std::string strData = std::move(oDirection.queChunks.front().strData);
+      oDirection.queChunks.pop_front();
+      oLock.unlock();
+
+      (iDirection == 0 ? m_oStats.uBytesToServer : m_oStats.uBytesToClient) += strData.size();
+      const char* pData = strData.data();
+      size_t uSize = strData.size();
+      while (uSize > 0)
+      {
+         const ssize_t iSent = send(iTo, pData, uSize, MSG_NOSIGNAL);
+         if (iSent <= 0)
+         {
+            if (iSent < 0 && errno == EINTR)
+               continue;
+            /* the receiver is gone: stop reading from the sender too */
+            shutdown(pLink->aiSocket[iDirection], SHUT_RDWR);
+            return;
+         }
+         pData += iSent;
+         uSize -= static_cast<size_t>(iSent);
+      }
+      oLock.lock();
+   }
+}
+
+#endif
@@ -0,0 +1,87 @@
+/*
+* @file NetworkEmulator.h
+* @brief TCP relay on loopback adding latency, jitter, bandwidth caps and stalls
+*
+* Written by acetone in 2023 for QtEmailFetcher
+*/
+
+#ifndef INCLUDE_NETWORKEMULATOR_H_
+#define INCLUDE_NETWORKEMULATOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Loopback round trips cost nothing, which hides exactly what dominates a
+* real IMAP session. The emulator listens on 127.0.0.1 and relays every
+* accepted connection to a target, delaying each chunk in each direction:
+*
+*  - half the RTT plus a uniform jitter of +-uJitterMs,
+*  - serialization at uBandwidth bytes per second (0: unlimited),
+*  - with probability uStallPerMille / 1000 per chunk, uStallMs more.
+*
+* Bytes keep their order, as on a TCP connection. Every direction of every
+* connection draws from its own generator seeded from uSeed and the
+* connection number, so a run with the same seed and the same traffic sees
+* the same delays. */
+class CNetworkEmulator
+{
+public:
+   struct Profile
+   {
+      unsigned uRttMs = 0;
+      unsigned uJitterMs = 0;
+      uint64_t uBandwidth = 0;     // bytes per second and direction, 0 unlimited
+      unsigned uStallPerMille = 0;
+      unsigned uStallMs = 0;
+      unsigned uSeed = 1;
+
+      inline bool IsTransparent() const
+      { return uRttMs == 0 && uJitterMs == 0 && uBandwidth == 0 && (uStallPerMille == 0 || uStallMs == 0); }
+   };
+
+   struct Stats
+   {
+      std::atomic<uint64_t> uConnections{0};
+      std::atomic<uint64_t> uBytesToServer{0};
+      std::atomic<uint64_t> uBytesToClient{0};
+      std::atomic<uint64_t> uStalls{0};
+   };
+
+   explicit CNetworkEmulator(const Profile& oProfile);
+   ~CNetworkEmulator();
+
+   CNetworkEmulator(const CNetworkEmulator&) = delete;
+   CNetworkEmulator& operator=(const CNetworkEmulator&) = delete;
+
+   /* relays 127.0.0.1:GetPort() to strHost:uPort */
+   bool Start(const std::string& strHost, uint16_t uPort);
+   void Stop();
+   inline uint16_t GetPort() const { return m_uPort; }
+   inline const Stats& GetStats() const { return m_oStats; }
+
+private:
+   struct Link;
+
+   void AcceptLoop();
+   void Pump(std::shared_ptr<Link> pLink, int iDirection);
+   void Deliver(std::shared_ptr<Link> pLink, int iDirection);
+
+   const Profile            m_oProfile;
+   std::string              m_strHost;
+   uint16_t                 m_uTargetPort = 0;
+   int                      m_iListener = -1;
+   uint16_t                 m_uPort = 0;
+   std::atomic<bool>        m_bRunning{false};
+   Stats                    m_oStats;
+   std::thread              m_oAcceptThread;
+   std::mutex               m_oLinkLock;
+   std::vector<std::weak_ptr<Link>> m_vecLinks;
+   std::vector<std::thread> m_vecThreads;
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "documentcache.h"
+
+// Bookkeeping that is not visible in the byte arrays: QString/QList headers,
+// part objects and the cache node itself
+constexpr qint64 DOCUMENT_OVERHEAD = 512;
+constexpr qint64 PART_OVERHEAD = 192;
+
+DocumentCache::DocumentCache(qint64 budgetBytes) :
+    m_budget(budgetBytes)
+{
+
+}
+
+QSharedPointer<EmailDocument> DocumentCache::get(const Key &key, EmailDocument::ParseMode mode, const Loader &load)
+{
+    QMutexLocker locker(&m_mutex);
+
+    QSharedPointer<Flight> flight;
+    bool coalesced = false;
+    for (;;)
+    {
+        auto iter = m_entries.find(key);
+        if (iter != m_entries.end() and iter.value()->document->parseMode() >= mode)
+        {
+            m_lru.splice(m_lru.begin(), m_lru, iter.value());
+            if (not coalesced) ++m_stats.hits;
+            return iter.value()->document;
+        }
+
+        flight = m_inFlight.value(key);
+        if (flight.isNull()) break;
+
+        if (not coalesced) ++m_stats.coalesced;
+        coalesced = true;
+        while (not flight->finished) flight->done.wait(&m_mutex);
+        if (not flight->result.isNull() and flight->result->parseMode() >= mode)
+        {
+            return flight->result;
+        }
+        // The shared load failed or went shallower than needed: another waiter
+        // may already be loading deeper, join it rather than loading again
+    }
+
+    ++m_stats.misses;
+    flight.reset(new Flight);
+    m_inFlight.insert(key, flight);
+
+    locker.unlock();
+    const QSharedPointer<EmailDocument> document = load();
+    locker.relock();
+
+    flight->result = document;
+    flight->finished = true;
+    if (m_inFlight.value(key) == flight)
+    {
+        m_inFlight.remove(key);
+    }
+    flight->done.wakeAll();
+
+    if (not document.isNull())
+    {
+        insert(key, document);
+    }
+    return document;
+}
+
+void DocumentCache::remove(const Key &key)
+{
+    QMutexLocker locker(&m_mutex);
+    auto iter = m_entries.find(key);
+    if (iter == m_entries.end()) return;
+
+    m_stats.retainedBytes -= iter.value()->bytes;
+    m_lru.erase(iter.value());
+    m_entries.erase(iter);
+}
+
+void DocumentCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_lru.clear();
+    m_entries.clear();
+    m_stats.retainedBytes = 0;
+}
+
+void DocumentCache::setBudget(qint64 budgetBytes)
+{
+    QMutexLocker locker(&m_mutex);
+    m_budget = budgetBytes;
+    evict();
+}
+
+qint64 DocumentCache::budget() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_budget;
+}
+
+DocumentCache::Stats DocumentCache::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    Stats result = m_stats;
+    result.documents = m_entries.size();
+    return result;
+}
+
+qint64 DocumentCache::retainedBytes(const EmailDocument &document)
+{
+    qint64 bytes = DOCUMENT_OVERHEAD + document.rawData().size();
+    for (const auto& part: document.payload())
+    {
+        bytes += PART_OVERHEAD; // raw slices are views into the message
+        // Undecoded parts are charged as if decoded: decode() may run after insertion
+        if (part->isDecoded())
+        {
+            bytes += part->content().size();
+        }
+        else if (not part->contentType().isMultipart())
+        {
+            const qint64 size = part->rawSize();
+            bytes += part->transferEncoding() == EmailDocumentEntry::TransferEncoding::base64 ? size / 4 * 3 : size;
+        }
+    }
+    return bytes;
+}
+
+void DocumentCache::insert(const Key &key, const QSharedPointer<EmailDocument> &document)
+{
+    auto iter = m_entries.find(key);
+    if (iter != m_entries.end())
+    {
+        m_stats.retainedBytes -= iter.value()->bytes;
+        m_lru.erase(iter.value());
+        m_entries.erase(iter);
+    }
+
+    const qint64 bytes = retainedBytes(*document);
+    if (bytes > m_budget) return; // would flush everything else and still not fit
+
+    m_lru.push_front(Entry {key, document, bytes});
+    m_entries.insert(key, m_lru.begin());
+    m_stats.retainedBytes += bytes;
+    evict();
+}
+
+void DocumentCache::evict()
+{
+    while (m_stats.retainedBytes > m_budget and not m_lru.empty())
+    {
+        const Entry& victim = m_lru.back();
+        m_stats.retainedBytes -= victim.bytes;
+        m_entries.remove(victim.key);
+        m_lru.pop_back();
+        ++m_stats.evictions;
+    }
+}
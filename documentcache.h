@@ -0,0 +1,93 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include "emaildocument.h"
+#include "messagestore.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QWaitCondition>
+
+#include <functional>
+#include <list>
+
+/*
+ * In-process LRU cache of parsed documents keyed like the message store, by
+ * folder, UIDVALIDITY and UID.
+ *
+ * The budget is measured in retained bytes: the raw message and every part's
+ * decoded content (parts' raw slices are views into the message), counted
+ * when the document is stored. Parts
+ * not decoded yet are charged their estimated decoded size up front, so a
+ * later decode() does not grow the document past what it was charged.
+ * Documents are shared between callers, so they must be treated as read-only;
+ * EmailDocumentEntry::decode() is the exception and is safe to call from any
+ * of them. Concurrent get() calls for the same key share one loader run
+ * (single-flight).
+ */
+class DocumentCache
+{
+public:
+    typedef MessageStore::Key Key;
+    typedef std::function<QSharedPointer<EmailDocument>()> Loader;
+
+    struct Stats
+    {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 coalesced = 0;
+        quint64 evictions = 0;
+        qint64 retainedBytes = 0;
+        int documents = 0;
+    };
+
+    explicit DocumentCache(qint64 budgetBytes = 256ll * 1024 * 1024);
+
+    DocumentCache(const DocumentCache&) = delete;
+    DocumentCache& operator=(const DocumentCache&) = delete;
+
+    /* returns the cached document when it was parsed at least as deep as mode,
+     * otherwise runs load() once for all concurrent callers and caches the result */
+    QSharedPointer<EmailDocument> get(const Key& key, EmailDocument::ParseMode mode, const Loader& load);
+
+    void remove(const Key& key);
+    void clear();
+
+    void setBudget(qint64 budgetBytes);
+    qint64 budget() const;
+    Stats stats() const;
+
+    static qint64 retainedBytes(const EmailDocument& document);
+
+private:
+    struct Entry
+    {
+        Key key;
+        QSharedPointer<EmailDocument> document;
+        qint64 bytes;
+    };
+
+    struct Flight
+    {
+        QWaitCondition done;
+        QSharedPointer<EmailDocument> result;
+        bool finished = false;
+    };
+
+    void insert(const Key& key, const QSharedPointer<EmailDocument>& document);
+    void evict();
+
+    qint64 m_budget;
+    std::list<Entry> m_lru; // most recently used first
+    QHash<Key, std::list<Entry>::iterator> m_entries;
+    QHash<Key, QSharedPointer<Flight>> m_inFlight;
+
+    Stats m_stats;
+    mutable QMutex m_mutex;
+};
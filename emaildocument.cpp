@@ -5,9 +5,14 @@
  */
 
 #include "emaildocument.h"
+#include "tracing.h"
 
 #include <QDebug>
-#include <QRegularExpression>
+#include <QPair>
+#include <QTextCodec>
+#include <QtEndian>
+
+#include <cstring>
 
 EmailDocument::EmailDocument()
 {
@@ -17,12 +22,257 @@ EmailDocument::EmailDocument()
 enum class ParseState {
     subject,
     from,
+    to,
+    cc,
+    bcc,
+    replyTo,
     other
 };
 
-void EmailDocument::parse(const QByteArray &data)
+namespace {
+
+struct DecodeTable
+{
+    quint8 value[256];
+};
+
+constexpr quint8 INVALID = 0xFF;
+
+constexpr DecodeTable makeBase64Table()
+{
+    DecodeTable table {};
+    for (int i = 0; i < 256; ++i) table.value[i] = INVALID;
+    for (int i = 0; i < 26; ++i)
+    {
+        table.value['A' + i] = static_cast<quint8>(i);
+        table.value['a' + i] = static_cast<quint8>(26 + i);
+    }
+    for (int i = 0; i < 10; ++i) table.value['0' + i] = static_cast<quint8>(52 + i);
+    table.value['+'] = 62;
+    table.value['/'] = 63;
+    return table;
+}
+
+constexpr DecodeTable makeHexTable()
+{
+    DecodeTable table {};
+    for (int i = 0; i < 256; ++i) table.value[i] = INVALID;
+    for (int i = 0; i < 10; ++i) table.value['0' + i] = static_cast<quint8>(i);
+    for (int i = 0; i < 6; ++i)
+    {
+        table.value['A' + i] = static_cast<quint8>(10 + i);
+        table.value['a' + i] = static_cast<quint8>(10 + i);
+    }
+    return table;
+}
+
+constexpr DecodeTable BASE64_TABLE = makeBase64Table();
+constexpr DecodeTable HEX_TABLE = makeHexTable();
+
+inline quint8 base64Value(char c) { return BASE64_TABLE.value[static_cast<quint8>(c)]; }
+inline quint8 hexValue(char c)    { return HEX_TABLE.value[static_cast<quint8>(c)]; }
+
+inline bool isBlank(char c)
+{
+    return c == ' ' or c == '\t' or c == '\r' or c == '\n';
+}
+
+bool equalsNoCase(const char* a, qsizetype aSize, const char* b, qsizetype bSize)
+{
+    if (aSize != bSize) return false;
+    for (qsizetype i = 0; i < aSize; ++i)
+    {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+    }
+    return true;
+}
+
+// RFC 2047 encoded-word: =?charset[*language]?B|Q?encoded-text?=
+struct EncodedWord
+{
+    const char* charset = nullptr;
+    qsizetype charsetSize = 0;
+    char encoding = 0;
+    const char* text = nullptr;
+    const char* textEnd = nullptr;
+    const char* end = nullptr;
+};
+
+// Every scan below stops at the next '?', so each byte of the header is
+// looked at by a bounded number of candidates and decoding stays linear.
+bool matchEncodedWord(const char* pos, const char* end, EncodedWord& word)
+{
+    if (end - pos < 8 or pos[0] != '=' or pos[1] != '?') return false;
+
+    const char* charset = pos + 2;
+    const char* cursor = charset;
+    while (cursor < end and *cursor != '?' and not isBlank(*cursor)) ++cursor;
+    if (cursor == charset or end - cursor < 4 or *cursor != '?') return false;
+
+    const char* language = static_cast<const char*>(memchr(charset, '*', static_cast<size_t>(cursor - charset)));
+    word.charset = charset;
+    word.charsetSize = (language != nullptr ? language : cursor) - charset;
+
+    word.encoding = static_cast<char>(cursor[1] & ~0x20);
+    if ((word.encoding != 'B' and word.encoding != 'Q') or cursor[2] != '?') return false;
+
+    word.text = cursor + 3;
+    const char* textEnd = static_cast<const char*>(memchr(word.text, '?', static_cast<size_t>(end - word.text)));
+    if (textEnd == nullptr or textEnd + 1 >= end or textEnd[1] != '=') return false;
+
+    word.textEnd = textEnd;
+    word.end = textEnd + 2;
+    return true;
+}
+
+void appendBase64(const EncodedWord& word, QByteArray& out)
+{
+    const qsizetype offset = out.size();
+    out.resize(offset + (word.textEnd - word.text) * 3 / 4 + 3);
+    char* dst = out.data() + offset;
+
+    quint32 accumulator = 0;
+    int bits = 0;
+    for (const char* src = word.text; src < word.textEnd; ++src)
+    {
+        const quint8 value = base64Value(*src);
+        if (value == INVALID) continue; // padding, folding whitespace or garbage
+        accumulator = (accumulator << 6) | value;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            *dst++ = static_cast<char>(accumulator >> bits);
+            accumulator &= (1u << bits) - 1;
+        }
+    }
+    out.resize(dst - out.constData());
+}
+
+void appendQuotedPrintable(const EncodedWord& word, QByteArray& out)
+{
+    const qsizetype offset = out.size();
+    out.resize(offset + (word.textEnd - word.text));
+    char* dst = out.data() + offset;
+
+    for (const char* src = word.text; src < word.textEnd; ++src)
+    {
+        const char c = *src;
+        if (c == '_')
+        {
+            *dst++ = ' ';
+        }
+        else if (c == '=')
+        {
+            // A lone '=' (soft break or broken encoder output) carries no data
+            if (word.textEnd - src > 2 and hexValue(src[1]) != INVALID and hexValue(src[2]) != INVALID)
+            {
+                *dst++ = static_cast<char>(hexValue(src[1]) << 4 | hexValue(src[2]));
+                src += 2;
+            }
+        }
+        else if (c != '\r' and c != '\n')
+        {
+            *dst++ = c;
+        }
+    }
+    out.resize(dst - out.constData());
+}
+
+void appendInCharset(const char* charset, qsizetype charsetSize, const QByteArray& bytes, QByteArray& out)
+{
+    if (bytes.isEmpty()) return;
+
+    if (equalsNoCase(charset, charsetSize, "utf-8", 5) or
+        equalsNoCase(charset, charsetSize, "utf8", 4) or
+        equalsNoCase(charset, charsetSize, "us-ascii", 8))
+    {
+        out += bytes;
+        return;
+    }
+
+    QTEMAILFETCHER_TRACE_SCOPE("decode.charset");
+    QTextCodec* codec = QTextCodec::codecForName(QByteArray(charset, static_cast<int>(charsetSize)));
+    if (codec == nullptr)
+    {
+        out += bytes;
+        return;
+    }
+    out += codec->toUnicode(bytes).toUtf8();
+}
+
+// Decodes every encoded-word in [begin, end) to UTF-8. Linear whitespace
+// between two adjacent encoded-words is dropped as RFC 2047 section 6.2 asks,
+// and consecutive words in one charset are transcoded together so multibyte
+// characters split across words survive.
+bool decodeEncodedWords(const char* begin, const char* end, QByteArray& out)
+{
+    out.reserve(end - begin);
+
+    QByteArray pending;
+    const char* pendingCharset = nullptr;
+    qsizetype pendingCharsetSize = 0;
+
+    const char* literal = begin;
+    bool found = false;
+
+    for (const char* pos = begin; pos < end; )
+    {
+        pos = static_cast<const char*>(memchr(pos, '=', static_cast<size_t>(end - pos)));
+        if (pos == nullptr) break;
+
+        EncodedWord word;
+        if (not matchEncodedWord(pos, end, word))
+        {
+            ++pos;
+            continue;
+        }
+
+        bool adjacent = found;
+        for (const char* c = literal; adjacent and c < pos; ++c)
+        {
+            adjacent = isBlank(*c);
+        }
+
+        if (not adjacent or not equalsNoCase(pendingCharset, pendingCharsetSize, word.charset, word.charsetSize))
+        {
+            appendInCharset(pendingCharset, pendingCharsetSize, pending, out);
+            pending.clear();
+            pendingCharset = word.charset;
+            pendingCharsetSize = word.charsetSize;
+        }
+        if (not adjacent)
+        {
+            out.append(literal, static_cast<int>(pos - literal));
+        }
+
+        if (word.encoding == 'B')
+        {
+            appendBase64(word, pending);
+        }
+        else
+        {
+            appendQuotedPrintable(word, pending);
+        }
+
+        found = true;
+        literal = pos = word.end;
+    }
+
+    if (not found) return false;
+
+    appendInCharset(pendingCharset, pendingCharsetSize, pending, out);
+    out.append(literal, static_cast<int>(end - literal));
+    return true;
+}
+
+} // namespace
+
+void EmailDocument::parse(const QByteArray &data, ParseMode mode)
 {
+    QTEMAILFETCHER_TRACE_SCOPE("parse");
     m_rawData = data;
+    m_parseMode = mode;
 
     QTextStream stream(data);
     QString line = stream.readLine();
@@ -30,55 +280,52 @@ void EmailDocument::parse(const QByteArray &data)
     QByteArray buffer;
     ParseState state = ParseState::other;
 
-    for (; not stream.atEnd(); line = stream.readLine())
+    auto finishHeader = [this, &buffer, &state]()
     {
         if (state == ParseState::subject)
         {
-            if (not line.startsWith('\t') and not line.startsWith(' '))
-            {
-                m_subject = buffer.trimmed();
-                while (m_subject.contains("  ")) m_subject.replace("  ", " ");
-                buffer.clear();
-                state = ParseState::other;
-            }
-            else
-            {
-                QByteArray tmp = decodeMimeString(line);
-                if (tmp.isEmpty())
-                {
-                    buffer += " " + line.toUtf8().trimmed();
-                }
-                else
-                {
-                    buffer += " " + tmp.trimmed();
-                }
-                continue;
-            }
+            QByteArray decoded = decodeMimeString(buffer);
+            m_subject = (decoded.isEmpty() ? buffer : decoded).simplified();
         }
         else if (state == ParseState::from)
         {
-            if (not line.startsWith('\t') and not line.startsWith(' '))
-            {
-                m_from.address = extractAddress(buffer);
-                m_from.name = extractName(buffer);
-                buffer.clear();
-                state = ParseState::other;
-            }
-            else
+            const auto from = parseAddressList(buffer);
+            m_from = from.isEmpty() ? Destination() : from.first();
+        }
+        else if (state == ParseState::to)      m_to = parseAddressList(buffer);
+        else if (state == ParseState::cc)      m_cc = parseAddressList(buffer);
+        else if (state == ParseState::bcc)     m_bcc = parseAddressList(buffer);
+        else if (state == ParseState::replyTo) m_replyTo = parseAddressList(buffer);
+
+        buffer.clear();
+        state = ParseState::other;
+    };
+
+    for (; not stream.atEnd(); line = stream.readLine())
+    {
+        if (state != ParseState::other)
+        {
+            if (line.startsWith('\t') or line.startsWith(' '))
             {
-                buffer += line.trimmed().toUtf8();
+                // Unfold first: encoded-words split over lines are joined by the decoder
+                buffer += " " + line.toUtf8().trimmed();
+                continue;
             }
+            finishHeader();
         }
 
         if (line.isEmpty())
         {
-            parseBody();
+            if (mode != ParseMode::envelope)
+            {
+                parseBody();
+            }
             return;
         }
 
         if (line.startsWith("Return-Path:", Qt::CaseInsensitive))
         {
-            m_returnPath = extractAddress(line.remove(0,11));
+            m_returnPath = extractAddress(line.remove(0,12));
         }
 
         else if (line.startsWith("From:", Qt::CaseInsensitive))
@@ -89,217 +336,775 @@ void EmailDocument::parse(const QByteArray &data)
 
         else if (line.startsWith("To:", Qt::CaseInsensitive))
         {
-            m_to.address = extractAddress(line.remove(0,3));
-            m_to.name = extractName(line);
+            buffer = line.remove(0,3).trimmed().toUtf8();
+            state = ParseState::to;
         }
 
-        else if (line.startsWith("Subject:", Qt::CaseInsensitive))
+        else if (line.startsWith("Cc:", Qt::CaseInsensitive))
         {
-            buffer = decodeMimeString(line);
-            if (buffer.isEmpty()) // not encoded or really empty
-            {
-                buffer = line.remove(0, 9).toUtf8().trimmed();
-            }
+            buffer = line.remove(0,3).trimmed().toUtf8();
+            state = ParseState::cc;
+        }
 
-            if (state != ParseState::subject)
-            {
-                state = ParseState::subject;
-            }
+        else if (line.startsWith("Bcc:", Qt::CaseInsensitive))
+        {
+            buffer = line.remove(0,4).trimmed().toUtf8();
+            state = ParseState::bcc;
+        }
+
+        else if (line.startsWith("Reply-To:", Qt::CaseInsensitive))
+        {
+            buffer = line.remove(0,9).trimmed().toUtf8();
+            state = ParseState::replyTo;
+        }
+
+        else if (line.startsWith("Subject:", Qt::CaseInsensitive))
+        {
+            buffer = line.remove(0, 8).toUtf8().trimmed();
+            state = ParseState::subject;
         }
 
         else if (line.startsWith("Date:"))
         {
-            m_dateTime = decodeTimeString(line.remove(0,5).trimmed());
+            m_dateTime = decodeTimeString(line.remove(0,5).toUtf8());
         }
     }
+
+    finishHeader();
 }
 
 QByteArray EmailDocument::decodeMimeString(const QString &mimeString)
 {
-    int charset_pos = mimeString.indexOf('?');
-    if (charset_pos < 0)
+    return decodeMimeString(mimeString.toUtf8());
+}
+
+QByteArray EmailDocument::decodeMimeString(const QByteArray &mimeString)
+{
+    QByteArray result;
+    if (not decodeEncodedWords(mimeString.constData(), mimeString.constData() + mimeString.size(), result))
     {
-//        qDebug() << __FUNCTION__ << "Missing Q codec separator for charset (first)";
         return QByteArray();
     }
+    return result;
+}
+
+namespace {
+
+// RFC 5322 section 3.4 address-list tokenizer. One pass over the header;
+// the scratch buffers are reused between mailboxes, so the only
+// allocations are the resulting QStrings.
+class AddressListParser
+{
+public:
+    AddressListParser(const char* begin, const char* end, QVector<EmailDocument::Destination>& result) :
+        m_pos(begin), m_end(end), m_result(result)
+    {}
 
-    int method_pos = mimeString.indexOf('?', charset_pos+1);
-    if (method_pos < 0)
+    void run()
     {
-//        qDebug() << __FUNCTION__ << "Missing Q codec separator for charset (second)";
-        return QByteArray();
+        while (m_pos < m_end)
+        {
+            const char c = *m_pos;
+            if (isBlank(c))
+            {
+                m_space = true;
+                ++m_pos;
+            }
+            else if (c == '(')
+            {
+                readComment();
+            }
+            else if (c == '"')
+            {
+                readQuotedString(m_phrase, true);
+            }
+            else if (c == '<')
+            {
+                readAngleAddress();
+            }
+            else if (c == ':')
+            {
+                // "group-name:" - members follow, the name itself is not a recipient
+                resetMailbox();
+                ++m_pos;
+            }
+            else if (c == ',' or c == ';')
+            {
+                finishMailbox();
+                ++m_pos;
+            }
+            else
+            {
+                readAtom();
+            }
+        }
+        finishMailbox();
     }
 
-    QString charset = mimeString.mid(charset_pos + 1, method_pos - charset_pos - 1).toUpper();
-    if (charset.isEmpty())
+private:
+    static bool isSpecial(char c)
     {
-//        qDebug() << __FUNCTION__ << "Missing Q codec charset";
-        return QByteArray();
+        return c == '(' or c == ')' or c == '<' or c == '>' or c == ',' or
+               c == ';' or c == ':' or c == '"' or isBlank(c);
     }
 
-    if (mimeString.size() <= method_pos+1)
+    void appendWord(QByteArray& target, const char* word, qsizetype size)
     {
-        qDebug() << __FUNCTION__ << "Input string too small";
-        return QByteArray();
+        if (m_space and not target.isEmpty()) target += ' ';
+        target.append(word, static_cast<int>(size));
+        m_space = false;
     }
-    QChar encodeType = mimeString.at(method_pos+1).toUpper();
 
-    bool base64 = false;
-    if (encodeType == 'B')
+    void readAtom()
     {
-        base64 = true;
+        const char* begin = m_pos;
+        while (m_pos < m_end and not isSpecial(*m_pos)) ++m_pos;
+        if (m_pos == begin) // stray '>' or ')'
+        {
+            ++m_pos;
+            return;
+        }
+        appendWord(m_phrase, begin, m_pos - begin);
     }
-    else if (encodeType != 'Q')
+
+    void readQuotedString(QByteArray& target, bool separate)
     {
-//        qDebug() << __FUNCTION__ << "Unsupported encoding type:" << encodeType;
-        return QByteArray();
+        ++m_pos; // opening quote
+        if (separate and m_space and not target.isEmpty()) target += ' ';
+        m_space = false;
+        for (; m_pos < m_end and *m_pos != '"'; ++m_pos)
+        {
+            if (*m_pos == '\\' and m_pos + 1 < m_end) ++m_pos;
+            else if (*m_pos == '\r' or *m_pos == '\n') continue;
+            target += *m_pos;
+        }
+        if (m_pos < m_end) ++m_pos; // closing quote
     }
 
-    int content_pos = mimeString.indexOf('?', method_pos + 1);
-    if (content_pos < 0)
+    void readComment()
     {
-//        qDebug() << __FUNCTION__ << "Missing Q codec separator for content (first)";
-        return QByteArray();
+        int depth = 0;
+        if (not m_comment.isEmpty()) m_comment += ' ';
+        for (; m_pos < m_end; ++m_pos)
+        {
+            const char c = *m_pos;
+            if (c == '(')
+            {
+                if (depth++ == 0) continue;
+            }
+            else if (c == ')')
+            {
+                if (--depth == 0)
+                {
+                    ++m_pos;
+                    break;
+                }
+            }
+            else if (c == '\\' and m_pos + 1 < m_end)
+            {
+                ++m_pos;
+            }
+            m_comment += *m_pos;
+        }
+        m_space = true;
     }
 
-    int content_end_pos = mimeString.indexOf('?', content_pos + 1);
-    if (content_end_pos < 0)
+    void readAngleAddress()
     {
-//        qDebug() << __FUNCTION__ << "Missing Q codec separator for content (second)";
-        return QByteArray();
+        m_angle = true;
+        m_address.clear();
+        ++m_pos; // '<'
+        while (m_pos < m_end and *m_pos != '>')
+        {
+            const char c = *m_pos;
+            if (c == '"')
+            {
+                m_address += '"';
+                readQuotedString(m_address, false);
+                m_address += '"';
+            }
+            else if (c == '(')
+            {
+                const QByteArray comment = m_comment;
+                readComment();
+                m_comment = comment;
+            }
+            else if (c == ':' and m_address.startsWith('@'))
+            {
+                m_address.clear(); // obs-route "@relay1,@relay2:"
+                ++m_pos;
+            }
+            else
+            {
+                if (not isBlank(c)) m_address += c;
+                ++m_pos;
+            }
+        }
+        if (m_pos < m_end) ++m_pos; // '>'
+        m_space = true;
+    }
+
+    void finishMailbox()
+    {
+        EmailDocument::Destination destination;
+        if (m_angle)
+        {
+            destination.address = QString::fromUtf8(m_address);
+            destination.name = decodedName(m_phrase.isEmpty() ? m_comment : m_phrase);
+        }
+        else if (not m_phrase.isEmpty())
+        {
+            // bare addr-spec, optionally followed by "(Display Name)"
+            m_phrase.replace(" ", "");
+            destination.address = QString::fromUtf8(m_phrase);
+            destination.name = decodedName(m_comment);
+        }
+
+        if (not destination.address.isEmpty())
+        {
+            m_result.push_back(destination);
+        }
+        resetMailbox();
     }
 
-    QString input = mimeString.mid(content_pos + 1, content_end_pos - content_pos - 1);
-    input.remove("\r");
-    input.remove("\n");
+    void resetMailbox()
+    {
+        m_phrase.resize(0);
+        m_address.resize(0);
+        m_comment.resize(0);
+        m_angle = false;
+        m_space = false;
+    }
 
-    if (base64)
+    static QString decodedName(const QByteArray& raw)
     {
-        QByteArray result = QByteArray::fromBase64(input.toUtf8());
-        QTextStream stream(result);
-        stream.setCodec(charset.toStdString().c_str());
-        return stream.readAll().toUtf8();
+        if (raw.isEmpty()) return QString();
+        const QByteArray decoded = EmailDocument::decodeMimeString(raw);
+        return QString::fromUtf8(decoded.isEmpty() ? raw : decoded).trimmed();
     }
 
-    while (input.contains("==")) input.remove("==");
+    const char* m_pos;
+    const char* m_end;
+    QVector<EmailDocument::Destination>& m_result;
+
+    QByteArray m_phrase;
+    QByteArray m_address;
+    QByteArray m_comment;
+    bool m_angle = false;
+    bool m_space = false;
+};
+
+} // namespace
+
+QVector<EmailDocument::Destination> EmailDocument::parseAddressList(const QByteArray &header)
+{
+    QVector<Destination> result;
+    AddressListParser(header.constData(), header.constData() + header.size(), result).run();
+    return result;
+}
+
+QString EmailDocument::extractAddress(const QString &string)
+{
+    const auto list = parseAddressList(string.toUtf8());
+    return list.isEmpty() ? QString() : list.first().address;
+}
+
+QString EmailDocument::extractName(const QString &string)
+{
+    const auto list = parseAddressList(string.toUtf8());
+    return list.isEmpty() ? QString() : list.first().name;
+}
+
+namespace {
+
+constexpr quint32 nameKey(char a, char b, char c = ' ')
+{
+    return static_cast<quint32>(static_cast<quint8>(a | 0x20)) << 16 |
+           static_cast<quint32>(static_cast<quint8>(b | 0x20)) << 8 |
+           static_cast<quint32>(static_cast<quint8>(c | 0x20));
+}
 
-    QByteArray decodedText;
+int monthFromKey(quint32 key)
+{
+    switch (key)
+    {
+    case nameKey('J','a','n'): return 1;
+    case nameKey('F','e','b'): return 2;
+    case nameKey('M','a','r'): return 3;
+    case nameKey('A','p','r'): return 4;
+    case nameKey('M','a','y'): return 5;
+    case nameKey('J','u','n'): return 6;
+    case nameKey('J','u','l'): return 7;
+    case nameKey('A','u','g'): return 8;
+    case nameKey('S','e','p'): return 9;
+    case nameKey('O','c','t'): return 10;
+    case nameKey('N','o','v'): return 11;
+    case nameKey('D','e','c'): return 12;
+    default: return 0;
+    }
+}
+
+// RFC 5322 section 4.3 obs-zone, offset in minutes
+bool obsoleteZoneOffset(quint32 key, int* minutes)
+{
+    switch (key)
+    {
+    case nameKey('U','T'):
+    case nameKey('G','M','T'): *minutes = 0;       return true;
+    case nameKey('E','S','T'): *minutes = -5 * 60; return true;
+    case nameKey('E','D','T'): *minutes = -4 * 60; return true;
+    case nameKey('C','S','T'): *minutes = -6 * 60; return true;
+    case nameKey('C','D','T'): *minutes = -5 * 60; return true;
+    case nameKey('M','S','T'): *minutes = -7 * 60; return true;
+    case nameKey('M','D','T'): *minutes = -6 * 60; return true;
+    case nameKey('P','S','T'): *minutes = -8 * 60; return true;
+    case nameKey('P','D','T'): *minutes = -7 * 60; return true;
+    default: return false;
+    }
+}
 
-    for (int i = 0; i < input.length(); i++) {
-        QChar c = input.at(i);
+inline bool isDigit(char c) { return c >= '0' and c <= '9'; }
+inline bool isAlpha(char c) { return (c | 0x20) >= 'a' and (c | 0x20) <= 'z'; }
 
-        if (c == '=' and input.length() > i+2)
+// CFWS: folding whitespace and (possibly nested) comments
+void skipCfws(const char*& pos, const char* end)
+{
+    int depth = 0;
+    for (; pos < end; ++pos)
+    {
+        const char c = *pos;
+        if (c == '(')
         {
-            QString hexCode = input.mid(i + 1, 2);
-            decodedText.push_back(QByteArray::fromHex(hexCode.toUtf8()));
-            i += 2;
+            ++depth;
         }
-        else
+        else if (depth > 0 and c == ')')
         {
-            decodedText.push_back(c.toLatin1());
+            --depth;
+        }
+        else if (depth > 0 and c == '\\' and pos + 1 < end)
+        {
+            ++pos;
+        }
+        else if (depth == 0 and not isBlank(c))
+        {
+            return;
         }
     }
+}
 
-    QTextStream stream(decodedText);
-    stream.setCodec(charset.toStdString().c_str());
-    return stream.readAll().toUtf8();
+int readNumber(const char*& pos, const char* end, int maxDigits, int* digits)
+{
+    int value = 0;
+    *digits = 0;
+    while (pos < end and isDigit(*pos) and *digits < maxDigits)
+    {
+        value = value * 10 + (*pos++ - '0');
+        ++*digits;
+    }
+    return value;
 }
 
-QString EmailDocument::extractAddress(const QString &string)
+quint32 readName(const char*& pos, const char* end, int* length)
+{
+    const char* begin = pos;
+    while (pos < end and isAlpha(*pos)) ++pos;
+    *length = static_cast<int>(pos - begin);
+    if (*length == 1) return nameKey(begin[0], ' ', ' ');
+    if (*length == 2) return nameKey(begin[0], begin[1]);
+    if (*length >= 3) return nameKey(begin[0], begin[1], begin[2]);
+    return 0;
+}
+
+// Days since 1970-01-01 of a proleptic Gregorian date
+qint64 daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    const qint64 era = (year >= 0 ? year : year - 399) / 400;
+    const int yearOfEra = static_cast<int>(year - era * 400);
+    const int dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+int daysInMonth(int year, int month)
 {
-    if (string.contains('<'))
+    static constexpr int DAYS[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (month == 2 and year % 4 == 0 and (year % 100 != 0 or year % 400 == 0)) return 29;
+    return DAYS[month - 1];
+}
+
+} // namespace
+
+bool EmailDocument::parseTimeString(const char *data, qsizetype size, qint64 *secsSinceEpoch, int *offsetFromUtc)
+{
+    const char* pos = data;
+    const char* end = data + size;
+    int digits = 0;
+    int length = 0;
+
+    // [ day-of-week "," ]
+    skipCfws(pos, end);
+    if (pos < end and isAlpha(*pos))
+    {
+        readName(pos, end, &length);
+        skipCfws(pos, end);
+        if (pos < end and *pos == ',') ++pos;
+        skipCfws(pos, end);
+    }
+
+    const int day = readNumber(pos, end, 2, &digits);
+    if (digits == 0) return false;
+    skipCfws(pos, end);
+
+    const int month = monthFromKey(readName(pos, end, &length));
+    if (month == 0 or length != 3) return false;
+    skipCfws(pos, end);
+
+    int year = readNumber(pos, end, 4, &digits);
+    if (digits < 2) return false;
+    if (digits == 2) year += year < 50 ? 2000 : 1900; // obs-year
+    else if (digits == 3) year += 1900;
+    skipCfws(pos, end);
+
+    const int hour = readNumber(pos, end, 2, &digits);
+    if (digits == 0) return false;
+    skipCfws(pos, end);
+    if (pos == end or *pos++ != ':') return false;
+    skipCfws(pos, end);
+
+    const int minute = readNumber(pos, end, 2, &digits);
+    if (digits == 0) return false;
+    skipCfws(pos, end);
+
+    int second = 0;
+    if (pos < end and *pos == ':')
+    {
+        ++pos;
+        skipCfws(pos, end);
+        second = readNumber(pos, end, 2, &digits);
+        if (digits == 0) return false;
+        skipCfws(pos, end);
+    }
+
+    if (day < 1 or day > daysInMonth(year, month) or hour > 23 or minute > 59 or second > 60)
     {
-        static const QRegularExpression rgxBegin("^.*<");
-        static const QRegularExpression rgxEnd(">.*$");
-        return QString(string).remove(rgxBegin).remove(rgxEnd).trimmed();
+        return false;
     }
-    else
+
+    // A missing or unknown zone is read as "-0000": UTC with no local information
+    int zoneMinutes = 0;
+    if (pos < end and (*pos == '+' or *pos == '-'))
     {
-        static const QRegularExpression rgx("^.* ");
-        return QString(string).remove(rgx);
+        const int sign = *pos++ == '-' ? -1 : 1;
+        const int zone = readNumber(pos, end, 4, &digits);
+        if (digits != 4 or zone % 100 > 59) return false;
+        zoneMinutes = sign * (zone / 100 * 60 + zone % 100);
     }
+    else if (pos < end and isAlpha(*pos))
+    {
+        const quint32 key = readName(pos, end, &length);
+        if (length > 3 or not obsoleteZoneOffset(key, &zoneMinutes))
+        {
+            zoneMinutes = 0; // military and unrecognized zones
+        }
+    }
+
+    *secsSinceEpoch = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second
+                      - zoneMinutes * 60;
+    *offsetFromUtc = zoneMinutes * 60;
+    return true;
 }
 
-QString EmailDocument::extractName(const QString &string)
+QDateTime EmailDocument::decodeTimeString(const QString &stringRFC822_1123)
 {
-    if (not string.contains('<') or not string.contains('>')) return QString();
+    return decodeTimeString(stringRFC822_1123.toUtf8());
+}
 
-    static const QRegularExpression rgx("<.*$");
-    QString raw = QString(string).remove(rgx).trimmed();
-    QString decoded = decodeMimeString(raw);
-    return decoded.isEmpty() ? raw : decoded;
+QDateTime EmailDocument::decodeTimeString(const QByteArray &stringRFC822_1123)
+{
+    qint64 secsSinceEpoch = 0;
+    int offsetFromUtc = 0;
+    if (not parseTimeString(stringRFC822_1123.constData(), stringRFC822_1123.size(), &secsSinceEpoch, &offsetFromUtc))
+    {
+        return QDateTime();
+    }
+    return QDateTime::fromSecsSinceEpoch(secsSinceEpoch, Qt::OffsetFromUTC, offsetFromUtc);
 }
 
-QDateTime EmailDocument::decodeTimeString(const QString &stringRFC822_1123)
+void EmailDocument::parseBody()
+{
+    QTEMAILFETCHER_TRACE_SCOPE("parse.body");
+    QSharedPointer<EmailDocumentEntry> entry(new EmailDocumentEntry(&m_content));
+    entry->parse(m_rawData, m_parseMode == ParseMode::full);
+
+    // Store only text/files, not a abstract structures
+    QList<QSharedPointer<EmailDocumentEntry>> parts;
+    parts.reserve(m_content.size() + 1);
+    if (not entry->contentType().isMultipart())
+    {
+        parts.push_back(entry); // main object to begin
+    }
+    for (const auto& part: m_content)
+    {
+        if (not part->contentType().isMultipart())
+        {
+            parts.push_back(part);
+        }
+    }
+    m_content = parts;
+}
+
+namespace {
+
+// Serialized document layout, all integers little-endian:
+//   header        HEADER_SIZE bytes, see serialize()
+//   fields        FIELD_COUNT string refs
+//   addresses     addressCount * ADDRESS_SIZE
+//   parts         partCount * PART_SIZE
+//   strings       UTF-8 blob the refs point into
+// A string ref is a (offset, size) pair of quint32 into the string blob.
+constexpr char IMAGE_MAGIC[4] = {'Q', 'E', 'F', 'D'};
+constexpr quint32 IMAGE_VERSION = 1;
+constexpr int HEADER_SIZE = 48;
+constexpr int STRING_REF_SIZE = 8;
+constexpr int FIELD_COUNT = 5; // subject, return path, comment, from address, from name
+constexpr int ADDRESS_SIZE = 4 + 2 * STRING_REF_SIZE;
+constexpr int PART_SIZE = 4 + 3 * STRING_REF_SIZE + 16;
+
+enum class AddressKind : quint8 { to, cc, bcc, replyTo };
+
+constexpr quint32 FLAG_DATE_VALID = 0x1;
+
+class ImageWriter
+{
+public:
+    void put8(quint8 value)   { m_tables += static_cast<char>(value); }
+    void put32(quint32 value) { putRaw(value); }
+    void put64(quint64 value) { putRaw(value); }
+
+    void putString(const QString& string)
+    {
+        const QByteArray utf8 = string.toUtf8();
+        put32(static_cast<quint32>(m_strings.size()));
+        put32(static_cast<quint32>(utf8.size()));
+        m_strings += utf8;
+    }
+
+    QByteArray finish() const { return m_tables + m_strings; }
+    qsizetype stringsSize() const { return m_strings.size(); }
+
+private:
+    template <typename T>
+    void putRaw(T value)
+    {
+        char buffer[sizeof(T)];
+        qToLittleEndian<T>(value, buffer);
+        m_tables.append(buffer, sizeof(T));
+    }
+
+    QByteArray m_tables;
+    QByteArray m_strings;
+};
+
+class ImageReader
 {
-    if (stringRFC822_1123.size() < 25) return QDateTime();
-    QString timeString (stringRFC822_1123);
+public:
+    ImageReader(const char* tables, const char* strings, quint32 stringsSize) :
+        m_pos(tables), m_strings(strings), m_stringsSize(stringsSize)
+    {}
+
+    quint8 get8()   { return static_cast<quint8>(*m_pos++); }
+    quint32 get32() { return getRaw<quint32>(); }
+    quint64 get64() { return getRaw<quint64>(); }
+    void skip(int bytes) { m_pos += bytes; }
 
-    timeString.remove(0,4); // "ddd,
-    int timeShortWordPos = timeString.indexOf('(');
-    if (timeShortWordPos > 0)
+    QString getString()
     {
-        timeString.remove(timeShortWordPos, timeString.size()-timeShortWordPos);
+        const quint32 offset = get32();
+        const quint32 size = get32();
+        if (offset > m_stringsSize or size > m_stringsSize - offset)
+        {
+            m_valid = false;
+            return QString();
+        }
+        return QString::fromUtf8(m_strings + offset, static_cast<int>(size));
     }
 
-    int plusPos = timeString.indexOf('+');
-    if (plusPos < 0 or plusPos >= timeString.size()+3) return QDateTime();
-    int receivedUtcOffset = timeString.mid(plusPos+1).trimmed().remove("0").toInt() * 60 * 60;
+    bool isValid() const { return m_valid; }
 
-    timeString.remove(plusPos-1, timeString.size()-plusPos+1);
+private:
+    template <typename T>
+    T getRaw()
+    {
+        const T value = qFromLittleEndian<T>(m_pos);
+        m_pos += sizeof(T);
+        return value;
+    }
+
+    const char* m_pos;
+    const char* m_strings;
+    const quint32 m_stringsSize;
+    bool m_valid = true;
+};
 
-    static const std::map<const char*, const char*> MONTH_CODES {
-        {"Jan", "01"},
-        {"Feb", "02"},
-        {"Mar", "03"},
-        {"Apr", "04"},
-        {"May", "05"},
-        {"Jun", "06"},
-        {"Jul", "07"},
-        {"Aug", "08"},
-        {"Sep", "09"},
-        {"Oct", "10"},
-        {"Nov", "11"},
-        {"Dec", "12"}
+} // namespace
+
+QByteArray EmailDocument::serialize() const
+{
+    const QList<QPair<AddressKind, const QVector<Destination>*>> addressLists {
+        {AddressKind::to, &m_to}, {AddressKind::cc, &m_cc},
+        {AddressKind::bcc, &m_bcc}, {AddressKind::replyTo, &m_replyTo}
     };
+    quint32 addressCount = 0;
+    for (const auto& list: addressLists) addressCount += static_cast<quint32>(list.second->size());
 
-    for (const auto& m: MONTH_CODES)
+    ImageWriter writer;
+    writer.put32(static_cast<quint32>(m_parseMode));
+    writer.put32(m_dateTime.isValid() ? FLAG_DATE_VALID : 0);
+    writer.put64(static_cast<quint64>(m_rawData.size()));
+    writer.put64(static_cast<quint64>(m_dateTime.isValid() ? m_dateTime.toSecsSinceEpoch() : 0));
+    writer.put32(static_cast<quint32>(m_dateTime.isValid() ? m_dateTime.offsetFromUtc() : 0));
+    writer.put32(addressCount);
+    writer.put32(static_cast<quint32>(m_content.size()));
+
+    writer.putString(m_subject);
+    writer.putString(m_returnPath);
+    writer.putString(m_comment);
+    writer.putString(m_from.address);
+    writer.putString(m_from.name);
+
+    for (const auto& list: addressLists)
     {
-        if (timeString.contains(m.first))
+        for (const auto& destination: *list.second)
         {
-            timeString.replace(m.first, m.second);
-            break;
+            writer.put8(static_cast<quint8>(list.first));
+            writer.put8(0);
+            writer.put8(0);
+            writer.put8(0);
+            writer.putString(destination.address);
+            writer.putString(destination.name);
         }
     }
 
-    auto result = QDateTime::fromString(timeString.trimmed(), "d MM yyyy hh:mm:ss");
-    result.setOffsetFromUtc(receivedUtcOffset);
-    return result;
+    for (const auto& part: m_content)
+    {
+        writer.put8(static_cast<quint8>(part->m_contentType.enumerate));
+        writer.put8(static_cast<quint8>(part->m_transferEncoding));
+        writer.put8(0);
+        writer.put8(0);
+        writer.putString(part->m_contentType.string);
+        writer.putString(part->m_name);
+        writer.putString(part->m_charset);
+        writer.put64(static_cast<quint64>(part->m_rawOffset));
+        writer.put64(static_cast<quint64>(part->m_rawData.size()));
+    }
+
+    QByteArray header(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    char buffer[4];
+    qToLittleEndian<quint32>(IMAGE_VERSION, buffer);
+    header.append(buffer, sizeof(buffer));
+    qToLittleEndian<quint32>(static_cast<quint32>(writer.stringsSize()), buffer);
+    header.append(buffer, sizeof(buffer));
+    // The writer's first 36 bytes complete the fixed header
+    return header + writer.finish();
 }
 
-void EmailDocument::parseBody()
+bool EmailDocument::deserialize(const QByteArray &image, const QByteArray &rawData)
 {
-    QSharedPointer<EmailDocumentEntry> entry(new EmailDocumentEntry(&m_content));
-    entry->parse(m_rawData);
-    m_content.push_front(entry); // main object to begin
+    if (image.size() < HEADER_SIZE or memcmp(image.constData(), IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+    {
+        return false;
+    }
+
+    const char* data = image.constData();
+    if (qFromLittleEndian<quint32>(data + 4) != IMAGE_VERSION)
+    {
+        return false;
+    }
+    const quint32 stringsSize = qFromLittleEndian<quint32>(data + 8);
+
+    ImageReader header(data + 12, nullptr, 0);
+    const auto mode = static_cast<ParseMode>(header.get32());
+    const quint32 flags = header.get32();
+    const quint64 rawSize = header.get64();
+    const qint64 secsSinceEpoch = static_cast<qint64>(header.get64());
+    const int offsetFromUtc = static_cast<int>(header.get32());
+    const quint32 addressCount = header.get32();
+    const quint32 partCount = header.get32();
+
+    if (mode != ParseMode::envelope and mode != ParseMode::structure and mode != ParseMode::full)
+    {
+        return false;
+    }
+
+    const quint64 tablesSize = static_cast<quint64>(FIELD_COUNT) * STRING_REF_SIZE +
+                               static_cast<quint64>(addressCount) * ADDRESS_SIZE +
+                               static_cast<quint64>(partCount) * PART_SIZE;
+    if (rawSize != static_cast<quint64>(rawData.size()) or
+        static_cast<quint64>(image.size()) != HEADER_SIZE + tablesSize + stringsSize)
+    {
+        return false;
+    }
+
+    ImageReader reader(data + HEADER_SIZE, data + HEADER_SIZE + tablesSize, stringsSize);
+
+    EmailDocument document;
+    document.m_rawData = rawData;
+    document.m_parseMode = mode;
+    if (flags & FLAG_DATE_VALID)
+    {
+        document.m_dateTime = QDateTime::fromSecsSinceEpoch(secsSinceEpoch, Qt::OffsetFromUTC, offsetFromUtc);
+    }
+
+    document.m_subject = reader.getString();
+    document.m_returnPath = reader.getString();
+    document.m_comment = reader.getString();
+    document.m_from.address = reader.getString();
+    document.m_from.name = reader.getString();
 
-    QList<int> toRemove;
-    int counter = 0;
-    for (QListIterator<QSharedPointer<EmailDocumentEntry>> iter(m_content); iter.hasNext(); counter++)
+    for (quint32 i = 0; i < addressCount; ++i)
     {
-        auto n = iter.next()->contentType();
-        auto type = n.enumerate;
-        if (type == EmailDocumentEntry::ContentType::Enum::multipartRelated or
-            type == EmailDocumentEntry::ContentType::Enum::multipartMixed or
-            type == EmailDocumentEntry::ContentType::Enum::multipartAlternative or
-            type == EmailDocumentEntry::ContentType::Enum::multipartOther)
+        const auto kind = static_cast<AddressKind>(reader.get8());
+        reader.skip(3);
+        Destination destination;
+        destination.address = reader.getString();
+        destination.name = reader.getString();
+
+        if      (kind == AddressKind::to)      document.m_to.push_back(destination);
+        else if (kind == AddressKind::cc)      document.m_cc.push_back(destination);
+        else if (kind == AddressKind::bcc)     document.m_bcc.push_back(destination);
+        else if (kind == AddressKind::replyTo) document.m_replyTo.push_back(destination);
+    }
+
+    for (quint32 i = 0; i < partCount; ++i)
+    {
+        QSharedPointer<EmailDocumentEntry> part(new EmailDocumentEntry);
+        part->m_contentType.enumerate = static_cast<EmailDocumentEntry::ContentType::Enum>(reader.get8());
+        part->m_transferEncoding = static_cast<EmailDocumentEntry::TransferEncoding>(reader.get8());
+        reader.skip(2);
+        part->m_contentType.string = reader.getString();
+        part->m_name = reader.getString();
+        part->m_charset = reader.getString();
+
+        const quint64 offset = reader.get64();
+        const quint64 size = reader.get64();
+        if (offset > rawSize or size > rawSize - offset)
         {
-            toRemove.push_front(counter);
+            return false;
         }
+        // A view into the message; m_rawOwner keeps its bytes alive
+        part->m_rawOwner = rawData;
+        part->m_rawData = QByteArray::fromRawData(rawData.constData() + offset, static_cast<int>(size));
+        part->m_rawOffset = static_cast<qsizetype>(offset);
+        part->m_decodeContent = mode == ParseMode::full and not part->m_contentType.isMultipart();
+        document.m_content.push_back(part);
     }
-    // Store only text/files, not a abstract structures
-    for (QListIterator<int> iter(toRemove); iter.hasNext(); )
+
+    if (not reader.isValid())
     {
-        m_content.removeAt(iter.next());
+        return false;
     }
+
+    *this = document;
+    return true;
 }
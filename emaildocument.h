@@ -11,6 +11,7 @@
 #include <QByteArray>
 #include <QString>
 #include <QMap>
+#include <QVector>
 #include <QDateTime>
 #include <QSharedPointer>
 
@@ -23,15 +24,30 @@ public:
         QString name;
     };
 
+    enum class ParseMode
+    {
+        envelope,  // headers only, stops at the header separator
+        structure, // headers and the part list, payloads left encoded
+        full       // everything decoded
+    };
+
     EmailDocument();
 
-    void parse(const QByteArray& data);
+    void parse(const QByteArray& data, ParseMode mode = ParseMode::full);
+    ParseMode parseMode() const { return m_parseMode; }
     static QByteArray decodeMimeString(const QString &mimeString);
+    static QByteArray decodeMimeString(const QByteArray &mimeString);
+    static QVector<Destination> parseAddressList(const QByteArray& header);
     static QString extractAddress(const QString& string);
     static QString extractName(const QString& string);
     static QDateTime decodeTimeString(const QString& stringRFC822_1123);
+    static QDateTime decodeTimeString(const QByteArray& stringRFC822_1123);
+    static bool parseTimeString(const char* data, qsizetype size, qint64* secsSinceEpoch, int* offsetFromUtc);
 
-    Destination to()                                    const { return m_to; }
+    QVector<Destination> to()                           const { return m_to; }
+    QVector<Destination> cc()                           const { return m_cc; }
+    QVector<Destination> bcc()                          const { return m_bcc; }
+    QVector<Destination> replyTo()                      const { return m_replyTo; }
     Destination from()                                  const { return m_from; }
     QString subject()                                   const { return m_subject; }
     QString returnPath()                                const { return m_returnPath; }
@@ -40,14 +56,26 @@ public:
 
     QByteArray rawData()                                const { return m_rawData; }
 
+    /* Versioned binary image of the parsed fields, part table and parse mode.
+     * Parts are stored as offsets into rawData(), so the image stays small and
+     * loading it skips parsing. Parts are views into rawData, which must own
+     * its bytes; those of a ParseMode::full image decode on first content().
+     * The image may point into an mmap'ed file: nothing refers to it afterwards. */
+    QByteArray serialize() const;
+    bool deserialize(const QByteArray& image, const QByteArray& rawData);
+
     void setComment(const QString& text) { m_comment = text; }
     QString comment() const { return m_comment; }
 
 private:
     void parseBody();
     QByteArray m_rawData;
+    ParseMode m_parseMode = ParseMode::full;
 
-    Destination m_to;
+    QVector<Destination> m_to;
+    QVector<Destination> m_cc;
+    QVector<Destination> m_bcc;
+    QVector<Destination> m_replyTo;
     Destination m_from;
     QString m_returnPath;
     QString m_subject;
@@ -6,94 +6,214 @@
 
 #include "emaildocumententry.h"
 #include "emaildocument.h"
+#include "tracing.h"
 
 #include <QDebug>
 
-enum class ParseState {
-    contentType,
-    other
-};
+#include <cctype>
+#include <cstring>
+
+// Deeper nesting than any real mailer produces; stops hostile input from
+// turning the recursive descent quadratic
+constexpr int MAX_NESTING_DEPTH = 32;
 
-EmailDocumentEntry::EmailDocumentEntry(QList<QSharedPointer<EmailDocumentEntry>> *attachments) : m_pAttachments(attachments)
+EmailDocumentEntry::EmailDocumentEntry(QList<QSharedPointer<EmailDocumentEntry>> *attachments, int depth) :
+    m_pAttachments(attachments),
+    m_depth(depth)
 {
 
 }
 
-void EmailDocumentEntry::parse(const QByteArray &data)
+namespace {
+
+// Bounds of data.mid(from, size).trimmed(), without building the untrimmed copy
+void trimRange(const QByteArray& data, qsizetype& from, qsizetype& size)
+{
+    const char* bytes = data.constData();
+    while (size > 0 and isspace(static_cast<unsigned char>(bytes[from])))
+    {
+        ++from;
+        --size;
+    }
+    while (size > 0 and isspace(static_cast<unsigned char>(bytes[from + size - 1])))
+    {
+        --size;
+    }
+}
+
+// Header lines of a part as views without their line break, up to the blank
+// line that ends the header block; leading whitespace is skipped like trimmed()
+class HeaderLines
+{
+public:
+    explicit HeaderLines(const QByteArray& data) :
+        m_pos(data.constData()),
+        m_end(data.constData() + data.size())
+    {
+        while (m_pos < m_end and isspace(static_cast<unsigned char>(*m_pos))) ++m_pos;
+    }
+
+    bool next(QByteArray& line)
+    {
+        if (m_pos >= m_end) return false;
+
+        const char* lineEnd = static_cast<const char*>(memchr(m_pos, '\n', static_cast<size_t>(m_end - m_pos)));
+        if (lineEnd == nullptr) lineEnd = m_end;
+        const char* stop = lineEnd > m_pos and lineEnd[-1] == '\r' ? lineEnd - 1 : lineEnd;
+
+        line = QByteArray::fromRawData(m_pos, static_cast<int>(stop - m_pos));
+        m_pos = lineEnd < m_end ? lineEnd + 1 : m_end;
+        return not line.isEmpty();
+    }
+
+private:
+    const char* m_pos;
+    const char* const m_end;
+};
+
+} // namespace
+
+void EmailDocumentEntry::parse(const QByteArray &data, bool decodeContent, qsizetype rawOffset)
 {
     m_rawData = data;
+    m_rawOffset = rawOffset;
+    m_decodeContent = decodeContent;
 
     QString boundary;
-    QString charset;
-    m_contentType = parseContentType(data, &m_name, &boundary, &charset);
+    m_contentType = parseContentType(data, &m_name, &boundary, &m_charset);
 
-    if (boundary.isEmpty())
+    if (not boundary.isEmpty() and m_depth >= MAX_NESTING_DEPTH)
     {
-        if (parseTransferEncoding(data) == TransferEncoding::base64)
-        {
-            m_content = QByteArray::fromBase64(rawPayload().trimmed()).trimmed();
-        }
-        else
-        {
-            m_content = rawPayload().trimmed();
-        }
+        qWarning() << __FUNCTION__ << "MIME nesting is too deep, part kept unparsed";
+        m_contentType = contentTypeFromString("application/octet-stream");
+        boundary.clear();
+    }
 
-        if (m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::textOther or
-            m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::textPlain)
+    if (boundary.isEmpty())
+    {
+        m_transferEncoding = parseTransferEncoding(data);
+        if (m_decodeContent)
         {
-            QTextStream stream(m_content);
-            stream.setCodec(charset.toStdString().c_str());
-            m_content = stream.readAll().toUtf8();
+            decode();
         }
-
         return;
     }
 
-    if (m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::multipartRelated or
-        m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::multipartMixed or
-        m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::multipartAlternative or
-        m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::multipartOther)
+    // Containers have no content of their own, only their children decode
+    m_decodeContent = false;
+
+    if (m_contentType.isMultipart())
     {
-        multipart(data);
+        multipart(data, decodeContent);
         return;
     }
 
     // Other MIME types (non-multipart)
-    QSharedPointer<EmailDocumentEntry> entry(new EmailDocumentEntry(m_pAttachments));
-    entry->parse(rawPayload());
+    qsizetype from = 0;
+    qsizetype size = 0;
+    payloadRange(from, size);
+    QSharedPointer<EmailDocumentEntry> entry = child(from, size);
+    entry->parse(entry->m_rawData, decodeContent, m_rawOffset + from);
     if (m_pAttachments != nullptr) m_pAttachments->push_back(entry);
 }
 
-QByteArray EmailDocumentEntry::rawPayload() const
+void EmailDocumentEntry::decode()
 {
-    int pos = m_rawData.indexOf("\n\n");
-    if (pos < 0)
+    if (m_decoded.load(std::memory_order_acquire)) return;
+
+    // Cached documents are shared between threads: decode once, under the lock
+    QMutexLocker lock(&m_decodeMutex);
+    if (m_decoded.load(std::memory_order_relaxed)) return;
+
+    qsizetype from = 0;
+    qsizetype size = 0;
+    payloadRange(from, size);
+    const QByteArray payload = QByteArray::fromRawData(m_rawData.constData() + from, static_cast<int>(size));
+    if (m_transferEncoding == TransferEncoding::base64)
     {
-        pos = m_rawData.indexOf("\r\n\r\n");
+        QTEMAILFETCHER_TRACE_SCOPE("decode.base64");
+        m_content = QByteArray::fromBase64(payload).trimmed();
     }
-    if (pos < 0)
+    else
     {
-        return QByteArray();
+        m_content = QByteArray(payload.constData(), payload.size()); // outlives the message
     }
-    return m_rawData.mid(pos).trimmed();
+
+    if (m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::textOther or
+        m_contentType.enumerate == EmailDocumentEntry::ContentType::Enum::textPlain)
+    {
+        QTEMAILFETCHER_TRACE_SCOPE("decode.charset");
+        QTextStream stream(m_content);
+        stream.setCodec(m_charset.toStdString().c_str());
+        m_content = stream.readAll().toUtf8();
+    }
+
+    m_decoded.store(true, std::memory_order_release);
 }
 
-QByteArray EmailDocumentEntry::rawHeaders() const
+QByteArray EmailDocumentEntry::content() const
 {
-    int pos = m_rawData.indexOf("\n\n");
+    // Parts restored from a full document image are decoded on first use.
+    // Others may be decoding on another thread: m_content is only read once final
+    if (m_decodeContent) const_cast<EmailDocumentEntry*>(this)->decode();
+    return isDecoded() ? m_content : QByteArray();
+}
+
+qsizetype EmailDocumentEntry::payloadPosition() const
+{
+    qsizetype pos = m_rawData.indexOf("\n\n");
     if (pos < 0)
     {
         pos = m_rawData.indexOf("\r\n\r\n");
     }
-    if (pos < 0)
+    return pos;
+}
+
+void EmailDocumentEntry::payloadRange(qsizetype &from, qsizetype &size) const
+{
+    from = payloadPosition();
+    if (from < 0)
+    {
+        from = 0;
+        size = 0;
+        return;
+    }
+    size = m_rawData.size() - from;
+    trimRange(m_rawData, from, size);
+}
+
+QByteArray EmailDocumentEntry::rawPayload() const
+{
+    qsizetype from = 0;
+    qsizetype size = 0;
+    payloadRange(from, size);
+    return m_rawData.mid(from, size);
+}
+
+QByteArray EmailDocumentEntry::rawHeaders() const
+{
+    qsizetype size = payloadPosition();
+    if (size < 0)
     {
         return QByteArray();
     }
-    return m_rawData.mid(0, pos).trimmed();
+    qsizetype from = 0;
+    trimRange(m_rawData, from, size);
+    return m_rawData.mid(from, size);
 }
 
-void EmailDocumentEntry::multipart(QByteArray section)
+QSharedPointer<EmailDocumentEntry> EmailDocumentEntry::child(qsizetype from, qsizetype size) const
 {
+    // A view into this part: nested parts share the message instead of copying their sections
+    QSharedPointer<EmailDocumentEntry> entry(new EmailDocumentEntry(m_pAttachments, m_depth + 1));
+    entry->m_rawOwner = m_rawOwner.isNull() ? m_rawData : m_rawOwner;
+    entry->m_rawData = QByteArray::fromRawData(m_rawData.constData() + from, static_cast<int>(size));
+    return entry;
+}
+
+void EmailDocumentEntry::multipart(const QByteArray& section, bool decodeContent)
+{
+    QTEMAILFETCHER_TRACE_SCOPE("parse.multipart");
     QString lineDelimiter = primaryLineDelimiter(section);
     if (lineDelimiter.isEmpty())
     {
@@ -109,30 +229,34 @@ void EmailDocumentEntry::multipart(QByteArray section)
         return;
     }
 
-    const QString beginBoundary = "--" + boundary + lineDelimiter;
-    const QString endBoundary = "--" + boundary + "--";
+    const QByteArray beginBoundary = ("--" + boundary + lineDelimiter).toUtf8();
+    const QByteArray endBoundary = ("--" + boundary + "--").toUtf8();
 
-    for (qsizetype beginPos = section.indexOf(beginBoundary.toUtf8());
-         beginPos > 0;
-         beginPos = section.indexOf(beginBoundary.toUtf8(), beginPos+1))
+    // Parts are cut straight out of the section, so the whole walk is a
+    // single forward scan however many parts there are
+    qsizetype beginPos = section.indexOf(beginBoundary);
+    while (beginPos > 0)
     {
-        QByteArray boundaryMarkedPart = section;
-        boundaryMarkedPart.remove(0, beginPos);
+        const qsizetype nextPos = section.indexOf(beginBoundary, beginPos + 1);
 
-        qsizetype endPos = boundaryMarkedPart.indexOf(beginBoundary.toUtf8(), 1);
+        qsizetype endPos = nextPos;
         if (endPos < 0) // last
         {
-            endPos = boundaryMarkedPart.indexOf(endBoundary.toUtf8(), 1);
+            endPos = section.indexOf(endBoundary, beginPos + 1);
             if (endPos < 0)
             {
-                endPos = boundaryMarkedPart.size()-1;
+                endPos = section.size()-1;
             }
         }
 
-        boundaryMarkedPart.remove(endPos, boundaryMarkedPart.size()-endPos);
-        QSharedPointer<EmailDocumentEntry> entry(new EmailDocumentEntry(m_pAttachments));
-        entry->parse(boundaryMarkedPart.trimmed());
+        qsizetype from = beginPos;
+        qsizetype size = endPos - beginPos;
+        trimRange(section, from, size);
+        QSharedPointer<EmailDocumentEntry> entry = child(from, size);
+        entry->parse(entry->m_rawData, decodeContent, m_rawOffset + from);
         if (m_pAttachments != nullptr) m_pAttachments->push_back(entry);
+
+        beginPos = nextPos;
     }
 }
 
@@ -178,73 +302,59 @@ EmailDocumentEntry::ContentType EmailDocumentEntry::parseContentType(const QByte
 {
     ContentType result;
 
-    ParseState state = ParseState::other;
-    QStringList contentTypeRaw;
-
-    QTextStream stream(data.trimmed());
-    QByteArray line = stream.readLine().toUtf8();
-
+    // Only the header block is looked at, in place: parts can be megabytes of payload
+    HeaderLines lines(data);
+    QByteArray line;
     QByteArray buffer;
+    bool found = false;
+    while (lines.next(line))
+    {
+        if (found)
+        {
+            if (not line.startsWith('\t') and not line.startsWith(' ')) break;
+            buffer += ';' + line;
+        }
+        else if (line.startsWith("Content-Type:"))
+        {
+            found = true;
+            buffer = line.mid(13).trimmed();
+        }
+    }
+    if (not found)
+    {
+        return result;
+    }
+
+    // Empty attributes left by folding (";;") are skipped below
+    const QStringList contentTypeRaw = QString(buffer.trimmed()).split(';');
 
-    for (; not stream.atEnd(); line = stream.readLine().toUtf8())
+    result = contentTypeFromString(contentTypeRaw.first());
+    QStringListIterator iter(contentTypeRaw);
+    while (iter.hasNext())
     {
-        if (state == ParseState::contentType)
+        auto attr = iter.next();
+        if (attr.trimmed().startsWith("boundary=") and boundary != nullptr)
         {
-            if (not line.startsWith('\t') and not line.startsWith(' '))
-            {
-                while (buffer.contains(";;")) buffer.replace(";;", ";");
-                contentTypeRaw = QString(buffer.trimmed()).split(';');
-
-                result = contentTypeFromString(contentTypeRaw.first());
-                QStringListIterator iter(contentTypeRaw);
-                while (iter.hasNext())
-                {
-                    auto attr = iter.next();
-                    if (attr.trimmed().startsWith("boundary=") and boundary != nullptr)
-                    {
-                        *boundary = attr.trimmed().remove(0,9).trimmed();
-                        boundary->remove('"');
-                    }
-
-                    else if (attr.trimmed().startsWith("name=") and name != nullptr)
-                    {
-                        QByteArray decoded = EmailDocument::decodeMimeString(attr.remove(0,5).trimmed());
-                        if (decoded.isEmpty())
-                        {
-                            *name = attr.trimmed();
-                            name->remove('"');
-                        }
-                        else
-                        {
-                            *name = decoded;
-                        }
-                    }
-
-                    else if (attr.trimmed().startsWith("charset=") and charset != nullptr)
-                    {
-                        *charset = attr.trimmed().remove(0,8).trimmed();
-                        charset->remove('"');
-                    }
-                }
-
-                break;
-            }
-            else
-            {
-                buffer += ';' + line;
-                continue;
-            }
+            *boundary = attr.trimmed().remove(0,9).trimmed();
+            boundary->remove('"');
         }
 
-        if (line.startsWith("Content-Type:"))
+        else if (attr.trimmed().startsWith("name=") and name != nullptr)
         {
-            state = ParseState::contentType;
-            buffer = line.remove(0,13).trimmed();
+            QByteArray value = attr.trimmed().remove(0,5).trimmed().toUtf8();
+            if (value.size() > 1 and value.startsWith('"') and value.endsWith('"'))
+            {
+                value = value.mid(1, value.size() - 2);
+            }
+
+            QByteArray decoded = EmailDocument::decodeMimeString(value);
+            *name = decoded.isEmpty() ? value : decoded;
         }
 
-        else if (line.isEmpty())
+        else if (attr.trimmed().startsWith("charset=") and charset != nullptr)
         {
-            break;
+            *charset = attr.trimmed().remove(0,8).trimmed();
+            charset->remove('"');
         }
     }
 
@@ -255,22 +365,13 @@ EmailDocumentEntry::TransferEncoding EmailDocumentEntry::parseTransferEncoding(c
 {
     TransferEncoding result = TransferEncoding::textPlain;
 
-    QTextStream stream(data.trimmed());
-    QString line = stream.readLine();
-
-    for (; not stream.atEnd(); line = stream.readLine())
+    HeaderLines lines(data);
+    QByteArray line;
+    while (lines.next(line))
     {
-        if (line.startsWith("Content-Transfer-Encoding:"))
-        {
-            if (line.contains("base64", Qt::CaseInsensitive))
-            {
-                result = TransferEncoding::base64;
-            }
-        }
-
-        else if (line.isEmpty())
+        if (line.startsWith("Content-Transfer-Encoding:") and line.mid(26).toLower().contains("base64"))
         {
-            break;
+            result = TransferEncoding::base64;
         }
     }
 
@@ -6,10 +6,13 @@
 
 #pragma once
 
+#include <QMutex>
 #include <QString>
 #include <QStringList>
 #include <QSharedPointer>
 
+#include <atomic>
+
 class EmailDocumentEntry
 {
 public:
@@ -31,6 +34,8 @@ public:
 
         Enum enumerate = Enum::undefined;
         QString string = "Undefined";
+
+        bool isMultipart() const { return enumerate >= Enum::multipartAlternative and enumerate <= Enum::multipartOther; }
     };
     enum class TransferEncoding
     {
@@ -38,8 +43,12 @@ public:
         base64
     };
 
-    EmailDocumentEntry(QList<QSharedPointer<EmailDocumentEntry>>* attachments = nullptr);
-    void parse(const QByteArray& data);
+    EmailDocumentEntry(QList<QSharedPointer<EmailDocumentEntry>>* attachments = nullptr, int depth = 0);
+    /* decodeContent = false only locates the part: content() stays empty until decode() */
+    /* rawOffset is where data starts inside the whole message */
+    void parse(const QByteArray& data, bool decodeContent = true, qsizetype rawOffset = 0);
+    /* may run on several threads at once for a shared document: one decodes, the others wait */
+    void decode();
 
     static ContentType contentTypeFromString(const QString& string);
     static ContentType contentTypeToString(ContentType type);
@@ -49,20 +58,40 @@ public:
     static QString primaryLineDelimiter(const QByteArray& data);
 
     ContentType contentType()               const { return m_contentType; }
-    QByteArray content()                    const { return m_content; }
+    /* empty until decoded, see parse() */
+    QByteArray content()                    const;
     QString name()                          const { return m_name; }
+    QString charset()                       const { return m_charset; }
+    TransferEncoding transferEncoding()     const { return m_transferEncoding; }
+    bool isDecoded()                        const { return m_decoded.load(std::memory_order_acquire); }
+    qsizetype rawOffset()                   const { return m_rawOffset; }
+    qsizetype rawSize()                     const { return m_rawData.size(); }
 
     QByteArray rawPayload()                 const;
     QByteArray rawHeaders()                 const;
 
 private:
-    void multipart(QByteArray section);
+    friend class EmailDocument; // restores parts from a serialized document
+
+    void multipart(const QByteArray& section, bool decodeContent);
+    QSharedPointer<EmailDocumentEntry> child(qsizetype from, qsizetype size) const;
+    qsizetype payloadPosition() const;
+    /* trimmed bounds of the payload inside m_rawData, size 0 when there is none */
+    void payloadRange(qsizetype& from, qsizetype& size) const;
 
     QByteArray m_rawData;
+    QByteArray m_rawOwner; // the whole message when m_rawData is a view into it
+    qsizetype m_rawOffset = 0;
     QList<QSharedPointer<EmailDocumentEntry>>* m_pAttachments;
+    int m_depth;
 
     ContentType m_contentType;
+    TransferEncoding m_transferEncoding = TransferEncoding::textPlain;
+    QString m_charset;
     QByteArray m_content;
     QString m_name = "Undefined";
+    bool m_decodeContent = true;
+    std::atomic<bool> m_decoded {false}; // m_content is final once set
+    QMutex m_decodeMutex;
 };
 
@@ -0,0 +1,174 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "fetchpipeline.h"
+
+#include "tracing.h"
+
+#include <QThread>
+
+#include <climits>
+
+FetchPipeline::FetchPipeline(QtImapClient &client, const Limits &limits) :
+    m_client(client),
+    m_maxMessages(qMax(1, limits.maxMessages)),
+    m_maxBytes(static_cast<int>(qBound<qint64>(1, limits.maxBytes, INT_MAX))),
+    m_parseWorkers(limits.parseWorkers > 0 ? limits.parseWorkers : qMax(1, QThread::idealThreadCount() - 1)),
+    m_fetched(m_maxMessages),
+    m_parsed(m_maxMessages),
+    m_messageSlots(m_maxMessages),
+    m_byteBudget(m_maxBytes)
+{
+}
+
+FetchPipeline::~FetchPipeline()
+{
+    cancel();
+}
+
+void FetchPipeline::start(const QVector<unsigned int> &uids, EmailDocument::ParseMode mode, const QString &folder)
+{
+    if (m_fetcher != nullptr) return;
+
+    m_uids = uids;
+    m_mode = mode;
+    m_folder = folder;
+    m_workersLeft = m_parseWorkers;
+
+    for (int i = 0; i < m_parseWorkers; ++i)
+    {
+        QThread* thread = QThread::create([this]() { parseStage(); });
+        thread->start();
+        m_workers.push_back(thread);
+    }
+
+    m_fetcher = QThread::create([this]() { fetchStage(); });
+    m_fetcher->start();
+}
+
+bool FetchPipeline::next(Result &result)
+{
+    if (m_fetcher == nullptr or m_stop) return false;
+
+    m_parsedReady.acquire();
+    Item item;
+    if (not m_parsed.pop(item))
+    {
+        // the end mark: leave it for the next call
+        m_parsedReady.release();
+        return false;
+    }
+
+    m_bytesInFlight -= item.charged;
+    --m_inFlight;
+    m_byteBudget.release(item.charged);
+    m_messageSlots.release();
+
+    result.uid = item.uid;
+    result.document = item.document;
+    result.errorString = item.errorString;
+    return true;
+}
+
+void FetchPipeline::cancel()
+{
+    if (m_fetcher == nullptr) return;
+
+    // Wakes the fetcher whatever it waits for; it sees m_stop before taking anything
+    m_stop = true;
+    m_messageSlots.release(m_maxMessages);
+    m_byteBudget.release(m_maxBytes);
+    join();
+}
+
+FetchPipeline::Stats FetchPipeline::stats() const
+{
+    Stats result;
+    result.fetched = m_fetchedCount;
+    result.failed = m_failedCount;
+    result.peakMessages = m_peakMessages;
+    result.peakBytes = m_peakBytes;
+    return result;
+}
+
+void FetchPipeline::fetchStage()
+{
+    for (unsigned int uid: m_uids)
+    {
+        m_messageSlots.acquire();
+        if (m_stop) break;
+
+        Item item;
+        item.uid = uid;
+        if (m_client.fetchRaw(uid, item.raw, m_folder))
+        {
+            item.charged = static_cast<int>(qMin<qint64>(item.raw.size(), m_maxBytes));
+            m_byteBudget.acquire(item.charged);
+            if (m_stop) break;
+            ++m_fetchedCount;
+        }
+        else
+        {
+            item.errorString = m_client.errorString();
+            ++m_failedCount;
+        }
+
+        // Only this thread adds to the counters, so the peaks need no compare-and-swap
+        const int messages = ++m_inFlight;
+        const qint64 bytes = m_bytesInFlight += item.charged;
+        if (messages > m_peakMessages) m_peakMessages = messages;
+        if (bytes > m_peakBytes) m_peakBytes = bytes;
+
+        // Cannot be full: every queued item holds one of m_maxMessages slots
+        m_fetched.push(std::move(item));
+        m_fetchedReady.release();
+    }
+
+    // One wake-up per worker with nothing behind it: each pops an empty queue once and leaves
+    m_fetchedReady.release(m_parseWorkers);
+}
+
+void FetchPipeline::parseStage()
+{
+    for (;;)
+    {
+        m_fetchedReady.acquire();
+        Item item;
+        if (not m_fetched.pop(item)) break;
+
+        if (item.errorString.isEmpty() and not m_stop)
+        {
+            QTEMAILFETCHER_TRACE_SCOPE("pipeline.parse");
+            item.document.reset(new EmailDocument);
+            item.document->parse(item.raw, m_mode);
+        }
+        item.raw = QByteArray();
+
+        m_parsed.push(std::move(item));
+        m_parsedReady.release();
+    }
+
+    if (--m_workersLeft == 0)
+    {
+        m_parsedReady.release();
+    }
+}
+
+void FetchPipeline::join()
+{
+    if (m_fetcher != nullptr)
+    {
+        m_fetcher->wait();
+        delete m_fetcher;
+        m_fetcher = nullptr;
+    }
+    for (QThread* thread: m_workers)
+    {
+        thread->wait();
+        delete thread;
+    }
+    m_workers.clear();
+}
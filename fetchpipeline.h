@@ -0,0 +1,117 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include "boundedqueue.h"
+#include "emaildocument.h"
+#include "qtimapclient.h"
+
+#include <QByteArray>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+
+class QThread;
+
+/*
+ * Fetches and parses a list of UIDs with the network and the CPU busy at the
+ * same time: one thread downloads messages through the client while parse
+ * workers turn the previous ones into documents, and next() hands them out
+ * in the order they are ready.
+ *
+ * A message is in flight from the start of its download until next() returns
+ * it. At most maxMessages are, holding at most maxBytes of raw messages (a
+ * single larger message is let through alone), so a slow consumer stops the
+ * downloads instead of piling up documents. The client must stay alive until
+ * the pipeline is finished or destroyed.
+ */
+class FetchPipeline
+{
+public:
+    struct Limits
+    {
+        int maxMessages = 32;
+        qint64 maxBytes = 64ll * 1024 * 1024;
+        int parseWorkers = 0; // 0: one per core but one
+    };
+
+    struct Result
+    {
+        unsigned int uid = 0;
+        QSharedPointer<EmailDocument> document; // null when the fetch failed
+        QString errorString;
+    };
+
+    struct Stats
+    {
+        quint64 fetched = 0;
+        quint64 failed = 0;
+        int peakMessages = 0;
+        qint64 peakBytes = 0;
+    };
+
+    FetchPipeline(QtImapClient& client, const Limits& limits);
+    ~FetchPipeline();
+
+    FetchPipeline(const FetchPipeline&) = delete;
+    FetchPipeline& operator=(const FetchPipeline&) = delete;
+
+    /* starts fetching uids of folder; once per pipeline */
+    void start(const QVector<unsigned int>& uids, EmailDocument::ParseMode mode = EmailDocument::ParseMode::full,
+               const QString& folder = "INBOX");
+    /* blocks until the next message is parsed; false once every message was returned or after cancel() */
+    bool next(Result& result);
+    /* stops after the download in progress and drops the messages not returned yet */
+    void cancel();
+
+    Stats stats() const;
+
+private:
+    struct Item
+    {
+        unsigned int uid = 0;
+        QByteArray raw;
+        QSharedPointer<EmailDocument> document;
+        QString errorString;
+        int charged = 0; // bytes taken from m_byteBudget
+    };
+
+    void fetchStage();
+    void parseStage();
+    void join();
+
+    QtImapClient& m_client;
+    int m_maxMessages;
+    int m_maxBytes;
+    int m_parseWorkers;
+
+    QVector<unsigned int> m_uids;
+    EmailDocument::ParseMode m_mode = EmailDocument::ParseMode::full;
+    QString m_folder;
+
+    BoundedQueue<Item> m_fetched;
+    BoundedQueue<Item> m_parsed;
+    QSemaphore m_messageSlots;
+    QSemaphore m_byteBudget;
+    QSemaphore m_fetchedReady;
+    QSemaphore m_parsedReady; // one more once the last worker is done
+
+    std::atomic<bool> m_stop {false};
+    std::atomic<int> m_workersLeft {0};
+    std::atomic<int> m_inFlight {0};
+    std::atomic<qint64> m_bytesInFlight {0};
+    std::atomic<quint64> m_fetchedCount {0};
+    std::atomic<quint64> m_failedCount {0};
+    std::atomic<int> m_peakMessages {0};
+    std::atomic<qint64> m_peakBytes {0};
+
+    QThread* m_fetcher = nullptr;
+    QVector<QThread*> m_workers;
+};
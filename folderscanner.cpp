@@ -0,0 +1,92 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "folderscanner.h"
+
+#include <QMutex>
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+
+FolderScanner::FolderScanner(const QtImapClient &prototype, int connections)
+{
+    const int count = qMax(1, connections);
+    m_connections.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        QSharedPointer<QtImapClient> connection(new QtImapClient);
+        connection->copySettings(prototype);
+        m_connections.push_back(connection);
+    }
+}
+
+bool FolderScanner::listFolders(QVector<QtImapClient::FolderStatus> &result)
+{
+    if (not m_connections.first()->listFolders(result))
+    {
+        m_errorString = m_connections.first()->errorString();
+        return false;
+    }
+    return true;
+}
+
+void FolderScanner::run(const QVector<QtImapClient::FolderStatus> &folders, const Task &task)
+{
+    if (folders.isEmpty()) return;
+
+    QVector<QtImapClient::FolderStatus> queue = folders;
+    std::stable_sort(queue.begin(), queue.end(), [](const QtImapClient::FolderStatus& a, const QtImapClient::FolderStatus& b) {
+        return a.messages > b.messages;
+    });
+
+    std::atomic<int> next {0};
+    auto worker = [&queue, &next, &task](QtImapClient* connection) {
+        for (int index = next++; index < queue.size(); index = next++)
+        {
+            task(*connection, queue[index]);
+        }
+    };
+
+    const int threads = qMin(m_connections.size(), queue.size());
+    QVector<QThread*> helpers;
+    for (int i = 1; i < threads; ++i)
+    {
+        QtImapClient* connection = m_connections[i].data();
+        QThread* thread = QThread::create([&worker, connection]() { worker(connection); });
+        thread->start();
+        helpers.push_back(thread);
+    }
+
+    worker(m_connections.first().data());
+
+    for (QThread* thread: helpers)
+    {
+        thread->wait();
+        delete thread;
+    }
+}
+
+QHash<QString, SearchResult> FolderScanner::search(const QVector<QtImapClient::FolderStatus> &folders,
+                                                   const SearchQuery &query, bool byUid)
+{
+    QVector<QtImapClient::FolderStatus> nonEmpty;
+    for (const auto& folder: folders)
+    {
+        if (folder.messages != 0) nonEmpty.push_back(folder);
+    }
+
+    QHash<QString, SearchResult> results;
+    QMutex mutex;
+    run(nonEmpty, [&](QtImapClient& connection, const QtImapClient::FolderStatus& folder) {
+        SearchResult result;
+        if (not connection.search(query, result, byUid, folder.name)) return;
+
+        QMutexLocker lock(&mutex);
+        results.insert(folder.name, result);
+    });
+    return results;
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include "qtimapclient.h"
+#include "searchquery.h"
+
+#include <QHash>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+/*
+ * Runs per-folder work over a small set of IMAP connections. Each connection
+ * is its own QtImapClient with its own curl handle, opened lazily with the
+ * settings of the prototype client. Folders are handed out largest first to
+ * whichever connection is free, so one huge folder does not end up queued
+ * behind many small ones.
+ */
+class FolderScanner
+{
+public:
+    typedef std::function<void(QtImapClient& connection, const QtImapClient::FolderStatus& folder)> Task;
+
+    explicit FolderScanner(const QtImapClient& prototype, int connections = 4);
+
+    FolderScanner(const FolderScanner&) = delete;
+    FolderScanner& operator=(const FolderScanner&) = delete;
+
+    /* folder list with counts, from the first connection */
+    bool listFolders(QVector<QtImapClient::FolderStatus>& result);
+
+    /* calls task once per folder, concurrently on up to connections() threads; blocks until all are done */
+    void run(const QVector<QtImapClient::FolderStatus>& folders, const Task& task);
+
+    /* SEARCH in every non-empty folder; folders whose search failed are missing from the result */
+    QHash<QString, SearchResult> search(const QVector<QtImapClient::FolderStatus>& folders,
+                                        const SearchQuery& query, bool byUid = true);
+
+    int connections() const { return m_connections.size(); }
+    QString errorString() const { return m_errorString; }
+
+private:
+    QVector<QSharedPointer<QtImapClient>> m_connections;
+    QString m_errorString;
+};
@@ -0,0 +1,319 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "imapbenchmark.h"
+
+#include "qtimapclient.h"
+
+#include "IMAPCompressRelay.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+namespace {
+
+// nearest-rank percentile of sorted values
+double percentile(const QVector<double>& sorted, double fraction)
+{
+    if (sorted.isEmpty()) return 0;
+    const int rank = static_cast<int>(std::ceil(fraction * sorted.size()));
+    return sorted.at(qBound(0, rank - 1, static_cast<int>(sorted.size()) - 1));
+}
+
+} // namespace
+
+bool ImapBenchmark::run(QVector<Result> &results)
+{
+    results.clear();
+
+    CIMAPStandInServer server(m_options.mailbox);
+    if (not server.Start())
+    {
+        m_errorString = "Stand-in server failed to start";
+        return false;
+    }
+
+    CNetworkEmulator network(m_options.network);
+    quint16 port = server.GetPort();
+    if (not m_options.network.IsTransparent())
+    {
+        if (not network.Start("127.0.0.1", port))
+        {
+            m_errorString = "Network emulator failed to start";
+            return false;
+        }
+        port = network.GetPort();
+    }
+
+    QtImapClient client;
+    client.setConnectionType(QtImapClient::ConnectionType::PLAIN_TEXT);
+    client.setHostname("127.0.0.1");
+    client.setPort(port);
+    client.setUsername("benchmark");
+    client.setPassword("benchmark");
+
+    // Connect, log in and cache CAPABILITY before the clock starts
+    SearchResult warmUp;
+    if (not client.search(SearchQuery(), warmUp))
+    {
+        m_errorString = "Warm-up failed: " + client.errorString();
+        return false;
+    }
+
+    // Unseen first: fetch() marks messages \Seen
+    bool ok = measure("checkUnseen", m_options.iterations, [&client](int, int, quint64& messages, quint64&) {
+        SequenceSet unseen;
+        if (not client.checkUnseen(unseen)) return false;
+        messages += unseen.count();
+        return true;
+    }, results);
+
+    ok = ok and measure("search", m_options.iterations, [&client](int, int call, quint64& messages, quint64&) {
+        const SearchQuery query = SearchQuery::from("sender" + QString::number(call % 50) + "@") or
+                                  SearchQuery::flag(CIMAPClient::SearchOption::FLAGGED);
+        SearchResult result;
+        if (not client.search(query, result)) return false;
+        messages += result.count;
+        return true;
+    }, results);
+
+    const unsigned total = server.GetMessageCount();
+    auto fetchWith = [&server, total](QtImapClient& connection) {
+        return [&connection, &server, total](int, int call, quint64& messages, quint64& bytes) {
+            const unsigned index = static_cast<unsigned>(call) % total;
+            if (connection.fetch(index + 1).isNull()) return false;
+            ++messages;
+            bytes += server.GetMessage(index).size();
+            return true;
+        };
+    };
+
+    quint64 wire = server.GetWireBytes();
+    ok = ok and total != 0 and measure("fetch", m_options.fetches, fetchWith(client), results);
+    if (ok) results.last().wireBytes = server.GetWireBytes() - wire;
+
+    // The same fetches compressed: fewer bytes on the wire for zlib time on both ends
+    if (ok and m_options.compression)
+    {
+        QtImapClient compressed;
+        compressed.copySettings(client);
+        compressed.setCompression(true);
+        const quint64 sessions = CIMAPCompressRelay::GetStats().uCompressedSessions;
+        if (not compressed.search(SearchQuery(), warmUp))
+        {
+            m_errorString = "Warm-up failed: " + compressed.errorString();
+            ok = false;
+        }
+        else if (CIMAPCompressRelay::GetStats().uCompressedSessions == sessions)
+        {
+            m_errorString = "COMPRESS DEFLATE was not negotiated";
+            ok = false;
+        }
+
+        wire = server.GetWireBytes();
+        ok = ok and measure("fetch deflate", m_options.fetches, fetchWith(compressed), results);
+        if (ok) results.last().wireBytes = server.GetWireBytes() - wire;
+    }
+
+    // The same fetches over a pool: round trips overlap instead of adding up
+    if (ok and m_options.connections > 1)
+    {
+        QVector<QSharedPointer<QtImapClient>> pool;
+        for (int i = 0; i < m_options.connections; ++i)
+        {
+            QSharedPointer<QtImapClient> connection(new QtImapClient);
+            connection->copySettings(client);
+            ok = ok and connection->search(SearchQuery(), warmUp);
+            pool.push_back(connection);
+        }
+        ok = ok and measure("fetch x" + QString::number(pool.size()), m_options.fetches,
+                     [&pool, &server, total](int worker, int call, quint64& messages, quint64& bytes) {
+            const unsigned index = static_cast<unsigned>(call) % total;
+            if (pool[worker]->fetch(index + 1).isNull()) return false;
+            ++messages;
+            bytes += server.GetMessage(index).size();
+            return true;
+        }, results, pool.size());
+    }
+
+    ok = ok and measure("fetchMailboxIndex", m_options.iterations, [&client, &server](int, int call, quint64& messages, quint64&) {
+        MailboxIndex index;
+        if (not client.fetchMailboxIndex(index)) return false;
+        messages += static_cast<quint64>(index.rows());
+        // Once: every row parsed, literal ENVELOPE strings included
+        if (call == 0 and static_cast<unsigned>(index.rows()) != server.GetMessageCount()) return false;
+        for (int row = 0; call == 0 and row < index.rows(); ++row)
+        {
+            if (index.subject(row).isEmpty() or index.sender(row).isEmpty()) return false;
+        }
+        return true;
+    }, results);
+
+    // Session options applied once per handle, and again before every command as
+    // Perform() used to: a setter marks the handle for a reset and a full re-apply
+    CIMAPClient direct;
+    if (ok and not (direct.InitSession("127.0.0.1:" + std::to_string(port), "benchmark", "benchmark",
+                                       CMailClient::SettingsFlag::ALL_FLAGS, CMailClient::SslTlsFlag::NO_SSLTLS) and
+                    direct.Noop()))
+    {
+        m_errorString = "CIMAPClient session failed";
+        ok = false;
+    }
+    ok = ok and measure("noop", m_options.fetches, [&direct](int, int, quint64&, quint64&) {
+        return direct.Noop();
+    }, results);
+    ok = ok and measure("noop reconfigured", m_options.fetches, [&direct](int, int, quint64&, quint64&) {
+        direct.SetTimeout(direct.GetTimeout());
+        return direct.Noop();
+    }, results);
+    direct.CleanupSession();
+
+    const int batch = qMax(1, m_options.storeBatch);
+    ok = ok and measure("storeFlags", m_options.iterations, [&client, batch, total](int, int call, quint64& messages, quint64&) {
+        // Alternately set and clear \Flagged on a sliding window of UIDs
+        const quint32 first = static_cast<quint32>((call / 2 * batch) % total) + 1;
+        SequenceSet uids;
+        uids.add(first, qMin<quint32>(first + static_cast<quint32>(batch) - 1, total));
+        if (not client.storeFlags(uids, CIMAPClient::MailProperty::Flagged, call % 2 == 0)) return false;
+        messages += uids.count();
+        return true;
+    }, results);
+
+    // The same window one STORE per message: the round trips the sets save
+    ok = ok and measure("storeFlags each", m_options.iterations, [&client, batch, total](int, int call, quint64& messages, quint64&) {
+        const quint32 first = static_cast<quint32>((call / 2 * batch) % total) + 1;
+        const quint32 last = qMin<quint32>(first + static_cast<quint32>(batch) - 1, total);
+        for (quint32 uid = first; uid <= last; ++uid)
+        {
+            SequenceSet one;
+            one.add(uid);
+            if (not client.storeFlags(one, CIMAPClient::MailProperty::Flagged, call % 2 == 0)) return false;
+            ++messages;
+        }
+        return true;
+    }, results);
+
+    // Moves go last as they empty the mailbox; each mode takes UIDs of its own
+    const quint32 moveBatch = static_cast<quint32>(qMax(1, m_options.moveBatch));
+    const quint32 moveSpan = moveBatch * static_cast<quint32>(qMax(0, m_options.iterations));
+    if (ok and moveSpan * 2 <= total)
+    {
+        ok = measure("moveMessages", m_options.iterations, [&client, moveBatch](int, int call, quint64& messages, quint64&) {
+            const quint32 first = static_cast<quint32>(call) * moveBatch + 1;
+            SequenceSet uids;
+            uids.add(first, first + moveBatch - 1);
+            if (not client.moveMessages(uids, "Archive")) return false;
+            messages += uids.count();
+            return true;
+        }, results);
+
+        ok = ok and measure("moveMessages each", m_options.iterations,
+                            [&client, moveBatch, moveSpan](int, int call, quint64& messages, quint64&) {
+            const quint32 first = moveSpan + static_cast<quint32>(call) * moveBatch + 1;
+            for (quint32 uid = first; uid < first + moveBatch; ++uid)
+            {
+                SequenceSet one;
+                one.add(uid);
+                if (not client.moveMessages(one, "Archive")) return false;
+                ++messages;
+            }
+            return true;
+        }, results);
+    }
+
+    if (not ok and m_errorString.isEmpty()) m_errorString = client.errorString();
+    network.Stop();
+    server.Stop();
+    return ok;
+}
+
+bool ImapBenchmark::measure(const QString &name, int calls, const Operation &operation, QVector<Result> &results,
+                            int workers)
+{
+    Result result;
+    result.operation = name;
+    result.calls = calls;
+
+    QVector<double> latencies;
+    latencies.reserve(calls);
+    QMutex mutex;
+    std::atomic<int> next {0};
+    std::atomic<bool> failed {false};
+
+    auto worker = [&](int index) {
+        QVector<double> own;
+        quint64 messages = 0;
+        quint64 bytes = 0;
+        for (int call = next++; call < calls and not failed; call = next++)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            if (not operation(index, call, messages, bytes))
+            {
+                failed = true;
+                break;
+            }
+            own.push_back(timer.nsecsElapsed() / 1e6);
+        }
+
+        QMutexLocker lock(&mutex);
+        latencies += own;
+        result.messages += messages;
+        result.bytes += bytes;
+    };
+
+    QElapsedTimer total;
+    total.start();
+    QVector<QThread*> helpers;
+    for (int i = 1; i < workers; ++i)
+    {
+        QThread* thread = QThread::create([&worker, i]() { worker(i); });
+        thread->start();
+        helpers.push_back(thread);
+    }
+    worker(0);
+    for (QThread* thread: helpers)
+    {
+        thread->wait();
+        delete thread;
+    }
+    result.seconds = total.nsecsElapsed() / 1e9;
+
+    if (failed)
+    {
+        m_errorString = name + " failed";
+        return false;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    result.p50Ms = percentile(latencies, 0.50);
+    result.p99Ms = percentile(latencies, 0.99);
+    results.push_back(result);
+    return true;
+}
+
+QString ImapBenchmark::report(const QVector<Result> &results)
+{
+    QString text = QString("%1 %2 %3 %4 %5 %6 %7\n")
+            .arg("operation", -18).arg("calls", 7).arg("msg/s", 12)
+            .arg("MB/s", 9).arg("p50 ms", 9).arg("p99 ms", 9).arg("wire MB", 9);
+    for (const auto& result: results)
+    {
+        text += QString("%1 %2 %3 %4 %5 %6 %7\n")
+                .arg(result.operation, -18).arg(result.calls, 7)
+                .arg(result.messagesPerSecond(), 12, 'f', 1)
+                .arg(result.megabytesPerSecond(), 9, 'f', 2)
+                .arg(result.p50Ms, 9, 'f', 3).arg(result.p99Ms, 9, 'f', 3)
+                .arg(result.wireBytes / (1024.0 * 1024), 9, 'f', 2);
+    }
+    return text;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include "IMAPStandInServer.h"
+#include "NetworkEmulator.h"
+
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+/*
+ * End-to-end throughput of QtImapClient against CIMAPStandInServer on
+ * loopback: every operation runs a fixed number of calls on one warmed-up
+ * connection and reports messages/s, MB/s and p50/p99 call latency.
+ * Baseline for performance changes; compare runs with the same Options.
+ *
+ * A non-transparent network profile puts CNetworkEmulator between client and
+ * server, so round-trip bound modes (one fetch per message, a pool of
+ * connections, one batched FETCH for the index) can be compared under WAN
+ * conditions. Its seed makes the injected delays repeatable.
+ */
+class ImapBenchmark
+{
+public:
+    struct Options
+    {
+        CIMAPStandInServer::MailboxSpec mailbox;
+        int iterations = 20;  // calls of checkUnseen, search, fetchMailboxIndex, storeFlags and moveMessages
+        int fetches = 200;    // messages fetched one by one, NOOPs on a bare CIMAPClient
+        int storeBatch = 100; // UIDs per storeFlags call
+        int moveBatch = 10;   // UIDs per moveMessages call; moved messages leave the mailbox
+        int connections = 4;  // pooled fetch: the same fetches over this many connections, 1 skips it
+        bool compression = true; // the same fetches again over COMPRESS=DEFLATE
+        CNetworkEmulator::Profile network;
+    };
+
+    struct Result
+    {
+        QString operation;
+        int calls = 0;
+        quint64 messages = 0; // messages returned or touched
+        quint64 bytes = 0;    // message bytes transferred, 0 when only ids travel
+        quint64 wireBytes = 0; // bytes on the server's sockets both ways, measured for the fetches
+        double seconds = 0;
+        double p50Ms = 0;
+        double p99Ms = 0;
+
+        double messagesPerSecond() const  { return seconds > 0 ? messages / seconds : 0; }
+        double megabytesPerSecond() const { return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0; }
+    };
+
+    explicit ImapBenchmark(const Options& options) : m_options(options) {}
+
+    /* starts the server (and the emulator), runs checkUnseen, search, fetch,
+       pooled fetch, compressed fetch, fetchMailboxIndex, NOOP with the session
+       options applied once and before every command, then storeFlags and
+       moveMessages both set-based and with one command per message */
+    bool run(QVector<Result>& results);
+    /* one line per operation, fixed-width columns */
+    static QString report(const QVector<Result>& results);
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    /* operation(worker, call, messages, bytes) returns false on failure */
+    typedef std::function<bool(int, int, quint64&, quint64&)> Operation;
+    /* calls are spread over workers threads, worker 0 is the calling thread */
+    bool measure(const QString& name, int calls, const Operation& operation, QVector<Result>& results,
+                 int workers = 1);
+
+    Options m_options;
+    QString m_errorString;
+};
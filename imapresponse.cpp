@@ -0,0 +1,162 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "imapresponse.h"
+
+#include <cstring>
+
+namespace {
+
+inline bool isAtomChar(char c)
+{
+    return c != ' ' and c != '\r' and c != '\n' and c != '(' and c != ')' and c != '"' and c != '{';
+}
+
+} // namespace
+
+ImapResponseTokenizer::ImapResponseTokenizer(const char *begin, const char *end) :
+    m_pos(begin),
+    m_end(end)
+{
+
+}
+
+ImapResponseTokenizer::ImapResponseTokenizer(const QByteArray &response) :
+    ImapResponseTokenizer(response.constData(), response.constData() + response.size())
+{
+
+}
+
+ImapResponseTokenizer::Token ImapResponseTokenizer::next()
+{
+    while (m_pos < m_end and *m_pos == ' ') ++m_pos;
+
+    m_data = m_pos;
+    m_size = 0;
+    if (m_pos >= m_end) return Token::end;
+
+    const char c = *m_pos;
+    if (c == '\r' or c == '\n')
+    {
+        if (c == '\r' and m_pos + 1 < m_end and m_pos[1] == '\n') ++m_pos;
+        ++m_pos;
+        return Token::lineEnd;
+    }
+    if (c == '(')
+    {
+        ++m_pos;
+        return Token::listBegin;
+    }
+    if (c == ')')
+    {
+        ++m_pos;
+        return Token::listEnd;
+    }
+
+    if (c == '"')
+    {
+        const char* begin = ++m_pos;
+        bool escaped = false;
+        while (m_pos < m_end and *m_pos != '"')
+        {
+            if (*m_pos == '\\' and m_pos + 1 < m_end)
+            {
+                escaped = true;
+                ++m_pos;
+            }
+            ++m_pos;
+        }
+
+        if (not escaped)
+        {
+            m_data = begin;
+            m_size = m_pos - begin;
+        }
+        else
+        {
+            m_scratch.resize(0);
+            for (const char* p = begin; p < m_pos; ++p)
+            {
+                if (*p == '\\' and p + 1 < m_pos) ++p;
+                m_scratch += *p;
+            }
+            m_data = m_scratch.constData();
+            m_size = m_scratch.size();
+        }
+
+        if (m_pos < m_end) ++m_pos; // closing quote
+        return Token::string;
+    }
+
+    if (c == '{')
+    {
+        // {n}CRLF followed by n octets; LITERAL+ servers may send {n+}
+        quint64 length = 0;
+        ++m_pos;
+        while (m_pos < m_end and *m_pos >= '0' and *m_pos <= '9')
+        {
+            length = length * 10 + static_cast<quint64>(*m_pos++ - '0');
+        }
+        while (m_pos < m_end and *m_pos != '\n') ++m_pos;
+        if (m_pos < m_end) ++m_pos;
+
+        const quint64 available = static_cast<quint64>(m_end - m_pos);
+        m_data = m_pos;
+        m_size = static_cast<qsizetype>(length < available ? length : available);
+        m_pos += m_size;
+        return Token::string;
+    }
+
+    while (m_pos < m_end and isAtomChar(*m_pos)) ++m_pos;
+    m_size = m_pos - m_data;
+    return is("NIL") ? Token::nil : Token::atom;
+}
+
+bool ImapResponseTokenizer::is(const char *atom) const
+{
+    const qsizetype length = static_cast<qsizetype>(strlen(atom));
+    if (length != m_size) return false;
+    for (qsizetype i = 0; i < length; ++i)
+    {
+        char c = m_data[i];
+        if (c >= 'a' and c <= 'z') c = static_cast<char>(c - 'a' + 'A');
+        if (c != atom[i]) return false;
+    }
+    return true;
+}
+
+quint64 ImapResponseTokenizer::number(bool *ok) const
+{
+    quint64 value = 0;
+    bool valid = m_size > 0 and m_size <= 20;
+    for (qsizetype i = 0; valid and i < m_size; ++i)
+    {
+        const char c = m_data[i];
+        valid = c >= '0' and c <= '9';
+        value = value * 10 + static_cast<quint64>(c - '0');
+    }
+    if (ok != nullptr) *ok = valid;
+    return valid ? value : 0;
+}
+
+void ImapResponseTokenizer::skipList()
+{
+    int depth = 1;
+    while (depth > 0)
+    {
+        const Token token = next();
+        if (token == Token::listBegin) ++depth;
+        else if (token == Token::listEnd) --depth;
+        else if (token == Token::end) return;
+    }
+}
+
+void ImapResponseTokenizer::skipLine()
+{
+    for (Token token = next(); token != Token::lineEnd and token != Token::end; token = next())
+    {
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+
+/*
+ * Forward-only tokenizer for untagged IMAP server responses (RFC 3501
+ * section 9): atoms, quoted strings, {n} literals, NIL and parenthesized
+ * lists. Tokens point into the response buffer; only quoted strings with
+ * escapes are copied into a scratch buffer.
+ */
+class ImapResponseTokenizer
+{
+public:
+    enum class Token
+    {
+        atom,
+        string,
+        nil,
+        listBegin,
+        listEnd,
+        lineEnd,
+        end
+    };
+
+    ImapResponseTokenizer(const char* begin, const char* end);
+    explicit ImapResponseTokenizer(const QByteArray& response);
+
+    Token next();
+
+    /* value of the last atom or string, valid until the next call to next() */
+    const char* data() const    { return m_data; }
+    qsizetype size() const      { return m_size; }
+    QByteArray text() const     { return QByteArray(m_data, static_cast<int>(m_size)); }
+
+    bool is(const char* atom) const;
+    quint64 number(bool* ok = nullptr) const;
+
+    /* call right after listBegin: consumes everything up to the matching listEnd */
+    void skipList();
+    /* consumes the rest of the current response line */
+    void skipLine();
+
+    bool atEnd() const { return m_pos >= m_end; }
+
+private:
+    const char* m_pos;
+    const char* m_end;
+    const char* m_data = nullptr;
+    qsizetype m_size = 0;
+    QByteArray m_scratch;
+};
@@ -0,0 +1,391 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "mailboxindex.h"
+
+#include "emaildocument.h"
+#include "imapresponse.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace {
+
+constexpr int COLUMN_COUNT = 5;
+
+typedef ImapResponseTokenizer::Token Token;
+
+quint8 flagFromAtom(const ImapResponseTokenizer& tokenizer)
+{
+    if (tokenizer.is("\\SEEN"))     return MailboxIndex::seen;
+    if (tokenizer.is("\\ANSWERED")) return MailboxIndex::answered;
+    if (tokenizer.is("\\FLAGGED"))  return MailboxIndex::flagged;
+    if (tokenizer.is("\\DELETED"))  return MailboxIndex::deleted;
+    if (tokenizer.is("\\DRAFT"))    return MailboxIndex::draft;
+    if (tokenizer.is("\\RECENT"))   return MailboxIndex::recent;
+    return 0;
+}
+
+// Skips one value of any kind: atom, string, NIL or a whole list
+void skipValue(ImapResponseTokenizer& tokenizer)
+{
+    if (tokenizer.next() == Token::listBegin) tokenizer.skipList();
+}
+
+// ENVELOPE (date subject from sender reply-to to cc bcc in-reply-to message-id),
+// only subject and the first From address are kept
+void parseEnvelope(ImapResponseTokenizer& tokenizer, QByteArray& sender, QByteArray& subject)
+{
+    if (tokenizer.next() != Token::listBegin) return;
+
+    skipValue(tokenizer); // date
+
+    if (tokenizer.next() == Token::string)
+    {
+        subject = tokenizer.text();
+        const QByteArray decoded = EmailDocument::decodeMimeString(subject);
+        if (not decoded.isEmpty()) subject = decoded;
+    }
+
+    Token token = tokenizer.next(); // from: NIL or ((name adl mailbox host) ...)
+    if (token == Token::listBegin)
+    {
+        token = tokenizer.next();
+        if (token == Token::listBegin)
+        {
+            skipValue(tokenizer); // name
+            skipValue(tokenizer); // source route
+            QByteArray mailbox;
+            if (tokenizer.next() == Token::string) mailbox = tokenizer.text();
+            QByteArray host;
+            if (tokenizer.next() == Token::string) host = tokenizer.text();
+            sender = host.isEmpty() ? mailbox : mailbox + '@' + host;
+            tokenizer.skipList(); // rest of the address
+            token = tokenizer.next();
+        }
+        while (token != Token::listEnd and token != Token::end)
+        {
+            if (token == Token::listBegin) tokenizer.skipList();
+            token = tokenizer.next();
+        }
+    }
+
+    tokenizer.skipList(); // sender .. message-id
+}
+
+// LSD radix sort of row numbers by a 64-bit key; stable, 11 bits per pass
+QVector<quint32> radixOrder(int rows, const std::function<quint64(int)>& key)
+{
+    constexpr int BITS = 11;
+    constexpr quint64 MASK = (1u << BITS) - 1;
+
+    QVector<quint64> keys(rows);
+    quint64 maximum = 0;
+    for (int row = 0; row < rows; ++row)
+    {
+        keys[row] = key(row);
+        maximum = qMax(maximum, keys[row]);
+    }
+
+    QVector<quint32> order(rows);
+    for (int row = 0; row < rows; ++row) order[row] = static_cast<quint32>(row);
+    QVector<quint32> buffer(rows);
+
+    for (int shift = 0; shift < 64 and (maximum >> shift) != 0; shift += BITS)
+    {
+        QVector<quint32> counts(static_cast<int>(MASK) + 2, 0);
+        for (const quint32 row: order) ++counts[static_cast<int>((keys[row] >> shift) & MASK) + 1];
+        for (int i = 1; i < counts.size(); ++i) counts[i] += counts[i - 1];
+        for (const quint32 row: order) buffer[counts[static_cast<int>((keys[row] >> shift) & MASK)]++] = row;
+        std::swap(order, buffer);
+    }
+    return order;
+}
+
+bool lessNoCase(const QByteArray& a, const QByteArray& b)
+{
+    return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        if (x >= 'A' and x <= 'Z') x = static_cast<char>(x - 'A' + 'a');
+        if (y >= 'A' and y <= 'Z') y = static_cast<char>(y - 'A' + 'a');
+        return static_cast<quint8>(x) < static_cast<quint8>(y);
+    });
+}
+
+} // namespace
+
+void MailboxIndex::clear()
+{
+    m_uids.clear();
+    m_sizes.clear();
+    m_dates.clear();
+    m_flags.clear();
+    m_senders.clear();
+    m_subjects.clear();
+    m_stringData.clear();
+    m_stringOffsets = {0};
+    m_stringIds.clear();
+    invalidate();
+}
+
+void MailboxIndex::reserve(int rows)
+{
+    m_uids.reserve(rows);
+    m_sizes.reserve(rows);
+    m_dates.reserve(rows);
+    m_flags.reserve(rows);
+    m_senders.reserve(rows);
+    m_subjects.reserve(rows);
+}
+
+int MailboxIndex::parseFetchResponse(const QByteArray &response)
+{
+    ImapResponseTokenizer tokenizer(response);
+    int added = 0;
+
+    QByteArray sender;
+    QByteArray subject;
+
+    for (Token token = tokenizer.next(); token != Token::end; token = tokenizer.next())
+    {
+        // "* <seq> FETCH (" - anything else (tagged status, other untagged data) is skipped
+        bool fetch = token == Token::atom and tokenizer.is("*");
+        if (fetch) fetch = (token = tokenizer.next()) == Token::atom;
+        if (fetch) fetch = (token = tokenizer.next()) == Token::atom and tokenizer.is("FETCH");
+        if (fetch) fetch = (token = tokenizer.next()) == Token::listBegin;
+        if (not fetch)
+        {
+            if (token != Token::lineEnd and token != Token::end) tokenizer.skipLine();
+            if (token == Token::end) break;
+            continue;
+        }
+
+        quint32 uid = 0;
+        quint32 size = 0;
+        qint64 date = 0;
+        quint8 flags = 0;
+        sender.resize(0);
+        subject.resize(0);
+
+        for (token = tokenizer.next(); token == Token::atom; token = tokenizer.next())
+        {
+            if (tokenizer.is("UID"))
+            {
+                tokenizer.next();
+                uid = static_cast<quint32>(tokenizer.number());
+            }
+            else if (tokenizer.is("RFC822.SIZE"))
+            {
+                tokenizer.next();
+                size = static_cast<quint32>(tokenizer.number());
+            }
+            else if (tokenizer.is("INTERNALDATE"))
+            {
+                tokenizer.next();
+                date = parseInternalDate(tokenizer.data(), tokenizer.size());
+            }
+            else if (tokenizer.is("FLAGS"))
+            {
+                if (tokenizer.next() != Token::listBegin) continue;
+                for (Token flag = tokenizer.next(); flag == Token::atom; flag = tokenizer.next())
+                {
+                    flags |= flagFromAtom(tokenizer);
+                }
+            }
+            else if (tokenizer.is("ENVELOPE"))
+            {
+                parseEnvelope(tokenizer, sender, subject);
+            }
+            else
+            {
+                skipValue(tokenizer);
+            }
+        }
+
+        if (token == Token::listEnd)
+        {
+            append(uid, size, date, flags, sender, subject);
+            ++added;
+        }
+        if (token == Token::end) break;
+        if (token != Token::lineEnd) tokenizer.skipLine();
+    }
+
+    return added;
+}
+
+void MailboxIndex::append(quint32 uid, quint32 size, qint64 internalDate, quint8 flags,
+                          const QByteArray &sender, const QByteArray &subject)
+{
+    m_uids.push_back(uid);
+    m_sizes.push_back(size);
+    m_dates.push_back(internalDate);
+    m_flags.push_back(flags);
+    m_senders.push_back(intern(sender));
+    m_subjects.push_back(intern(subject));
+    invalidate();
+}
+
+const QVector<quint32> &MailboxIndex::sorted(Column column) const
+{
+    const int index = static_cast<int>(column);
+    if (m_sortedValid[index]) return m_sorted[index];
+
+    const int count = rows();
+    QVector<quint32> order;
+    if (column == Column::uid)
+    {
+        order = radixOrder(count, [this](int row) { return static_cast<quint64>(m_uids[row]); });
+    }
+    else if (column == Column::size)
+    {
+        order = radixOrder(count, [this](int row) { return static_cast<quint64>(m_sizes[row]); });
+    }
+    else if (column == Column::internalDate)
+    {
+        const qint64 minimum = count == 0 ? 0 : *std::min_element(m_dates.begin(), m_dates.end());
+        order = radixOrder(count, [this, minimum](int row) { return static_cast<quint64>(m_dates[row] - minimum); });
+    }
+    else
+    {
+        const QVector<quint32> ranks = stringRanks();
+        const QVector<quint32>& ids = column == Column::sender ? m_senders : m_subjects;
+        order = radixOrder(count, [&ranks, &ids](int row) { return static_cast<quint64>(ranks[static_cast<int>(ids[row])]); });
+    }
+
+    m_sorted[index] = order;
+    m_sortedValid[index] = true;
+    return m_sorted[index];
+}
+
+QVector<quint32> MailboxIndex::withFlags(quint8 required, quint8 excluded) const
+{
+    QVector<quint32> result;
+    const quint8* flags = m_flags.constData();
+    for (int row = 0; row < m_flags.size(); ++row)
+    {
+        if ((flags[row] & required) == required and (flags[row] & excluded) == 0)
+        {
+            result.push_back(static_cast<quint32>(row));
+        }
+    }
+    return result;
+}
+
+QVector<quint32> MailboxIndex::inRange(Column column, qint64 min, qint64 max) const
+{
+    QVector<quint32> result;
+    const int count = rows();
+    for (int row = 0; row < count; ++row)
+    {
+        qint64 value = 0;
+        if      (column == Column::uid)          value = m_uids[row];
+        else if (column == Column::size)         value = m_sizes[row];
+        else if (column == Column::internalDate) value = m_dates[row];
+        else return result; // string columns have no numeric range
+
+        if (value >= min and value <= max) result.push_back(static_cast<quint32>(row));
+    }
+    return result;
+}
+
+QVector<quint32> MailboxIndex::fromSender(const QString &address) const
+{
+    QVector<quint32> result;
+    const auto id = m_stringIds.constFind(address.toUtf8());
+    if (id == m_stringIds.constEnd()) return result;
+
+    for (int row = 0; row < m_senders.size(); ++row)
+    {
+        if (m_senders[row] == id.value()) result.push_back(static_cast<quint32>(row));
+    }
+    return result;
+}
+
+QVector<quint32> MailboxIndex::subjectContains(const QString &text) const
+{
+    // Match every distinct string once, then scan the id column
+    QVector<bool> matches(m_stringOffsets.size() - 1, false);
+    for (int id = 0; id < matches.size(); ++id)
+    {
+        matches[id] = string(static_cast<quint32>(id)).contains(text, Qt::CaseInsensitive);
+    }
+
+    QVector<quint32> result;
+    for (int row = 0; row < m_subjects.size(); ++row)
+    {
+        if (matches[static_cast<int>(m_subjects[row])]) result.push_back(static_cast<quint32>(row));
+    }
+    return result;
+}
+
+qint64 MailboxIndex::parseInternalDate(const char *data, qsizetype size)
+{
+    // date-time = DQUOTE date-day-fixed "-" date-month "-" date-year SP time SP zone DQUOTE;
+    // with the two date dashes turned into spaces it is an RFC 5322 date
+    char buffer[64];
+    if (size <= 0 or size >= static_cast<qsizetype>(sizeof(buffer))) return 0;
+    memcpy(buffer, data, static_cast<size_t>(size));
+
+    int dashes = 0;
+    for (qsizetype i = 0; i < size and dashes < 2; ++i)
+    {
+        if (buffer[i] == '-')
+        {
+            buffer[i] = ' ';
+            ++dashes;
+        }
+    }
+
+    qint64 secsSinceEpoch = 0;
+    int offsetFromUtc = 0;
+    if (not EmailDocument::parseTimeString(buffer, size, &secsSinceEpoch, &offsetFromUtc)) return 0;
+    return secsSinceEpoch;
+}
+
+quint32 MailboxIndex::intern(const QByteArray &string)
+{
+    const auto iter = m_stringIds.constFind(string);
+    if (iter != m_stringIds.constEnd()) return iter.value();
+
+    const quint32 id = static_cast<quint32>(m_stringOffsets.size() - 1);
+    m_stringData += string;
+    m_stringOffsets.push_back(static_cast<quint32>(m_stringData.size()));
+    m_stringIds.insert(string, id);
+    return id;
+}
+
+QString MailboxIndex::string(quint32 id) const
+{
+    const quint32 begin = m_stringOffsets[static_cast<int>(id)];
+    const quint32 end = m_stringOffsets[static_cast<int>(id) + 1];
+    return QString::fromUtf8(m_stringData.constData() + begin, static_cast<int>(end - begin));
+}
+
+QVector<quint32> MailboxIndex::stringRanks() const
+{
+    const int count = m_stringOffsets.size() - 1;
+    QVector<QByteArray> strings(count);
+    QVector<quint32> ids(count);
+    for (int id = 0; id < count; ++id)
+    {
+        strings[id] = QByteArray::fromRawData(m_stringData.constData() + m_stringOffsets[id],
+                                              static_cast<int>(m_stringOffsets[id + 1] - m_stringOffsets[id]));
+        ids[id] = static_cast<quint32>(id);
+    }
+    std::sort(ids.begin(), ids.end(), [&strings](quint32 a, quint32 b) {
+        return lessNoCase(strings[static_cast<int>(a)], strings[static_cast<int>(b)]);
+    });
+
+    QVector<quint32> ranks(count);
+    for (int rank = 0; rank < count; ++rank) ranks[static_cast<int>(ids[rank])] = static_cast<quint32>(rank);
+    return ranks;
+}
+
+void MailboxIndex::invalidate()
+{
+    for (int i = 0; i < COLUMN_COUNT; ++i) m_sortedValid[i] = false;
+}
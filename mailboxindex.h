@@ -0,0 +1,92 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+/*
+ * Struct-of-arrays summary of a mailbox: one row per message, one array per
+ * column. Sender and subject are interned, so a row costs about 30 bytes
+ * however long the strings are. It is filled from a
+ * FETCH 1:* (UID FLAGS RFC822.SIZE INTERNALDATE ENVELOPE) response.
+ *
+ * Sort orders are computed once per column with a radix sort and cached
+ * until the index changes. Filters are linear scans over a single column.
+ * Not thread-safe.
+ */
+class MailboxIndex
+{
+public:
+    enum Flag : quint8
+    {
+        seen     = 0x01,
+        answered = 0x02,
+        flagged  = 0x04,
+        deleted  = 0x08,
+        draft    = 0x10,
+        recent   = 0x20
+    };
+
+    enum class Column
+    {
+        uid,
+        size,
+        internalDate,
+        sender,
+        subject
+    };
+
+    void clear();
+    void reserve(int rows);
+
+    /* appends one row per "* n FETCH (...)" line, returns the number of rows added */
+    int parseFetchResponse(const QByteArray& response);
+    void append(quint32 uid, quint32 size, qint64 internalDate, quint8 flags,
+                const QByteArray& sender, const QByteArray& subject);
+
+    int rows() const { return m_uids.size(); }
+
+    quint32 uid(int row) const          { return m_uids.at(row); }
+    quint32 size(int row) const         { return m_sizes.at(row); }
+    qint64 internalDate(int row) const  { return m_dates.at(row); }
+    quint8 flags(int row) const         { return m_flags.at(row); }
+    QString sender(int row) const       { return string(m_senders.at(row)); }
+    QString subject(int row) const      { return string(m_subjects.at(row)); }
+
+    /* rows in ascending order of column; iterate backwards for descending */
+    const QVector<quint32>& sorted(Column column) const;
+
+    QVector<quint32> withFlags(quint8 required, quint8 excluded = 0) const;
+    QVector<quint32> inRange(Column column, qint64 min, qint64 max) const;
+    QVector<quint32> fromSender(const QString& address) const;
+    QVector<quint32> subjectContains(const QString& text) const;
+
+    static qint64 parseInternalDate(const char* data, qsizetype size);
+
+private:
+    quint32 intern(const QByteArray& string);
+    QString string(quint32 id) const;
+    QVector<quint32> stringRanks() const;
+    void invalidate();
+
+    QVector<quint32> m_uids;
+    QVector<quint32> m_sizes;
+    QVector<qint64> m_dates;
+    QVector<quint8> m_flags;
+    QVector<quint32> m_senders;
+    QVector<quint32> m_subjects;
+
+    QByteArray m_stringData;
+    QVector<quint32> m_stringOffsets {0};
+    QHash<QByteArray, quint32> m_stringIds;
+
+    mutable QVector<quint32> m_sorted[5];
+    mutable bool m_sortedValid[5] = {};
+};
@@ -0,0 +1,414 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "messagestore.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QLockFile>
+#include <QSaveFile>
+
+#include <cstring>
+
+namespace {
+
+constexpr char INDEX_MAGIC[4] = {'Q', 'E', 'F', 'I'};
+constexpr quint32 INDEX_VERSION = 1;
+constexpr qint64 INDEX_HEADER_SIZE = 16; // magic, version, generation
+constexpr qint64 RECORD_FIXED_SIZE = 30; // uidValidity, uid, segment, offset, size, folder length
+
+constexpr qint64 MAX_SEGMENT_SIZE = 64ll * 1024 * 1024;
+
+// Records are stored in host byte order: the store is a local cache, not an
+// interchange format
+template <typename T>
+void putValue(QByteArray& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T takeValue(const char*& pos)
+{
+    T value;
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+}
+
+} // namespace
+
+void MessageStore::appendRecord(QByteArray &out, const Key &key, const Location &location)
+{
+    const QByteArray folder = key.folder.toUtf8();
+    putValue<quint32>(out, static_cast<quint32>(RECORD_FIXED_SIZE + folder.size()));
+    putValue<quint32>(out, key.uidValidity);
+    putValue<quint32>(out, key.uid);
+    putValue<quint32>(out, location.segment);
+    putValue<qint64>(out, location.offset);
+    putValue<qint64>(out, location.size);
+    putValue<quint16>(out, static_cast<quint16>(folder.size()));
+    out += folder;
+}
+
+MessageStore::MessageStore(const QString &directory, qint64 budgetBytes) :
+    m_directory(directory),
+    m_budget(budgetBytes),
+    m_segmentLimit(qBound(1024ll * 1024, budgetBytes / 8, MAX_SEGMENT_SIZE))
+{
+
+}
+
+MessageStore::~MessageStore()
+{
+
+}
+
+bool MessageStore::open()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_opened) return true;
+
+    if (not QDir().mkpath(m_directory))
+    {
+        m_errorString = "Unable to create store directory " + m_directory;
+        return false;
+    }
+
+    QLockFile lock(QDir(m_directory).filePath("store.lock"));
+    if (not lock.lock())
+    {
+        m_errorString = "Unable to lock message store";
+        return false;
+    }
+
+    QFile index(QDir(m_directory).filePath("index.dat"));
+    if (not index.exists())
+    {
+        if (not index.open(QIODevice::WriteOnly) or not writeIndexHeader(index, 1))
+        {
+            m_errorString = "Unable to create store index: " + index.errorString();
+            return false;
+        }
+        index.close();
+    }
+
+    m_opened = refreshIndex();
+    return m_opened;
+}
+
+bool MessageStore::get(const Key &key, QByteArray &message)
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 size = 0;
+    QSharedPointer<const uchar> mapping;
+    const uchar* data = find(key, size, mapping);
+    if (data == nullptr) return false;
+
+    message = QByteArray(reinterpret_cast<const char*>(data), static_cast<int>(size));
+    return true;
+}
+
+bool MessageStore::map(const Key &key, QByteArray &message, QSharedPointer<const uchar> &mapping)
+{
+    QMutexLocker locker(&m_mutex);
+    qint64 size = 0;
+    const uchar* data = find(key, size, mapping);
+    if (data == nullptr) return false;
+
+    message = QByteArray::fromRawData(reinterpret_cast<const char*>(data), static_cast<int>(size));
+    return true;
+}
+
+const uchar *MessageStore::find(const Key &key, qint64 &size, QSharedPointer<const uchar> &mapping)
+{
+    if (not m_opened) return nullptr;
+
+    auto iter = m_index.constFind(key);
+    if (iter == m_index.constEnd())
+    {
+        // Another process may have stored it since our last look
+        refreshIndex();
+        iter = m_index.constFind(key);
+    }
+
+    if (iter != m_index.constEnd())
+    {
+        const uchar* data = mapRange(iter.value().segment, iter.value().offset, iter.value().size);
+        if (data != nullptr)
+        {
+            size = iter.value().size;
+            mapping = m_segments.value(iter.value().segment).map;
+            ++m_stats.hits;
+            return data;
+        }
+        m_index.remove(key); // segment was evicted by another process
+    }
+
+    ++m_stats.misses;
+    return nullptr;
+}
+
+bool MessageStore::put(const Key &key, const QByteArray &message, bool replace)
+{
+    QMutexLocker locker(&m_mutex);
+    if (not m_opened or message.isEmpty() or message.size() > m_budget) return false;
+
+    QLockFile lock(QDir(m_directory).filePath("store.lock"));
+    if (not lock.lock())
+    {
+        m_errorString = "Unable to lock message store";
+        return false;
+    }
+
+    refreshIndex();
+    if (not replace and m_index.contains(key)) return true;
+
+    quint32 segment = 0;
+    for (auto iter = m_segmentSizes.constBegin(); iter != m_segmentSizes.constEnd(); ++iter)
+    {
+        segment = qMax(segment, iter.key());
+    }
+    if (segment == 0 or m_segmentSizes.value(segment) + message.size() > m_segmentLimit)
+    {
+        ++segment;
+    }
+
+    QFile segmentFile(segmentPath(segment));
+    if (not segmentFile.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        m_errorString = "Unable to open store segment: " + segmentFile.errorString();
+        return false;
+    }
+
+    Location location;
+    location.segment = segment;
+    location.offset = segmentFile.size();
+    location.size = message.size();
+    if (segmentFile.write(message) != message.size() or not segmentFile.flush())
+    {
+        m_errorString = "Unable to write store segment: " + segmentFile.errorString();
+        return false;
+    }
+    segmentFile.close();
+
+    // Data first, index second: a crash in between only leaves unreferenced bytes.
+    // A later record of the same key wins when the index is loaded
+    QByteArray record;
+    appendRecord(record, key, location);
+
+    QFile index(QDir(m_directory).filePath("index.dat"));
+    if (not index.open(QIODevice::WriteOnly | QIODevice::Append) or index.write(record) != record.size())
+    {
+        m_errorString = "Unable to append store index: " + index.errorString();
+        return false;
+    }
+    index.close();
+
+    m_index.insert(key, location);
+    m_indexOffset += record.size();
+    m_segmentSizes[segment] = location.offset + location.size;
+
+    qint64 total = 0;
+    for (const auto size: m_segmentSizes) total += size;
+    while (total > m_budget and m_segmentSizes.size() > 1)
+    {
+        const qint64 freed = evictOldest();
+        if (freed < 0) break;
+        total -= freed;
+    }
+
+    return true;
+}
+
+MessageStore::Stats MessageStore::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    Stats result = m_stats;
+    result.messages = m_index.size();
+    result.storedBytes = 0;
+    for (const auto size: m_segmentSizes) result.storedBytes += size;
+    return result;
+}
+
+bool MessageStore::refreshIndex()
+{
+    QFile index(QDir(m_directory).filePath("index.dat"));
+    if (not index.open(QIODevice::ReadOnly))
+    {
+        m_errorString = "Unable to open store index: " + index.errorString();
+        return false;
+    }
+
+    const QByteArray header = index.read(INDEX_HEADER_SIZE);
+    if (header.size() != INDEX_HEADER_SIZE or memcmp(header.constData(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+    {
+        m_errorString = "Store index is corrupted";
+        return false;
+    }
+
+    const char* pos = header.constData() + sizeof(INDEX_MAGIC);
+    if (takeValue<quint32>(pos) != INDEX_VERSION)
+    {
+        m_errorString = "Unsupported store index version";
+        return false;
+    }
+
+    const quint64 generation = takeValue<quint64>(pos);
+    if (generation != m_generation)
+    {
+        // Compacted by an eviction (ours or another process'): start over
+        m_index.clear();
+        m_segmentSizes.clear();
+        m_segments.clear();
+
+        const QStringList segments = QDir(m_directory).entryList({"segment-*.dat"}, QDir::Files);
+        for (const auto& name: segments)
+        {
+            bool ok = false;
+            const quint32 id = name.mid(8, name.size() - 12).toUInt(&ok);
+            if (ok) m_segmentSizes.insert(id, QFileInfo(QDir(m_directory).filePath(name)).size());
+        }
+
+        m_generation = generation;
+        m_indexOffset = INDEX_HEADER_SIZE;
+    }
+
+    return loadIndex(index, m_indexOffset);
+}
+
+bool MessageStore::loadIndex(QFile &index, qint64 from)
+{
+    if (index.size() <= from) return true;
+    if (not index.seek(from)) return false;
+
+    const QByteArray data = index.readAll();
+    const char* pos = data.constData();
+    const char* end = pos + data.size();
+
+    while (end - pos >= static_cast<qint64>(sizeof(quint32)))
+    {
+        const char* recordBegin = pos;
+        const quint32 recordSize = takeValue<quint32>(pos);
+        if (recordSize < RECORD_FIXED_SIZE or end - pos < recordSize)
+        {
+            pos = recordBegin; // a writer is still appending this one
+            break;
+        }
+
+        Key key;
+        Location location;
+        key.uidValidity = takeValue<quint32>(pos);
+        key.uid = takeValue<quint32>(pos);
+        location.segment = takeValue<quint32>(pos);
+        location.offset = takeValue<qint64>(pos);
+        location.size = takeValue<qint64>(pos);
+        const quint16 folderSize = takeValue<quint16>(pos);
+        key.folder = QString::fromUtf8(pos, folderSize);
+        pos = recordBegin + sizeof(quint32) + recordSize;
+
+        m_index.insert(key, location);
+        m_segmentSizes[location.segment] = qMax(m_segmentSizes.value(location.segment), location.offset + location.size);
+    }
+
+    m_indexOffset = from + (pos - data.constData());
+    return true;
+}
+
+bool MessageStore::writeIndexHeader(QIODevice &index, quint64 generation)
+{
+    QByteArray header(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    putValue<quint32>(header, INDEX_VERSION);
+    putValue<quint64>(header, generation);
+    return index.write(header) == header.size();
+}
+
+qint64 MessageStore::evictOldest()
+{
+    quint32 oldest = 0;
+    for (auto iter = m_segmentSizes.constBegin(); iter != m_segmentSizes.constEnd(); ++iter)
+    {
+        if (oldest == 0 or iter.key() < oldest) oldest = iter.key();
+    }
+    if (oldest == 0) return -1;
+
+    QByteArray compacted;
+    for (auto iter = m_index.begin(); iter != m_index.end(); )
+    {
+        if (iter.value().segment == oldest)
+        {
+            iter = m_index.erase(iter);
+            ++m_stats.evictions;
+            continue;
+        }
+
+        appendRecord(compacted, iter.key(), iter.value());
+        ++iter;
+    }
+
+    QSaveFile index(QDir(m_directory).filePath("index.dat"));
+    if (not index.open(QIODevice::WriteOnly) or not writeIndexHeader(index, m_generation + 1) or
+        index.write(compacted) != compacted.size() or not index.commit())
+    {
+        m_errorString = "Unable to compact store index: " + index.errorString();
+        return -1;
+    }
+
+    const qint64 freed = m_segmentSizes.take(oldest);
+    unmapSegment(oldest);
+    QFile::remove(segmentPath(oldest));
+
+    ++m_generation;
+    m_indexOffset = INDEX_HEADER_SIZE + compacted.size();
+    return freed;
+}
+
+const uchar *MessageStore::mapRange(quint32 segment, qint64 offset, qint64 size)
+{
+    const Segment& mapped = m_segments[segment];
+    if (not mapped.map.isNull() and offset + size <= mapped.mappedSize)
+    {
+        return mapped.map.data() + offset;
+    }
+
+    // The segment grew since it was mapped (or was never mapped): map it whole
+    // again; views into the old mapping keep it alive
+    unmapSegment(segment);
+    QSharedPointer<QFile> file(new QFile(segmentPath(segment)));
+    if (not file->open(QIODevice::ReadOnly))
+    {
+        return nullptr;
+    }
+
+    const qint64 mappedSize = file->size();
+    if (offset + size > mappedSize or mappedSize == 0)
+    {
+        return nullptr;
+    }
+
+    uchar* data = file->map(0, mappedSize);
+    if (data == nullptr)
+    {
+        qWarning() << __FUNCTION__ << "mmap failed:" << file->errorString();
+        return nullptr;
+    }
+
+    Segment& fresh = m_segments[segment];
+    fresh.map = QSharedPointer<const uchar>(data, [file](const uchar* map) { file->unmap(const_cast<uchar*>(map)); });
+    fresh.mappedSize = mappedSize;
+    return data + offset;
+}
+
+void MessageStore::unmapSegment(quint32 segment)
+{
+    m_segments.remove(segment);
+}
+
+QString MessageStore::segmentPath(quint32 segment) const
+{
+    return QDir(m_directory).filePath(QString("segment-%1.dat").arg(segment));
+}
@@ -0,0 +1,115 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QString>
+
+/*
+ * Persistent store of raw RFC822 messages shared between processes.
+ *
+ * Messages are appended to segment files ("segment-<n>.dat"), and every write
+ * appends a record to "index.dat". Reads go through mmap'ed segments. When the
+ * store grows past its budget, the oldest segment is dropped and the index is
+ * compacted. Other processes notice the new index generation on their next
+ * miss and reload it.
+ */
+class MessageStore
+{
+public:
+    struct Key
+    {
+        QString folder;
+        quint32 uidValidity = 0;
+        quint32 uid = 0;
+
+        bool operator==(const Key& other) const
+        {
+            return uid == other.uid and uidValidity == other.uidValidity and folder == other.folder;
+        }
+    };
+
+    struct Stats
+    {
+        quint64 hits = 0;
+        quint64 misses = 0;
+        quint64 evictions = 0;
+        qint64 storedBytes = 0;
+        int messages = 0;
+    };
+
+    explicit MessageStore(const QString& directory, qint64 budgetBytes = 1024ll * 1024 * 1024);
+    ~MessageStore();
+
+    MessageStore(const MessageStore&) = delete;
+    MessageStore& operator=(const MessageStore&) = delete;
+
+    bool open();
+    bool isOpen() const { return m_opened; }
+
+    bool get(const Key& key, QByteArray& message);
+    /* get() without the copy: message points into the mapped segment, which
+       stays mapped, even past eviction, while mapping is held */
+    bool map(const Key& key, QByteArray& message, QSharedPointer<const uchar>& mapping);
+    /* keeps the stored message of key unless replace is set; a replaced one
+       keeps its bytes until its segment is evicted */
+    bool put(const Key& key, const QByteArray& message, bool replace = false);
+
+    Stats stats() const;
+    QString directory() const { return m_directory; }
+    qint64 budget() const { return m_budget; }
+    QString errorString() const { return m_errorString; }
+
+private:
+    struct Location
+    {
+        quint32 segment = 0;
+        qint64 offset = 0;
+        qint64 size = 0;
+    };
+
+    struct Segment
+    {
+        QSharedPointer<const uchar> map; // unmaps when the last holder lets go
+        qint64 mappedSize = 0;
+    };
+
+    static void appendRecord(QByteArray& out, const Key& key, const Location& location);
+    bool refreshIndex();
+    bool loadIndex(QFile& index, qint64 from);
+    bool writeIndexHeader(QIODevice& index, quint64 generation);
+    qint64 evictOldest();
+    const uchar* find(const Key& key, qint64& size, QSharedPointer<const uchar>& mapping);
+    const uchar* mapRange(quint32 segment, qint64 offset, qint64 size);
+    void unmapSegment(quint32 segment);
+    QString segmentPath(quint32 segment) const;
+
+    const QString m_directory;
+    const qint64 m_budget;
+    const qint64 m_segmentLimit;
+
+    bool m_opened = false;
+    quint64 m_generation = 0;
+    qint64 m_indexOffset = 0;
+
+    QHash<Key, Location> m_index;
+    QHash<quint32, Segment> m_segments;
+    QHash<quint32, qint64> m_segmentSizes;
+
+    Stats m_stats;
+    QString m_errorString;
+    mutable QMutex m_mutex;
+};
+
+inline uint qHash(const MessageStore::Key& key, uint seed = 0)
+{
+    return qHash(key.folder, seed) ^ (key.uidValidity * 2654435761u) ^ key.uid;
+}
@@ -0,0 +1,597 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "parserbenchmark.h"
+
+#include "emaildocument.h"
+
+#include <QDateTime>
+#include <QElapsedTimer>
+
+#include <atomic>
+#include <map>
+#include <random>
+
+#if defined(QTEMAILFETCHER_COUNT_ALLOCATIONS) && defined(__GLIBC__)
+#define PARSERBENCHMARK_MALLOC_HOOK
+
+// Qt containers allocate with malloc, not operator new, so malloc itself is counted
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+namespace { std::atomic<quint64> g_allocations {0}; }
+
+extern "C" void* malloc(size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+namespace {
+
+const char* const WORDS[12] = {"delivery", "invoice", "meeting", "agenda", "review", "budget",
+                               "contract", "release", "schedule", "payment", "summary", "report"};
+
+// "Привет, мир" in three single-byte charsets and UTF-8
+const char KOI8R[] = "\xF0\xD2\xC9\xD7\xC5\xD4, \xCD\xC9\xD2";
+const char CP1251[] = "\xCF\xF0\xE8\xE2\xE5\xF2, \xEC\xE8\xF0";
+const char LATIN1[] = "Gr\xFC\xDF" "e aus K\xF6ln";
+const char UTF8[] = "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xD0\xBC\xD0\xB8\xD1\x80";
+
+volatile qint64 g_sink = 0; // keeps results observable
+
+// decodeTimeString before the single-pass parser, kept as the reference to beat;
+// it knows only "+hhmm" zones, so half of the corpus dates come out invalid
+QDateTime legacyDecodeTimeString(const QString& stringRFC822_1123)
+{
+    if (stringRFC822_1123.size() < 25) return QDateTime();
+    QString timeString (stringRFC822_1123);
+
+    timeString.remove(0,4); // "ddd,
+    int timeShortWordPos = timeString.indexOf('(');
+    if (timeShortWordPos > 0)
+    {
+        timeString.remove(timeShortWordPos, timeString.size()-timeShortWordPos);
+    }
+
+    int plusPos = timeString.indexOf('+');
+    if (plusPos < 0 or plusPos >= timeString.size()+3) return QDateTime();
+    int receivedUtcOffset = timeString.mid(plusPos+1).trimmed().remove("0").toInt() * 60 * 60;
+
+    timeString.remove(plusPos-1, timeString.size()-plusPos+1);
+
+    static const std::map<const char*, const char*> MONTH_CODES {
+        {"Jan", "01"}, {"Feb", "02"}, {"Mar", "03"}, {"Apr", "04"}, {"May", "05"}, {"Jun", "06"},
+        {"Jul", "07"}, {"Aug", "08"}, {"Sep", "09"}, {"Oct", "10"}, {"Nov", "11"}, {"Dec", "12"}
+    };
+
+    for (const auto& m: MONTH_CODES)
+    {
+        if (timeString.contains(m.first))
+        {
+            timeString.replace(m.first, m.second);
+            break;
+        }
+    }
+
+    auto result = QDateTime::fromString(timeString.trimmed(), "d MM yyyy hh:mm:ss");
+    result.setOffsetFromUtc(receivedUtcOffset);
+    return result;
+}
+
+quint64 allocations()
+{
+#ifdef PARSERBENCHMARK_MALLOC_HOOK
+    return g_allocations.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+class Generator
+{
+public:
+    Generator(quint32 seed, int scale) : m_random(seed), m_scale(qMax(1, scale)) {}
+
+    // about size * scale bytes of words in lines of at most 76 characters
+    QByteArray text(int size)
+    {
+        QByteArray result;
+        int line = 0;
+        while (result.size() < size * m_scale)
+        {
+            const char* word = WORDS[m_random() % 12];
+            const int length = static_cast<int>(qstrlen(word));
+            if (line + length + 1 > 76)
+            {
+                result += "\r\n";
+                line = 0;
+            }
+            else if (line != 0)
+            {
+                result += ' ';
+                ++line;
+            }
+            result += word;
+            line += length;
+        }
+        return result + "\r\n";
+    }
+
+    QByteArray binary(int size)
+    {
+        QByteArray result(size * m_scale, '\0');
+        for (auto& c: result) c = static_cast<char>(m_random());
+        return result;
+    }
+
+    quint32 next() { return m_random(); }
+
+private:
+    std::mt19937 m_random;
+    int m_scale;
+};
+
+QByteArray base64Lines(const QByteArray& data)
+{
+    const QByteArray encoded = data.toBase64();
+    QByteArray result;
+    result.reserve(encoded.size() + encoded.size() / 76 * 2 + 2);
+    for (int pos = 0; pos < encoded.size(); pos += 76)
+    {
+        result += encoded.mid(pos, 76) + "\r\n";
+    }
+    return result;
+}
+
+// quoted-printable with soft line breaks, CRLF kept as hard breaks
+QByteArray quotedPrintable(const QByteArray& data)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    QByteArray result;
+    int line = 0;
+    for (int i = 0; i < data.size(); ++i)
+    {
+        const uchar c = static_cast<uchar>(data.at(i));
+        if (c == '\r' and i + 1 < data.size() and data.at(i + 1) == '\n')
+        {
+            result += "\r\n";
+            line = 0;
+            ++i;
+            continue;
+        }
+
+        QByteArray encoded;
+        if ((c >= 33 and c <= 126 and c != '=') or c == ' ') encoded = QByteArray(1, static_cast<char>(c));
+        else encoded = QByteArray("=") + hex[c >> 4] + hex[c & 15];
+
+        if (line + encoded.size() > 75)
+        {
+            result += "=\r\n";
+            line = 0;
+        }
+        result += encoded;
+        line += encoded.size();
+    }
+    return result;
+}
+
+QByteArray encodedWord(const char* charset, const QByteArray& text)
+{
+    return QByteArray("=?") + charset + "?B?" + text.toBase64() + "?=";
+}
+
+QByteArray part(const QByteArray& headers, const QByteArray& body)
+{
+    return headers + "\r\n" + body;
+}
+
+QByteArray multipart(const char* subtype, const QByteArray& boundary, const QVector<QByteArray>& parts)
+{
+    QByteArray result = QByteArray("Content-Type: multipart/") + subtype + "; boundary=\"" + boundary + "\"\r\n\r\n";
+    for (const auto& item: parts)
+    {
+        result += "--" + boundary + "\r\n" + item;
+    }
+    return result + "--" + boundary + "--\r\n";
+}
+
+ParserBenchmark::Sample message(Generator& random, const QByteArray& name, const QByteArray& subject,
+                                const QByteArray& body)
+{
+    static const char* const days[7] = {"Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun"};
+    static const char* const months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                           "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    // one draw per statement: the order of operands in an expression is unspecified
+    const quint32 sender = random.next() % 100;
+    const char* day = days[random.next() % 7];
+    const quint32 dayOfMonth = 1 + random.next() % 28;
+    const char* month = months[random.next() % 12];
+    const quint32 hour = 10 + random.next() % 14;
+    const quint32 minute = 10 + random.next() % 50;
+    const quint32 second = 10 + random.next() % 50;
+    const char* zone = random.next() % 2 ? " +0300" : " -0700";
+    const quint32 messageId = random.next();
+
+    ParserBenchmark::Sample sample;
+    sample.name = name;
+    sample.subject = subject;
+    sample.from = "\"Sender " + QByteArray::number(sender) + "\" <sender" + QByteArray::number(sender) + "@example.org>";
+    sample.date = QByteArray(day) + ", " + QByteArray::number(dayOfMonth) + ' ' + month + " 2023 " +
+                  QByteArray::number(hour) + ":" + QByteArray::number(minute) + ":" + QByteArray::number(second) + zone;
+
+    sample.data = "Return-Path: <sender" + QByteArray::number(sender) + "@example.org>\r\n"
+                  "From: " + sample.from + "\r\n"
+                  "To: \"User\" <user@example.com>, other@example.com\r\n"
+                  "Cc: =?UTF-8?B?0JrQvtC/0LjRjw==?= <copy@example.com>\r\n"
+                  "Subject: " + subject + "\r\n"
+                  "Date: " + sample.date + "\r\n"
+                  "Message-ID: <" + QByteArray::number(messageId) + "@example.org>\r\n"
+                  "MIME-Version: 1.0\r\n" + body;
+    return sample;
+}
+
+template <class Operation>
+ParserBenchmark::Result measure(const QByteArray& sample, const QByteArray& function, qint64 bytesPerCall,
+                                int opsPerCall, int minTimeMs, Operation operation)
+{
+    // one untimed call: first-use allocations are not steady state
+    operation();
+
+    ParserBenchmark::Result result;
+    result.sample = sample;
+    result.function = function;
+
+    quint64 calls = 0;
+    quint64 batch = 1;
+    const quint64 allocationsBefore = allocations();
+    QElapsedTimer timer;
+    timer.start();
+    while (timer.nsecsElapsed() < minTimeMs * 1000000ll)
+    {
+        for (quint64 i = 0; i < batch; ++i) operation();
+        calls += batch;
+        batch = qMin<quint64>(batch * 2, 1024);
+    }
+    const double nanoseconds = timer.nsecsElapsed();
+    const quint64 allocated = allocations() - allocationsBefore;
+
+    result.ops = calls * static_cast<quint64>(opsPerCall);
+    result.nsPerOp = nanoseconds / result.ops;
+    result.megabytesPerSecond = bytesPerCall * static_cast<double>(calls) / (1024.0 * 1024.0) / (nanoseconds / 1e9);
+    if (ParserBenchmark::countsAllocations())
+    {
+        result.allocationsPerOp = static_cast<double>(allocated) / result.ops;
+    }
+    return result;
+}
+
+} // namespace
+
+QVector<ParserBenchmark::Sample> ParserBenchmark::corpus(quint32 seed, int scale)
+{
+    // Every draw from the generator is its own statement, or a braced list
+    // element: function arguments are evaluated in an unspecified order
+    Generator random(seed, scale);
+    QVector<Sample> result;
+
+    {
+        const QByteArray subject = "Weekly report " + QByteArray::number(random.next() % 1000);
+        const QByteArray text = random.text(4096);
+        result.push_back(message(random, "plain", subject,
+                                 "Content-Type: text/plain; charset=us-ascii\r\n"
+                                 "Content-Transfer-Encoding: 7bit\r\n\r\n" + text));
+    }
+
+    const QByteArray html = "<html><body><p>" + random.text(6144) + "</p></body></html>\r\n";
+    {
+        const QByteArray boundary = "=_alt_" + QByteArray::number(random.next());
+        const QVector<QByteArray> parts {
+            part("Content-Type: text/plain; charset=utf-8\r\nContent-Transfer-Encoding: quoted-printable\r\n",
+                 quotedPrintable(random.text(3072))),
+            part("Content-Type: text/html; charset=utf-8\r\nContent-Transfer-Encoding: quoted-printable\r\n",
+                 quotedPrintable(html))
+        };
+        result.push_back(message(random, "alternative", encodedWord("UTF-8", UTF8), multipart("alternative", boundary, parts)));
+    }
+
+    // mixed { alternative { text, related { html, 2 inline images } }, pdf }
+    {
+        const QByteArray relatedBoundary = "=_rel_" + QByteArray::number(random.next());
+        const QVector<QByteArray> relatedParts {
+            part("Content-Type: text/html; charset=utf-8\r\n", html),
+            part("Content-Type: image/png; name=\"logo.png\"\r\nContent-Transfer-Encoding: base64\r\n"
+                 "Content-ID: <logo@example.org>\r\nContent-Disposition: inline\r\n", base64Lines(random.binary(8192))),
+            part("Content-Type: image/jpeg; name=\"photo.jpg\"\r\nContent-Transfer-Encoding: base64\r\n"
+                 "Content-ID: <photo@example.org>\r\nContent-Disposition: inline\r\n", base64Lines(random.binary(32768)))
+        };
+        const QByteArray alternativeBoundary = "=_alt_" + QByteArray::number(random.next());
+        const QVector<QByteArray> alternativeParts {
+            part("Content-Type: text/plain; charset=utf-8\r\n", random.text(2048)),
+            multipart("related", relatedBoundary, relatedParts)
+        };
+        const QByteArray mixedBoundary = "=_mix_" + QByteArray::number(random.next());
+        const QVector<QByteArray> mixedParts {
+            multipart("alternative", alternativeBoundary, alternativeParts),
+            part("Content-Type: application/pdf; name=\"terms.pdf\"\r\nContent-Transfer-Encoding: base64\r\n"
+                 "Content-Disposition: attachment; filename=\"terms.pdf\"\r\n", base64Lines(random.binary(65536)))
+        };
+        result.push_back(message(random, "related", "Newsletter " + encodedWord("UTF-8", UTF8),
+                                 multipart("mixed", mixedBoundary, mixedParts)));
+    }
+
+    {
+        QVector<QByteArray> parts;
+        parts.push_back(part("Content-Type: text/plain; charset=us-ascii\r\n", random.text(1024)));
+        for (int i = 1; i <= 30; ++i)
+        {
+            const QByteArray file = "scan-" + QByteArray::number(i) + ".bin";
+            parts.push_back(part("Content-Type: application/octet-stream; name=\"" + file + "\"\r\n"
+                                 "Content-Transfer-Encoding: base64\r\n"
+                                 "Content-Disposition: attachment; filename=\"" + file + "\"\r\n",
+                                 base64Lines(random.binary(4096))));
+        }
+        const QByteArray boundary = "=_att_" + QByteArray::number(random.next());
+        result.push_back(message(random, "attachments", "Scans (30 files)", multipart("mixed", boundary, parts)));
+    }
+
+    {
+        const QByteArray boundary = "=_cs_" + QByteArray::number(random.next());
+        const QVector<QByteArray> parts {
+            part("Content-Type: text/plain; charset=koi8-r\r\nContent-Transfer-Encoding: 8bit\r\n",
+                 QByteArray(KOI8R).repeated(64) + "\r\n"),
+            part("Content-Type: text/plain; charset=windows-1251\r\nContent-Transfer-Encoding: base64\r\n",
+                 base64Lines(QByteArray(CP1251).repeated(256))),
+            part("Content-Type: text/plain; charset=iso-8859-1\r\nContent-Transfer-Encoding: quoted-printable\r\n",
+                 quotedPrintable(QByteArray(LATIN1).repeated(128) + "\r\n")),
+            part("Content-Type: text/html; charset=utf-8\r\nContent-Transfer-Encoding: base64\r\n",
+                 base64Lines("<p>" + QByteArray(UTF8).repeated(128) + "</p>"))
+        };
+        const QByteArray subject = encodedWord("koi8-r", KOI8R) + ' ' + encodedWord("windows-1251", CP1251) +
+                                   " =?iso-8859-1?Q?Gr=FC=DFe?=";
+        result.push_back(message(random, "charsets", subject, multipart("mixed", boundary, parts)));
+    }
+
+    // The same messages with bare LF line ends, as some servers and files have them
+    const int crlfCount = result.size();
+    for (int i = 0; i < crlfCount; ++i)
+    {
+        Sample lf = result[i];
+        lf.name += "-lf";
+        lf.data.replace("\r\n", "\n");
+        result[i].name += "-crlf";
+        result.push_back(lf);
+    }
+    return result;
+}
+
+QVector<ParserBenchmark::Sample> ParserBenchmark::adversarialCorpus(quint32 seed, int scale)
+{
+    Generator random(seed, scale);
+    const int factor = qMax(1, scale);
+    // A linear parser needs a few milliseconds for each of these
+    const double budgetMs = 250.0 * factor;
+    QVector<Sample> result;
+
+    // Every level has its own boundary, so each one is searched for in the rest of the message
+    {
+        const int levels = 1000 * factor;
+        QByteArray head;
+        QVector<QByteArray> boundaries;
+        for (int level = 0; level < levels; ++level)
+        {
+            const QByteArray boundary = "=_n" + QByteArray::number(level) + '_' + QByteArray::number(random.next());
+            head += "Content-Type: multipart/mixed; boundary=\"" + boundary + "\"\r\n\r\n--" + boundary + "\r\n";
+            boundaries.push_back(boundary);
+        }
+        QByteArray body = head + part("Content-Type: text/plain; charset=us-ascii\r\n", random.text(64));
+        for (int level = levels - 1; level >= 0; --level)
+        {
+            body += "--" + boundaries.at(level) + "--\r\n";
+        }
+        result.push_back(message(random, "deep-nesting", "Nested " + QByteArray::number(levels), body));
+        result.last().budgetMs = budgetMs;
+    }
+
+    {
+        QByteArray subject = "Folded";
+        for (int line = 0; line < 20000 * factor; ++line)
+        {
+            subject += "\r\n ";
+            subject += WORDS[random.next() % 12];
+        }
+        const QByteArray text = random.text(256);
+        result.push_back(message(random, "header-folding", subject,
+                                 "Content-Type: text/plain; charset=us-ascii\r\n\r\n" + text));
+        result.last().budgetMs = budgetMs;
+    }
+
+    {
+        const QByteArray words[4] = {encodedWord("koi8-r", KOI8R), encodedWord("windows-1251", CP1251),
+                                     encodedWord("UTF-8", UTF8), "=?iso-8859-1?Q?Gr=FC=DFe?="};
+        QByteArray subject = words[0];
+        for (int i = 1; i < 5000 * factor; ++i)
+        {
+            subject += ' ' + words[random.next() % 4];
+        }
+        const QByteArray text = random.text(256);
+        result.push_back(message(random, "encoded-words", subject,
+                                 "Content-Type: text/plain; charset=us-ascii\r\n\r\n" + text));
+        result.last().budgetMs = budgetMs;
+    }
+
+    // Lines one character short of the boundary and no closing delimiter
+    {
+        const QByteArray boundary = "=_scan_" + QByteArray::number(random.next());
+        const QByteArray nearMiss = "--" + boundary.left(boundary.size() - 1) + "\r\n";
+        QByteArray body = "Content-Type: multipart/mixed; boundary=\"" + boundary + "\"\r\n\r\n--" + boundary + "\r\n" +
+                          "Content-Type: text/plain; charset=us-ascii\r\n\r\n";
+        body.reserve(body.size() + nearMiss.size() * 40000 * factor);
+        for (int line = 0; line < 40000 * factor; ++line)
+        {
+            body += nearMiss;
+        }
+        result.push_back(message(random, "boundary-scan", "Unterminated", body));
+        result.last().budgetMs = budgetMs;
+    }
+
+    return result;
+}
+
+QVector<ParserBenchmark::Result> ParserBenchmark::run(const QVector<Sample> &samples) const
+{
+    QVector<Result> results;
+
+    for (const auto& sample: samples)
+    {
+        const int first = results.size();
+        const qint64 size = sample.data.size();
+        results.push_back(measure(sample.name, "EmailDocument::parse", size, 1, m_minTimeMs, [&sample]() {
+            EmailDocument document;
+            document.parse(sample.data);
+            g_sink = g_sink + document.payload().size();
+        }));
+        results.push_back(measure(sample.name, "EmailDocument::parse(structure)", size, 1, m_minTimeMs, [&sample]() {
+            EmailDocument document;
+            document.parse(sample.data, EmailDocument::ParseMode::structure);
+            g_sink = g_sink + document.payload().size();
+        }));
+        results.push_back(measure(sample.name, "EmailDocument::parse(envelope)", size, 1, m_minTimeMs, [&sample]() {
+            EmailDocument document;
+            document.parse(sample.data, EmailDocument::ParseMode::envelope);
+            g_sink = g_sink + document.subject().size();
+        }));
+        // Deferring pays off only when some parts are never decoded: this is the price when all are
+        results.push_back(measure(sample.name, "EmailDocument::parse(structure)+decode", size, 1, m_minTimeMs, [&sample]() {
+            EmailDocument document;
+            document.parse(sample.data, EmailDocument::ParseMode::structure);
+            for (const auto& part: document.payload())
+            {
+                part->decode();
+                g_sink = g_sink + part->content().size();
+            }
+        }));
+        // A warm start: the structure image stored next to the message instead of parsing it
+        EmailDocument parsed;
+        parsed.parse(sample.data, EmailDocument::ParseMode::structure);
+        const QByteArray image = parsed.serialize();
+        results.push_back(measure(sample.name, "EmailDocument::deserialize", size, 1, m_minTimeMs, [&sample, &image]() {
+            EmailDocument document;
+            document.deserialize(image, sample.data);
+            g_sink = g_sink + document.payload().size();
+        }));
+        results.push_back(measure(sample.name, "EmailDocumentEntry::parse", size, 1, m_minTimeMs, [&sample]() {
+            QList<QSharedPointer<EmailDocumentEntry>> parts;
+            EmailDocumentEntry entry(&parts);
+            entry.parse(sample.data);
+            g_sink = g_sink + parts.size();
+        }));
+
+        if (sample.budgetMs > 0)
+        {
+            results.push_back(measure(sample.name, "EmailDocument::decodeMimeString", sample.subject.size(), 1, m_minTimeMs, [&sample]() {
+                g_sink = g_sink + EmailDocument::decodeMimeString(sample.subject).size();
+            }));
+        }
+        for (int i = first; i < results.size(); ++i)
+        {
+            results[i].overBudget = sample.budgetMs > 0 and results[i].nsPerOp > sample.budgetMs * 1e6;
+        }
+    }
+
+    if (samples.isEmpty()) return results;
+
+    // Header functions: one op is one header value
+    QVector<QByteArray> subjects, dates;
+    QVector<QString> senders;
+    qint64 subjectBytes = 0, dateBytes = 0, senderBytes = 0;
+    for (const auto& sample: samples)
+    {
+        subjects.push_back(sample.subject);
+        dates.push_back(sample.date);
+        senders.push_back(QString::fromUtf8(sample.from));
+        subjectBytes += sample.subject.size();
+        dateBytes += sample.date.size();
+        senderBytes += sample.from.size();
+    }
+
+    results.push_back(measure("headers", "EmailDocument::decodeMimeString", subjectBytes, subjects.size(), m_minTimeMs, [&subjects]() {
+        for (const auto& subject: subjects) g_sink = g_sink + EmailDocument::decodeMimeString(subject).size();
+    }));
+    results.push_back(measure("headers", "EmailDocument::decodeTimeString", dateBytes, dates.size(), m_minTimeMs, [&dates]() {
+        for (const auto& date: dates) g_sink = g_sink + EmailDocument::decodeTimeString(date).toSecsSinceEpoch();
+    }));
+    results.push_back(measure("headers", "EmailDocument::parseTimeString", dateBytes, dates.size(), m_minTimeMs, [&dates]() {
+        for (const auto& date: dates)
+        {
+            qint64 seconds = 0;
+            int offset = 0;
+            EmailDocument::parseTimeString(date.constData(), date.size(), &seconds, &offset);
+            g_sink = g_sink + seconds + offset;
+        }
+    }));
+    // The old parser takes the header as QString: the conversion is part of its cost
+    results.push_back(measure("headers", "legacy decodeTimeString", dateBytes, dates.size(), m_minTimeMs, [&dates]() {
+        for (const auto& date: dates) g_sink = g_sink + legacyDecodeTimeString(QString::fromLatin1(date)).toSecsSinceEpoch();
+    }));
+    results.push_back(measure("headers", "EmailDocument::extractAddress", senderBytes, senders.size(), m_minTimeMs, [&senders]() {
+        for (const auto& sender: senders) g_sink = g_sink + EmailDocument::extractAddress(sender).size();
+    }));
+    return results;
+}
+
+bool ParserBenchmark::withinBudget(const QVector<Result> &results, QByteArray *failure)
+{
+    bool within = true;
+    for (const auto& result: results)
+    {
+        if (not result.overBudget) continue;
+        within = false;
+        if (failure != nullptr)
+        {
+            if (not failure->isEmpty()) *failure += ", ";
+            *failure += result.sample + ' ' + result.function;
+        }
+    }
+    return within;
+}
+
+QByteArray ParserBenchmark::toCsv(const QVector<Result> &results)
+{
+    QByteArray csv = "sample,function,ops,ns_per_op,mb_per_s,allocs_per_op,over_budget\n";
+    for (const auto& result: results)
+    {
+        csv += result.sample + ',' + result.function + ',' + QByteArray::number(result.ops) + ',' +
+               QByteArray::number(result.nsPerOp, 'f', 1) + ',' +
+               QByteArray::number(result.megabytesPerSecond, 'f', 2) + ',' +
+               QByteArray::number(result.allocationsPerOp, 'f', 2) + ',' +
+               (result.overBudget ? '1' : '0') + '\n';
+    }
+    return csv;
+}
+
+bool ParserBenchmark::countsAllocations()
+{
+#ifdef PARSERBENCHMARK_MALLOC_HOOK
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QVector>
+
+/*
+ * Microbenchmarks of the parser on a deterministic synthetic corpus: plain
+ * text, HTML alternatives, multipart/related nested in alternatives, many
+ * attachments and mixed charsets, each with CRLF and with bare LF line ends.
+ *
+ * Every function is repeated until minTimeMs have passed and reported as
+ * ns/op, MB/s of input and allocations/op. Allocations are counted only in
+ * builds with QTEMAILFETCHER_COUNT_ALLOCATIONS on glibc, which replaces
+ * malloc for the whole program; otherwise they are reported as -1.
+ *
+ * The adversarial corpus holds inputs that make a careless parser quadratic
+ * or recursive. Its samples carry a time budget per op, sized for a parser
+ * that stays linear in the input, and withinBudget() fails a run over it.
+ */
+class ParserBenchmark
+{
+public:
+    struct Sample
+    {
+        QByteArray name;    // "related-crlf", ...
+        QByteArray data;
+        QByteArray subject; // raw header values, for the header functions
+        QByteArray from;
+        QByteArray date;
+        double budgetMs = 0; // limit per op of every per-sample function, 0: none
+    };
+
+    struct Result
+    {
+        QByteArray sample;   // sample name, "headers" for the header functions
+        QByteArray function;
+        quint64 ops = 0;
+        double nsPerOp = 0;
+        double megabytesPerSecond = 0;
+        double allocationsPerOp = -1;
+        bool overBudget = false;
+    };
+
+    /* same seed and scale, same bytes; scale multiplies text and attachment sizes */
+    static QVector<Sample> corpus(quint32 seed = 1, int scale = 1);
+    /* multiparts nested past the depth limit, a header folded over many lines,
+       a subject of many encoded-words, a long body of near-miss boundaries */
+    static QVector<Sample> adversarialCorpus(quint32 seed = 1, int scale = 1);
+
+    explicit ParserBenchmark(int minTimeMs = 200) : m_minTimeMs(minTimeMs) {}
+
+    /* EmailDocument::parse in every mode and structure followed by decoding
+       every part, deserialize of a structure image,
+       EmailDocumentEntry::parse per sample, decodeMimeString of the subject of
+       samples with a budget; decodeMimeString, decodeTimeString (with its
+       parseTimeString core and the QDateTime::fromString based parser it
+       replaced), extractAddress over all headers */
+    QVector<Result> run(const QVector<Sample>& samples) const;
+    /* false when a result is over its sample's budget; failure gets "sample function" of each */
+    static bool withinBudget(const QVector<Result>& results, QByteArray* failure = nullptr);
+
+    /* "sample,function,ops,ns_per_op,mb_per_s,allocs_per_op,over_budget" and one line per result */
+    static QByteArray toCsv(const QVector<Result>& results);
+
+    static bool countsAllocations();
+
+private:
+    int m_minTimeMs;
+};
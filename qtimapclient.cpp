@@ -6,14 +6,86 @@
 
 #include "qtimapclient.h"
 
+#include "imapresponse.h"
+#include "tracing.h"
+
 #include <QDebug>
-#include <QRegularExpression>
-#include <QDebug>
+#include <QDir>
+#include <QHash>
+
+namespace {
+
+typedef ImapResponseTokenizer::Token Token;
+
+// "* LIST (flags) delimiter name" and "* STATUS name (MESSAGES n UNSEEN n ...)" lines
+void parseFolders(const QByteArray& response, QVector<QtImapClient::FolderStatus>& result)
+{
+    QHash<QByteArray, int> byName;
+    ImapResponseTokenizer tokenizer(response);
+
+    for (Token token = tokenizer.next(); token != Token::end; token = tokenizer.next())
+    {
+        if (token == Token::lineEnd) continue;
+
+        bool list = false;
+        bool status = false;
+        if (token == Token::atom and tokenizer.is("*"))
+        {
+            token = tokenizer.next();
+            list = token == Token::atom and tokenizer.is("LIST");
+            status = token == Token::atom and tokenizer.is("STATUS");
+        }
 
-QtImapClient::QtImapClient() : m_imapClient ([this](const std::string& strLogMsg) {
-        qWarning() << "QtImapClient backend:" << strLogMsg.c_str();
-        m_backEndErrors.push_back(strLogMsg.c_str());
-    })
+        if (list and tokenizer.next() == Token::listBegin)
+        {
+            bool selectable = true;
+            for (token = tokenizer.next(); token == Token::atom; token = tokenizer.next())
+            {
+                if (tokenizer.is("\\NOSELECT") or tokenizer.is("\\NONEXISTENT")) selectable = false;
+            }
+            tokenizer.next(); // hierarchy delimiter
+            token = tokenizer.next();
+            if (selectable and (token == Token::atom or token == Token::string))
+            {
+                const QByteArray name = tokenizer.text();
+                if (not byName.contains(name))
+                {
+                    byName.insert(name, result.size());
+                    QtImapClient::FolderStatus folder;
+                    folder.name = QString::fromUtf8(name);
+                    result.push_back(folder);
+                }
+            }
+        }
+        else if (status)
+        {
+            token = tokenizer.next();
+            const int index = byName.value(tokenizer.text(), -1);
+            if ((token == Token::atom or token == Token::string) and index >= 0 and tokenizer.next() == Token::listBegin)
+            {
+                QtImapClient::FolderStatus& folder = result[index];
+                for (token = tokenizer.next(); token == Token::atom; token = tokenizer.next())
+                {
+                    quint32* target = nullptr;
+                    if (tokenizer.is("MESSAGES"))         target = &folder.messages;
+                    else if (tokenizer.is("UNSEEN"))      target = &folder.unseen;
+                    else if (tokenizer.is("UIDNEXT"))     target = &folder.uidNext;
+                    else if (tokenizer.is("UIDVALIDITY")) target = &folder.uidValidity;
+
+                    if (tokenizer.next() != Token::atom) break;
+                    if (target != nullptr) *target = static_cast<quint32>(tokenizer.number());
+                }
+            }
+        }
+
+        if (token != Token::lineEnd and token != Token::end) tokenizer.skipLine();
+        if (token == Token::end) break;
+    }
+}
+
+} // namespace
+
+QtImapClient::QtImapClient()
 {}
 
 QtImapClient::~QtImapClient()
@@ -21,7 +93,16 @@ QtImapClient::~QtImapClient()
     m_imapClient.CleanupSession();
 }
 
-bool QtImapClient::checkUnseen(QList<unsigned int> &result)
+bool QtImapClient::checkUnseen(QList<unsigned int> &result, const QString &folder)
+{
+    SequenceSet unseen;
+    if (not checkUnseen(unseen, folder)) return false;
+
+    result = unseen.toList();
+    return true;
+}
+
+bool QtImapClient::checkUnseen(SequenceSet &result, const QString &folder)
 {
     if (not initConnection())
     {
@@ -31,35 +112,48 @@ bool QtImapClient::checkUnseen(QList<unsigned int> &result)
 
     std::string out;
 
-    bool status = m_imapClient.Search(out, CIMAPClient::SearchOption::UNSEEN);
+    QMutexLocker lock(&m_mtxClient);
+    bool status = m_imapClient.Search(out, CIMAPClient::SearchOption::UNSEEN, folder.toStdString());
+    lock.unlock();
     if (not status)
     {
         m_errorString = "Fetch unseen messages failed";
         return false;
     }
 
-    static const QRegularExpression onlyNumbers("[^ 0-9]");
-    QString string = QString::fromStdString(out.c_str());
-    string.remove(onlyNumbers);
-    while (string.contains("  ")) string.remove("  ");
-    QStringList strList = string.split(' ');
+    result = SequenceSet::fromSearchResponse(QByteArray::fromRawData(out.c_str(), static_cast<int>(out.size())));
+    return true;
+}
 
-    if (not result.isEmpty()) result.clear();
+bool QtImapClient::search(const SearchQuery &query, SearchResult &result, bool byUid, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
 
-    QStringListIterator iter(strList);
-    while (iter.hasNext())
+    std::string out;
+
+    QMutexLocker lock(&m_mtxClient);
+    QByteArray criteria = query.toString();
+    if (hasCapability("ESEARCH"))
     {
-        bool ok = false;
-        auto val = iter.next().toUInt(&ok);
-        if (ok)
-        {
-            result.push_back(val);
-        }
+        criteria.prepend("RETURN (MIN MAX COUNT ALL) ");
     }
+    bool status = m_imapClient.Search(out, criteria.toStdString(), byUid, folder.toStdString());
+    lock.unlock();
+    if (not status)
+    {
+        m_errorString = "Search failed";
+        return false;
+    }
+
+    result = SearchResult::fromResponse(QByteArray::fromRawData(out.c_str(), static_cast<int>(out.size())));
     return true;
 }
 
-QSharedPointer<EmailDocument> QtImapClient::fetch(unsigned int mailIndex)
+QSharedPointer<EmailDocument> QtImapClient::fetch(unsigned int mailIndex, EmailDocument::ParseMode mode, const QString &folder)
 {
     if (not initConnection())
     {
@@ -67,8 +161,32 @@ QSharedPointer<EmailDocument> QtImapClient::fetch(unsigned int mailIndex)
         return nullptr;
     }
 
+    if (not m_messageStore.isNull() or m_documentCache.budget() > 0)
+    {
+        // Store and cache are keyed by UID: "UID SEARCH n" resolves it in one round trip
+        std::string out;
+        QMutexLocker lock(&m_mtxClient);
+        const bool status = m_imapClient.Search(out, std::to_string(mailIndex), true, folder.toStdString());
+        lock.unlock();
+        const SequenceSet uids = status ? SequenceSet::fromSearchResponse(QByteArray::fromRawData(out.c_str(), static_cast<int>(out.size())))
+                                        : SequenceSet();
+        if (uids.isEmpty())
+        {
+            m_errorString = "Fetching failed";
+            return nullptr;
+        }
+        return fetchUid(uids.min(), mode, folder);
+    }
+
+    QTEMAILFETCHER_TRACE_SCOPE("fetch");
     std::string output;
-    bool fetchStatus = m_imapClient.GetString(std::to_string(mailIndex), output);
+    QMutexLocker lock(&m_mtxClient);
+    bool fetchStatus = false;
+    {
+        QTEMAILFETCHER_TRACE_SCOPE("fetch.network");
+        fetchStatus = m_imapClient.GetString(std::to_string(mailIndex), output, folder.toStdString());
+    }
+    lock.unlock();
 
     if (not fetchStatus)
     {
@@ -77,10 +195,433 @@ QSharedPointer<EmailDocument> QtImapClient::fetch(unsigned int mailIndex)
     }
 
     QSharedPointer<EmailDocument> document(new EmailDocument);
-    document->parse(output.c_str());
+    document->parse(output.c_str(), mode);
     return document;
 }
 
+QSharedPointer<EmailDocument> QtImapClient::fetchUid(unsigned int uid, EmailDocument::ParseMode mode, const QString &folder)
+{
+    QTEMAILFETCHER_TRACE_SCOPE("fetch");
+    if (m_documentCache.budget() <= 0)
+    {
+        return loadUid(uid, mode, folder);
+    }
+
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return nullptr;
+    }
+
+    DocumentCache::Key key;
+    key.folder = folder;
+    key.uid = uid;
+    QMutexLocker lock(&m_mtxClient);
+    const bool known = uidValidity(folder, key.uidValidity);
+    lock.unlock();
+    if (not known)
+    {
+        // Without UIDVALIDITY a cached UID may name another message
+        return loadUid(uid, mode, folder);
+    }
+    return m_documentCache.get(key, mode, [this, uid, mode, folder]() { return loadUid(uid, mode, folder); });
+}
+
+QSharedPointer<EmailDocument> QtImapClient::loadUid(unsigned int uid, EmailDocument::ParseMode mode, const QString &folder)
+{
+    QByteArray raw;
+    if (not fetchRaw(uid, raw, folder))
+    {
+        return nullptr;
+    }
+
+    MessageStore::Key key;
+    key.folder = folder;
+    key.uid = uid;
+    if (not m_documentStore.isNull())
+    {
+        QMutexLocker lock(&m_mtxClient);
+        uidValidity(folder, key.uidValidity); // known by now when the message came from the store
+    }
+
+    QSharedPointer<EmailDocument> document(new EmailDocument);
+    bool stored = false;
+    if (key.uidValidity != 0)
+    {
+        QTEMAILFETCHER_TRACE_SCOPE("fetch.image");
+        QByteArray image;
+        QSharedPointer<const uchar> mapping; // deserialize() reads the image straight from the mmap
+        stored = m_documentStore->map(key, image, mapping);
+        if (stored and document->deserialize(image, raw) and document->parseMode() >= mode)
+        {
+            return document;
+        }
+        document.reset(new EmailDocument);
+    }
+
+    document->parse(raw, mode);
+    if (key.uidValidity != 0)
+    {
+        // A stored image that was too shallow (or unreadable) gives way to this one
+        m_documentStore->put(key, document->serialize(), stored);
+    }
+    return document;
+}
+
+bool QtImapClient::fetchMailboxIndex(MailboxIndex &index, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    std::string output;
+    QMutexLocker lock(&m_mtxClient);
+    bool status = m_imapClient.FetchSummaries(output, "1:*", folder.toStdString());
+    lock.unlock();
+
+    if (not status)
+    {
+        m_errorString = "Fetching summaries failed";
+        return false;
+    }
+
+    index.clear();
+    index.parseFetchResponse(QByteArray::fromRawData(output.c_str(), static_cast<int>(output.size())));
+    return true;
+}
+
+bool QtImapClient::listFolders(QVector<FolderStatus> &result)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+
+    result.clear();
+    std::string output;
+    if (hasCapability("LIST-STATUS"))
+    {
+        if (not m_imapClient.ListStatus(output))
+        {
+            m_errorString = "Listing folders failed";
+            return false;
+        }
+        parseFolders(QByteArray::fromRawData(output.c_str(), static_cast<int>(output.size())), result);
+        updateUidValidity(result);
+        return true;
+    }
+
+    // Without LIST-STATUS: one LIST, then one STATUS per folder on this connection
+    if (not m_imapClient.List(output))
+    {
+        m_errorString = "Listing folders failed";
+        return false;
+    }
+    QVector<FolderStatus> folders;
+    parseFolders(QByteArray::fromRawData(output.c_str(), static_cast<int>(output.size())), folders);
+    for (const auto& folder: folders)
+    {
+        if (not m_imapClient.Status(folder.name.toStdString(), output))
+        {
+            m_errorString = "Folder status failed: " + folder.name;
+            return false;
+        }
+    }
+    parseFolders(QByteArray::fromRawData(output.c_str(), static_cast<int>(output.size())), result);
+    updateUidValidity(result);
+    return true;
+}
+
+bool QtImapClient::appendMessages(const QVector<QByteArray> &messages, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+    const std::string mailbox = folder.toStdString();
+    const bool batching = hasCapability("MULTIAPPEND") and hasCapability("LITERAL+");
+    const size_t header = 8 + mailbox.size() * 2 + 2; // APPEND and the quoted, worst case escaped name
+
+    std::vector<std::string> batch;
+    size_t batchSize = header;
+    auto flush = [this, &batch, &batchSize, &mailbox, header]() {
+        bool status = true;
+        if (batch.size() == 1) status = m_imapClient.SendString(batch.front(), mailbox);
+        else if (not batch.empty()) status = m_imapClient.MultiAppend(batch, mailbox);
+        batch.clear();
+        batchSize = header;
+        return status;
+    };
+
+    for (const auto& message: messages)
+    {
+        std::string mail(message.constData(), static_cast<size_t>(message.size()));
+        const size_t cost = batching and not message.contains('\0') ? CIMAPClient::MultiAppendCost(mail) : 0;
+
+        if (cost == 0 or header + cost > CIMAPClient::MULTIAPPEND_MAX_COMMAND)
+        {
+            // The batch goes first: the server assigns UIDs in the order it receives messages
+            if (not flush() or not m_imapClient.SendString(mail, mailbox))
+            {
+                m_errorString = "Append failed";
+                return false;
+            }
+            continue;
+        }
+
+        if (batchSize + cost > CIMAPClient::MULTIAPPEND_MAX_COMMAND and not flush())
+        {
+            m_errorString = "Append failed";
+            return false;
+        }
+        batch.push_back(std::move(mail));
+        batchSize += cost;
+    }
+
+    if (not flush())
+    {
+        m_errorString = "Append failed";
+        return false;
+    }
+    return true;
+}
+
+bool QtImapClient::storeFlags(const SequenceSet &uids, CIMAPClient::MailProperty property, bool add, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+    for (const auto& chunk: uids.toStrings())
+    {
+        if (not m_imapClient.StoreProperty(chunk.toStdString(), property, add, folder.toStdString()))
+        {
+            m_errorString = "Storing flags failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool QtImapClient::moveMessages(const SequenceSet &uids, const QString &destination, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+    const bool move = hasCapability("MOVE");
+    const bool uidExpunge = hasCapability("UIDPLUS");
+
+    for (const auto& chunk: uids.toStrings())
+    {
+        const std::string set = chunk.toStdString();
+        bool status = false;
+        if (move)
+        {
+            status = m_imapClient.MoveMail(set, destination.toStdString(), folder.toStdString());
+        }
+        else
+        {
+            // Without UIDPLUS the originals stay flagged \Deleted: a plain EXPUNGE
+            // would also remove messages someone else marked
+            status = m_imapClient.CopyMail(set, destination.toStdString(), folder.toStdString(), true) and
+                     m_imapClient.StoreProperty(set, CIMAPClient::MailProperty::Deleted, true, folder.toStdString()) and
+                     (not uidExpunge or m_imapClient.Expunge(set, folder.toStdString()));
+        }
+
+        if (not status)
+        {
+            m_errorString = "Moving messages failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool QtImapClient::expunge(const SequenceSet &uids, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+    if (not hasCapability("UIDPLUS"))
+    {
+        m_errorString = "Server has no UIDPLUS, UID EXPUNGE is not available";
+        return false;
+    }
+
+    for (const auto& chunk: uids.toStrings())
+    {
+        if (not m_imapClient.Expunge(chunk.toStdString(), folder.toStdString()))
+        {
+            m_errorString = "Expunge failed";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool QtImapClient::setMessageStore(const QString &directory, qint64 budgetBytes)
+{
+    QSharedPointer<MessageStore> store(new MessageStore(directory, budgetBytes));
+    if (not store->open())
+    {
+        m_errorString = "Message store: " + store->errorString();
+        return false;
+    }
+
+    QSharedPointer<MessageStore> documents(new MessageStore(QDir(directory).filePath("documents"), budgetBytes / 8));
+    if (not documents->open())
+    {
+        m_errorString = "Document store: " + documents->errorString();
+        return false;
+    }
+
+    m_messageStore = store;
+    m_documentStore = documents;
+    return true;
+}
+
+MessageStore::Stats QtImapClient::messageStoreStats() const
+{
+    return m_messageStore.isNull() ? MessageStore::Stats() : m_messageStore->stats();
+}
+
+bool QtImapClient::fetchRaw(unsigned int uid, QByteArray &raw, const QString &folder)
+{
+    if (not initConnection())
+    {
+        m_errorString = "Connection initialize failed";
+        return false;
+    }
+
+    QMutexLocker lock(&m_mtxClient);
+
+    MessageStore::Key key;
+    if (not m_messageStore.isNull())
+    {
+        key.folder = folder;
+        key.uid = uid;
+        QTEMAILFETCHER_TRACE_SCOPE("fetch.store");
+        if (uidValidity(folder, key.uidValidity) and m_messageStore->get(key, raw))
+        {
+            return true;
+        }
+    }
+
+    std::string output;
+    bool fetched = false;
+    {
+        QTEMAILFETCHER_TRACE_SCOPE("fetch.network");
+        fetched = m_imapClient.GetStringByUID(std::to_string(uid), output, folder.toStdString());
+    }
+    if (not fetched)
+    {
+        // The UID may be gone because the folder was recreated: ask for UIDVALIDITY again
+        m_uidValidity.remove(folder);
+        m_errorString = "Fetching failed";
+        return false;
+    }
+
+    raw = QByteArray(output.c_str(), static_cast<int>(output.size()));
+    if (not m_messageStore.isNull() and key.uidValidity != 0)
+    {
+        m_messageStore->put(key, raw);
+    }
+    return true;
+}
+
+bool QtImapClient::uidValidity(const QString &folder, quint32 &value)
+{
+    // Asked once per folder until the server reports another value (listFolders)
+    // or a UID fetch fails; store and cache hits never reach the server.
+    // STATUS, unlike EXAMINE, leaves the selected folder alone.
+    value = m_uidValidity.value(folder);
+    if (value == 0)
+    {
+        std::string info;
+        if (not m_imapClient.Status(folder.toStdString(), info))
+        {
+            return false;
+        }
+
+        const auto pos = info.find("UIDVALIDITY ");
+        if (pos == std::string::npos)
+        {
+            return false;
+        }
+        value = static_cast<quint32>(std::strtoul(info.c_str() + pos + 12, nullptr, 10));
+        if (value != 0) m_uidValidity.insert(folder, value);
+    }
+
+    return value != 0;
+}
+
+void QtImapClient::updateUidValidity(const QVector<FolderStatus> &folders)
+{
+    // A new value means new keys: stale store and cache entries are never hit again
+    for (const auto& folder: folders)
+    {
+        if (folder.uidValidity != 0) m_uidValidity.insert(folder.name, folder.uidValidity);
+    }
+}
+
+bool QtImapClient::hasCapability(const char *name)
+{
+    // Asked once per session, like UIDVALIDITY; an unknown answer means "no"
+    if (m_capabilities.isEmpty())
+    {
+        std::string info;
+        if (not m_imapClient.Capability(info))
+        {
+            return false;
+        }
+        m_capabilities = " " + QByteArray(info.c_str()).toUpper().simplified() + " ";
+    }
+
+    return m_capabilities.contains(" " + QByteArray(name) + " ");
+}
+
+QStringList QtImapClient::backendErrors() const
+{
+    QStringList result;
+    for (const CMailLog::Event& event: m_imapClient.GetLog().Read())
+    {
+        result.push_back(QString::fromStdString(CMailLog::Format(event)));
+    }
+    return result;
+}
+
+void QtImapClient::copySettings(const QtImapClient &other)
+{
+    m_hostname = other.m_hostname;
+    m_port = other.m_port;
+    m_connectionType = other.m_connectionType;
+    m_proxy = other.m_proxy;
+    m_username = other.m_username;
+    m_password = other.m_password;
+    m_imapClient.SetCompression(other.m_imapClient.GetCompression());
+    m_imapClient.SetTransport(other.m_imapClient.GetTransport());
+    m_imapClient.SetMetrics(other.m_imapClient.GetMetrics());
+}
+
 bool QtImapClient::initConnection()
 {
     QMutexLocker lock (&m_mtxInit);
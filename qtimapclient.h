@@ -6,19 +6,36 @@
 
 #pragma once
 
+#include "documentcache.h"
 #include "emaildocument.h"
+#include "mailboxindex.h"
+#include "messagestore.h"
+#include "searchquery.h"
+#include "sequenceset.h"
 
 #include "IMAPClient.h"
 
+#include <QHash>
 #include <QMutex>
 #include <QString>
+#include <QStringList>
 #include <QSharedPointer>
+#include <QVector>
 
 class QtImapClient {
 
 public:
     enum class ConnectionType { START_TLS, SSL, PLAIN_TEXT };
 
+    struct FolderStatus
+    {
+        QString name; // as the server spells it (modified UTF-7)
+        quint32 messages = 0;
+        quint32 unseen = 0;
+        quint32 uidNext = 0;
+        quint32 uidValidity = 0;
+    };
+
     QtImapClient();
     ~QtImapClient();
     void setHostname(const QString& host)       { m_hostname = host; }
@@ -27,18 +44,80 @@ public:
     void setHttpProxy(const QString& address)   { m_proxy = address; }
     void setPassword(const QString& password)   { m_password = password; }
     void setUsername(const QString& username)   { m_username = username; }
+    /* record or replay the session instead of talking to the server, see
+       MAILTransport.h; not owned. Set before the first request. */
+    void setTransport(CMailTransport* transport) { m_imapClient.SetTransport(transport); }
+    /* per-operation timings, see MAILMetrics.h; not owned, may be shared by clients */
+    void setMetrics(CMailMetrics* metrics) { m_imapClient.SetMetrics(metrics); }
+    /* COMPRESS=DEFLATE for PLAIN_TEXT connections without a proxy; on other connections it is
+       ignored with a warning in backendErrors(). Set before the first request. */
+    void setCompression(bool enable) { m_imapClient.SetCompression(enable); }
+    /* takes host, port, credentials, proxy, compression, transport and metrics of other, for opening extra connections */
+    void copySettings(const QtImapClient& other);
+
+    bool checkUnseen(QList<unsigned int>& result, const QString& folder = "INBOX");
+    bool checkUnseen(SequenceSet& result, const QString& folder = "INBOX");
+
+    /* one SEARCH round trip; uses ESEARCH RETURN (MIN MAX COUNT ALL) when the server has it */
+    bool search(const SearchQuery& query, SearchResult& result, bool byUid = true, const QString& folder = "INBOX");
+    /* by sequence number; with a message store or document cache the number is first
+       resolved to a UID (one UID SEARCH) and the fetch goes through them like fetchUid */
+    QSharedPointer<EmailDocument> fetch(unsigned int mailIndex, EmailDocument::ParseMode mode = EmailDocument::ParseMode::full,
+                                        const QString& folder = "INBOX");
+    QSharedPointer<EmailDocument> fetchUid(unsigned int uid, EmailDocument::ParseMode mode = EmailDocument::ParseMode::full,
+                                           const QString& folder = "INBOX");
+    /* the message as sent by the server, through the message store when set; see FetchPipeline */
+    bool fetchRaw(unsigned int uid, QByteArray& raw, const QString& folder = "INBOX");
+
+    /* replaces index contents with a summary of every message in folder, one round trip */
+    bool fetchMailboxIndex(MailboxIndex& index, const QString& folder = "INBOX");
+
+    /* uploads messages to folder; small ones are batched into MULTIAPPEND commands
+       when the server has MULTIAPPEND and LITERAL+, the rest go one APPEND each */
+    bool appendMessages(const QVector<QByteArray>& messages, const QString& folder = "INBOX");
+
+    /* selectable folders with their counts; one LIST-STATUS round trip when the server has it */
+    bool listFolders(QVector<FolderStatus>& result);
+
+    /* set-based maintenance by UID: one command per ~8 KB of sequence set, not per message */
+    bool storeFlags(const SequenceSet& uids, CIMAPClient::MailProperty property, bool add = true,
+                    const QString& folder = "INBOX");
+    /* UID MOVE when the server has MOVE; otherwise copy, flag \Deleted and, with UIDPLUS, UID EXPUNGE */
+    bool moveMessages(const SequenceSet& uids, const QString& destination, const QString& folder = "INBOX");
+    /* UID EXPUNGE, needs UIDPLUS: unlike EXPUNGE it does not touch other \Deleted messages */
+    bool expunge(const SequenceSet& uids, const QString& folder = "INBOX");
+
+    /* raw messages fetched by UID are kept on disk and shared with other processes,
+       keyed by folder, UIDVALIDITY and UID; so are images of the documents parsed
+       from them (in "documents", an eighth of the budget), which a warm start
+       loads instead of parsing again */
+    bool setMessageStore(const QString& directory, qint64 budgetBytes = 1024ll * 1024 * 1024);
+    MessageStore::Stats messageStoreStats() const;
 
-    bool checkUnseen(QList<unsigned int>& result);
-    QSharedPointer<EmailDocument> fetch(unsigned int mailIndex);
+    /* parsed documents fetched by UID are shared between callers; 0 disables */
+    void setDocumentCacheBudget(qint64 budgetBytes) { m_documentCache.setBudget(budgetBytes); }
+    DocumentCache::Stats documentCacheStats() const { return m_documentCache.stats(); }
 
     QString errorString() const { return m_errorString; }
+    /* the last backend log messages, oldest first; formatted on each call */
+    QStringList backendErrors() const;
 
 private:
     bool initConnection();
+    QSharedPointer<EmailDocument> loadUid(unsigned int uid, EmailDocument::ParseMode mode, const QString& folder);
+    bool uidValidity(const QString& folder, quint32& value);
+    void updateUidValidity(const QVector<FolderStatus>& folders);
+    bool hasCapability(const char* name);
     bool m_inited = false;
     QMutex m_mtxInit;
 
     CIMAPClient m_imapClient;
+    QMutex m_mtxClient; // one curl handle: one request at a time
+    DocumentCache m_documentCache;
+    QSharedPointer<MessageStore> m_messageStore;
+    QSharedPointer<MessageStore> m_documentStore; // EmailDocument::serialize() images
+    QHash<QString, quint32> m_uidValidity; // by folder
+    QByteArray m_capabilities;
 
     ConnectionType m_connectionType = ConnectionType::START_TLS;
 
@@ -50,5 +129,4 @@ private:
     QString m_proxy;
 
     QString m_errorString;
-    QStringList m_backEndErrors;
 };
@@ -0,0 +1,210 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "searchquery.h"
+
+#include "imapresponse.h"
+
+#include <algorithm>
+
+namespace {
+
+const char* const MONTHS[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// date = date-day "-" date-month "-" date-year, month names are not localized
+QByteArray imapDate(const QDate& date)
+{
+    if (not date.isValid()) return "1-Jan-1970";
+    return QByteArray::number(date.day()) + '-' + MONTHS[date.month() - 1] + '-' + QByteArray::number(date.year());
+}
+
+} // namespace
+
+SearchQuery::SearchQuery() :
+    m_keys(0),
+    m_utf8(false)
+{
+
+}
+
+SearchQuery::SearchQuery(const QByteArray &criteria, int keys, bool utf8) :
+    m_criteria(criteria),
+    m_keys(keys),
+    m_utf8(utf8)
+{
+
+}
+
+SearchQuery SearchQuery::flag(CIMAPClient::SearchOption option)
+{
+    switch (option)
+    {
+    case CIMAPClient::SearchOption::ANSWERED: return SearchQuery("ANSWERED", 1, false);
+    case CIMAPClient::SearchOption::DELETED:  return SearchQuery("DELETED", 1, false);
+    case CIMAPClient::SearchOption::DRAFT:    return SearchQuery("DRAFT", 1, false);
+    case CIMAPClient::SearchOption::FLAGGED:  return SearchQuery("FLAGGED", 1, false);
+    case CIMAPClient::SearchOption::NEW:      return SearchQuery("NEW", 1, false);
+    case CIMAPClient::SearchOption::RECENT:   return SearchQuery("RECENT", 1, false);
+    case CIMAPClient::SearchOption::SEEN:     return SearchQuery("SEEN", 1, false);
+    case CIMAPClient::SearchOption::UNSEEN:   return SearchQuery("UNSEEN", 1, false);
+    }
+    return SearchQuery();
+}
+
+SearchQuery SearchQuery::since(const QDate &date)
+{
+    return SearchQuery("SINCE " + imapDate(date), 1, false);
+}
+
+SearchQuery SearchQuery::before(const QDate &date)
+{
+    return SearchQuery("BEFORE " + imapDate(date), 1, false);
+}
+
+SearchQuery SearchQuery::from(const QString &text)
+{
+    return SearchQuery::text("FROM", text);
+}
+
+SearchQuery SearchQuery::to(const QString &text)
+{
+    return SearchQuery::text("TO", text);
+}
+
+SearchQuery SearchQuery::subject(const QString &text)
+{
+    return SearchQuery::text("SUBJECT", text);
+}
+
+SearchQuery SearchQuery::header(const QString &field, const QString &text)
+{
+    // HEADER takes two strings: the field name and the substring to look for
+    SearchQuery name = SearchQuery::text("HEADER", field);
+    SearchQuery value = SearchQuery::text("", text);
+    return SearchQuery(name.m_criteria + value.m_criteria, 1, name.m_utf8 or value.m_utf8);
+}
+
+SearchQuery SearchQuery::larger(quint32 bytes)
+{
+    return SearchQuery("LARGER " + QByteArray::number(bytes), 1, false);
+}
+
+SearchQuery SearchQuery::smaller(quint32 bytes)
+{
+    return SearchQuery("SMALLER " + QByteArray::number(bytes), 1, false);
+}
+
+SearchQuery SearchQuery::uid(const SequenceSet &uids)
+{
+    // An empty set is not valid syntax; UID 0 is never assigned, so nothing matches
+    return SearchQuery("UID " + (uids.isEmpty() ? QByteArray("0") : uids.toString()), 1, false);
+}
+
+SearchQuery SearchQuery::operator&&(const SearchQuery &other) const
+{
+    if (m_keys == 0) return other;
+    if (other.m_keys == 0) return *this;
+    return SearchQuery(m_criteria + ' ' + other.m_criteria, m_keys + other.m_keys, m_utf8 or other.m_utf8);
+}
+
+SearchQuery SearchQuery::operator||(const SearchQuery &other) const
+{
+    if (m_keys == 0 or other.m_keys == 0) return SearchQuery();
+    return SearchQuery("OR " + operand() + ' ' + other.operand(), 1, m_utf8 or other.m_utf8);
+}
+
+SearchQuery SearchQuery::operator!() const
+{
+    return SearchQuery("NOT " + operand(), 1, m_utf8);
+}
+
+QByteArray SearchQuery::toString() const
+{
+    QByteArray result;
+    if (m_utf8) result = "CHARSET UTF-8 ";
+    result += m_keys == 0 ? QByteArray("ALL") : m_criteria;
+    return result;
+}
+
+SearchQuery SearchQuery::text(const char *key, const QString &value)
+{
+    // Quoted string: backslash and quote escaped, CR and LF cannot be sent at all.
+    // 8-bit text strictly needs a literal, but curl cannot send one inside a
+    // custom request; UTF-8 in a quoted string is accepted by common servers.
+    const QByteArray utf8 = value.toUtf8();
+    QByteArray result = key;
+    result.reserve(result.size() + utf8.size() + 4);
+    result += " \"";
+
+    bool eightBit = false;
+    for (const char c: utf8)
+    {
+        if (c == '\r' or c == '\n')
+        {
+            result += ' ';
+            continue;
+        }
+        if (c == '"' or c == '\\') result += '\\';
+        if (static_cast<quint8>(c) >= 0x80) eightBit = true;
+        result += c;
+    }
+    result += '"';
+    return SearchQuery(result, 1, eightBit);
+}
+
+QByteArray SearchQuery::operand() const
+{
+    if (m_keys == 0) return "ALL";
+    if (m_keys == 1) return m_criteria;
+    return '(' + m_criteria + ')';
+}
+
+SearchResult SearchResult::fromResponse(const QByteArray &response)
+{
+    SearchResult result;
+    result.all = SequenceSet::fromSearchResponse(response);
+    result.min = result.all.min();
+    result.max = result.all.max();
+    result.count = result.all.count();
+
+    // ESEARCH may return MIN/MAX/COUNT without ALL: take the server's numbers
+    const char* pos = response.constData();
+    const char* const end = pos + response.size();
+    while (pos < end)
+    {
+        const char* lineEnd = std::find(pos, end, '\n');
+        ImapResponseTokenizer tokenizer(pos, lineEnd);
+        if (tokenizer.next() == ImapResponseTokenizer::Token::atom and tokenizer.is("*") and
+            tokenizer.next() == ImapResponseTokenizer::Token::atom and tokenizer.is("ESEARCH"))
+        {
+            for (auto token = tokenizer.next(); token != ImapResponseTokenizer::Token::end; token = tokenizer.next())
+            {
+                if (token == ImapResponseTokenizer::Token::listBegin)
+                {
+                    tokenizer.skipList();
+                    continue;
+                }
+                if (token != ImapResponseTokenizer::Token::atom) continue;
+
+                const bool isCount = tokenizer.is("COUNT");
+                const bool isMin = tokenizer.is("MIN");
+                if (not isCount and not isMin and not tokenizer.is("MAX")) continue;
+
+                bool ok = false;
+                if (tokenizer.next() != ImapResponseTokenizer::Token::atom) continue;
+                const quint64 value = tokenizer.number(&ok);
+                if (not ok) continue;
+
+                if (isCount) result.count = value;
+                else if (isMin) result.min = static_cast<quint32>(value);
+                else result.max = static_cast<quint32>(value);
+            }
+        }
+        pos = lineEnd < end ? lineEnd + 1 : end;
+    }
+    return result;
+}
@@ -0,0 +1,75 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include "sequenceset.h"
+
+#include "IMAPClient.h"
+
+#include <QByteArray>
+#include <QDate>
+#include <QString>
+
+/*
+ * IMAP SEARCH criteria (RFC 3501 section 6.4.4) built from small pieces:
+ *
+ *     auto query = SearchQuery::since(date) && !SearchQuery::from("noreply@")
+ *               && (SearchQuery::larger(1 << 20) || SearchQuery::header("X-Priority", "1"));
+ *
+ * Every piece is rendered when it is created, so combining is string
+ * concatenation: AND is juxtaposition, OR and NOT are prefix keys, and
+ * compound operands are parenthesized. Non-ASCII strings switch the whole
+ * query to CHARSET UTF-8.
+ */
+class SearchQuery
+{
+public:
+    /* matches everything */
+    SearchQuery();
+
+    static SearchQuery flag(CIMAPClient::SearchOption option);
+    static SearchQuery since(const QDate& date);
+    static SearchQuery before(const QDate& date);
+    static SearchQuery from(const QString& text);
+    static SearchQuery to(const QString& text);
+    static SearchQuery subject(const QString& text);
+    static SearchQuery header(const QString& field, const QString& text);
+    static SearchQuery larger(quint32 bytes);
+    static SearchQuery smaller(quint32 bytes);
+    static SearchQuery uid(const SequenceSet& uids);
+
+    SearchQuery operator&&(const SearchQuery& other) const;
+    SearchQuery operator||(const SearchQuery& other) const;
+    SearchQuery operator!() const;
+
+    /* criteria after the SEARCH keyword, e.g. "CHARSET UTF-8 SINCE 1-Feb-2023 FROM \"x\"" */
+    QByteArray toString() const;
+
+private:
+    SearchQuery(const QByteArray& criteria, int keys, bool utf8);
+
+    static SearchQuery text(const char* key, const QString& value);
+    QByteArray operand() const;
+
+    QByteArray m_criteria;
+    int m_keys;     // top-level search keys in m_criteria
+    bool m_utf8;
+};
+
+/*
+ * SEARCH or ESEARCH (RFC 4731) answer. With ESEARCH the server computes
+ * min, max and count itself; for a plain SEARCH they are derived from the set.
+ */
+struct SearchResult
+{
+    SequenceSet all;
+    quint32 min = 0;
+    quint32 max = 0;
+    quint64 count = 0;
+
+    static SearchResult fromResponse(const QByteArray& response);
+};
@@ -0,0 +1,341 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "sequenceset.h"
+
+#include "imapresponse.h"
+
+#include <algorithm>
+
+namespace {
+
+bool startsWithNoCase(const char* data, const char* end, const char* prefix)
+{
+    for (; *prefix != '\0'; ++data, ++prefix)
+    {
+        if (data >= end) return false;
+        char c = *data;
+        if (c >= 'a' and c <= 'z') c = static_cast<char>(c - 'a' + 'A');
+        if (c != *prefix) return false;
+    }
+    return true;
+}
+
+// Reads "n" or "n:m" ranges separated by commas into ranges, stops at the first other character
+const char* readSequenceSet(const char* pos, const char* end, QVector<SequenceSet::Range>& ranges, bool* ok)
+{
+    bool valid = pos < end;
+    while (valid and pos < end)
+    {
+        quint64 values[2] = {0, 0};
+        int count = 0;
+        while (count < 2)
+        {
+            const char* digits = pos;
+            quint64 value = 0;
+            while (pos < end and *pos >= '0' and *pos <= '9' and value <= 0xFFFFFFFFull)
+            {
+                value = value * 10 + static_cast<quint64>(*pos++ - '0');
+            }
+            if (pos == digits or value == 0 or value > 0xFFFFFFFFull)
+            {
+                valid = false;
+                break;
+            }
+            values[count++] = value;
+            if (pos < end and *pos == ':' and count == 1) ++pos;
+            else break;
+        }
+        if (not valid) break;
+
+        const quint32 first = static_cast<quint32>(values[0]);
+        const quint32 last = count == 2 ? static_cast<quint32>(values[1]) : first;
+        ranges.push_back(SequenceSet::Range {qMin(first, last), qMax(first, last)}); // "5:1" means "1:5"
+
+        if (pos < end and *pos == ',') ++pos;
+        else break;
+    }
+    if (ok != nullptr) *ok = valid;
+    return pos;
+}
+
+} // namespace
+
+SequenceSet SequenceSet::fromSearchResponse(const QByteArray &response)
+{
+    QVector<Range> ranges;
+    const char* pos = response.constData();
+    const char* const end = pos + response.size();
+
+    while (pos < end)
+    {
+        const char* lineEnd = std::find(pos, end, '\n');
+
+        if (startsWithNoCase(pos, lineEnd, "* SEARCH"))
+        {
+            // Past 0xFFFFFFFF the value stops growing, so a runaway number is
+            // dropped instead of wrapping around into a valid one
+            quint64 value = 0;
+            bool inNumber = false;
+            for (const char* p = pos + 8; p < lineEnd; ++p)
+            {
+                if (*p >= '0' and *p <= '9')
+                {
+                    if (value <= 0xFFFFFFFFull) value = value * 10 + static_cast<quint64>(*p - '0');
+                    inNumber = true;
+                }
+                else if (inNumber)
+                {
+                    if (value != 0 and value <= 0xFFFFFFFFull) ranges.push_back(Range {static_cast<quint32>(value), static_cast<quint32>(value)});
+                    value = 0;
+                    inNumber = false;
+                }
+            }
+            if (inNumber and value != 0 and value <= 0xFFFFFFFFull) ranges.push_back(Range {static_cast<quint32>(value), static_cast<quint32>(value)});
+        }
+        else if (startsWithNoCase(pos, lineEnd, "* ESEARCH"))
+        {
+            ImapResponseTokenizer tokenizer(pos, lineEnd);
+            for (auto token = tokenizer.next(); token != ImapResponseTokenizer::Token::end; token = tokenizer.next())
+            {
+                if (token == ImapResponseTokenizer::Token::listBegin)
+                {
+                    tokenizer.skipList(); // search correlator
+                }
+                else if (token == ImapResponseTokenizer::Token::atom and tokenizer.is("ALL") and
+                         tokenizer.next() == ImapResponseTokenizer::Token::atom)
+                {
+                    readSequenceSet(tokenizer.data(), tokenizer.data() + tokenizer.size(), ranges, nullptr);
+                }
+            }
+        }
+
+        pos = lineEnd < end ? lineEnd + 1 : end;
+    }
+    return fromRanges(ranges);
+}
+
+SequenceSet SequenceSet::fromString(const QByteArray &sequenceSet, bool *ok)
+{
+    QVector<Range> ranges;
+    const char* end = sequenceSet.constData() + sequenceSet.size();
+    bool valid = false;
+    const char* stop = readSequenceSet(sequenceSet.constData(), end, ranges, &valid);
+    valid = valid and stop == end;
+    if (ok != nullptr) *ok = valid;
+    return valid ? fromRanges(ranges) : SequenceSet();
+}
+
+SequenceSet SequenceSet::fromRanges(QVector<Range> &ranges)
+{
+    // One sort for input in any order instead of an O(n) insert per
+    // out-of-order value; servers usually answer in order and skip the sort
+    const auto byFirst = [](const Range& a, const Range& b) { return a.first < b.first; };
+    if (not std::is_sorted(ranges.begin(), ranges.end(), byFirst))
+    {
+        std::sort(ranges.begin(), ranges.end(), byFirst);
+    }
+
+    SequenceSet result;
+    result.m_ranges.reserve(ranges.size());
+    for (const auto& range: ranges)
+    {
+        result.append(range.first, range.last);
+    }
+    result.m_ranges.squeeze();
+    return result;
+}
+
+void SequenceSet::add(quint32 first, quint32 last)
+{
+    if (first > last) return;
+
+    if (m_ranges.isEmpty() or first >= m_ranges.last().first)
+    {
+        append(first, last);
+        return;
+    }
+
+    // Out of order: merge with every range it overlaps or touches
+    auto begin = std::lower_bound(m_ranges.begin(), m_ranges.end(), first, [](const Range& range, quint32 value) {
+        return static_cast<quint64>(range.last) + 1 < value;
+    });
+    auto stop = begin;
+    while (stop != m_ranges.end() and stop->first <= static_cast<quint64>(last) + 1)
+    {
+        first = qMin(first, stop->first);
+        last = qMax(last, stop->last);
+        ++stop;
+    }
+
+    const int index = static_cast<int>(begin - m_ranges.begin());
+    const int merged = static_cast<int>(stop - begin);
+    if (merged == 0)
+    {
+        m_ranges.insert(index, Range {first, last});
+        return;
+    }
+    m_ranges[index] = Range {first, last};
+    m_ranges.remove(index + 1, merged - 1);
+}
+
+bool SequenceSet::contains(quint32 value) const
+{
+    auto iter = std::lower_bound(m_ranges.begin(), m_ranges.end(), value, [](const Range& range, quint32 value) {
+        return range.last < value;
+    });
+    return iter != m_ranges.end() and iter->first <= value;
+}
+
+quint64 SequenceSet::count() const
+{
+    quint64 result = 0;
+    for (const auto& range: m_ranges)
+    {
+        result += static_cast<quint64>(range.last) - range.first + 1;
+    }
+    return result;
+}
+
+SequenceSet SequenceSet::united(const SequenceSet &other) const
+{
+    SequenceSet result;
+    result.m_ranges.reserve(m_ranges.size() + other.m_ranges.size());
+
+    int i = 0, j = 0;
+    while (i < m_ranges.size() or j < other.m_ranges.size())
+    {
+        const bool takeOwn = j == other.m_ranges.size() or
+                             (i < m_ranges.size() and m_ranges[i].first <= other.m_ranges[j].first);
+        const Range& range = takeOwn ? m_ranges[i++] : other.m_ranges[j++];
+        result.append(range.first, range.last);
+    }
+    return result;
+}
+
+SequenceSet SequenceSet::intersected(const SequenceSet &other) const
+{
+    SequenceSet result;
+
+    int i = 0, j = 0;
+    while (i < m_ranges.size() and j < other.m_ranges.size())
+    {
+        const Range& a = m_ranges[i];
+        const Range& b = other.m_ranges[j];
+        const quint32 first = qMax(a.first, b.first);
+        const quint32 last = qMin(a.last, b.last);
+        if (first <= last) result.m_ranges.push_back(Range {first, last});
+
+        if (a.last < b.last) ++i;
+        else ++j;
+    }
+    return result;
+}
+
+SequenceSet SequenceSet::subtracted(const SequenceSet &other) const
+{
+    SequenceSet result;
+
+    int j = 0;
+    for (const auto& range: m_ranges)
+    {
+        quint64 first = range.first;
+        while (j < other.m_ranges.size() and other.m_ranges[j].last < first) ++j;
+
+        for (int k = j; k < other.m_ranges.size() and other.m_ranges[k].first <= range.last; ++k)
+        {
+            const Range& hole = other.m_ranges[k];
+            if (hole.first > first)
+            {
+                result.m_ranges.push_back(Range {static_cast<quint32>(first), hole.first - 1});
+            }
+            first = static_cast<quint64>(hole.last) + 1;
+            if (first > range.last) break;
+        }
+
+        if (first <= range.last)
+        {
+            result.m_ranges.push_back(Range {static_cast<quint32>(first), range.last});
+        }
+    }
+    return result;
+}
+
+QByteArray SequenceSet::toString() const
+{
+    QByteArray result;
+    result.reserve(m_ranges.size() * 12);
+    for (const auto& range: m_ranges)
+    {
+        if (not result.isEmpty()) result += ',';
+        result += QByteArray::number(range.first);
+        if (range.last != range.first)
+        {
+            result += ':';
+            result += QByteArray::number(range.last);
+        }
+    }
+    return result;
+}
+
+QVector<QByteArray> SequenceSet::toStrings(int maxLength) const
+{
+    QVector<QByteArray> result;
+    QByteArray current;
+    for (const auto& range: m_ranges)
+    {
+        QByteArray item = QByteArray::number(range.first);
+        if (range.last != range.first)
+        {
+            item += ':';
+            item += QByteArray::number(range.last);
+        }
+
+        if (not current.isEmpty() and current.size() + 1 + item.size() > maxLength)
+        {
+            result.push_back(current);
+            current.clear();
+        }
+        if (not current.isEmpty()) current += ',';
+        current += item;
+    }
+    if (not current.isEmpty()) result.push_back(current);
+    return result;
+}
+
+QList<unsigned int> SequenceSet::toList() const
+{
+    QList<unsigned int> result;
+    result.reserve(static_cast<int>(qMin<quint64>(count(), 0x7FFFFFFF)));
+    for (const auto& range: m_ranges)
+    {
+        for (quint64 value = range.first; value <= range.last; ++value)
+        {
+            result.push_back(static_cast<unsigned int>(value));
+        }
+    }
+    return result;
+}
+
+bool SequenceSet::operator==(const SequenceSet &other) const
+{
+    if (m_ranges.size() != other.m_ranges.size()) return false;
+    for (int i = 0; i < m_ranges.size(); ++i)
+    {
+        if (m_ranges[i].first != other.m_ranges[i].first or m_ranges[i].last != other.m_ranges[i].last) return false;
+    }
+    return true;
+}
+
+void SequenceSet::append(quint32 first, quint32 last)
+{
+    if (not m_ranges.isEmpty() and first <= static_cast<quint64>(m_ranges.last().last) + 1)
+    {
+        m_ranges.last().last = qMax(m_ranges.last().last, last);
+        return;
+    }
+    m_ranges.push_back(Range {first, last});
+}
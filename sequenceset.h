@@ -0,0 +1,66 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+
+/*
+ * Set of message numbers or UIDs stored as sorted, disjoint, non-adjacent
+ * ranges - the same run-length form as an IMAP sequence set (RFC 3501
+ * section 9, "sequence-set"). A mailbox where 500k unseen messages form a few
+ * runs takes a few ranges instead of 500k list entries. Set operations are
+ * linear merges over the ranges.
+ */
+class SequenceSet
+{
+public:
+    struct Range
+    {
+        quint32 first;
+        quint32 last;
+    };
+
+    SequenceSet() = default;
+
+    /* "* SEARCH 1 2 3" lines and the ALL item of "* ESEARCH ... ALL 1:3,7" lines */
+    static SequenceSet fromSearchResponse(const QByteArray& response);
+    /* "1:5,7,9:12"; "*" is not a number and is rejected */
+    static SequenceSet fromString(const QByteArray& sequenceSet, bool* ok = nullptr);
+
+    void add(quint32 value)                     { add(value, value); }
+    void add(quint32 first, quint32 last);
+    void clear()                                { m_ranges.clear(); }
+
+    bool isEmpty() const                        { return m_ranges.isEmpty(); }
+    bool contains(quint32 value) const;
+    quint64 count() const;
+    quint32 min() const                         { return m_ranges.isEmpty() ? 0 : m_ranges.first().first; }
+    quint32 max() const                         { return m_ranges.isEmpty() ? 0 : m_ranges.last().last; }
+    const QVector<Range>& ranges() const        { return m_ranges; }
+
+    SequenceSet united(const SequenceSet& other) const;
+    SequenceSet intersected(const SequenceSet& other) const;
+    SequenceSet subtracted(const SequenceSet& other) const;
+
+    /* "1:5,7,9:12", empty for an empty set */
+    QByteArray toString() const;
+    /* the same ranges split into strings of at most maxLength bytes, to keep command lines short */
+    QVector<QByteArray> toStrings(int maxLength = 8000) const;
+    QList<unsigned int> toList() const;
+
+    bool operator==(const SequenceSet& other) const;
+    bool operator!=(const SequenceSet& other) const { return not (*this == other); }
+
+private:
+    /* sorts ranges in place and merges them */
+    static SequenceSet fromRanges(QVector<Range>& ranges);
+    void append(quint32 first, quint32 last);
+
+    QVector<Range> m_ranges;
+};
@@ -0,0 +1,175 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#include "tracing.h"
+
+#ifdef QTEMAILFETCHER_TRACING
+
+#include <QMutex>
+#include <QMutexLocker>
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace {
+
+struct Span
+{
+    std::atomic<const char*> name {nullptr};
+    std::atomic<qint64> start {0};    // ns since the trace epoch
+    std::atomic<qint64> duration {0};
+};
+
+// One writer, the owning thread, and a seqlock for readers: span i lives in
+// slot i % RING_SIZE, "claimed" counts spans started being written and
+// "committed" spans finished. A reader copies up to committed, then every
+// span below claimed - RING_SIZE may have been overwritten under it.
+struct Ring
+{
+    Span spans[Tracing::RING_SIZE];
+    std::atomic<quint64> claimed {0};
+    std::atomic<quint64> committed {0};
+    std::atomic<quint64> cleared {0};
+    std::atomic<bool> inUse {false};
+    int id = 0;
+};
+
+QMutex g_ringsMutex;
+std::vector<Ring*> g_rings; // never freed: bounded by the peak number of threads
+
+qint64 now()
+{
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+Ring* acquireRing()
+{
+    QMutexLocker lock(&g_ringsMutex);
+    for (Ring* ring: g_rings)
+    {
+        bool expected = false;
+        if (ring->inUse.compare_exchange_strong(expected, true))
+        {
+            return ring;
+        }
+    }
+    Ring* ring = new Ring;
+    ring->inUse = true;
+    ring->id = static_cast<int>(g_rings.size()) + 1;
+    g_rings.push_back(ring);
+    return ring;
+}
+
+struct ThreadRing
+{
+    Ring* ring = acquireRing();
+    ~ThreadRing() { ring->inUse.store(false, std::memory_order_release); }
+};
+
+thread_local ThreadRing t_ring;
+
+} // namespace
+
+Tracing::Scope::Scope(const char* name) :
+    m_name(name),
+    m_start(now())
+{
+}
+
+Tracing::Scope::~Scope()
+{
+    const qint64 end = now();
+    Ring* ring = t_ring.ring;
+    const quint64 index = ring->committed.load(std::memory_order_relaxed);
+
+    ring->claimed.store(index + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    Span& span = ring->spans[index % RING_SIZE];
+    span.name.store(m_name, std::memory_order_relaxed);
+    span.start.store(m_start, std::memory_order_relaxed);
+    span.duration.store(end - m_start, std::memory_order_relaxed);
+
+    ring->committed.store(index + 1, std::memory_order_release);
+}
+
+QByteArray Tracing::toChromeJson()
+{
+    struct Copy
+    {
+        const char* name;
+        qint64 start;
+        qint64 duration;
+    };
+
+    QByteArray json = "{\"traceEvents\":[";
+    bool first = true;
+
+    QMutexLocker lock(&g_ringsMutex);
+    for (const Ring* ring: g_rings)
+    {
+        const quint64 committed = ring->committed.load(std::memory_order_acquire);
+        quint64 from = ring->cleared.load(std::memory_order_relaxed);
+        if (committed > RING_SIZE) from = qMax(from, committed - RING_SIZE);
+
+        std::vector<Copy> copies;
+        copies.reserve(committed > from ? committed - from : 0);
+        for (quint64 i = from; i < committed; ++i)
+        {
+            const Span& span = ring->spans[i % RING_SIZE];
+            copies.push_back({span.name.load(std::memory_order_relaxed),
+                              span.start.load(std::memory_order_relaxed),
+                              span.duration.load(std::memory_order_relaxed)});
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const quint64 claimed = ring->claimed.load(std::memory_order_relaxed);
+        const quint64 valid = claimed > RING_SIZE ? claimed - RING_SIZE : 0;
+
+        for (quint64 i = qMax(from, valid); i < committed; ++i)
+        {
+            const Copy& copy = copies[i - from];
+            json += first ? "\n" : ",\n";
+            first = false;
+            json += "{\"name\":\"";
+            json += copy.name;
+            json += "\",\"ph\":\"X\",\"pid\":1,\"tid\":";
+            json += QByteArray::number(ring->id);
+            json += ",\"ts\":";
+            json += QByteArray::number(copy.start / 1000.0, 'f', 3);
+            json += ",\"dur\":";
+            json += QByteArray::number(copy.duration / 1000.0, 'f', 3);
+            json += "}";
+        }
+    }
+
+    json += "\n]}\n";
+    return json;
+}
+
+void Tracing::clear()
+{
+    QMutexLocker lock(&g_ringsMutex);
+    for (Ring* ring: g_rings)
+    {
+        ring->cleared.store(ring->committed.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+#else
+
+QByteArray Tracing::toChromeJson()
+{
+    return "{\"traceEvents\":[]}\n";
+}
+
+void Tracing::clear()
+{
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * This file is part of QtEmailFetcher project: Email parser for C++ Qt.
+ *
+ * GPLv3+ (c) acetone, 2023
+ */
+
+#pragma once
+
+#include <QByteArray>
+
+/*
+ * Scoped spans over the fetch and parse stages, for a flame chart of where
+ * fetch time goes without a profiler:
+ *
+ *     QTEMAILFETCHER_TRACE_SCOPE("parse.body");
+ *
+ * Only builds with QTEMAILFETCHER_TRACING record anything; otherwise the macro
+ * expands to nothing. Every thread writes its spans into its own ring of the
+ * last RING_SIZE spans, without locks; a thread's ring is reused by the next
+ * thread once it exits. toChromeJson() may run at any time, spans overwritten
+ * while it copies a ring are left out. Names must be string literals.
+ */
+class Tracing
+{
+public:
+    static constexpr int RING_SIZE = 8192;
+
+    static constexpr bool enabled()
+    {
+#ifdef QTEMAILFETCHER_TRACING
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /* {"traceEvents":[...]} of complete ("X") events, for chrome://tracing or Perfetto */
+    static QByteArray toChromeJson();
+    /* forgets the spans recorded so far */
+    static void clear();
+
+#ifdef QTEMAILFETCHER_TRACING
+    class Scope
+    {
+    public:
+        explicit Scope(const char* name);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const char* m_name;
+        qint64 m_start;
+    };
+#endif
+};
+
+#ifdef QTEMAILFETCHER_TRACING
+#define QTEMAILFETCHER_TRACE_CONCAT2(a, b) a##b
+#define QTEMAILFETCHER_TRACE_CONCAT(a, b) QTEMAILFETCHER_TRACE_CONCAT2(a, b)
+#define QTEMAILFETCHER_TRACE_SCOPE(name) \
+    const Tracing::Scope QTEMAILFETCHER_TRACE_CONCAT(traceScope, __LINE__)(name)
+#else
+#define QTEMAILFETCHER_TRACE_SCOPE(name)
+#endif